@@ -262,6 +262,17 @@ class Blob {
    * shared_ptr calls its destructor when reset with the "=" operator.
    */
   void ShareDiff(const Blob& other);
+  /**
+   * @brief Set the data_ shared_ptr to point to data, which must hold at
+   *        least count() elements -- useful to share one buffer among Blob%s
+   *        whose values are never needed at the same time.
+   *
+   * The Blob keeps data as long as it is reshaped to no more elements than
+   * both data and its diff_ hold; beyond that it allocates its own again.
+   */
+  void ShareDataMemory(const shared_ptr<SyncedMemory>& data);
+  /// @brief As ShareDataMemory, for the diff_ shared_ptr.
+  void ShareDiffMemory(const shared_ptr<SyncedMemory>& diff);
 
   bool ShapeEquals(const BlobProto& other);
 
@@ -114,6 +114,8 @@ class Caffe {
     explicit RNG(unsigned int seed);
     explicit RNG(const RNG&);
     RNG& operator=(const RNG&);
+    // Exchanges the generators of two RNGs without copying either.
+    inline void swap(RNG& other) { generator_.swap(other.generator_); }
     void* generator();
    private:
     class Generator;
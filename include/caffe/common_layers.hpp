@@ -426,6 +426,40 @@ class ReductionLayer : public Layer<Dtype> {
   Blob<Dtype> sum_multiplier_;
 };
 
+/**
+ * @brief Reorders a 4 axis NCHW Blob into the 5 axis channel-blocked
+ *        NCHW[b]c layout, num x (channels / b) x height x width x b, or a
+ *        5 axis blocked Blob back into NCHW.
+ *
+ * Nets with NetParameter.channel_block insert these between the layers that
+ * run on the blocked layout and those that do not.
+ */
+template <typename Dtype>
+class ReorderLayer : public Layer<Dtype> {
+ public:
+  explicit ReorderLayer(const LayerParameter& param)
+      : Layer<Dtype>(param) {}
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline const char* type() const { return "Reorder"; }
+  virtual inline int ExactNumBottomBlobs() const { return 1; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  /// @brief whether the bottom is NCHW, to be blocked
+  bool to_blocked_;
+  int num_;
+  int channels_;
+  int spatial_dim_;
+  int block_;
+};
+
 /*
  * @brief Reshapes the input Blob into an arbitrary-sized output Blob.
  *
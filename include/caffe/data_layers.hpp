@@ -1,6 +1,8 @@
 #ifndef CAFFE_DATA_LAYERS_HPP_
 #define CAFFE_DATA_LAYERS_HPP_
 
+#include <list>
+#include <map>
 #include <string>
 #include <utility>
 #include <vector>
@@ -15,7 +17,9 @@
 #include "caffe/internal_thread.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/db.hpp"
+#include "caffe/util/sample_cache.hpp"
 
 namespace caffe {
 
@@ -94,9 +98,14 @@ class DataLayer : public BasePrefetchingDataLayer<Dtype> {
 
  protected:
   virtual void InternalThreadEntry();
+  // Reads the next datum through sample_cache_, decoded.
+  virtual void ReadCachedDatum(Datum* datum);
 
   shared_ptr<db::DB> db_;
   shared_ptr<db::Cursor> cursor_;
+  shared_ptr<SampleCache> sample_cache_;
+  // Whether the current pass over cursor_ started at its first record.
+  bool pass_from_start_;
 };
 
 template <typename Dtype>
@@ -172,11 +181,33 @@ class MapDataLayer : public BasePrefetchingDataLayer<Dtype> {
 
  protected:
   virtual void InternalThreadEntry();
+  // Reads the next data and label maps, from iter_ or sample_cache_.
+  virtual void ReadMaps(Datum* data_map, Datum* label_map);
+  // Reads the next data and label maps through sample_cache_.
+  virtual void ReadCachedMaps(Datum* data_map, Datum* label_map);
+  // Transforms a pair of maps into item item_id of the prefetch batch.
+  virtual void TransformMaps(const int item_id, const Datum& data_map,
+      const Datum& label_map);
+  // Scans the source once for the distinct shapes of its records, each of
+  // which gets a bucket.
+  virtual void IndexShapes();
+  // Reads records into their buckets until one holds a whole batch, and
+  // returns that bucket.
+  virtual int FillBucket();
   DataTransformer<Dtype> label_transformer_;
   Blob<Dtype> transformed_label_;
 
   shared_ptr<db::DB> db_;
   shared_ptr<db::Cursor> iter_;
+  shared_ptr<SampleCache> sample_cache_;
+  // Whether the current pass over iter_ started at its first record.
+  bool pass_from_start_;
+  // With bucket_by_shape, the bucket of each record shape (data channels,
+  // height, width, then the same for the label), and the maps read into
+  // each bucket that are not batched yet.
+  std::map<vector<int>, int> bucket_ids_;
+  vector<vector<Datum> > bucket_data_;
+  vector<vector<Datum> > bucket_labels_;
 
  private:
   static TransformationParameter label_trans_param(
@@ -218,13 +249,16 @@ class DummyDataLayer : public Layer<Dtype> {
 /**
  * @brief Provides data to the Net from HDF5 files.
  *
- * TODO(dox): thorough documentation for Forward and proto params.
+ * Batches are assembled in a background thread, one ahead of the Net, from a
+ * resident window of consecutive rows of the current file (see
+ * HDF5DataParameter.window_rows). The following window, possibly of the next
+ * file, is read by a second thread while the current one is consumed.
  */
 template <typename Dtype>
-class HDF5DataLayer : public Layer<Dtype> {
+class HDF5DataLayer : public Layer<Dtype>, public InternalThread {
  public:
   explicit HDF5DataLayer(const LayerParameter& param)
-      : Layer<Dtype>(param) {}
+      : Layer<Dtype>(param), file_id_(-1) {}
   virtual ~HDF5DataLayer();
   virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
@@ -236,6 +270,9 @@ class HDF5DataLayer : public Layer<Dtype> {
   virtual inline int ExactNumBottomBlobs() const { return 0; }
   virtual inline int MinTopBlobs() const { return 1; }
 
+  virtual void CreatePrefetchThread();
+  virtual void JoinPrefetchThread();
+
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
@@ -245,13 +282,44 @@ class HDF5DataLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {}
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {}
-  virtual void LoadHDF5FileData(const char* filename);
+  // Fills prefetch_blobs_ with the next batch.
+  virtual void InternalThreadEntry();
+  // Opens file_permutation_[current_file_] and splits it into windows.
+  virtual void OpenHDF5File();
+  virtual void CloseHDF5File();
+  // Reads the window current_window_ of the open file into blobs.
+  virtual void LoadHDF5Window(vector<shared_ptr<Blob<Dtype> > >* blobs);
+  // Moves current_window_ to the next window, and to the next file after the
+  // last window of a file.
+  void NextHDF5Window();
+  // Reads the next window into next_blobs_ in window_thread_.
+  void CreateWindowThread();
+  void WindowThreadEntry();
+  void JoinWindowThread();
+  // Makes the next window the resident one once the current one is used up.
+  void SwapHDF5Window();
+  // Restarts the rows of the resident window, in a new order if shuffling.
+  void ShuffleRows();
 
   std::vector<std::string> hdf_filenames_;
   unsigned int num_files_;
   unsigned int current_file_;
-  hsize_t current_row_;
+  int current_row_;
+  hid_t file_id_;
+  int file_rows_;
+  // First rows of the windows of the open file, in the order they are read.
+  std::vector<int> window_starts_;
+  int current_window_;
+  // True if the data has a single window, which then stays resident.
+  bool single_window_;
   std::vector<shared_ptr<Blob<Dtype> > > hdf_blobs_;
+  std::vector<shared_ptr<Blob<Dtype> > > next_blobs_;
+  std::vector<shared_ptr<Blob<Dtype> > > prefetch_blobs_;
+  shared_ptr<boost::thread> window_thread_;
+  // Shuffles the rows, on the prefetch thread.
+  shared_ptr<Caffe::RNG> prefetch_rng_;
+  // Shuffles the files and windows, on the window thread.
+  shared_ptr<Caffe::RNG> window_rng_;
   std::vector<unsigned int> data_permutation_;
   std::vector<unsigned int> file_permutation_;
 };
@@ -259,10 +327,14 @@ class HDF5DataLayer : public Layer<Dtype> {
 /**
  * @brief Write blobs to disk as HDF5 files.
  *
- * TODO(dox): thorough documentation for Forward and proto params.
+ * Each Forward appends the data and label bottoms to the "data" and "label"
+ * datasets, which are chunked and extendible along their first axis (see
+ * HDF5OutputParameter). Forward only copies the bottoms into one of
+ * queue_size buffers; a writer thread appends them to the file, and the
+ * destructor waits for it to write everything queued.
  */
 template <typename Dtype>
-class HDF5OutputLayer : public Layer<Dtype> {
+class HDF5OutputLayer : public Layer<Dtype>, public InternalThread {
  public:
   explicit HDF5OutputLayer(const LayerParameter& param)
       : Layer<Dtype>(param), file_opened_(false) {}
@@ -289,13 +361,25 @@ class HDF5OutputLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
-  virtual void SaveBlobs();
+  // Queues a copy of the bottoms for the writer thread.
+  void QueueBlobs(const vector<Blob<Dtype>*>& bottom, bool from_gpu);
+  // The writer thread: appends queued buffers until it pops -1.
+  virtual void InternalThreadEntry();
+  virtual void SaveBlobs(const vector<shared_ptr<Blob<Dtype> > >& blobs);
+  // Creates the dataset for rows shaped like blob's.
+  void CreateDataset(const char* name, const Blob<Dtype>& blob);
 
   bool file_opened_;
   std::string file_name_;
   hid_t file_id_;
-  Blob<Dtype> data_blob_;
-  Blob<Dtype> label_blob_;
+  // Datasets, their numbers of rows and row shapes, in bottom order.
+  vector<hid_t> dataset_ids_;
+  vector<hsize_t> dataset_rows_;
+  vector<vector<int> > row_shapes_;
+  // Copies of the bottoms, queued by index.
+  vector<vector<shared_ptr<Blob<Dtype> > > > buffers_;
+  BlockingQueue<int> free_;
+  BlockingQueue<int> full_;
 };
 
 /**
@@ -307,7 +391,7 @@ template <typename Dtype>
 class ImageDataLayer : public BasePrefetchingDataLayer<Dtype> {
  public:
   explicit ImageDataLayer(const LayerParameter& param)
-      : BasePrefetchingDataLayer<Dtype>(param) {}
+      : BasePrefetchingDataLayer<Dtype>(param), image_cache_bytes_(0) {}
   virtual ~ImageDataLayer();
   virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
@@ -320,21 +404,41 @@ class ImageDataLayer : public BasePrefetchingDataLayer<Dtype> {
   shared_ptr<Caffe::RNG> prefetch_rng_;
   virtual void ShuffleImages();
   virtual void InternalThreadEntry();
+  // Decodes every num_threads-th image of batch_lines_, starting at
+  // thread_id, into batch_images_.
+  virtual void DecodeImages(const int thread_id, const int num_threads);
 
   vector<std::pair<std::string, int> > lines_;
   int lines_id_;
+  // Lines and decoded images of the batch being prefetched.
+  vector<std::pair<std::string, int> > batch_lines_;
+  vector<shared_ptr<cv::Mat> > batch_images_;
+  // Decoder downscaling factor learned for an image of the batch, or 0.
+  vector<int> batch_reduce_;
+  // Decoder downscaling factor of each image decoded so far.
+  map<string, int> reduce_factor_;
+  // Decoded, resized images kept in memory, and their size in bytes.
+  map<string, shared_ptr<cv::Mat> > image_cache_;
+  size_t image_cache_bytes_;
 };
 
 /**
  * @brief Provides data to the Net from memory.
  *
- * TODO(dox): thorough documentation for Forward and proto params.
+ * Arrays are given with Reset(), or transformed from Datum and cv::Mat
+ * vectors with AddDatumVector() and AddMatVector(). With
+ * memory_data_param.ring_size set, producers on any thread instead Push()
+ * samples into a ring, a pool of transform_threads workers transforms them
+ * into their ring slots, and Forward hands out batches of the ring to the
+ * Net without copying them. Push() waits while the ring is full, and
+ * Forward while the next batch is not transformed yet.
  */
 template <typename Dtype>
 class MemoryDataLayer : public BaseDataLayer<Dtype> {
  public:
   explicit MemoryDataLayer(const LayerParameter& param)
       : BaseDataLayer<Dtype>(param), has_new_data_(false) {}
+  virtual ~MemoryDataLayer();
   virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
 
@@ -351,16 +455,35 @@ class MemoryDataLayer : public BaseDataLayer<Dtype> {
   void Reset(Dtype* data, Dtype* label, int n);
   void set_batch_size(int new_size);
 
+  // Queue a sample for the ring; label holds label_size() values. The image
+  // shares its pixels with the caller, who must leave them unchanged until
+  // Forward has handed out the sample (wrap raw frames in a cv::Mat header
+  // to avoid copying them). The datum is copied. Returns false, without
+  // queuing the sample, once the layer is being destroyed.
+  bool Push(const cv::Mat& image, const Dtype* label);
+  bool Push(const Datum& datum, const Dtype* label);
+
   int batch_size() { return batch_size_; }
   int channels() { return channels_; }
   int height() { return height_; }
   int width() { return width_; }
+  int label_size() { return label_size_; }
 
  protected:
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  // Returns a free ring slot, waiting for one if the ring is full, or -1
+  // once the layer is being destroyed. Every slot returned must be passed
+  // to ReleaseProducer once queued.
+  int AcquireSlot(const Dtype* label);
+  void ReleaseProducer();
+  // Transforms the samples of queued slots until it pops -1.
+  void TransformSlots(const int worker);
 
   int batch_size_, channels_, height_, width_, size_;
+  // Shape and size of the label of one sample.
+  vector<int> label_shape_;
+  int label_size_;
   Dtype* data_;
   Dtype* labels_;
   int n_;
@@ -368,6 +491,36 @@ class MemoryDataLayer : public BaseDataLayer<Dtype> {
   Blob<Dtype> added_data_;
   Blob<Dtype> added_label_;
   bool has_new_data_;
+
+  // The ring, which data_ and labels_ point to: the sample of slot i is at
+  // data_ + i * size_ and labels_ + i * label_size_.
+  int ring_size_;
+  Blob<Dtype> ring_data_;
+  Blob<Dtype> ring_labels_;
+  // Pending inputs of the slots; a slot holds an image or a datum.
+  vector<shared_ptr<cv::Mat> > slot_images_;
+  vector<Datum> slot_datums_;
+  // Slots cycle through free_slots_, pending_slots_ (transformed by the
+  // workers) and done_slots_, then wait in slot_ready_ for their batch.
+  BlockingQueue<int> free_slots_;
+  BlockingQueue<int> pending_slots_;
+  BlockingQueue<int> done_slots_;
+  vector<bool> slot_ready_;
+  // The batch handed out by the last Forward, or -1.
+  int batch_start_;
+  // The index of the sample in each slot, in the order they were pushed.
+  // Its random transformation is seeded from it and sample_seed_, so it does
+  // not depend on which worker transforms it.
+  vector<unsigned int> slot_samples_;
+  unsigned int sample_seed_;
+  // Counts the producers inside Push and the samples pushed, and lets the
+  // destructor wait for the producers; see memory_data_layer.cpp.
+  class ProducerSync;
+  shared_ptr<ProducerSync> producer_sync_;
+  // Each worker has its own transformer, as transformers are not thread safe.
+  vector<shared_ptr<boost::thread> > workers_;
+  vector<shared_ptr<DataTransformer<Dtype> > > worker_transformers_;
+  vector<shared_ptr<Blob<Dtype> > > worker_blobs_;
 };
 
 /**
@@ -380,7 +533,7 @@ template <typename Dtype>
 class WindowDataLayer : public BasePrefetchingDataLayer<Dtype> {
  public:
   explicit WindowDataLayer(const LayerParameter& param)
-      : BasePrefetchingDataLayer<Dtype>(param) {}
+      : BasePrefetchingDataLayer<Dtype>(param), image_cache_bytes_(0) {}
   virtual ~WindowDataLayer();
   virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
@@ -389,9 +542,20 @@ class WindowDataLayer : public BasePrefetchingDataLayer<Dtype> {
   virtual inline int ExactNumBottomBlobs() const { return 0; }
   virtual inline int ExactNumTopBlobs() const { return 2; }
 
+  // The bytes of decoded images in the cache; only meaningful while no
+  // batch is being prefetched (see JoinPrefetchThread).
+  inline size_t image_cache_bytes() const { return image_cache_bytes_; }
+
  protected:
   virtual unsigned int PrefetchRand();
   virtual void InternalThreadEntry();
+  // Decodes the images thread_id, thread_id + num_threads, ... of the batch
+  // that are not cached, and crops all of their windows into top_data.
+  void ProcessImages(const int thread_id, const int num_threads,
+      Dtype* top_data);
+  // Warps window of cv_img into item item_id of the batch top_data.
+  void CropWindow(const cv::Mat& cv_img, const vector<float>& window,
+      const bool do_mirror, const int item_id, Dtype* top_data);
 
   shared_ptr<Caffe::RNG> prefetch_rng_;
   vector<std::pair<std::string, vector<int> > > image_database_;
@@ -404,6 +568,19 @@ class WindowDataLayer : public BasePrefetchingDataLayer<Dtype> {
   bool has_mean_values_;
   bool cache_images_;
   vector<std::pair<std::string, Datum > > image_database_cache_;
+  // The windows of the batch being prefetched, and the distinct images they
+  // come from with, for each image, the items of its windows.
+  vector<vector<float> > batch_windows_;
+  vector<bool> batch_mirror_;
+  vector<std::pair<int, shared_ptr<cv::Mat> > > batch_images_;
+  vector<vector<int> > batch_image_items_;
+  // Decoded images by image index, in an LRU list of at most
+  // window_data_param.cache_bytes bytes.
+  typedef std::pair<shared_ptr<cv::Mat>, std::list<int>::iterator>
+      CachedImage;
+  map<int, CachedImage> image_cache_;
+  std::list<int> image_lru_;
+  size_t image_cache_bytes_;
 };
 
 }  // namespace caffe
@@ -1,6 +1,8 @@
 #ifndef CAFFE_DATA_TRANSFORMER_HPP
 #define CAFFE_DATA_TRANSFORMER_HPP
 
+#include <map>
+#include <utility>
 #include <vector>
 
 #include "caffe/blob.hpp"
@@ -9,6 +11,41 @@
 
 namespace caffe {
 
+/**
+ * @brief The random choices of one augmented sample.
+ *
+ * Drawn once per sample by DataTransformer::SampleAugmentation() and passed to
+ * Transform(), so that a sample and its paired label maps share the same
+ * geometric transformation.
+ */
+struct Augmentation {
+  Augmentation()
+      : mirror(false), crop_h(0), crop_w(0), angle(0), scale(1),
+        brightness(0), contrast(1), gamma(1) {}
+
+  bool geometric() const { return angle != 0 || scale != 1; }
+  bool photometric() const {
+    return brightness != 0 || contrast != 1 || gamma != 1;
+  }
+  // Label maps only take the geometric part of a draw.
+  void ClearPhotometric() {
+    brightness = 0;
+    contrast = 1;
+    gamma = 1;
+  }
+
+  bool mirror;
+  // Random crop position as a fraction in [0, 1) of the possible offsets.
+  float crop_h;
+  float crop_w;
+  // Rotation in degrees and zoom factor, both about the image center.
+  float angle;
+  float scale;
+  float brightness;
+  float contrast;
+  float gamma;
+};
+
 /**
  * @brief Applies common transformations to the input data, such as
  * scaling, mirroring, substracting the image mean...
@@ -24,6 +61,11 @@ class DataTransformer {
    *    transformation.
    */
   void InitRand();
+  /**
+   * @brief Makes the random choices of the next transform depend on seed
+   *    alone, whichever samples this transformer has drawn before.
+   */
+  void SeedSample(const unsigned int seed);
 
   /**
    * @brief Applies the transformation defined in the data layer's
@@ -87,6 +129,36 @@ class DataTransformer {
    */
   void Transform(Blob<Dtype>* input_blob, Blob<Dtype>* transformed_blob);
 
+  /**
+   * @brief Draws the random crop, mirror and augmentation of the next sample.
+   *    If transform_param has an augmentation block, each call uses its own
+   *    generator seeded from the sample index; otherwise only crop and mirror
+   *    are drawn, from the same generator as Transform().
+   */
+  Augmentation SampleAugmentation();
+
+  /**
+   * @brief Applies crop, mirror, the augmentation aug, mean subtraction and
+   *    scaling in a single pass over the output.
+   *
+   * @param datum
+   *    Datum containing the data to be transformed.
+   * @param aug
+   *    The random choices for this sample, see SampleAugmentation().
+   * @param transformed_blob
+   *    This is destination blob. Geometric ops sample the input bilinearly
+   *    and treat pixels outside of it as zero.
+   */
+  void Transform(const Datum& datum, const Augmentation& aug,
+                Blob<Dtype>* transformed_blob);
+
+  /**
+   * @brief Applies crop, mirror, the augmentation aug, mean subtraction and
+   *    scaling to a cv::Mat in a single pass over the output.
+   */
+  void Transform(const cv::Mat& cv_img, const Augmentation& aug,
+                Blob<Dtype>* transformed_blob);
+
  protected:
    /**
    * @brief Generates a random integer from Uniform({0, 1, ..., n-1}).
@@ -99,6 +171,22 @@ class DataTransformer {
   virtual int Rand(int n);
 
   void Transform(const Datum& datum, Dtype* transformed_data);
+  // Checks the mean against the input shape and returns the mean file data,
+  // resized to height x width if resize_mean is set, or NULL if mean values
+  // (or no mean) are used.
+  const Dtype* PrepareMean(const int channels, const int height,
+      const int width);
+  // Returns the mean of the crop_height x crop_width window at (h_off, w_off)
+  // of a channels x height x width input, or NULL if mean values (or no mean)
+  // are used. Rows of the window are *row_step apart and channels
+  // *plane_step apart; windows are copied into contiguous cached tiles while
+  // the number of distinct crop offsets stays small.
+  const Dtype* MeanWindow(const int channels, const int height,
+      const int width, const int h_off, const int w_off,
+      const int crop_height, const int crop_width, int* row_step,
+      int* plane_step);
+  // Crop offset for an input dimension of the given size.
+  int CropOffset(const int size, const int crop_size, const float fraction);
   // Tranformation parameters
   TransformationParameter param_;
 
@@ -107,6 +195,16 @@ class DataTransformer {
   Phase phase_;
   Blob<Dtype> data_mean_;
   vector<Dtype> mean_values_;
+  // False if there is no mean file or it was reduced to mean_values_.
+  bool use_mean_file_;
+  // data_mean_ resized to other input sizes, keyed on (height, width).
+  map<pair<int, int>, shared_ptr<Blob<Dtype> > > resized_means_;
+  // Cropped mean tiles, keyed on (height, width, h_off, w_off, crop height,
+  // crop width).
+  map<vector<int>, shared_ptr<Blob<Dtype> > > mean_tiles_;
+  // Seed and sample counter of the per-sample augmentation generators.
+  unsigned int aug_seed_;
+  unsigned int aug_sample_;
 };
 
 }  // namespace caffe
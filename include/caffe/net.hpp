@@ -85,6 +85,33 @@ class Net {
   /// @brief Updates the network weights based on the diff values computed.
   void Update();
 
+  /**
+   * @brief For an inference net, lets activations share memory: each blob
+   *        is live from the layer that first writes it to the last layer
+   *        that uses it, and blobs whose lifetimes do not overlap get the same
+   *        SyncedMemory, sized to the largest of them. Returns the bytes of
+   *        activation memory after planning.
+   *
+   * The inputs, outputs, losses and data layer tops keep their own memory
+   * (MemoryData points its tops at the caller's arrays); any other blob
+   * holds its value only until the memory is reused. Blobs reshaped to more
+   * elements than their buffer holds fall back to memory of their own, so
+   * plan again after reshaping the inputs to a larger size.
+   */
+  size_t PlanActivationMemory();
+
+  /**
+   * @brief returns the first layer of each checkpointing segment
+   *        (NetParameter.checkpoint), or nothing if checkpointing is off.
+   *
+   * Blobs used only inside one segment share memory with those of the other
+   * segments, so BackwardFromTo recomputes the forward pass of a segment
+   * before running back through it, unless it was the last one forwarded.
+   */
+  inline const vector<int>& checkpoint_segments() const {
+    return segment_begin_;
+  }
+
   /**
    * @brief For an already initialized net, implicitly copies (i.e., using no
    *        additional memory) the pre-trained layers from another Net.
@@ -117,6 +144,17 @@ class Net {
   }
   /// @brief returns the phase: TRAIN or TEST
   inline Phase phase() const { return phase_; }
+  /// @brief returns whether the net only runs forward (NetState.inference)
+  inline bool inference() const { return inference_; }
+  /**
+   * @brief returns the bytes of backward-only buffers (pooling argmaxes,
+   *        dropout masks) that the net does not allocate in inference mode,
+   *        0 otherwise. Diffs are not counted: they are allocated lazily, so
+   *        no net that only runs forward allocates them.
+   */
+  inline size_t inference_memory_saved() const {
+    return inference_memory_saved_;
+  }
   /**
    * @brief returns the bottom vecs for each layer -- usually you won't
    *        need this unless you do per-layer checks such as gradients.
@@ -206,6 +244,44 @@ class Net {
   /// @brief Helper for displaying debug info in Update.
   void UpdateDebugInfo(const int param_id);
 
+  /**
+   * @brief For each blob, finds the blob whose memory it aliases (its root),
+   *        and for each root the first layer to write it, the last to use it
+   *        and the last to write it.
+   */
+  void BlobLifetimes(vector<int>* root, vector<int>* first, vector<int>* last,
+      vector<int>* last_write) const;
+  /**
+   * @brief Marks the roots of the blobs that keep their own memory: the
+   *        inputs, outputs, loss blobs and the tops of layers without bottoms.
+   */
+  void KeptBlobs(const vector<int>& root, vector<bool>* kept) const;
+  /// @brief Sets up gradient checkpointing (NetParameter.checkpoint).
+  void InitCheckpoints(const NetParameter& param);
+  /**
+   * @brief Returns the activation bytes with the net cut into segments
+   *        beginning at segment_begin; if share, makes the blobs each
+   *        segment recomputes share memory with the other segments'.
+   */
+  size_t SegmentMemory(const vector<int>& segment_begin, bool share);
+  /**
+   * @brief Before running back through a checkpointing segment, runs its
+   *        forward pass again unless it was the last forwarded, and clears
+   *        the diffs of the blobs it recomputes.
+   */
+  void RestoreSegment(const int segment);
+  /**
+   * @brief Switches the random number streams to the seed of a segment with
+   *        layers that draw random numbers, so that recomputing it draws the
+   *        same numbers as its forward pass did.
+   */
+  void BeginSegmentDraws(const int segment);
+  /**
+   * @brief Switches the CPU random number stream back to the main one, and
+   *        reseeds cuRAND from it.
+   */
+  void EndSegmentDraws();
+
   /// @brief Get misc parameters, e.g. the LR multiplier and weight decay.
   void GetLearningRateAndWeightDecay();
 
@@ -213,6 +289,9 @@ class Net {
   string name_;
   /// @brief The phase: TRAIN or TEST
   Phase phase_;
+  /// @brief Whether the net only runs forward
+  bool inference_;
+  size_t inference_memory_saved_;
   /// @brief Individual layers in the net
   vector<shared_ptr<Layer<Dtype> > > layers_;
   vector<string> layer_names_;
@@ -255,6 +334,18 @@ class Net {
   size_t memory_used_;
   /// Whether to compute and display debug info for the net.
   bool debug_info_;
+  /// The first layer of each checkpointing segment
+  vector<int> segment_begin_;
+  /// The blobs recomputed for each segment, whose diffs Backward clears
+  vector<vector<int> > segment_blobs_;
+  /// The segment whose blobs hold their forward values, or -1
+  int resident_segment_;
+  /// Whether each segment has layers that draw random numbers
+  vector<bool> segment_random_;
+  /// The seed each such segment drew its random numbers from
+  vector<unsigned int> segment_seed_;
+  /// The main CPU random number stream, while a segment's is in use
+  shared_ptr<Caffe::RNG> main_rng_;
 
   DISABLE_COPY_AND_ASSIGN(Net);
 };
@@ -0,0 +1,39 @@
+#ifndef CAFFE_UTIL_BLOCKED_LAYOUT_HPP_
+#define CAFFE_UTIL_BLOCKED_LAYOUT_HPP_
+
+#include <string>
+
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+/**
+ * @brief Reorders num x channels x spatial_dim NCHW data into the blocked
+ *        NCHW[b]c layout and back.
+ *
+ * The blocked layout is num x (channels / block) x spatial_dim x block: each
+ * pixel holds block consecutive channels side by side, so that SIMD lanes
+ * run across channels. block must divide channels.
+ */
+template <typename Dtype>
+void nchw_to_blocked(const Dtype* nchw, const int num, const int channels,
+    const int spatial_dim, const int block, Dtype* blocked);
+
+template <typename Dtype>
+void blocked_to_nchw(const Dtype* blocked, const int num, const int channels,
+    const int spatial_dim, const int block, Dtype* nchw);
+
+// Copy NetParameters with activations kept in the NCHW[b]c layout of
+// param.channel_block() channels per block where layers support it: from the
+// first eligible Convolution on, the tops of Convolution, ReLU, Pooling,
+// Eltwise and Concat layers are renamed to their BlockedBlobName, and
+// ReorderLayers bring them back under their own name in NCHW for the other
+// layers and the outputs of the net.
+void InsertBlockedLayout(const NetParameter& param,
+    NetParameter* param_blocked);
+
+string BlockedBlobName(const string& blob_name);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_BLOCKED_LAYOUT_HPP_
@@ -0,0 +1,39 @@
+#ifndef CAFFE_UTIL_BLOCKING_QUEUE_HPP_
+#define CAFFE_UTIL_BLOCKING_QUEUE_HPP_
+
+#include <queue>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief A queue shared between threads, whose pop() waits for an element.
+ *
+ * To bound the work in flight, circulate a fixed set of elements between a
+ * queue of free ones and a queue of full ones, see HDF5OutputLayer.
+ */
+template <typename T>
+class BlockingQueue {
+ public:
+  BlockingQueue();
+
+  void push(const T& t);
+  // Returns false instead of waiting if the queue is empty.
+  bool try_pop(T* t);
+  T pop();
+  size_t size() const;
+
+ protected:
+  // Keeps the boost thread headers out of this one, see internal_thread.hpp.
+  class sync;
+
+  std::queue<T> queue_;
+  shared_ptr<sync> sync_;
+
+  DISABLE_COPY_AND_ASSIGN(BlockingQueue);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_BLOCKING_QUEUE_HPP_
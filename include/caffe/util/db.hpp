@@ -2,6 +2,7 @@
 #define CAFFE_UTIL_DB_HPP
 
 #include <string>
+#include <vector>
 
 #include "leveldb/db.h"
 #include "leveldb/write_batch.h"
@@ -147,23 +148,34 @@ class LMDBCursor : public Cursor {
   bool valid_;
 };
 
+// Puts are buffered until Commit(), which writes them in one LMDB
+// transaction. If the map fills up, the transaction is aborted, the map size
+// doubled and the puts replayed, so databases can outgrow their initial map.
 class LMDBTransaction : public Transaction {
  public:
   explicit LMDBTransaction(MDB_dbi* mdb_dbi, MDB_txn* mdb_txn)
-    : mdb_dbi_(mdb_dbi), mdb_txn_(mdb_txn) { }
+    : mdb_env_(NULL), mdb_dbi_(mdb_dbi), mdb_txn_(mdb_txn) { }
+  // Keeps the puts until Commit, which doubles the map size and writes them
+  // again when the map is full.
+  explicit LMDBTransaction(MDB_env* mdb_env, MDB_dbi* mdb_dbi)
+    : mdb_env_(mdb_env), mdb_dbi_(mdb_dbi), mdb_txn_(NULL) { }
   virtual void Put(const string& key, const string& value);
-  virtual void Commit() { MDB_CHECK(mdb_txn_commit(mdb_txn_)); }
+  virtual void Commit();
 
  private:
+  void DoubleMapSize();
+
+  MDB_env* mdb_env_;
   MDB_dbi* mdb_dbi_;
   MDB_txn* mdb_txn_;
+  vector<string> keys_, values_;
 
   DISABLE_COPY_AND_ASSIGN(LMDBTransaction);
 };
 
 class LMDB : public DB {
  public:
-  LMDB() : mdb_env_(NULL) { }
+  LMDB() : mdb_env_(NULL), mdb_dbi_(0), map_size_(0), grow_map_(false) { }
   virtual ~LMDB() { Close(); }
   virtual void Open(const string& source, Mode mode);
   virtual void Close() {
@@ -175,10 +187,18 @@ class LMDB : public DB {
   }
   virtual LMDBCursor* NewCursor();
   virtual LMDBTransaction* NewTransaction();
+  // Sets the initial map size in bytes, a multiple of the page size, for
+  // the next Open(); 0 keeps the default.
+  void set_map_size(const size_t map_size) { map_size_ = map_size; }
+  // Lets new transactions double the map size when a commit fills it; they
+  // then keep a copy of every put until Commit.
+  void set_grow_map(const bool grow_map) { grow_map_ = grow_map; }
 
  private:
   MDB_env* mdb_env_;
   MDB_dbi mdb_dbi_;
+  size_t map_size_;
+  bool grow_map_;
 };
 
 DB* GetDB(DataParameter::DB backend);
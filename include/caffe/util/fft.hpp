@@ -0,0 +1,96 @@
+#ifndef CAFFE_UTIL_FFT_HPP_
+#define CAFFE_UTIL_FFT_HPP_
+
+#include <vector>
+
+namespace caffe {
+
+/**
+ * @brief Convolution of one group of one image through radix-2 FFTs on CPU.
+ *
+ * The padded input is cut into windows of fft_h x fft_w, powers of two, each
+ * giving a tile of (fft_h - extent_h + 1) x (fft_w - extent_w + 1) outputs at
+ * stride 1 (overlap-save), where extent is the kernel size dilated by
+ * kstride; strided outputs are picked out of these. The gradient with
+ * respect to the input adds the windows back up (overlap-add). Spectra are
+ * those of real signals, so only fft_w / 2 + 1 columns are kept, and the
+ * spectra of the filters are computed once by SetFilters.
+ *
+ * The cost per output grows with log(fft size) rather than with the kernel
+ * area, which makes it pay off over im2col + GEMM for large kernels only.
+ */
+template <typename Dtype>
+class FFTConvolution {
+ public:
+  FFTConvolution(const int channels, const int out_channels, const int height,
+      const int width, const int kernel_h, const int kernel_w,
+      const int pad_h, const int pad_w, const int stride_h,
+      const int stride_w, const int kstride_h, const int kstride_w);
+
+  int height_out() const { return height_out_; }
+  int width_out() const { return width_out_; }
+
+  // Computes the spectra of the out_channels x channels x kernel_h x kernel_w
+  // weights, unless they equal those of the last call.
+  void SetFilters(const Dtype* weights);
+  // output = input convolved with the filters, channels x height x width to
+  // out_channels x height_out x width_out.
+  void Forward(const Dtype* input, Dtype* output);
+  // input_diff = the gradient with respect to the input for output_diff.
+  void BackwardData(const Dtype* output_diff, Dtype* input_diff);
+  // Adds the gradient with respect to the filters of one image to the
+  // spectra accumulated since the last FilterDiff, which adds them to
+  // weights_diff.
+  void AccumulateFilterDiff(const Dtype* input, const Dtype* output_diff);
+  void FilterDiff(Dtype* weights_diff);
+
+ private:
+  // The twiddles and bit reversal of a complex FFT of size n.
+  struct Plan {
+    int n;
+    std::vector<int> bit_reverse;
+    std::vector<Dtype> cos;
+    std::vector<Dtype> sin;
+  };
+  static void MakePlan(const int n, Plan* plan);
+  // In-place complex FFT of the n values at re and im.
+  static void Transform(const Plan& plan, const bool inverse, Dtype* re,
+      Dtype* im);
+  // The half spectrum of the real fft_h x fft_w window, and back for its
+  // first rows rows, scaled by 1 / (fft_h * fft_w).
+  void ForwardReal(const Dtype* window, Dtype* spec_re, Dtype* spec_im) const;
+  void InverseReal(Dtype* spec_re, Dtype* spec_im, const int rows,
+      Dtype* window) const;
+  // The windows of channels maps at the tile of output row oy and column ox
+  // (at stride 1), starting pad before it, and their spectra.
+  void InputSpectra(const Dtype* input, const int oy, const int ox);
+  void OutputDiffSpectra(const Dtype* output_diff, const int oy, const int ox);
+
+  int channels_, out_channels_;
+  int height_, width_;
+  int kernel_h_, kernel_w_;
+  int pad_h_, pad_w_;
+  int stride_h_, stride_w_;
+  int kstride_h_, kstride_w_;
+  int height_out_, width_out_;
+  // The output at stride 1 that covers the strided one.
+  int dense_h_, dense_w_;
+  int fft_h_, fft_w_;
+  int tile_h_, tile_w_;
+  // fft_h_ x (fft_w_ / 2 + 1) bins.
+  int bins_w_;
+  int spectrum_size_;
+  Plan plan_h_, plan_w_;
+  // The weights the filter spectra were computed from.
+  std::vector<Dtype> weights_;
+  // Spectra are split into real and imaginary parts, out_channels x channels
+  // of them for the filters and their gradients.
+  std::vector<Dtype> filter_re_, filter_im_;
+  std::vector<Dtype> filter_diff_re_, filter_diff_im_;
+  std::vector<Dtype> input_re_, input_im_;
+  std::vector<Dtype> output_re_, output_im_;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_FFT_HPP_
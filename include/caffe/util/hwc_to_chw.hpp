@@ -0,0 +1,25 @@
+#ifndef CAFFE_UTIL_HWC_TO_CHW_HPP_
+#define CAFFE_UTIL_HWC_TO_CHW_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace caffe {
+
+/**
+ * @brief Deinterleaves a uint8 image into channel planes.
+ *
+ * data_hwc is height x width x channels, e.g. the pixels of an 8 bit
+ * cv::Mat, with rows row_step bytes apart (cv::Mat::step[0]). data_chw
+ * receives the contiguous channels x height x width planes, converted to
+ * Dtype; it may point straight into a protobuf buffer. Images with 1, 3 or
+ * 4 channels go through SSE2 kernels when they are available.
+ */
+template <typename Dtype>
+void hwc_to_chw(const uint8_t* data_hwc, const int channels,
+    const int height, const int width, const size_t row_step,
+    Dtype* data_chw);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_HWC_TO_CHW_HPP_
@@ -9,6 +9,15 @@ void im2col_cpu(const Dtype* data_im, const int channels,
     const int pad_h, const int pad_w, const int stride_h,
     const int stride_w, Dtype* data_col);
 
+// As im2col_cpu, but with the rows of data_col row_stride apart instead of
+// height_col * width_col, so that the columns of several images can be laid
+// side by side in one matrix.
+template <typename Dtype>
+void im2col_strided_cpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w, const int stride_h,
+    const int stride_w, const int row_stride, Dtype* data_col);
+
 template <typename Dtype>
 void col2im_cpu(const Dtype* data_col, const int channels,
     const int height, const int width, const int patch_h, const int patch_w,
@@ -14,6 +14,8 @@
 
 #define HDF5_NUM_DIMS 4
 
+namespace boost { class mutex; }
+
 namespace caffe {
 
 using ::google::protobuf::Message;
@@ -139,6 +141,13 @@ cv::Mat ReadImageToCVMat(const string& filename,
 
 cv::Mat ReadImageToCVMat(const string& filename);
 
+// Like ReadImageToCVMat, but lets the decoder downscale the image by
+// reduce_factor (2, 4 or 8) first; for JPEG this happens in the DCT domain.
+// Falls back to a full decode with OpenCV older than 3.2.
+cv::Mat ReadImageToCVMatReduced(const string& filename,
+    const int height, const int width, const bool is_color,
+    const int reduce_factor);
+
 cv::Mat DecodeDatumToCVMatNative(const Datum& datum);
 cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color);
 
@@ -154,6 +163,22 @@ void hdf5_load_nd_dataset(
     hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
     Blob<Dtype>* blob);
 
+// Reads the shape of a float or double dataset without reading its data.
+void hdf5_get_nd_dataset_shape(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    vector<int>* shape);
+
+// Reads rows [start, start + num) of a dataset, i.e. a hyperslab of its
+// first axis, into blob, which is reshaped to num rows.
+template <typename Dtype>
+void hdf5_load_nd_dataset_rows(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    int start, int num, Blob<Dtype>* blob);
+
+// HDF5 is usually built without thread safety: calls into it from a
+// background thread, and the ones they may overlap with, hold this mutex.
+boost::mutex& hdf5_mutex();
+
 template <typename Dtype>
 void hdf5_save_nd_dataset(
     const hid_t file_id, const string& dataset_name, const Blob<Dtype>& blob);
@@ -0,0 +1,100 @@
+#ifndef CAFFE_UTIL_SAMPLE_CACHE_H_
+#define CAFFE_UTIL_SAMPLE_CACHE_H_
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+/**
+ * @brief Keeps decoded, pre-transform samples of a data layer in memory.
+ *
+ * A sample is a vector of raw (not encoded) Datum, e.g. the data and label
+ * maps of MapDataLayer. Only the shape, the label and the pixels are kept:
+ * pixels are stored as uint8 whenever they are integers in [0, 255], which
+ * also holds for float_data produced from images, and as float otherwise.
+ * Samples are packed end to end in one arena, which grows up to
+ * capacity_bytes and is charged the bytes the samples take. When it is full
+ * the least recently used samples are evicted; the ranges they free are
+ * reused, and the samples are packed together again when the free bytes are
+ * too scattered for a new sample.
+ *
+ * The data layer reads its source in order, asks Get() before parsing a
+ * record and Put()s what it parsed, and calls EndEpoch() when the source
+ * wraps around. Once a whole pass fitted in memory, the cache is
+ * in_memory() and Next() serves the following epochs without touching the
+ * source, optionally in a new random order each epoch.
+ */
+class SampleCache {
+ public:
+  SampleCache(const size_t capacity_bytes, const bool shuffle);
+
+  // Copies the sample stored under key into sample, and marks it as the
+  // most recently used. Returns false on a miss.
+  bool Get(const string& key, vector<Datum>* sample);
+  // Stores sample under key, evicting the least recently used samples as
+  // needed. Returns false if the sample alone exceeds the capacity.
+  bool Put(const string& key, const vector<Datum>& sample);
+  // Ends a pass over the source. complete is false if the pass did not start
+  // at the first record (rand_skip). Returns true if the cache is now
+  // in_memory().
+  bool EndEpoch(const bool complete);
+  // Serves the next sample once in_memory().
+  void Next(vector<Datum>* sample);
+
+  inline bool in_memory() const { return in_memory_; }
+  inline int size() const { return entries_.size(); }
+  inline size_t bytes() const { return used_bytes_; }
+  inline size_t hits() const { return hits_; }
+  inline size_t misses() const { return misses_; }
+  inline float hit_rate() const {
+    return hits_ + misses_ ? static_cast<float>(hits_) / (hits_ + misses_) : 0;
+  }
+
+ protected:
+  struct Entry {
+    size_t offset;
+    size_t bytes;
+    std::list<string>::iterator lru;
+  };
+
+  void Evict();
+  // Takes bytes bytes from the first free range that holds them.
+  bool Allocate(const size_t bytes, size_t* offset);
+  // Returns a range to the free ranges, merging it with its neighbours.
+  void Free(const size_t offset, const size_t bytes);
+  // Enlarges the arena so that its free tail can hold bytes more bytes.
+  void Grow(const size_t bytes);
+  // Moves the samples to the front of the arena, leaving one free range.
+  void Compact();
+  void LogStats(const char* event) const;
+
+  size_t capacity_bytes_;
+  bool shuffle_;
+  vector<char> arena_;
+  // The free ranges of the arena, from offset to size.
+  map<size_t, size_t> free_ranges_;
+  size_t used_bytes_;
+  map<string, Entry> entries_;
+  // Keys from the most to the least recently used.
+  std::list<string> lru_;
+  // Keys of the current pass; once in_memory(), the epoch order.
+  vector<string> pass_keys_;
+  bool in_memory_;
+  int next_key_;
+  shared_ptr<Caffe::RNG> rng_;
+  size_t hits_;
+  size_t misses_;
+  // Scratch buffer for serializing a sample.
+  vector<char> buffer_;
+
+  DISABLE_COPY_AND_ASSIGN(SampleCache);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_SAMPLE_CACHE_H_
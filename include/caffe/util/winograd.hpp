@@ -0,0 +1,46 @@
+#ifndef CAFFE_UTIL_WINOGRAD_HPP_
+#define CAFFE_UTIL_WINOGRAD_HPP_
+
+namespace caffe {
+
+/**
+ * @brief Winograd F(m x m, 3 x 3) convolution of stride 1 on CPU.
+ *
+ * Each m x m tile of the output is computed from an (m + 2) x (m + 2) tile
+ * of the input in the transformed domain, where the 3 x 3 filters become
+ * element-wise products; over the channels these turn into (m + 2)^2
+ * independent GEMMs. tile selects m, which is 2 or 4: F(4 x 4, 3 x 3) needs
+ * 4 multiplies per output against 9 for direct convolution but rounds a bit
+ * worse than F(2 x 2, 3 x 3), which needs 4 per 2.25 outputs.
+ */
+
+// The number of elements of the transformed filters of out_channels x
+// in_channels 3 x 3 filters.
+int winograd_filters_size(const int tile, const int out_channels,
+    const int in_channels);
+
+// Transforms the out_channels x in_channels x 3 x 3 weights. With flip,
+// the filters are instead rotated by 180 degrees and the roles of the in
+// and out channels swapped, which turns the convolution into the one that
+// propagates gradients back to its input.
+template <typename Dtype>
+void winograd_transform_filters(const int tile, const Dtype* weights,
+    const int out_channels, const int in_channels, const bool flip,
+    Dtype* transformed);
+
+// The number of elements of workspace needed by winograd_conv_cpu.
+int winograd_workspace_size(const int tile, const int channels,
+    const int out_channels, const int height_out, const int width_out);
+
+// Convolves the channels x height x width data_im with transformed filters
+// of out_channels x channels into data_out, of out_channels x
+// (height + 2 * pad_h - 2) x (width + 2 * pad_w - 2).
+template <typename Dtype>
+void winograd_conv_cpu(const int tile, const Dtype* data_im,
+    const int channels, const int height, const int width, const int pad_h,
+    const int pad_w, const Dtype* filters, const int out_channels,
+    Dtype* workspace, Dtype* data_out);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_WINOGRAD_HPP_
@@ -13,6 +13,7 @@
 #include "caffe/loss_layers.hpp"
 #include "caffe/neuron_layers.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/fft.hpp"
 
 namespace caffe {
 
@@ -59,6 +60,12 @@ class ConvolutionSKLayer : public Layer<Dtype> {
   int M_;
   int K_;
   int N_;
+  // Whether Forward_cpu convolves through FFTs, one per group, instead of
+  // im2col, which then needs no column buffer.
+  bool use_fft_;
+  vector<shared_ptr<FFTConvolution<Dtype> > > ffts_;
+  // The input size ffts_ were made for.
+  int fft_height_, fft_width_;
 };
 
 /**
@@ -81,16 +88,34 @@ class BaseConvolutionLayer : public Layer<Dtype> {
 
  protected:
   // Helper functions that abstract away the column buffer and gemm arguments.
-  // The last argument in forward_cpu_gemm is so that we can skip the im2col if
-  // we just called weight_cpu_gemm with the same input.
+  // The skip_im2col argument in forward_cpu_gemm is so that we can skip the
+  // im2col if we just called weight_cpu_gemm with the same input. The CPU
+  // helpers use col_buff instead of col_buffer_ when it is given.
   void forward_cpu_gemm(const Dtype* input, const Dtype* weights,
-      Dtype* output, bool skip_im2col = false);
+      Dtype* output, bool skip_im2col = false, Dtype* col_buff = NULL);
   void forward_cpu_bias(Dtype* output, const Dtype* bias);
   void backward_cpu_gemm(const Dtype* input, const Dtype* weights,
-      Dtype* output);
+      Dtype* output, Dtype* col_buff = NULL);
   void weight_cpu_gemm(const Dtype* input, const Dtype* output, Dtype*
-      weights);
+      weights, Dtype* col_buff = NULL);
   void backward_cpu_bias(Dtype* bias, const Dtype* input);
+  // Convolves the num images at input, col_batch_ at a time with one GEMM
+  // per group, and adds bias unless it is NULL.
+  void forward_cpu_batch(const Dtype* input, const int num,
+      const Dtype* weights, const Dtype* bias, Dtype* output);
+  // The column buffers of the image_threads_ threads, col_buffer_ first;
+  // NULL for 1x1 convolution, which needs none.
+  vector<Dtype*> cpu_col_buffers();
+  // The GEMMs of forward_cpu_gemm, backward_cpu_gemm and weight_cpu_gemm
+  // for 1x1 convolution, over all num images and groups in one call and
+  // without a column buffer. With maps of a single pixel the images are the
+  // rows of one matrix, so each takes a single GEMM.
+  void forward_cpu_1x1(const Dtype* input, const int num,
+      const Dtype* weights, Dtype* output);
+  void backward_cpu_1x1(const Dtype* output, const int num,
+      const Dtype* weights, Dtype* input);
+  void weight_cpu_1x1(const Dtype* input, const Dtype* output, const int num,
+      Dtype* weights);
 
 #ifndef CPU_ONLY
   void forward_gpu_gemm(const Dtype* col_input, const Dtype* weights,
@@ -120,6 +145,13 @@ class BaseConvolutionLayer : public Layer<Dtype> {
   int height_out_, width_out_;
   bool bias_term_;
   bool is_1x1_;
+  // Images per GEMM of forward_cpu_batch; 1 when not batching.
+  int col_batch_;
+  // OpenMP threads splitting the images of the batch on CPU, and the column
+  // buffers and weight gradients of the threads past the first.
+  int image_threads_;
+  vector<shared_ptr<Blob<Dtype> > > thread_col_buffers_;
+  vector<shared_ptr<Blob<Dtype> > > thread_weight_diffs_;
 
  private:
   // wrap im2col/col2im so we don't have to remember the (long) argument lists
@@ -154,6 +186,8 @@ class BaseConvolutionLayer : public Layer<Dtype> {
 
   Blob<Dtype> col_buffer_;
   Blob<Dtype> bias_multiplier_;
+  // Output of forward_cpu_batch, with the images side by side in each row.
+  Blob<Dtype> batch_output_;
 };
 
 /**
@@ -221,6 +255,132 @@ class ConvolutionLayer : public BaseConvolutionLayer<Dtype> {
   virtual void compute_output_shape();
 };
 
+/**
+ * @brief ConvolutionLayer computed by Winograd's minimal filtering algorithm
+ *        on CPU, for 3x3 filters of stride 1.
+ *
+ *   The filters are transformed once and kept until the weights change. The
+ *   forward pass and the gradient with respect to the bottom, which is the
+ *   convolution of the top diff with the flipped filters, run through
+ *   winograd_conv_cpu. The weight gradient and GPU mode use ConvolutionLayer.
+ */
+template <typename Dtype>
+class WinogradConvolutionLayer : public ConvolutionLayer<Dtype> {
+ public:
+  explicit WinogradConvolutionLayer(const LayerParameter& param)
+      : ConvolutionLayer<Dtype>(param) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  // Transforms the filters again if the weights differ from the ones they
+  // were last transformed from.
+  void UpdateFilters();
+
+  // The output tile size m of F(m x m, 3 x 3).
+  int tile_;
+  // Whether the bottom gradient goes through Winograd too, which needs the
+  // padding of the flipped convolution, 2 - pad, to be non-negative.
+  bool winograd_backward_;
+  // The transformed filters of each group, for forward and backward.
+  Blob<Dtype> filters_;
+  Blob<Dtype> flipped_filters_;
+  Blob<Dtype> cached_weights_;
+  Blob<Dtype> workspace_;
+};
+
+/**
+ * @brief ConvolutionLayer computed through FFTs on CPU, for large kernels.
+ *
+ *   Each group of each image is convolved by an FFTConvolution, which keeps
+ *   the filter spectra until the weights change; the forward pass and both
+ *   gradients go through it, so no column buffer is used. GPU mode uses
+ *   ConvolutionLayer.
+ */
+template <typename Dtype>
+class FFTConvolutionLayer : public ConvolutionLayer<Dtype> {
+ public:
+  explicit FFTConvolutionLayer(const LayerParameter& param)
+      : ConvolutionLayer<Dtype>(param) {}
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  vector<shared_ptr<FFTConvolution<Dtype> > > ffts_;
+  // The input size ffts_ were made for.
+  int fft_height_, fft_width_;
+};
+
+/**
+ * @brief ConvolutionLayer on CPU whose top is in the channel-blocked
+ *        NCHW[b]c layout, for inference.
+ *
+ *   The top is num x (num_output / b) x height_out x width_out x b, with the
+ *   b channels of a block side by side at each pixel. The bottom is NCHW or
+ *   blocked the same way. The receptive field of each output pixel is laid
+ *   out as a row, copying a blocked bottom a block at a time, so that one GEMM
+ *   per image gives every output channel of every pixel; these are then
+ *   split into the blocks of the top. Nets use this engine through
+ *   NetParameter.channel_block; there is no backward pass.
+ */
+template <typename Dtype>
+class BlockedConvolutionLayer : public ConvolutionLayer<Dtype> {
+ public:
+  explicit BlockedConvolutionLayer(const LayerParameter& param)
+      : ConvolutionLayer<Dtype>(param), bottom_block_(0) {}
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  virtual inline int ExactNumBottomBlobs() const { return 1; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  // Points nchw_bottom_vec_ and nchw_top_vec_ at blobs of the NCHW shapes
+  // of bottom and top, for ConvolutionLayer to set up from.
+  void ShapeNCHW(const Blob<Dtype>& bottom);
+  // Reorders the weights into filters_ if they differ from the ones they
+  // were last reordered from.
+  void UpdateFilters();
+
+  // The channels per block b of the top, and per pixel of the bottom: b if
+  // it is blocked, 1 if it is NCHW.
+  int block_, bottom_block_;
+  // NCHW stand-ins for the bottom and top; never allocated.
+  Blob<Dtype> nchw_bottom_, nchw_top_;
+  vector<Blob<Dtype>*> nchw_bottom_vec_, nchw_top_vec_;
+  // The weights as num_output x (channels / bottom_block_) x kernel_h x
+  // kernel_w x bottom_block_, the order of the rows.
+  Blob<Dtype> filters_;
+  Blob<Dtype> cached_weights_;
+  // The receptive fields of one image, height_out * width_out rows of
+  // channels * kernel_h * kernel_w; transposed, as im2col lays them out, for
+  // an NCHW bottom.
+  Blob<Dtype> rows_;
+  // The output of one image, height_out * width_out pixels of num_output.
+  Blob<Dtype> pixels_;
+};
+
 /**
  * @brief Convolve the input with a bank of learned filters, and (optionally)
  *        add biases, treating filters and convolution parameters in the
@@ -497,10 +657,17 @@ class PoolingLayer : public Layer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
   virtual void Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  // Max or average pooling of a channel-blocked bottom.
+  void ForwardBlocked_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
 
   int kernel_h_, kernel_w_;
   int stride_h_, stride_w_;
   int pad_h_, pad_w_;
+  // Whether the bottom is channel-blocked, with block_ channels per pixel;
+  // channels_ then counts blocks.
+  bool blocked_;
+  int block_;
   int channels_;
   int height_, width_;
   int pooled_height_, pooled_width_;
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <climits>
 #include <vector>
 
@@ -127,6 +128,25 @@ void Blob<Dtype>::ShareData(const Blob& other) {
   data_ = other.data();
 }
 
+template <typename Dtype>
+void Blob<Dtype>::ShareDataMemory(const shared_ptr<SyncedMemory>& data) {
+  CHECK(data);
+  CHECK_GE(data->size(), count_ * sizeof(Dtype));
+  data_ = data;
+  // Reshape keeps data_ and diff_ up to capacity_, so it must fit both.
+  capacity_ = (diff_ ? std::min(data_->size(), diff_->size()) :
+      data_->size()) / sizeof(Dtype);
+}
+
+template <typename Dtype>
+void Blob<Dtype>::ShareDiffMemory(const shared_ptr<SyncedMemory>& diff) {
+  CHECK(diff);
+  CHECK_GE(diff->size(), count_ * sizeof(Dtype));
+  diff_ = diff;
+  capacity_ = (data_ ? std::min(data_->size(), diff_->size()) :
+      diff_->size()) / sizeof(Dtype);
+}
+
 template <typename Dtype>
 void Blob<Dtype>::ShareDiff(const Blob& other) {
   CHECK_EQ(count_, other.count());
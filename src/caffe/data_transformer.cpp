@@ -1,19 +1,266 @@
 #include <opencv2/core/core.hpp>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <string>
 #include <vector>
 
 #include "caffe/data_transformer.hpp"
+#include "caffe/util/hwc_to_chw.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
 
 namespace caffe {
 
+namespace {
+
+// Scalar body of the row kernels below; also handles the tail of a row that
+// the SIMD specialization leaves over.
+template <typename Dtype, typename SrcT, bool kMeanRow, bool kMirror>
+inline void TransformRowScalar(const SrcT* src, const Dtype* mean,
+    const Dtype mean_value, const Dtype scale, const int width, Dtype* dst) {
+  for (int w = 0; w < width; ++w) {
+    const Dtype m = kMeanRow ? mean[w] : mean_value;
+    const Dtype v = (static_cast<Dtype>(src[w]) - m) * scale;
+    if (kMirror) {
+      dst[width - 1 - w] = v;
+    } else {
+      dst[w] = v;
+    }
+  }
+}
+
+// Transforms one row: dst[w] = (src[w] - mean[w]) * scale, where the mean is
+// either a row of the mean file (kMeanRow) or a per-channel constant, and the
+// row is written back to front when kMirror is set.
+template <typename Dtype, typename SrcT, bool kMeanRow, bool kMirror>
+struct TransformRow {
+  static void Run(const SrcT* src, const Dtype* mean, const Dtype mean_value,
+      const Dtype scale, const int width, Dtype* dst) {
+    TransformRowScalar<Dtype, SrcT, kMeanRow, kMirror>(src, mean, mean_value,
+        scale, width, dst);
+  }
+};
+
+#ifdef __SSE2__
+// uint8 -> float in 16 pixel blocks. The arithmetic is the same single
+// precision sub/mul as the scalar path, so results are bit-identical.
+template <bool kMeanRow, bool kMirror>
+struct TransformRow<float, uint8_t, kMeanRow, kMirror> {
+  static void Run(const uint8_t* src, const float* mean,
+      const float mean_value, const float scale, const int width,
+      float* dst) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 scale_v = _mm_set1_ps(scale);
+    const __m128 mean_v = _mm_set1_ps(mean_value);
+    int w = 0;
+    for (; w + 16 <= width; w += 16) {
+      const __m128i bytes =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + w));
+      const __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+      const __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+      __m128 v[4];
+      v[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+      v[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+      v[2] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+      v[3] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+      for (int i = 0; i < 4; ++i) {
+        const __m128 m = kMeanRow ? _mm_loadu_ps(mean + w + 4 * i) : mean_v;
+        v[i] = _mm_mul_ps(_mm_sub_ps(v[i], m), scale_v);
+        if (kMirror) {
+          _mm_storeu_ps(dst + width - w - 4 * (i + 1),
+              _mm_shuffle_ps(v[i], v[i], _MM_SHUFFLE(0, 1, 2, 3)));
+        } else {
+          _mm_storeu_ps(dst + w + 4 * i, v[i]);
+        }
+      }
+    }
+    TransformRowScalar<float, uint8_t, kMeanRow, kMirror>(src + w,
+        kMeanRow ? mean + w : mean, mean_value, scale, width - w,
+        kMirror ? dst : dst + w);
+  }
+};
+#endif  // __SSE2__
+
+// Applies crop, mean subtraction, scaling and mirroring to a CHW buffer.
+// The row kernel is selected once, so the per-pixel loop has no branches.
+// mean, if not NULL, is the mean of the cropped window, with rows mean_row
+// and channels mean_plane elements apart (see MeanWindow).
+template <typename Dtype, typename SrcT>
+void TransformPlanes(const SrcT* src, const int channels,
+    const int src_height, const int src_width, const int h_off,
+    const int w_off, const int height, const int width, const Dtype* mean,
+    const int mean_row, const int mean_plane,
+    const vector<Dtype>& mean_values, const Dtype scale, const bool mirror,
+    Dtype* dst) {
+  void (*row)(const SrcT*, const Dtype*, const Dtype, const Dtype, const int,
+      Dtype*);
+  if (mean) {
+    row = mirror ? &TransformRow<Dtype, SrcT, true, true>::Run
+                 : &TransformRow<Dtype, SrcT, true, false>::Run;
+  } else {
+    row = mirror ? &TransformRow<Dtype, SrcT, false, true>::Run
+                 : &TransformRow<Dtype, SrcT, false, false>::Run;
+  }
+  for (int c = 0; c < channels; ++c) {
+    const Dtype mean_value = mean_values.empty() ? Dtype(0) : mean_values[c];
+    for (int h = 0; h < height; ++h) {
+      const int src_index = (c * src_height + h_off + h) * src_width + w_off;
+      row(src + src_index, mean ? mean + c * mean_plane + h * mean_row : NULL,
+          mean_value, scale, width, dst + (c * height + h) * width);
+    }
+  }
+}
+
+// Maps pixel values 0..255 through contrast (around 128), brightness and
+// gamma. The extra entry lets Photometric() interpolate without a bound check.
+void BuildPhotometricTable(const Augmentation& aug, vector<float>* table) {
+  table->resize(257);
+  for (int v = 0; v < 256; ++v) {
+    float p = aug.contrast * (v - 128.f) + 128.f + aug.brightness;
+    p = std::min(std::max(p, 0.f), 255.f);
+    if (aug.gamma != 1) {
+      p = 255.f * std::pow(p / 255.f, aug.gamma);
+    }
+    (*table)[v] = p;
+  }
+  (*table)[256] = (*table)[255];
+}
+
+inline float Photometric(const float* table, float v) {
+  v = std::min(std::max(v, 0.f), 255.f);
+  const int i = static_cast<int>(v);
+  return table[i] + (v - i) * (table[i + 1] - table[i]);
+}
+
+// Augmented counterpart of TransformPlanes: every output pixel is mapped back
+// through mirror, crop and the inverse rotation/zoom, sampled bilinearly
+// (zero outside of the input), passed through the photometric table if any,
+// then mean subtracted and scaled. Element (c, y, x) of the input is at
+// src[c * c_step + y * y_step + x * x_step], which covers both CHW Datum and
+// interleaved cv::Mat data. mean, if not NULL, is CHW with the input shape.
+template <typename Dtype, typename SrcT>
+void AugmentPlanes(const SrcT* src, const int channels, const int c_step,
+    const int y_step, const int x_step, const int src_height,
+    const int src_width, const int h_off, const int w_off, const int height,
+    const int width, const Dtype* mean, const vector<Dtype>& mean_values,
+    const Dtype scale, const Augmentation& aug, const float* table,
+    Dtype* dst) {
+  const bool geometric = aug.geometric();
+  const float theta = aug.angle * static_cast<float>(M_PI) / 180.f;
+  const float a = std::cos(theta) / aug.scale;
+  const float b = std::sin(theta) / aug.scale;
+  const float cy = (src_height - 1) / 2.f;
+  const float cx = (src_width - 1) / 2.f;
+  const int plane = height * width;
+  for (int h = 0; h < height; ++h) {
+    const int y = h_off + h;
+    for (int w = 0; w < width; ++w) {
+      const int x = w_off + (aug.mirror ? width - 1 - w : w);
+      // Bilinear taps; without geometric ops this is the pixel itself.
+      int sx[2] = { x, x };
+      int sy[2] = { y, y };
+      float wx[2] = { 1, 0 };
+      float wy[2] = { 1, 0 };
+      if (geometric) {
+        const float dx = x - cx;
+        const float dy = y - cy;
+        const float fx = cx + a * dx + b * dy;
+        const float fy = cy - b * dx + a * dy;
+        sx[0] = static_cast<int>(std::floor(fx));
+        sy[0] = static_cast<int>(std::floor(fy));
+        sx[1] = sx[0] + 1;
+        sy[1] = sy[0] + 1;
+        wx[1] = fx - sx[0];
+        wy[1] = fy - sy[0];
+        wx[0] = 1 - wx[1];
+        wy[0] = 1 - wy[1];
+        for (int i = 0; i < 2; ++i) {
+          if (sx[i] < 0 || sx[i] >= src_width) { wx[i] = 0; sx[i] = 0; }
+          if (sy[i] < 0 || sy[i] >= src_height) { wy[i] = 0; sy[i] = 0; }
+        }
+      }
+      const int mean_index = y * src_width + x;
+      const int top_index = h * width + w;
+      for (int c = 0; c < channels; ++c) {
+        const SrcT* src_c = src + c * c_step;
+        float v = 0;
+        for (int i = 0; i < 2; ++i) {
+          if (wy[i] == 0) continue;
+          const SrcT* row = src_c + sy[i] * y_step;
+          float r = 0;
+          for (int j = 0; j < 2; ++j) {
+            if (wx[j] != 0) {
+              r += wx[j] * static_cast<float>(row[sx[j] * x_step]);
+            }
+          }
+          v += wy[i] * r;
+        }
+        if (table) {
+          v = Photometric(table, v);
+        }
+        const Dtype m = mean ?
+            mean[c * src_height * src_width + mean_index] :
+            (mean_values.empty() ? Dtype(0) : mean_values[c]);
+        dst[c * plane + top_index] = (static_cast<Dtype>(v) - m) * scale;
+      }
+    }
+  }
+}
+
+// Bilinear resize of CHW planes, with pixel centers aligned as in
+// cv::resize(..., INTER_LINEAR).
+template <typename Dtype>
+void ResizePlanes(const Dtype* src, const int channels, const int src_height,
+    const int src_width, const int height, const int width, Dtype* dst) {
+  const float scale_y = static_cast<float>(src_height) / height;
+  const float scale_x = static_cast<float>(src_width) / width;
+  for (int h = 0; h < height; ++h) {
+    const float fy = std::min(std::max((h + 0.5f) * scale_y - 0.5f, 0.f),
+        static_cast<float>(src_height - 1));
+    const int y0 = static_cast<int>(fy);
+    const int y1 = std::min(y0 + 1, src_height - 1);
+    const float wy = fy - y0;
+    for (int w = 0; w < width; ++w) {
+      const float fx = std::min(std::max((w + 0.5f) * scale_x - 0.5f, 0.f),
+          static_cast<float>(src_width - 1));
+      const int x0 = static_cast<int>(fx);
+      const int x1 = std::min(x0 + 1, src_width - 1);
+      const float wx = fx - x0;
+      for (int c = 0; c < channels; ++c) {
+        const Dtype* plane = src + c * src_height * src_width;
+        const Dtype* row0 = plane + y0 * src_width;
+        const Dtype* row1 = plane + y1 * src_width;
+        dst[(c * height + h) * width + w] = static_cast<Dtype>(
+            (1 - wy) * ((1 - wx) * row0[x0] + wx * row0[x1]) +
+            wy * ((1 - wx) * row1[x0] + wx * row1[x1]));
+      }
+    }
+  }
+}
+
+// Cropped mean tiles are only cached while there are at most this many
+// distinct windows, which always holds for the centered crops of TEST.
+const int kMaxMeanTiles = 16;
+
+inline float Uniform(rng_t* rng, const float a, const float b) {
+  return a + (b - a) * static_cast<float>((*rng)() / 4294967296.0);
+}
+
+}  // namespace
+
 template<typename Dtype>
 DataTransformer<Dtype>::DataTransformer(const TransformationParameter& param,
     Phase phase)
-    : param_(param), phase_(phase) {
+    : param_(param), phase_(phase), use_mean_file_(false), aug_seed_(0),
+      aug_sample_(0) {
   // check if we want to use mean_file
   if (param_.has_mean_file()) {
     CHECK_EQ(param_.mean_value_size(), 0) <<
@@ -23,6 +270,20 @@ DataTransformer<Dtype>::DataTransformer(const TransformationParameter& param,
     BlobProto blob_proto;
     ReadProtoFromBinaryFileOrDie(mean_file.c_str(), &blob_proto);
     data_mean_.FromProto(blob_proto);
+    use_mean_file_ = true;
+    if (param_.mean_per_channel()) {
+      // Reduce the mean file to mean values.
+      const int plane = data_mean_.height() * data_mean_.width();
+      for (int c = 0; c < data_mean_.channels(); ++c) {
+        const Dtype* mean = data_mean_.cpu_data() + data_mean_.offset(0, c);
+        double sum = 0;
+        for (int i = 0; i < plane; ++i) {
+          sum += mean[i];
+        }
+        mean_values_.push_back(static_cast<Dtype>(sum / plane));
+      }
+      use_mean_file_ = false;
+    }
   }
   // check if we want to use mean_value
   if (param_.mean_value_size() > 0) {
@@ -32,6 +293,15 @@ DataTransformer<Dtype>::DataTransformer(const TransformationParameter& param,
       mean_values_.push_back(param_.mean_value(c));
     }
   }
+  if (param_.has_augmentation()) {
+    const AugmentationParameter& aug = param_.augmentation();
+    CHECK_GT(aug.min_scale(), 0) << "min_scale must be positive";
+    CHECK_LE(aug.min_scale(), aug.max_scale()) <<
+        "min_scale must not exceed max_scale";
+    CHECK_GE(aug.gamma(), 0) << "gamma must not be negative";
+    CHECK_LT(aug.gamma(), 1) << "gamma must be smaller than 1";
+    aug_seed_ = aug.has_seed() ? aug.seed() : caffe_rng_rand();
+  }
 }
 
 template<typename Dtype>
@@ -45,32 +315,12 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
   const int crop_size = param_.crop_size();
   const Dtype scale = param_.scale();
   const bool do_mirror = param_.mirror() && Rand(2);
-  const bool has_mean_file = param_.has_mean_file();
   const bool has_uint8 = data.size() > 0;
-  const bool has_mean_values = mean_values_.size() > 0;
 
   CHECK_GT(datum_channels, 0);
   CHECK_GE(datum_height, crop_size);
   CHECK_GE(datum_width, crop_size);
 
-  Dtype* mean = NULL;
-  if (has_mean_file) {
-    CHECK_EQ(datum_channels, data_mean_.channels());
-    CHECK_EQ(datum_height, data_mean_.height());
-    CHECK_EQ(datum_width, data_mean_.width());
-    mean = data_mean_.mutable_cpu_data();
-  }
-  if (has_mean_values) {
-    CHECK(mean_values_.size() == 1 || mean_values_.size() == datum_channels) <<
-     "Specify either 1 mean_value or as many as channels: " << datum_channels;
-    if (datum_channels > 1 && mean_values_.size() == 1) {
-      // Replicate the mean_value for simplicity
-      for (int c = 1; c < datum_channels; ++c) {
-        mean_values_.push_back(mean_values_[0]);
-      }
-    }
-  }
-
   int height = datum_height;
   int width = datum_width;
 
@@ -89,36 +339,23 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
     }
   }
 
-  Dtype datum_element;
-  int top_index, data_index;
-  for (int c = 0; c < datum_channels; ++c) {
-    for (int h = 0; h < height; ++h) {
-      for (int w = 0; w < width; ++w) {
-        data_index = (c * datum_height + h_off + h) * datum_width + w_off + w;
-        if (do_mirror) {
-          top_index = (c * height + h) * width + (width - 1 - w);
-        } else {
-          top_index = (c * height + h) * width + w;
-        }
-        if (has_uint8) {
-          datum_element =
-            static_cast<Dtype>(static_cast<uint8_t>(data[data_index]));
-        } else {
-          datum_element = datum.float_data(data_index);
-        }
-        if (has_mean_file) {
-          transformed_data[top_index] =
-            (datum_element - mean[data_index]) * scale;
-        } else {
-          if (has_mean_values) {
-            transformed_data[top_index] =
-              (datum_element - mean_values_[c]) * scale;
-          } else {
-            transformed_data[top_index] = datum_element * scale;
-          }
-        }
-      }
-    }
+  int mean_row = 0;
+  int mean_plane = 0;
+  const Dtype* mean = MeanWindow(datum_channels, datum_height, datum_width,
+      h_off, w_off, height, width, &mean_row, &mean_plane);
+  // Select the row kernel once for the whole datum; see TransformPlanes.
+  if (has_uint8) {
+    TransformPlanes(reinterpret_cast<const uint8_t*>(data.data()),
+        datum_channels, datum_height, datum_width, h_off, w_off, height,
+        width, mean, mean_row, mean_plane, mean_values_, scale, do_mirror,
+        transformed_data);
+  } else {
+    CHECK_EQ(datum.float_data_size(),
+        datum_channels * datum_height * datum_width);
+    TransformPlanes(datum.float_data().data(),
+        datum_channels, datum_height, datum_width, h_off, w_off, height,
+        width, mean, mean_row, mean_plane, mean_values_, scale, do_mirror,
+        transformed_data);
   }
 }
 
@@ -149,6 +386,10 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
     CHECK_EQ(datum_width, width);
   }
 
+  if (param_.has_augmentation()) {
+    Transform(datum, SampleAugmentation(), transformed_blob);
+    return;
+  }
   Dtype* transformed_data = transformed_blob->mutable_cpu_data();
   Transform(datum, transformed_data);
 }
@@ -212,34 +453,19 @@ void DataTransformer<Dtype>::Transform(const cv::Mat& cv_img,
 
   CHECK(cv_img.depth() == CV_8U) << "Image data type must be unsigned byte";
 
+  if (param_.has_augmentation()) {
+    Transform(cv_img, SampleAugmentation(), transformed_blob);
+    return;
+  }
+
   const int crop_size = param_.crop_size();
   const Dtype scale = param_.scale();
   const bool do_mirror = param_.mirror() && Rand(2);
-  const bool has_mean_file = param_.has_mean_file();
-  const bool has_mean_values = mean_values_.size() > 0;
 
   CHECK_GT(img_channels, 0);
   CHECK_GE(img_height, crop_size);
   CHECK_GE(img_width, crop_size);
 
-  Dtype* mean = NULL;
-  if (has_mean_file) {
-    CHECK_EQ(img_channels, data_mean_.channels());
-    CHECK_EQ(img_height, data_mean_.height());
-    CHECK_EQ(img_width, data_mean_.width());
-    mean = data_mean_.mutable_cpu_data();
-  }
-  if (has_mean_values) {
-    CHECK(mean_values_.size() == 1 || mean_values_.size() == img_channels) <<
-     "Specify either 1 mean_value or as many as channels: " << img_channels;
-    if (img_channels > 1 && mean_values_.size() == 1) {
-      // Replicate the mean_value for simplicity
-      for (int c = 1; c < img_channels; ++c) {
-        mean_values_.push_back(mean_values_[0]);
-      }
-    }
-  }
-
   int h_off = 0;
   int w_off = 0;
   cv::Mat cv_cropped_img = cv_img;
@@ -263,35 +489,18 @@ void DataTransformer<Dtype>::Transform(const cv::Mat& cv_img,
 
   CHECK(cv_cropped_img.data);
 
-  Dtype* transformed_data = transformed_blob->mutable_cpu_data();
-  int top_index;
-  for (int h = 0; h < height; ++h) {
-    const uchar* ptr = cv_cropped_img.ptr<uchar>(h);
-    int img_index = 0;
-    for (int w = 0; w < width; ++w) {
-      for (int c = 0; c < img_channels; ++c) {
-        if (do_mirror) {
-          top_index = (c * height + h) * width + (width - 1 - w);
-        } else {
-          top_index = (c * height + h) * width + w;
-        }
-        // int top_index = (c * height + h) * width + w;
-        Dtype pixel = static_cast<Dtype>(ptr[img_index++]);
-        if (has_mean_file) {
-          int mean_index = (c * img_height + h_off + h) * img_width + w_off + w;
-          transformed_data[top_index] =
-            (pixel - mean[mean_index]) * scale;
-        } else {
-          if (has_mean_values) {
-            transformed_data[top_index] =
-              (pixel - mean_values_[c]) * scale;
-          } else {
-            transformed_data[top_index] = pixel * scale;
-          }
-        }
-      }
-    }
-  }
+  int mean_row = 0;
+  int mean_plane = 0;
+  const Dtype* mean = MeanWindow(img_channels, img_height, img_width, h_off,
+      w_off, height, width, &mean_row, &mean_plane);
+  // Deinterleave the crop into uint8 planes, then run the same row kernels
+  // as an uint8 Datum.
+  vector<uint8_t> planes(img_channels * height * width);
+  hwc_to_chw(cv_cropped_img.ptr<uint8_t>(0), img_channels, height, width,
+      cv_cropped_img.step, &planes[0]);
+  TransformPlanes(&planes[0], img_channels, height, width, 0, 0, height,
+      width, mean, mean_row, mean_plane, mean_values_, scale, do_mirror,
+      transformed_blob->mutable_cpu_data());
 }
 
 template<typename Dtype>
@@ -306,7 +515,6 @@ void DataTransformer<Dtype>::Transform(Blob<Dtype>* input_blob,
   const int channels = transformed_blob->channels();
   const int height = transformed_blob->height();
   const int width = transformed_blob->width();
-  const int size = transformed_blob->count();
 
   CHECK_LE(input_num, num);
   CHECK_EQ(input_channels, channels);
@@ -316,8 +524,6 @@ void DataTransformer<Dtype>::Transform(Blob<Dtype>* input_blob,
   const int crop_size = param_.crop_size();
   const Dtype scale = param_.scale();
   const bool do_mirror = param_.mirror() && Rand(2);
-  const bool has_mean_file = param_.has_mean_file();
-  const bool has_mean_values = mean_values_.size() > 0;
 
   int h_off = 0;
   int w_off = 0;
@@ -337,62 +543,257 @@ void DataTransformer<Dtype>::Transform(Blob<Dtype>* input_blob,
     CHECK_EQ(input_width, width);
   }
 
-  Dtype* input_data = input_blob->mutable_cpu_data();
-  if (has_mean_file) {
-    CHECK_EQ(input_channels, data_mean_.channels());
-    CHECK_EQ(input_height, data_mean_.height());
-    CHECK_EQ(input_width, data_mean_.width());
-    for (int n = 0; n < input_num; ++n) {
-      int offset = input_blob->offset(n);
-      caffe_sub(data_mean_.count(), input_data + offset,
-            data_mean_.cpu_data(), input_data + offset);
+  // Crop first and subtract the mean of the cropped window only; the input
+  // blob is left untouched.
+  int mean_row = 0;
+  int mean_plane = 0;
+  const Dtype* mean = MeanWindow(input_channels, input_height, input_width,
+      h_off, w_off, height, width, &mean_row, &mean_plane);
+  const Dtype* input_data = input_blob->cpu_data();
+  Dtype* transformed_data = transformed_blob->mutable_cpu_data();
+  for (int n = 0; n < input_num; ++n) {
+    TransformPlanes(input_data + input_blob->offset(n), channels,
+        input_height, input_width, h_off, w_off, height, width, mean,
+        mean_row, mean_plane, mean_values_, scale, do_mirror,
+        transformed_data + transformed_blob->offset(n));
+  }
+}
+
+template <typename Dtype>
+Augmentation DataTransformer<Dtype>::SampleAugmentation() {
+  Augmentation aug;
+  if (!param_.has_augmentation()) {
+    aug.mirror = param_.mirror() && Rand(2);
+    if (phase_ == TRAIN && param_.crop_size()) {
+      rng_t* rng = static_cast<rng_t*>(rng_->generator());
+      aug.crop_h = Uniform(rng, 0, 1);
+      aug.crop_w = Uniform(rng, 0, 1);
     }
+    return aug;
   }
+  // A generator per sample, seeded from the sample index, so the draw of a
+  // sample does not depend on the samples drawn before it.
+  rng_t rng(aug_seed_ + 2654435761u * aug_sample_++);
+  aug.mirror = param_.mirror() && (rng() & 1);
+  aug.crop_h = Uniform(&rng, 0, 1);
+  aug.crop_w = Uniform(&rng, 0, 1);
+  if (phase_ != TRAIN) {
+    return aug;
+  }
+  const AugmentationParameter& param = param_.augmentation();
+  aug.angle = Uniform(&rng, -param.max_rotation(), param.max_rotation());
+  aug.scale = Uniform(&rng, param.min_scale(), param.max_scale());
+  aug.brightness = Uniform(&rng, -param.brightness(), param.brightness());
+  aug.contrast = Uniform(&rng, 1 - param.contrast(), 1 + param.contrast());
+  aug.gamma = Uniform(&rng, 1 - param.gamma(), 1 + param.gamma());
+  return aug;
+}
 
-  if (has_mean_values) {
-    CHECK(mean_values_.size() == 1 || mean_values_.size() == input_channels) <<
-     "Specify either 1 mean_value or as many as channels: " << input_channels;
-    if (mean_values_.size() == 1) {
-      caffe_add_scalar(input_blob->count(), -(mean_values_[0]), input_data);
-    } else {
-      for (int n = 0; n < input_num; ++n) {
-        for (int c = 0; c < input_channels; ++c) {
-          int offset = input_blob->offset(n, c);
-          caffe_add_scalar(input_height * input_width, -(mean_values_[c]),
-            input_data + offset);
-        }
+template <typename Dtype>
+const Dtype* DataTransformer<Dtype>::PrepareMean(const int channels,
+    const int height, const int width) {
+  if (use_mean_file_) {
+    CHECK_EQ(channels, data_mean_.channels());
+    if (height == data_mean_.height() && width == data_mean_.width()) {
+      return data_mean_.cpu_data();
+    }
+    CHECK(param_.resize_mean()) << "Input size " << height << "x" << width
+        << " does not match the mean file, " << data_mean_.height() << "x"
+        << data_mean_.width() << "; set resize_mean to resize it";
+    shared_ptr<Blob<Dtype> >& resized =
+        resized_means_[std::make_pair(height, width)];
+    if (!resized) {
+      LOG(INFO) << "Resizing mean to " << height << "x" << width;
+      resized.reset(new Blob<Dtype>(1, channels, height, width));
+      ResizePlanes(data_mean_.cpu_data(), channels, data_mean_.height(),
+          data_mean_.width(), height, width, resized->mutable_cpu_data());
+    }
+    return resized->cpu_data();
+  }
+  if (mean_values_.size() > 0) {
+    CHECK(mean_values_.size() == 1 || mean_values_.size() == channels) <<
+     "Specify either 1 mean_value or as many as channels: " << channels;
+    if (channels > 1 && mean_values_.size() == 1) {
+      // Replicate the mean_value for simplicity
+      for (int c = 1; c < channels; ++c) {
+        mean_values_.push_back(mean_values_[0]);
       }
     }
   }
+  return NULL;
+}
 
-  Dtype* transformed_data = transformed_blob->mutable_cpu_data();
-
-  for (int n = 0; n < input_num; ++n) {
-    int top_index_n = n * channels;
-    int data_index_n = n * channels;
+template <typename Dtype>
+const Dtype* DataTransformer<Dtype>::MeanWindow(const int channels,
+    const int height, const int width, const int h_off, const int w_off,
+    const int crop_height, const int crop_width, int* row_step,
+    int* plane_step) {
+  const Dtype* mean = PrepareMean(channels, height, width);
+  if (!mean) {
+    return NULL;
+  }
+  if (crop_height == height && crop_width == width) {
+    *row_step = width;
+    *plane_step = height * width;
+    return mean;
+  }
+  vector<int> key(6);
+  key[0] = height;
+  key[1] = width;
+  key[2] = h_off;
+  key[3] = w_off;
+  key[4] = crop_height;
+  key[5] = crop_width;
+  typename map<vector<int>, shared_ptr<Blob<Dtype> > >::const_iterator it =
+      mean_tiles_.find(key);
+  if (it == mean_tiles_.end()) {
+    if (static_cast<int>(mean_tiles_.size()) >= kMaxMeanTiles) {
+      // Too many crop offsets (random crops): read the window in place.
+      *row_step = width;
+      *plane_step = height * width;
+      return mean + h_off * width + w_off;
+    }
+    shared_ptr<Blob<Dtype> > tile(
+        new Blob<Dtype>(1, channels, crop_height, crop_width));
+    Dtype* tile_data = tile->mutable_cpu_data();
     for (int c = 0; c < channels; ++c) {
-      int top_index_c = (top_index_n + c) * height;
-      int data_index_c = (data_index_n + c) * input_height + h_off;
-      for (int h = 0; h < height; ++h) {
-        int top_index_h = (top_index_c + h) * width;
-        int data_index_h = (data_index_c + h) * input_width + w_off;
-        if (do_mirror) {
-          int top_index_w = top_index_h + width - 1;
-          for (int w = 0; w < width; ++w) {
-            transformed_data[top_index_w-w] = input_data[data_index_h + w];
-          }
-        } else {
-          for (int w = 0; w < width; ++w) {
-            transformed_data[top_index_h + w] = input_data[data_index_h + w];
-          }
-        }
+      for (int h = 0; h < crop_height; ++h) {
+        caffe_copy(crop_width,
+            mean + (c * height + h_off + h) * width + w_off,
+            tile_data + (c * crop_height + h) * crop_width);
       }
     }
+    it = mean_tiles_.insert(std::make_pair(key, tile)).first;
   }
-  if (scale != Dtype(1)) {
-    DLOG(INFO) << "Scale: " << scale;
-    caffe_scal(size, scale, transformed_data);
+  *row_step = crop_width;
+  *plane_step = crop_height * crop_width;
+  return it->second->cpu_data();
+}
+
+template <typename Dtype>
+int DataTransformer<Dtype>::CropOffset(const int size, const int crop_size,
+    const float fraction) {
+  // We only do random crop when we do training.
+  if (phase_ == TRAIN) {
+    return std::min(static_cast<int>(fraction * (size - crop_size + 1)),
+        size - crop_size);
   }
+  return (size - crop_size) / 2;
+}
+
+template<typename Dtype>
+void DataTransformer<Dtype>::Transform(const Datum& datum,
+    const Augmentation& aug, Blob<Dtype>* transformed_blob) {
+  const string& data = datum.data();
+  const int datum_channels = datum.channels();
+  const int datum_height = datum.height();
+  const int datum_width = datum.width();
+
+  const int channels = transformed_blob->channels();
+  const int height = transformed_blob->height();
+  const int width = transformed_blob->width();
+  const int crop_size = param_.crop_size();
+
+  CHECK_GT(datum_channels, 0);
+  CHECK_EQ(channels, datum_channels);
+  CHECK_GE(transformed_blob->num(), 1);
+  if (crop_size) {
+    CHECK_GE(datum_height, crop_size);
+    CHECK_GE(datum_width, crop_size);
+    CHECK_EQ(crop_size, height);
+    CHECK_EQ(crop_size, width);
+  } else {
+    CHECK_EQ(datum_height, height);
+    CHECK_EQ(datum_width, width);
+  }
+  const int h_off = crop_size ?
+      CropOffset(datum_height, crop_size, aug.crop_h) : 0;
+  const int w_off = crop_size ?
+      CropOffset(datum_width, crop_size, aug.crop_w) : 0;
+
+  const Dtype* mean = PrepareMean(datum_channels, datum_height, datum_width);
+  const Dtype scale = param_.scale();
+  Dtype* transformed_data = transformed_blob->mutable_cpu_data();
+  const int plane = datum_height * datum_width;
+  if (!aug.geometric() && !aug.photometric()) {
+    // Only crop and mirror: use the row kernels.
+    int mean_row = 0;
+    int mean_plane = 0;
+    mean = MeanWindow(datum_channels, datum_height, datum_width, h_off,
+        w_off, height, width, &mean_row, &mean_plane);
+    if (data.size() > 0) {
+      TransformPlanes(reinterpret_cast<const uint8_t*>(data.data()),
+          datum_channels, datum_height, datum_width, h_off, w_off, height,
+          width, mean, mean_row, mean_plane, mean_values_, scale, aug.mirror,
+          transformed_data);
+    } else {
+      CHECK_EQ(datum.float_data_size(), datum_channels * plane);
+      TransformPlanes(datum.float_data().data(),
+          datum_channels, datum_height, datum_width, h_off, w_off, height,
+          width, mean, mean_row, mean_plane, mean_values_, scale, aug.mirror,
+          transformed_data);
+    }
+    return;
+  }
+  vector<float> table;
+  if (aug.photometric()) {
+    BuildPhotometricTable(aug, &table);
+  }
+  const float* table_data = table.empty() ? NULL : &table[0];
+  if (data.size() > 0) {
+    AugmentPlanes(reinterpret_cast<const uint8_t*>(data.data()),
+        datum_channels, plane, datum_width, 1, datum_height, datum_width,
+        h_off, w_off, height, width, mean, mean_values_, scale, aug,
+        table_data, transformed_data);
+  } else {
+    CHECK_EQ(datum.float_data_size(), datum_channels * plane);
+    AugmentPlanes(datum.float_data().data(),
+        datum_channels, plane, datum_width, 1, datum_height, datum_width,
+        h_off, w_off, height, width, mean, mean_values_, scale, aug,
+        table_data, transformed_data);
+  }
+}
+
+template<typename Dtype>
+void DataTransformer<Dtype>::Transform(const cv::Mat& cv_img,
+    const Augmentation& aug, Blob<Dtype>* transformed_blob) {
+  const int img_channels = cv_img.channels();
+  const int img_height = cv_img.rows;
+  const int img_width = cv_img.cols;
+
+  const int channels = transformed_blob->channels();
+  const int height = transformed_blob->height();
+  const int width = transformed_blob->width();
+  const int crop_size = param_.crop_size();
+
+  CHECK(cv_img.depth() == CV_8U) << "Image data type must be unsigned byte";
+  CHECK_GT(img_channels, 0);
+  CHECK_EQ(channels, img_channels);
+  CHECK_GE(transformed_blob->num(), 1);
+  if (crop_size) {
+    CHECK_GE(img_height, crop_size);
+    CHECK_GE(img_width, crop_size);
+    CHECK_EQ(crop_size, height);
+    CHECK_EQ(crop_size, width);
+  } else {
+    CHECK_EQ(img_height, height);
+    CHECK_EQ(img_width, width);
+  }
+  const int h_off = crop_size ?
+      CropOffset(img_height, crop_size, aug.crop_h) : 0;
+  const int w_off = crop_size ?
+      CropOffset(img_width, crop_size, aug.crop_w) : 0;
+
+  const Dtype* mean = PrepareMean(img_channels, img_height, img_width);
+  vector<float> table;
+  if (aug.photometric()) {
+    BuildPhotometricTable(aug, &table);
+  }
+  AugmentPlanes(cv_img.ptr<uchar>(0), img_channels, 1,
+      static_cast<int>(cv_img.step), img_channels, img_height, img_width,
+      h_off, w_off, height, width, mean, mean_values_,
+      static_cast<Dtype>(param_.scale()), aug,
+      table.empty() ? NULL : &table[0], transformed_blob->mutable_cpu_data());
 }
 
 template <typename Dtype>
@@ -407,6 +808,15 @@ void DataTransformer<Dtype>::InitRand() {
   }
 }
 
+template <typename Dtype>
+void DataTransformer<Dtype>::SeedSample(const unsigned int seed) {
+  aug_seed_ = seed;
+  aug_sample_ = 0;
+  if (rng_) {
+    rng_.reset(new Caffe::RNG(seed));
+  }
+}
+
 template <typename Dtype>
 int DataTransformer<Dtype>::Rand(int n) {
   CHECK(rng_);
@@ -15,15 +15,46 @@ namespace caffe {
 template <typename Dtype>
 shared_ptr<Layer<Dtype> > GetConvolutionLayer(
     const LayerParameter& param) {
-  ConvolutionParameter_Engine engine = param.convolution_param().engine();
+  const ConvolutionParameter& conv_param = param.convolution_param();
+  ConvolutionParameter_Engine engine = conv_param.engine();
   if (engine == ConvolutionParameter_Engine_DEFAULT) {
     engine = ConvolutionParameter_Engine_CAFFE;
 #ifdef USE_CUDNN
     engine = ConvolutionParameter_Engine_CUDNN;
 #endif
+    const int kernel_area = conv_param.has_kernel_size() ?
+        conv_param.kernel_size() * conv_param.kernel_size() :
+        conv_param.kernel_h() * conv_param.kernel_w();
+    const bool is_stride_1 = conv_param.has_stride_h() ?
+        conv_param.stride_h() == 1 && conv_param.stride_w() == 1 :
+        conv_param.stride() == 1;
+    if (Caffe::mode() == Caffe::CPU && is_stride_1 &&
+        conv_param.fft_min_kernel_area() > 0 &&
+        kernel_area >= conv_param.fft_min_kernel_area()) {
+      engine = ConvolutionParameter_Engine_FFT;
+    }
   }
   if (engine == ConvolutionParameter_Engine_CAFFE) {
     return shared_ptr<Layer<Dtype> >(new ConvolutionLayer<Dtype>(param));
+  } else if (engine == ConvolutionParameter_Engine_FFT) {
+    return shared_ptr<Layer<Dtype> >(new FFTConvolutionLayer<Dtype>(param));
+  } else if (engine == ConvolutionParameter_Engine_BLOCKED) {
+    return shared_ptr<Layer<Dtype> >(
+        new BlockedConvolutionLayer<Dtype>(param));
+  } else if (engine == ConvolutionParameter_Engine_WINOGRAD) {
+    const bool is_3x3 = conv_param.has_kernel_size() ?
+        conv_param.kernel_size() == 3 :
+        conv_param.kernel_h() == 3 && conv_param.kernel_w() == 3;
+    const bool is_stride_1 = conv_param.has_stride_h() ?
+        conv_param.stride_h() == 1 && conv_param.stride_w() == 1 :
+        conv_param.stride() == 1;
+    if (!is_3x3 || !is_stride_1) {
+      LOG(INFO) << "WINOGRAD only supports 3x3 filters of stride 1. "
+                << "Using Caffe's own convolution layer.";
+      return shared_ptr<Layer<Dtype> >(new ConvolutionLayer<Dtype>(param));
+    }
+    return shared_ptr<Layer<Dtype> >(
+        new WinogradConvolutionLayer<Dtype>(param));
 #ifdef USE_CUDNN
   } else if (engine == ConvolutionParameter_Engine_CUDNN) {
     return shared_ptr<Layer<Dtype> >(new CuDNNConvolutionLayer<Dtype>(param));
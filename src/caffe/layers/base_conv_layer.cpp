@@ -1,5 +1,10 @@
+#include <algorithm>
 #include <vector>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "caffe/filler.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/util/im2col.hpp"
@@ -139,40 +144,198 @@ void BaseConvolutionLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
   col_offset_ = kernel_dim_ * conv_out_spatial_dim_ / group_;
   output_offset_ = conv_out_channels_ * conv_out_spatial_dim_ / group_;
   // The im2col result buffer will only hold one image at a time to avoid
-  // overly large memory usage. In the special case of 1x1 convolution
-  // it goes lazily unused to save memory.
-  if (reverse_dimensions()) {
+  // overly large memory usage, unless forward on CPU is asked to batch
+  // images and they fit in im2col_batch_bytes. In the special case of 1x1
+  // convolution it is empty, so that it is never allocated.
+  const ConvolutionParameter& conv_param =
+      this->layer_param_.convolution_param();
+  col_batch_ = 1;
+  if (Caffe::mode() == Caffe::CPU && !reverse_dimensions() && !is_1x1_) {
+    const uint64_t image_bytes = static_cast<uint64_t>(kernel_dim_) *
+        conv_out_spatial_dim_ * sizeof(Dtype);
+    const uint64_t max_batch = std::min<uint64_t>(conv_param.im2col_batch(),
+        conv_param.im2col_batch_bytes() / std::max<uint64_t>(image_bytes, 1));
+    col_batch_ = std::max<int>(std::min<uint64_t>(max_batch, num_), 1);
+  }
+  if (is_1x1_) {
+    col_buffer_.Reshape(vector<int>(1, 0));
+  } else if (reverse_dimensions()) {
     col_buffer_.Reshape(1, kernel_dim_, height_, width_);
   } else {
-    col_buffer_.Reshape(1, kernel_dim_, height_out_, width_out_);
+    col_buffer_.Reshape(col_batch_, kernel_dim_, height_out_, width_out_);
+  }
+  if (col_batch_ > 1) {
+    batch_output_.Reshape(1, conv_out_channels_, col_batch_,
+        conv_out_spatial_dim_);
+  }
+  // Threads of the image-parallel mode, each past the first with its own
+  // column buffer and weight gradient.
+  image_threads_ = 1;
+#ifdef _OPENMP
+  if (Caffe::mode() == Caffe::CPU && !reverse_dimensions()) {
+    image_threads_ = conv_param.image_threads() > 0 ?
+        conv_param.image_threads() : omp_get_max_threads();
+    image_threads_ = std::max(1, std::min(image_threads_, num_));
+  }
+#endif
+  thread_col_buffers_.resize(image_threads_ - 1);
+  thread_weight_diffs_.resize(image_threads_ - 1);
+  for (int t = 0; t < image_threads_ - 1; ++t) {
+    if (!thread_col_buffers_[t]) {
+      thread_col_buffers_[t].reset(new Blob<Dtype>());
+      thread_weight_diffs_[t].reset(new Blob<Dtype>());
+    }
+    thread_col_buffers_[t]->ReshapeLike(col_buffer_);
+    thread_weight_diffs_[t]->ReshapeLike(*this->blobs_[0]);
   }
   // Set up the all ones "bias multiplier" for adding biases by BLAS
   if (bias_term_) {
-    vector<int> bias_multiplier_shape(1, height_out_ * width_out_);
+    vector<int> bias_multiplier_shape(1,
+        col_batch_ * height_out_ * width_out_);
     bias_multiplier_.Reshape(bias_multiplier_shape);
     caffe_set(bias_multiplier_.count(), Dtype(1),
         bias_multiplier_.mutable_cpu_data());
   }
 }
 
+template <typename Dtype>
+vector<Dtype*> BaseConvolutionLayer<Dtype>::cpu_col_buffers() {
+  vector<Dtype*> buffers(image_threads_, static_cast<Dtype*>(NULL));
+  if (!is_1x1_) {
+    buffers[0] = col_buffer_.mutable_cpu_data();
+    for (int t = 1; t < image_threads_; ++t) {
+      buffers[t] = thread_col_buffers_[t - 1]->mutable_cpu_data();
+    }
+  }
+  return buffers;
+}
+
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::forward_cpu_1x1(const Dtype* input,
+    const int num, const Dtype* weights, Dtype* output) {
+  if (conv_out_spatial_dim_ == 1 && group_ == 1) {
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, num, conv_out_channels_,
+        conv_in_channels_, (Dtype)1., input, weights, (Dtype)0., output);
+    return;
+  }
+  const int input_dim = conv_in_channels_ * conv_out_spatial_dim_;
+  const int output_dim = conv_out_channels_ * conv_out_spatial_dim_;
+  for (int n = 0; n < num; ++n) {
+    for (int g = 0; g < group_; ++g) {
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, conv_out_channels_ /
+          group_, conv_out_spatial_dim_, conv_in_channels_ / group_,
+          (Dtype)1., weights + weight_offset_ * g,
+          input + n * input_dim + col_offset_ * g,
+          (Dtype)0., output + n * output_dim + output_offset_ * g);
+    }
+  }
+}
+
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::backward_cpu_1x1(const Dtype* output,
+    const int num, const Dtype* weights, Dtype* input) {
+  if (conv_out_spatial_dim_ == 1 && group_ == 1) {
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num, conv_in_channels_,
+        conv_out_channels_, (Dtype)1., output, weights, (Dtype)0., input);
+    return;
+  }
+  const int input_dim = conv_in_channels_ * conv_out_spatial_dim_;
+  const int output_dim = conv_out_channels_ * conv_out_spatial_dim_;
+  for (int n = 0; n < num; ++n) {
+    for (int g = 0; g < group_; ++g) {
+      caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, conv_in_channels_ /
+          group_, conv_out_spatial_dim_, conv_out_channels_ / group_,
+          (Dtype)1., weights + weight_offset_ * g,
+          output + n * output_dim + output_offset_ * g,
+          (Dtype)0., input + n * input_dim + col_offset_ * g);
+    }
+  }
+}
+
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::weight_cpu_1x1(const Dtype* input,
+    const Dtype* output, const int num, Dtype* weights) {
+  if (conv_out_spatial_dim_ == 1 && group_ == 1) {
+    caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, conv_out_channels_,
+        conv_in_channels_, num, (Dtype)1., output, input, (Dtype)1.,
+        weights);
+    return;
+  }
+  const int input_dim = conv_in_channels_ * conv_out_spatial_dim_;
+  const int output_dim = conv_out_channels_ * conv_out_spatial_dim_;
+  for (int g = 0; g < group_; ++g) {
+    for (int n = 0; n < num; ++n) {
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, conv_out_channels_ /
+          group_, conv_in_channels_ / group_, conv_out_spatial_dim_,
+          (Dtype)1., output + n * output_dim + output_offset_ * g,
+          input + n * input_dim + col_offset_ * g,
+          (Dtype)1., weights + weight_offset_ * g);
+    }
+  }
+}
+
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::forward_cpu_gemm(const Dtype* input,
-    const Dtype* weights, Dtype* output, bool skip_im2col) {
-  const Dtype* col_buff = input;
+    const Dtype* weights, Dtype* output, bool skip_im2col, Dtype* col_buff) {
+  const Dtype* col_data = input;
   if (!is_1x1_) {
+    if (!col_buff) {
+      col_buff = col_buffer_.mutable_cpu_data();
+    }
     if (!skip_im2col) {
-      conv_im2col_cpu(input, col_buffer_.mutable_cpu_data());
+      conv_im2col_cpu(input, col_buff);
     }
-    col_buff = col_buffer_.cpu_data();
+    col_data = col_buff;
   }
   for (int g = 0; g < group_; ++g) {
     caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, conv_out_channels_ /
         group_, conv_out_spatial_dim_, kernel_dim_ / group_,
-        (Dtype)1., weights + weight_offset_ * g, col_buff + col_offset_ * g,
+        (Dtype)1., weights + weight_offset_ * g, col_data + col_offset_ * g,
         (Dtype)0., output + output_offset_ * g);
   }
 }
 
+template <typename Dtype>
+void BaseConvolutionLayer<Dtype>::forward_cpu_batch(const Dtype* input,
+    const int num, const Dtype* weights, const Dtype* bias, Dtype* output) {
+  const int input_dim = conv_in_channels_ * conv_in_height_ * conv_in_width_;
+  const int output_dim = conv_out_channels_ * conv_out_spatial_dim_;
+  for (int n = 0; n < num; n += col_batch_) {
+    const int batch = std::min(col_batch_, num - n);
+    const int batch_dim = batch * conv_out_spatial_dim_;
+    // im2col the images side by side: row k of the column buffer holds row k
+    // of every image's columns in turn.
+    Dtype* col_buff = col_buffer_.mutable_cpu_data();
+    for (int b = 0; b < batch; ++b) {
+      im2col_strided_cpu(input + (n + b) * input_dim, conv_in_channels_,
+          conv_in_height_, conv_in_width_, kernel_h_, kernel_w_, pad_h_,
+          pad_w_, stride_h_, stride_w_, batch_dim,
+          col_buff + b * conv_out_spatial_dim_);
+    }
+    Dtype* batch_out = batch_output_.mutable_cpu_data();
+    for (int g = 0; g < group_; ++g) {
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, conv_out_channels_ /
+          group_, batch_dim, kernel_dim_ / group_,
+          (Dtype)1., weights + weight_offset_ * g,
+          col_buff + col_offset_ * batch * g,
+          (Dtype)0., batch_out + output_offset_ * batch * g);
+    }
+    if (bias) {
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num_output_,
+          batch_dim, 1, (Dtype)1., bias, bias_multiplier_.cpu_data(),
+          (Dtype)1., batch_out);
+    }
+    // Scatter the rows back into one output image after the other.
+    for (int b = 0; b < batch; ++b) {
+      for (int c = 0; c < conv_out_channels_; ++c) {
+        caffe_copy(conv_out_spatial_dim_,
+            batch_out + c * batch_dim + b * conv_out_spatial_dim_,
+            output + (n + b) * output_dim + c * conv_out_spatial_dim_);
+      }
+    }
+  }
+}
+
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::forward_cpu_bias(Dtype* output,
     const Dtype* bias) {
@@ -183,10 +346,11 @@ void BaseConvolutionLayer<Dtype>::forward_cpu_bias(Dtype* output,
 
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::backward_cpu_gemm(const Dtype* output,
-    const Dtype* weights, Dtype* input) {
-  Dtype* col_buff = col_buffer_.mutable_cpu_data();
+    const Dtype* weights, Dtype* input, Dtype* col_buff) {
   if (is_1x1_) {
     col_buff = input;
+  } else if (!col_buff) {
+    col_buff = col_buffer_.mutable_cpu_data();
   }
   for (int g = 0; g < group_; ++g) {
     caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, kernel_dim_ / group_,
@@ -201,16 +365,19 @@ void BaseConvolutionLayer<Dtype>::backward_cpu_gemm(const Dtype* output,
 
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::weight_cpu_gemm(const Dtype* input,
-    const Dtype* output, Dtype* weights) {
-  const Dtype* col_buff = input;
+    const Dtype* output, Dtype* weights, Dtype* col_buff) {
+  const Dtype* col_data = input;
   if (!is_1x1_) {
-    conv_im2col_cpu(input, col_buffer_.mutable_cpu_data());
-    col_buff = col_buffer_.cpu_data();
+    if (!col_buff) {
+      col_buff = col_buffer_.mutable_cpu_data();
+    }
+    conv_im2col_cpu(input, col_buff);
+    col_data = col_buff;
   }
   for (int g = 0; g < group_; ++g) {
     caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, conv_out_channels_ / group_,
         kernel_dim_ / group_, conv_out_spatial_dim_,
-        (Dtype)1., output + output_offset_ * g, col_buff + col_offset_ * g,
+        (Dtype)1., output + output_offset_ * g, col_data + col_offset_ * g,
         (Dtype)1., weights + weight_offset_ * g);
   }
 }
@@ -253,10 +420,7 @@ void BaseConvolutionLayer<Dtype>::forward_gpu_bias(Dtype* output,
 template <typename Dtype>
 void BaseConvolutionLayer<Dtype>::backward_gpu_gemm(const Dtype* output,
     const Dtype* weights, Dtype* input) {
-  Dtype* col_buff = col_buffer_.mutable_gpu_data();
-  if (is_1x1_) {
-    col_buff = input;
-  }
+  Dtype* col_buff = is_1x1_ ? input : col_buffer_.mutable_gpu_data();
   for (int g = 0; g < group_; ++g) {
     caffe_gpu_gemm<Dtype>(CblasTrans, CblasNoTrans, kernel_dim_ / group_,
         conv_out_spatial_dim_, conv_out_channels_ / group_,
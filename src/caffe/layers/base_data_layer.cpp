@@ -69,6 +69,7 @@ void BasePrefetchingDataLayer<Dtype>::Forward_cpu(
              top[0]->mutable_cpu_data());
   DLOG(INFO) << "Prefetch copied";
   if (this->output_labels_) {
+    top[1]->ReshapeLike(prefetch_label_);
     caffe_copy(prefetch_label_.count(), prefetch_label_.cpu_data(),
                top[1]->mutable_cpu_data());
   }
@@ -16,6 +16,7 @@ void BasePrefetchingDataLayer<Dtype>::Forward_gpu(
   caffe_copy(prefetch_data_.count(), prefetch_data_.cpu_data(),
       top[0]->mutable_gpu_data());
   if (this->output_labels_) {
+    top[1]->ReshapeLike(prefetch_label_);
     caffe_copy(prefetch_label_.count(), prefetch_label_.cpu_data(),
         top[1]->mutable_gpu_data());
   }
@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/im2col.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+namespace {
+
+// Lays out the receptive field of each output pixel as a row of rows,
+// height_out x width_out rows of planes x kernel_h x kernel_w x
+// bottom_block, from a bottom of planes of height x width x bottom_block.
+// A blocked bottom is copied a whole block of channels at a time.
+template <typename Dtype>
+void im2row_blocked(const Dtype* bottom, const int planes,
+    const int bottom_block, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int height_out,
+    const int width_out, Dtype* rows) {
+  for (int oh = 0; oh < height_out; ++oh) {
+    for (int ow = 0; ow < width_out; ++ow) {
+      for (int p = 0; p < planes; ++p) {
+        for (int kh = 0; kh < kernel_h; ++kh) {
+          const int ih = oh * stride_h - pad_h + kh;
+          for (int kw = 0; kw < kernel_w; ++kw) {
+            const int iw = ow * stride_w - pad_w + kw;
+            if (ih >= 0 && ih < height && iw >= 0 && iw < width) {
+              const Dtype* in =
+                  bottom + ((p * height + ih) * width + iw) * bottom_block;
+              for (int c = 0; c < bottom_block; ++c) {
+                rows[c] = in[c];
+              }
+            } else {
+              for (int c = 0; c < bottom_block; ++c) {
+                rows[c] = 0;
+              }
+            }
+            rows += bottom_block;
+          }
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+
+template <typename Dtype>
+void BlockedConvolutionLayer<Dtype>::LayerSetUp(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  block_ = this->layer_param_.convolution_param().channel_block();
+  CHECK(block_ == 8 || block_ == 16) << "channel_block must be 8 or 16.";
+  ShapeNCHW(*bottom[0]);
+  ConvolutionLayer<Dtype>::LayerSetUp(nchw_bottom_vec_, nchw_top_vec_);
+  CHECK_EQ(this->group_, 1) << "BLOCKED does not support groups.";
+  CHECK_EQ(this->num_output_ % block_, 0)
+      << "channel_block must divide num_output.";
+}
+
+template <typename Dtype>
+void BlockedConvolutionLayer<Dtype>::Reshape(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  ShapeNCHW(*bottom[0]);
+  ConvolutionLayer<Dtype>::Reshape(nchw_bottom_vec_, nchw_top_vec_);
+  vector<int> top_shape(5);
+  top_shape[0] = this->num_;
+  top_shape[1] = this->num_output_ / block_;
+  top_shape[2] = this->height_out_;
+  top_shape[3] = this->width_out_;
+  top_shape[4] = block_;
+  top[0]->Reshape(top_shape);
+  filters_.ReshapeLike(*this->blobs_[0]);
+  rows_.Reshape(1, 1, this->height_out_ * this->width_out_,
+      this->channels_ * this->kernel_h_ * this->kernel_w_);
+  pixels_.Reshape(1, 1, this->height_out_ * this->width_out_,
+      this->num_output_);
+}
+
+template <typename Dtype>
+void BlockedConvolutionLayer<Dtype>::ShapeNCHW(const Blob<Dtype>& bottom) {
+  CHECK(bottom.num_axes() == 4 || bottom.num_axes() == 5)
+      << "Input must have 4 axes, corresponding to (num, channels, height, "
+      << "width), or 5 axes, blocked by channels";
+  const int bottom_block = bottom.num_axes() == 5 ? bottom.shape(4) : 1;
+  if (bottom_block != bottom_block_) {
+    // The filters are laid out for the bottom's block.
+    bottom_block_ = bottom_block;
+    cached_weights_.Reshape(vector<int>(1, 0));
+  }
+  nchw_bottom_.Reshape(bottom.shape(0), bottom.shape(1) * bottom_block_,
+      bottom.shape(2), bottom.shape(3));
+  nchw_bottom_vec_.assign(1, &nchw_bottom_);
+  nchw_top_vec_.assign(1, &nchw_top_);
+}
+
+template <typename Dtype>
+void BlockedConvolutionLayer<Dtype>::UpdateFilters() {
+  const Blob<Dtype>& weights = *this->blobs_[0];
+  if (cached_weights_.count() == weights.count() &&
+      std::equal(weights.cpu_data(), weights.cpu_data() + weights.count(),
+          cached_weights_.cpu_data())) {
+    return;
+  }
+  cached_weights_.CopyFrom(weights, false, true);
+  const int kernel_dim = this->kernel_h_ * this->kernel_w_;
+  const Dtype* weight = weights.cpu_data();
+  Dtype* filters = filters_.mutable_cpu_data();
+  for (int o = 0; o < this->num_output_; ++o) {
+    for (int c = 0; c < this->channels_; ++c) {
+      for (int i = 0; i < kernel_dim; ++i) {
+        filters[((o * (this->channels_ / bottom_block_) + c / bottom_block_) *
+            kernel_dim + i) * bottom_block_ + c % bottom_block_] =
+            weight[(o * this->channels_ + c) * kernel_dim + i];
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void BlockedConvolutionLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  UpdateFilters();
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = top[0]->mutable_cpu_data();
+  const Dtype* filters = filters_.cpu_data();
+  Dtype* rows = rows_.mutable_cpu_data();
+  Dtype* pixels = pixels_.mutable_cpu_data();
+  const Dtype* bias = this->bias_term_ ? this->blobs_[1]->cpu_data() : NULL;
+  Dtype bias_block[16];
+  const int spatial_dim = this->height_out_ * this->width_out_;
+  const int bottom_dim = this->channels_ * this->height_ * this->width_;
+  const int top_dim = this->num_output_ * spatial_dim;
+  const int top_blocks = this->num_output_ / block_;
+  const int kernel_dim = this->channels_ * this->kernel_h_ * this->kernel_w_;
+  for (int n = 0; n < this->num_; ++n) {
+    // An NCHW bottom goes through im2col, whose columns are the rows
+    // transposed; a blocked bottom is laid out as rows a block at a time.
+    if (bottom_block_ == 1) {
+      im2col_cpu(bottom_data + n * bottom_dim, this->channels_, this->height_,
+          this->width_, this->kernel_h_, this->kernel_w_, this->pad_h_,
+          this->pad_w_, this->stride_h_, this->stride_w_, rows);
+    } else {
+      im2row_blocked(bottom_data + n * bottom_dim,
+          this->channels_ / bottom_block_, bottom_block_, this->height_,
+          this->width_, this->kernel_h_, this->kernel_w_, this->pad_h_,
+          this->pad_w_, this->stride_h_, this->stride_w_, this->height_out_,
+          this->width_out_, rows);
+    }
+    // One GEMM gives the pixels x num_output_ output, which is then split
+    // into blocks, adding the bias on the way.
+    caffe_cpu_gemm<Dtype>(bottom_block_ == 1 ? CblasTrans : CblasNoTrans,
+        CblasTrans, spatial_dim, this->num_output_, kernel_dim, (Dtype)1.,
+        rows, filters, (Dtype)0., pixels);
+    Dtype* top_image = top_data + n * top_dim;
+    for (int b = 0; b < top_blocks; ++b) {
+      for (int k = 0; k < block_; ++k) {
+        bias_block[k] = bias ? bias[b * block_ + k] : Dtype(0);
+      }
+      const Dtype* src = pixels + b * block_;
+      Dtype* dst = top_image + b * spatial_dim * block_;
+      for (int i = 0; i < spatial_dim; ++i) {
+        for (int k = 0; k < block_; ++k) {
+          dst[i * block_ + k] = src[i * this->num_output_ + k] + bias_block[k];
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void BlockedConvolutionLayer<Dtype>::Forward_gpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  Forward_cpu(bottom, top);
+}
+
+template <typename Dtype>
+void BlockedConvolutionLayer<Dtype>::Backward_cpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  LOG(FATAL) << "BLOCKED convolution is for inference only.";
+}
+
+template <typename Dtype>
+void BlockedConvolutionLayer<Dtype>::Backward_gpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  Backward_cpu(top, propagate_down, bottom);
+}
+
+INSTANTIATE_CLASS(BlockedConvolutionLayer);
+
+}  // namespace caffe
@@ -1,5 +1,9 @@
 #include <vector>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "caffe/filler.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/util/im2col.hpp"
@@ -23,6 +27,38 @@ void ConvolutionLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   for (int i = 0; i < bottom.size(); ++i) {
     const Dtype* bottom_data = bottom[i]->cpu_data();
     Dtype* top_data = top[i]->mutable_cpu_data();
+    if (this->is_1x1_ && this->image_threads_ == 1) {
+      this->forward_cpu_1x1(bottom_data, this->num_, weight, top_data);
+      if (this->bias_term_) {
+        const Dtype* bias = this->blobs_[1]->cpu_data();
+        for (int n = 0; n < this->num_; ++n) {
+          this->forward_cpu_bias(top_data + top[i]->offset(n), bias);
+        }
+      }
+      continue;
+    }
+    if (this->col_batch_ > 1) {
+      this->forward_cpu_batch(bottom_data, this->num_, weight,
+          this->bias_term_ ? this->blobs_[1]->cpu_data() : NULL, top_data);
+      continue;
+    }
+#ifdef _OPENMP
+    if (this->image_threads_ > 1) {
+      const vector<Dtype*> col_buffs = this->cpu_col_buffers();
+      const Dtype* bias =
+          this->bias_term_ ? this->blobs_[1]->cpu_data() : NULL;
+#pragma omp parallel for num_threads(this->image_threads_) schedule(static)
+      for (int n = 0; n < this->num_; ++n) {
+        this->forward_cpu_gemm(bottom_data + bottom[i]->offset(n), weight,
+            top_data + top[i]->offset(n), false,
+            col_buffs[omp_get_thread_num()]);
+        if (bias) {
+          this->forward_cpu_bias(top_data + top[i]->offset(n), bias);
+        }
+      }
+      continue;
+    }
+#endif
     for (int n = 0; n < this->num_; ++n) {
       this->forward_cpu_gemm(bottom_data + bottom[i]->offset(n), weight,
           top_data + top[i]->offset(n));
@@ -58,6 +94,48 @@ void ConvolutionLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       }
     }
     if (this->param_propagate_down_[0] || propagate_down[i]) {
+      if (this->is_1x1_ && this->image_threads_ == 1) {
+        if (this->param_propagate_down_[0]) {
+          this->weight_cpu_1x1(bottom_data, top_diff, this->num_,
+              weight_diff);
+        }
+        if (propagate_down[i]) {
+          this->backward_cpu_1x1(top_diff, this->num_, weight, bottom_diff);
+        }
+        continue;
+      }
+#ifdef _OPENMP
+      if (this->image_threads_ > 1) {
+        const vector<Dtype*> col_buffs = this->cpu_col_buffers();
+        // Threads past the first accumulate their weight gradients apart;
+        // they are summed into weight_diff after the loop.
+        vector<Dtype*> weight_diffs(1, weight_diff);
+        if (this->param_propagate_down_[0]) {
+          for (int t = 1; t < this->image_threads_; ++t) {
+            weight_diffs.push_back(
+                this->thread_weight_diffs_[t - 1]->mutable_cpu_data());
+            caffe_set(this->blobs_[0]->count(), Dtype(0), weight_diffs[t]);
+          }
+        }
+#pragma omp parallel for num_threads(this->image_threads_) schedule(static)
+        for (int n = 0; n < this->num_; ++n) {
+          const int t = omp_get_thread_num();
+          if (this->param_propagate_down_[0]) {
+            this->weight_cpu_gemm(bottom_data + bottom[i]->offset(n),
+                top_diff + top[i]->offset(n), weight_diffs[t], col_buffs[t]);
+          }
+          if (propagate_down[i]) {
+            this->backward_cpu_gemm(top_diff + top[i]->offset(n), weight,
+                bottom_diff + bottom[i]->offset(n), col_buffs[t]);
+          }
+        }
+        for (int t = 1; t < weight_diffs.size(); ++t) {
+          caffe_axpy(this->blobs_[0]->count(), Dtype(1), weight_diffs[t],
+              weight_diff);
+        }
+        continue;
+      }
+#endif
       for (int n = 0; n < this->num_; ++n) {
         // gradient w.r.t. weight. Note that we will accumulate diffs.
         if (this->param_propagate_down_[0]) {
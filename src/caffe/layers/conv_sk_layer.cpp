@@ -89,6 +89,12 @@ void ConvolutionSKLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
     }
   }
   this->param_propagate_down_.resize(this->blobs_.size(), true);
+  const ConvolutionParameter_Engine engine = conv_param.engine();
+  use_fft_ = engine == ConvolutionParameter_Engine_FFT ||
+      (engine == ConvolutionParameter_Engine_DEFAULT &&
+       conv_param.fft_min_kernel_area() > 0 && stride_h_ == 1 &&
+       stride_w_ == 1 &&
+       kernel_h_ * kernel_w_ >= conv_param.fft_min_kernel_area());
 }
 
 template<typename Dtype>
@@ -115,8 +121,23 @@ void ConvolutionSKLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
   int ext_kernel_w = (kernel_w_ - 1) * kstride_w_ + 1;
   int height_out = (height_ - ext_kernel_h) / stride_h_ + 1;
   int width_out = (width_ - ext_kernel_w) / stride_w_ + 1;
+  // Only allocated when used, so not by the FFT convolution on CPU.
   col_buffer_.Reshape(
       1, channels_ * kernel_h_ * kernel_w_, height_out, width_out);
+  // With stride > 1, inputs of different sizes can give the same output
+  // size, so the FFTs are made for the input size.
+  if (use_fft_ && (ffts_.empty() || fft_height_ != height_ ||
+      fft_width_ != width_)) {
+    fft_height_ = height_;
+    fft_width_ = width_;
+    ffts_.clear();
+    for (int g = 0; g < group_; ++g) {
+      ffts_.push_back(shared_ptr<FFTConvolution<Dtype> >(
+          new FFTConvolution<Dtype>(channels_ / group_, num_output_ / group_,
+              height_, width_, kernel_h_, kernel_w_, pad_h_, pad_w_,
+              stride_h_, stride_w_, kstride_h_, kstride_w_)));
+    }
+  }
   // Figure out the dimensions for individual gemms.
   M_ = num_output_ / group_;
   K_ = channels_ * kernel_h_ * kernel_w_ / group_;
@@ -134,6 +155,30 @@ void ConvolutionSKLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void ConvolutionSKLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+  if (use_fft_) {
+    const Dtype* weight = this->blobs_[0]->cpu_data();
+    for (int g = 0; g < group_; ++g) {
+      ffts_[g]->SetFilters(weight + M_ * K_ * g);
+    }
+    for (int i = 0; i < bottom.size(); ++i) {
+      const Dtype* bottom_data = bottom[i]->cpu_data();
+      Dtype* top_data = top[i]->mutable_cpu_data();
+      for (int n = 0; n < num_; ++n) {
+        for (int g = 0; g < group_; ++g) {
+          ffts_[g]->Forward(bottom_data + bottom[i]->offset(n) +
+              channels_ / group_ * height_ * width_ * g,
+              top_data + top[i]->offset(n) + M_ * N_ * g);
+        }
+        if (bias_term_) {
+          caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, num_output_,
+              N_, 1, (Dtype)1., this->blobs_[1]->cpu_data(),
+              bias_multiplier_.cpu_data(),
+              (Dtype)1., top_data + top[i]->offset(n));
+        }
+      }
+    }
+    return;
+  }
   for (int i = 0; i < bottom.size(); ++i) {
     const Dtype* bottom_data = bottom[i]->cpu_data();
     Dtype* top_data = top[i]->mutable_cpu_data();
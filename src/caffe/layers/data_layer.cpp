@@ -30,14 +30,21 @@ void DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   cursor_.reset(db_->NewCursor());
 
   // Check if we should randomly skip a few data points
+  pass_from_start_ = true;
   if (this->layer_param_.data_param().rand_skip()) {
     unsigned int skip = caffe_rng_rand() %
                         this->layer_param_.data_param().rand_skip();
     LOG(INFO) << "Skipping first " << skip << " data points.";
+    pass_from_start_ = (skip == 0);
     while (skip-- > 0) {
       cursor_->Next();
     }
   }
+  if (this->layer_param_.data_param().cache_bytes() > 0) {
+    sample_cache_.reset(new SampleCache(
+        this->layer_param_.data_param().cache_bytes(),
+        this->layer_param_.data_param().cache_shuffle()));
+  }
   // Read a data point, and use it to initialize the top blob.
   Datum datum;
   datum.ParseFromString(cursor_->value());
@@ -86,27 +93,9 @@ void DataLayer<Dtype>::InternalThreadEntry() {
   CHECK(this->prefetch_data_.count());
   CHECK(this->transformed_data_.count());
 
-  // Reshape on single input batches for inputs of varying dimension.
   const int batch_size = this->layer_param_.data_param().batch_size();
   const int crop_size = this->layer_param_.transform_param().crop_size();
   bool force_color = this->layer_param_.data_param().force_encoded_color();
-  if (batch_size == 1 && crop_size == 0) {
-    Datum datum;
-    datum.ParseFromString(cursor_->value());
-    if (datum.encoded()) {
-      if (force_color) {
-        DecodeDatum(&datum, true);
-      } else {
-        DecodeDatumNative(&datum);
-      }
-    }
-    this->prefetch_data_.Reshape(1, datum.channels(),
-        datum.height(), datum.width());
-    this->transformed_data_.Reshape(1, datum.channels(),
-        datum.height(), datum.width());
-  }
-
-  Dtype* top_data = this->prefetch_data_.mutable_cpu_data();
   Dtype* top_label = NULL;  // suppress warnings about uninitialized variables
 
   if (this->output_labels_) {
@@ -116,29 +105,45 @@ void DataLayer<Dtype>::InternalThreadEntry() {
     timer.Start();
     // get a blob
     Datum datum;
-    datum.ParseFromString(cursor_->value());
-
     cv::Mat cv_img;
-    if (datum.encoded()) {
-      if (force_color) {
-        cv_img = DecodeDatumToCVMat(datum, true);
-      } else {
-        cv_img = DecodeDatumToCVMatNative(datum);
-      }
-      if (cv_img.channels() != this->transformed_data_.channels()) {
-        LOG(WARNING) << "Your dataset contains encoded images with mixed "
-        << "channel sizes. Consider adding a 'force_color' flag to the "
-        << "model definition, or rebuild your dataset using "
-        << "convert_imageset.";
+    if (sample_cache_) {
+      ReadCachedDatum(&datum);
+    } else {
+      datum.ParseFromString(cursor_->value());
+      if (datum.encoded()) {
+        if (force_color) {
+          cv_img = DecodeDatumToCVMat(datum, true);
+        } else {
+          cv_img = DecodeDatumToCVMatNative(datum);
+        }
+        if (cv_img.channels() != this->transformed_data_.channels()) {
+          LOG(WARNING) << "Your dataset contains encoded images with mixed "
+          << "channel sizes. Consider adding a 'force_color' flag to the "
+          << "model definition, or rebuild your dataset using "
+          << "convert_imageset.";
+        }
       }
     }
     read_time += timer.MicroSeconds();
     timer.Start();
 
+    // Reshape on single input batches for inputs of varying dimension.
+    if (batch_size == 1 && crop_size == 0) {
+      if (cv_img.data) {
+        this->prefetch_data_.Reshape(1, cv_img.channels(),
+            cv_img.rows, cv_img.cols);
+      } else {
+        this->prefetch_data_.Reshape(1, datum.channels(),
+            datum.height(), datum.width());
+      }
+      this->transformed_data_.ReshapeLike(this->prefetch_data_);
+    }
+
     // Apply data transformations (mirror, scale, crop...)
+    Dtype* top_data = this->prefetch_data_.mutable_cpu_data();
     int offset = this->prefetch_data_.offset(item_id);
     this->transformed_data_.set_cpu_data(top_data + offset);
-    if (datum.encoded()) {
+    if (cv_img.data) {
       this->data_transformer_->Transform(cv_img, &(this->transformed_data_));
     } else {
       this->data_transformer_->Transform(datum, &(this->transformed_data_));
@@ -147,6 +152,9 @@ void DataLayer<Dtype>::InternalThreadEntry() {
       top_label[item_id] = datum.label();
     }
     trans_time += timer.MicroSeconds();
+    if (sample_cache_) {
+      continue;
+    }
     // go to the next iter
     cursor_->Next();
     if (!cursor_->valid()) {
@@ -160,6 +168,38 @@ void DataLayer<Dtype>::InternalThreadEntry() {
   DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
 }
 
+template <typename Dtype>
+void DataLayer<Dtype>::ReadCachedDatum(Datum* datum) {
+  vector<Datum> sample;
+  if (sample_cache_->in_memory()) {
+    sample_cache_->Next(&sample);
+    datum->Swap(&sample[0]);
+    return;
+  }
+  const string key = cursor_->key();
+  if (!sample_cache_->Get(key, &sample)) {
+    // Cache the decoded pixels, so hits skip the image decoding as well.
+    sample.resize(1);
+    sample[0].ParseFromString(cursor_->value());
+    if (sample[0].encoded()) {
+      if (this->layer_param_.data_param().force_encoded_color()) {
+        DecodeDatum(&sample[0], true);
+      } else {
+        DecodeDatumNative(&sample[0]);
+      }
+    }
+    sample_cache_->Put(key, sample);
+  }
+  datum->Swap(&sample[0]);
+  cursor_->Next();
+  if (!cursor_->valid()) {
+    DLOG(INFO) << "Restarting data prefetching from start.";
+    cursor_->SeekToFirst();
+    sample_cache_->EndEpoch(pass_from_start_);
+    pass_from_start_ = true;
+  }
+}
+
 INSTANTIATE_CLASS(DataLayer);
 REGISTER_LAYER_CLASS(Data);
 
@@ -23,9 +23,14 @@ void DeconvolutionLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   for (int i = 0; i < bottom.size(); ++i) {
     const Dtype* bottom_data = bottom[i]->cpu_data();
     Dtype* top_data = top[i]->mutable_cpu_data();
+    if (this->is_1x1_) {
+      this->backward_cpu_1x1(bottom_data, this->num_, weight, top_data);
+    }
     for (int n = 0; n < this->num_; ++n) {
-      this->backward_cpu_gemm(bottom_data + bottom[i]->offset(n), weight,
-          top_data + top[i]->offset(n));
+      if (!this->is_1x1_) {
+        this->backward_cpu_gemm(bottom_data + bottom[i]->offset(n), weight,
+            top_data + top[i]->offset(n));
+      }
       if (this->bias_term_) {
         const Dtype* bias = this->blobs_[1]->cpu_data();
         this->forward_cpu_bias(top_data + top[i]->offset(n), bias);
@@ -57,7 +62,14 @@ void DeconvolutionLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
         this->backward_cpu_bias(bias_diff, top_diff + top[i]->offset(n));
       }
     }
-    if (this->param_propagate_down_[0] || propagate_down[i]) {
+    if (this->is_1x1_) {
+      if (this->param_propagate_down_[0]) {
+        this->weight_cpu_1x1(top_diff, bottom_data, this->num_, weight_diff);
+      }
+      if (propagate_down[i]) {
+        this->forward_cpu_1x1(top_diff, this->num_, weight, bottom_diff);
+      }
+    } else if (this->param_propagate_down_[0] || propagate_down[i]) {
       for (int n = 0; n < this->num_; ++n) {
         // Gradient w.r.t. weight. Note that we will accumulate diffs.
         if (this->param_propagate_down_[0]) {
@@ -0,0 +1,109 @@
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/fft.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void FFTConvolutionLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  ConvolutionLayer<Dtype>::Reshape(bottom, top);
+  if (!ffts_.empty() && this->height_ == fft_height_ &&
+      this->width_ == fft_width_) {
+    return;
+  }
+  fft_height_ = this->height_;
+  fft_width_ = this->width_;
+  ffts_.clear();
+  for (int g = 0; g < this->group_; ++g) {
+    ffts_.push_back(shared_ptr<FFTConvolution<Dtype> >(
+        new FFTConvolution<Dtype>(this->channels_ / this->group_,
+            this->num_output_ / this->group_, this->height_, this->width_,
+            this->kernel_h_, this->kernel_w_, this->pad_h_, this->pad_w_,
+            this->stride_h_, this->stride_w_, 1, 1)));
+  }
+}
+
+template <typename Dtype>
+void FFTConvolutionLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  const Dtype* weight = this->blobs_[0]->cpu_data();
+  const int weight_dim = this->blobs_[0]->count() / this->group_;
+  for (int g = 0; g < this->group_; ++g) {
+    ffts_[g]->SetFilters(weight + g * weight_dim);
+  }
+  const int bottom_dim = bottom[0]->count(1) / this->group_;
+  const int top_dim = top[0]->count(1) / this->group_;
+  for (int i = 0; i < bottom.size(); ++i) {
+    const Dtype* bottom_data = bottom[i]->cpu_data();
+    Dtype* top_data = top[i]->mutable_cpu_data();
+    for (int n = 0; n < this->num_; ++n) {
+      for (int g = 0; g < this->group_; ++g) {
+        ffts_[g]->Forward(bottom_data + bottom[i]->offset(n) + g * bottom_dim,
+            top_data + top[i]->offset(n) + g * top_dim);
+      }
+      if (this->bias_term_) {
+        const Dtype* bias = this->blobs_[1]->cpu_data();
+        this->forward_cpu_bias(top_data + top[i]->offset(n), bias);
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void FFTConvolutionLayer<Dtype>::Backward_cpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  const Dtype* weight = this->blobs_[0]->cpu_data();
+  Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
+  const int weight_dim = this->blobs_[0]->count() / this->group_;
+  if (this->param_propagate_down_[0]) {
+    caffe_set(this->blobs_[0]->count(), Dtype(0), weight_diff);
+  }
+  if (this->bias_term_ && this->param_propagate_down_[1]) {
+    caffe_set(this->blobs_[1]->count(), Dtype(0),
+        this->blobs_[1]->mutable_cpu_diff());
+  }
+  for (int g = 0; g < this->group_; ++g) {
+    ffts_[g]->SetFilters(weight + g * weight_dim);
+  }
+  const int bottom_dim = bottom[0]->count(1) / this->group_;
+  const int top_dim = top[0]->count(1) / this->group_;
+  for (int i = 0; i < top.size(); ++i) {
+    const Dtype* top_diff = top[i]->cpu_diff();
+    const Dtype* bottom_data = bottom[i]->cpu_data();
+    Dtype* bottom_diff = bottom[i]->mutable_cpu_diff();
+    for (int n = 0; n < this->num_; ++n) {
+      if (this->bias_term_ && this->param_propagate_down_[1]) {
+        this->backward_cpu_bias(this->blobs_[1]->mutable_cpu_diff(),
+            top_diff + top[i]->offset(n));
+      }
+      for (int g = 0; g < this->group_; ++g) {
+        const Dtype* image_diff = top_diff + top[i]->offset(n) + g * top_dim;
+        // The weight gradient is summed over the batch in the frequency
+        // domain and transformed back once below.
+        if (this->param_propagate_down_[0]) {
+          ffts_[g]->AccumulateFilterDiff(
+              bottom_data + bottom[i]->offset(n) + g * bottom_dim,
+              image_diff);
+        }
+        if (propagate_down[i]) {
+          ffts_[g]->BackwardData(image_diff,
+              bottom_diff + bottom[i]->offset(n) + g * bottom_dim);
+        }
+      }
+    }
+  }
+  if (this->param_propagate_down_[0]) {
+    for (int g = 0; g < this->group_; ++g) {
+      ffts_[g]->FilterDiff(weight_diff + g * weight_dim);
+    }
+  }
+}
+
+INSTANTIATE_CLASS(FFTConvolutionLayer);
+
+}  // namespace caffe
@@ -1,11 +1,5 @@
-/*
-TODO:
-- load file in a separate thread ("prefetch")
-- can be smarter about the memcpy call instead of doing it row-by-row
-  :: use util functions caffe_copy, and Blob->offset()
-  :: don't forget to update hdf5_daa_layer.cu accordingly
-- add ability to shuffle filenames if flag is set
-*/
+#include <boost/thread.hpp>
+#include <algorithm>
 #include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
@@ -17,64 +11,176 @@ TODO:
 #include "caffe/data_layers.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/rng.hpp"
 
 namespace caffe {
 
 template <typename Dtype>
-HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() { }
+HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() {
+  JoinPrefetchThread();
+  JoinWindowThread();
+  CloseHDF5File();
+}
 
-// Load data and label from HDF5 filename into the class property blobs.
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::LoadHDF5FileData(const char* filename) {
-  DLOG(INFO) << "Loading HDF5 file: " << filename;
-  hid_t file_id = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
-  if (file_id < 0) {
+void HDF5DataLayer<Dtype>::OpenHDF5File() {
+  CloseHDF5File();
+  const char* filename =
+      hdf_filenames_[file_permutation_[current_file_]].c_str();
+  DLOG(INFO) << "Opening HDF5 file: " << filename;
+  boost::mutex::scoped_lock lock(hdf5_mutex());
+  file_id_ = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (file_id_ < 0) {
     LOG(FATAL) << "Failed opening HDF5 file: " << filename;
   }
 
-  int top_size = this->layer_param_.top_size();
-  hdf_blobs_.resize(top_size);
-
   const int MIN_DATA_DIM = 1;
   const int MAX_DATA_DIM = INT_MAX;
 
-  for (int i = 0; i < top_size; ++i) {
-    hdf_blobs_[i] = shared_ptr<Blob<Dtype> >(new Blob<Dtype>());
-    hdf5_load_nd_dataset(file_id, this->layer_param_.top(i).c_str(),
-        MIN_DATA_DIM, MAX_DATA_DIM, hdf_blobs_[i].get());
+  // MinTopBlobs==1 guarantees at least one top blob
+  vector<int> shape;
+  for (int i = 0; i < this->layer_param_.top_size(); ++i) {
+    hdf5_get_nd_dataset_shape(file_id_, this->layer_param_.top(i).c_str(),
+        MIN_DATA_DIM, MAX_DATA_DIM, &shape);
+    if (i == 0) {
+      file_rows_ = shape[0];
+    } else {
+      CHECK_EQ(shape[0], file_rows_);
+    }
   }
+  CHECK_GT(file_rows_, 0) << "No rows in HDF5 file: " << filename;
 
-  herr_t status = H5Fclose(file_id);
-  CHECK_GE(status, 0) << "Failed to close HDF5 file: " << filename;
+  const int window_rows = this->layer_param_.hdf5_data_param().window_rows();
+  const int window = window_rows > 0 ? window_rows : file_rows_;
+  window_starts_.clear();
+  for (int start = 0; start < file_rows_; start += window) {
+    window_starts_.push_back(start);
+  }
+  if (this->layer_param_.hdf5_data_param().shuffle()) {
+    shuffle(window_starts_.begin(), window_starts_.end(),
+        static_cast<caffe::rng_t*>(window_rng_->generator()));
+  }
+  current_window_ = 0;
+}
 
-  // MinTopBlobs==1 guarantees at least one top blob
-  CHECK_GE(hdf_blobs_[0]->num_axes(), 1) << "Input must have at least 1 axis.";
-  const int num = hdf_blobs_[0]->shape(0);
-  for (int i = 1; i < top_size; ++i) {
-    CHECK_EQ(hdf_blobs_[i]->shape(0), num);
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::CloseHDF5File() {
+  if (file_id_ < 0) {
+    return;
   }
-  // Default to identity permutation.
-  data_permutation_.clear();
-  data_permutation_.resize(hdf_blobs_[0]->shape(0));
-  for (int i = 0; i < hdf_blobs_[0]->shape(0); i++)
-    data_permutation_[i] = i;
+  boost::mutex::scoped_lock lock(hdf5_mutex());
+  herr_t status = H5Fclose(file_id_);
+  CHECK_GE(status, 0) << "Failed to close HDF5 file: "
+      << hdf_filenames_[file_permutation_[current_file_]];
+  file_id_ = -1;
+}
 
-  // Shuffle if needed.
-  if (this->layer_param_.hdf5_data_param().shuffle()) {
-    std::random_shuffle(data_permutation_.begin(), data_permutation_.end());
-    DLOG(INFO) << "Successully loaded " << hdf_blobs_[0]->shape(0)
-               << " rows (shuffled)";
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::LoadHDF5Window(
+    vector<shared_ptr<Blob<Dtype> > >* blobs) {
+  const int window_rows = this->layer_param_.hdf5_data_param().window_rows();
+  const int start = window_starts_[current_window_];
+  const int num = window_rows > 0 ?
+      std::min(window_rows, file_rows_ - start) : file_rows_;
+  boost::mutex::scoped_lock lock(hdf5_mutex());
+  for (int i = 0; i < blobs->size(); ++i) {
+    hdf5_load_nd_dataset_rows(file_id_, this->layer_param_.top(i).c_str(),
+        1, INT_MAX, start, num, (*blobs)[i].get());
+  }
+  DLOG(INFO) << "Successully loaded rows " << start << " to "
+             << start + num - 1;
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::NextHDF5Window() {
+  if (++current_window_ < window_starts_.size()) {
+    return;
+  }
+  const bool shuffle = this->layer_param_.hdf5_data_param().shuffle();
+  if (num_files_ > 1) {
+    ++current_file_;
+    if (current_file_ == num_files_) {
+      current_file_ = 0;
+      if (shuffle) {
+        caffe::shuffle(file_permutation_.begin(), file_permutation_.end(),
+            static_cast<caffe::rng_t*>(window_rng_->generator()));
+      }
+      DLOG(INFO) << "Looping around to first file.";
+    }
+    OpenHDF5File();
   } else {
-    DLOG(INFO) << "Successully loaded " << hdf_blobs_[0]->shape(0) << " rows";
+    current_window_ = 0;
+    if (shuffle) {
+      caffe::shuffle(window_starts_.begin(), window_starts_.end(),
+          static_cast<caffe::rng_t*>(window_rng_->generator()));
+    }
   }
 }
 
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::CreateWindowThread() {
+  // The window thread shuffles with its own generator, seeded from
+  // prefetch_rng_ before it starts, so no generator is shared between
+  // threads and the order does not depend on their timing.
+  window_rng_.reset(new Caffe::RNG(
+      (*static_cast<caffe::rng_t*>(prefetch_rng_->generator()))()));
+  window_thread_.reset(new boost::thread(
+      &HDF5DataLayer<Dtype>::WindowThreadEntry, this));
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::WindowThreadEntry() {
+  NextHDF5Window();
+  LoadHDF5Window(&next_blobs_);
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::JoinWindowThread() {
+  if (window_thread_) {
+    window_thread_->join();
+    window_thread_.reset();
+  }
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::ShuffleRows() {
+  const int num = hdf_blobs_[0]->shape(0);
+  data_permutation_.resize(num);
+  for (int i = 0; i < num; ++i) {
+    data_permutation_[i] = i;
+  }
+  if (this->layer_param_.hdf5_data_param().shuffle()) {
+    shuffle(data_permutation_.begin(), data_permutation_.end(),
+        static_cast<caffe::rng_t*>(prefetch_rng_->generator()));
+  }
+  current_row_ = 0;
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::SwapHDF5Window() {
+  if (!single_window_) {
+    JoinWindowThread();
+    hdf_blobs_.swap(next_blobs_);
+    CreateWindowThread();
+    for (int i = 0; i < hdf_blobs_.size(); ++i) {
+      CHECK_EQ(hdf_blobs_[i]->count(1), prefetch_blobs_[i]->count(1))
+          << "Rows of " << this->layer_param_.top(i)
+          << " differ in size between HDF5 files.";
+    }
+  }
+  ShuffleRows();
+}
+
 template <typename Dtype>
 void HDF5DataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   // Refuse transformation parameters since HDF5 is totally generic.
   CHECK(!this->layer_param_.has_transform_param()) <<
       this->type() << " does not transform data.";
+  // Stop the threads of a previous setup.
+  JoinPrefetchThread();
+  JoinWindowThread();
+  CloseHDF5File();
   // Read the source to parse the filenames.
   const string& source = this->layer_param_.hdf5_data_param().source();
   LOG(INFO) << "Loading list of HDF5 filenames from: " << source;
@@ -102,59 +208,101 @@ void HDF5DataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
     file_permutation_[i] = i;
   }
 
-  // Shuffle if needed.
+  // Shuffle if needed. The rows are shuffled with prefetch_rng_, the files
+  // and windows with window_rng_, which is reseeded from prefetch_rng_ for
+  // every window thread.
+  prefetch_rng_.reset(new Caffe::RNG(caffe_rng_rand()));
+  window_rng_.reset(new Caffe::RNG(
+      (*static_cast<caffe::rng_t*>(prefetch_rng_->generator()))()));
   if (this->layer_param_.hdf5_data_param().shuffle()) {
-    std::random_shuffle(file_permutation_.begin(), file_permutation_.end());
+    shuffle(file_permutation_.begin(), file_permutation_.end(),
+        static_cast<caffe::rng_t*>(window_rng_->generator()));
   }
 
-  // Load the first HDF5 file and initialize the line counter.
-  LoadHDF5FileData(hdf_filenames_[file_permutation_[current_file_]].c_str());
-  current_row_ = 0;
+  // Load the first window of the first HDF5 file and initialize the line
+  // counter.
+  const int top_size = this->layer_param_.top_size();
+  hdf_blobs_.resize(top_size);
+  next_blobs_.resize(top_size);
+  prefetch_blobs_.resize(top_size);
+  for (int i = 0; i < top_size; ++i) {
+    hdf_blobs_[i].reset(new Blob<Dtype>());
+    next_blobs_[i].reset(new Blob<Dtype>());
+  }
+  OpenHDF5File();
+  LoadHDF5Window(&hdf_blobs_);
+  single_window_ = num_files_ == 1 && window_starts_.size() == 1;
+  ShuffleRows();
 
   // Reshape blobs.
   const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
-  const int top_size = this->layer_param_.top_size();
   vector<int> top_shape;
   for (int i = 0; i < top_size; ++i) {
-    top_shape.resize(hdf_blobs_[i]->num_axes());
+    top_shape = hdf_blobs_[i]->shape();
     top_shape[0] = batch_size;
-    for (int j = 1; j < top_shape.size(); ++j) {
-      top_shape[j] = hdf_blobs_[i]->shape(j);
-    }
     top[i]->Reshape(top_shape);
+    prefetch_blobs_[i].reset(new Blob<Dtype>(top_shape));
+    // Allocate from the main thread, see BasePrefetchingDataLayer.
+    prefetch_blobs_[i]->mutable_cpu_data();
   }
+
+  // Now, start reading the next window and the first batch.
+  if (!single_window_) {
+    CreateWindowThread();
+  }
+  DLOG(INFO) << "Initializing prefetch";
+  CreatePrefetchThread();
+  DLOG(INFO) << "Prefetch initialized.";
 }
 
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top) {
+void HDF5DataLayer<Dtype>::CreatePrefetchThread() {
+  CHECK(StartInternalThread()) << "Thread execution failed";
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::JoinPrefetchThread() {
+  CHECK(WaitForInternalThreadToExit()) << "Thread joining failed";
+}
+
+// This function is used to create a thread that prefetches the data.
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::InternalThreadEntry() {
   const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
-  for (int i = 0; i < batch_size; ++i, ++current_row_) {
+  for (int i = 0; i < batch_size; ) {
     if (current_row_ == hdf_blobs_[0]->shape(0)) {
-      if (num_files_ > 1) {
-        ++current_file_;
-        if (current_file_ == num_files_) {
-          current_file_ = 0;
-          if (this->layer_param_.hdf5_data_param().shuffle()) {
-            std::random_shuffle(file_permutation_.begin(),
-                                file_permutation_.end());
-          }
-          DLOG(INFO) << "Looping around to first file.";
-        }
-        LoadHDF5FileData(
-            hdf_filenames_[file_permutation_[current_file_]].c_str());
-      }
-      current_row_ = 0;
-      if (this->layer_param_.hdf5_data_param().shuffle())
-        std::random_shuffle(data_permutation_.begin(), data_permutation_.end());
+      SwapHDF5Window();
+    }
+    // Rows that are consecutive in the window, e.g. all of them when not
+    // shuffling, are copied as one run.
+    const int first = data_permutation_[current_row_];
+    int run = 1;
+    while (i + run < batch_size &&
+        current_row_ + run < hdf_blobs_[0]->shape(0) &&
+        data_permutation_[current_row_ + run] == first + run) {
+      ++run;
     }
-    for (int j = 0; j < this->layer_param_.top_size(); ++j) {
-      int data_dim = top[j]->count() / top[j]->shape(0);
-      caffe_copy(data_dim,
-          &hdf_blobs_[j]->cpu_data()[data_permutation_[current_row_]
-            * data_dim], &top[j]->mutable_cpu_data()[i * data_dim]);
+    for (int j = 0; j < prefetch_blobs_.size(); ++j) {
+      const int data_dim = prefetch_blobs_[j]->count(1);
+      caffe_copy(run * data_dim, hdf_blobs_[j]->cpu_data() + first * data_dim,
+          prefetch_blobs_[j]->mutable_cpu_data() + i * data_dim);
     }
+    i += run;
+    current_row_ += run;
+  }
+}
+
+template <typename Dtype>
+void HDF5DataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  // First, join the thread
+  JoinPrefetchThread();
+  for (int j = 0; j < prefetch_blobs_.size(); ++j) {
+    caffe_copy(prefetch_blobs_[j]->count(), prefetch_blobs_[j]->cpu_data(),
+        top[j]->mutable_cpu_data());
   }
+  // Start a new prefetch thread
+  CreatePrefetchThread();
 }
 
 #ifdef CPU_ONLY
@@ -1,3 +1,4 @@
+#include <boost/thread.hpp>
 #include <vector>
 
 #include "hdf5.h"
@@ -11,54 +12,160 @@
 
 namespace caffe {
 
+template <typename Dtype>
+static hid_t hdf5_native_type();
+
+template <>
+hid_t hdf5_native_type<float>() { return H5T_NATIVE_FLOAT; }
+
+template <>
+hid_t hdf5_native_type<double>() { return H5T_NATIVE_DOUBLE; }
+
+// IEEE 754 half precision, which HDF5 1.10 does not predefine; HDF5
+// converts to and from it on write and read.
+static hid_t hdf5_float16_type() {
+  hid_t type = H5Tcopy(H5T_IEEE_F32LE);
+  CHECK_GE(type, 0);
+  CHECK_GE(H5Tset_fields(type, 15, 10, 5, 0, 10), 0);
+  CHECK_GE(H5Tset_size(type, 2), 0);
+  CHECK_GE(H5Tset_ebias(type, 15), 0);
+  return type;
+}
+
 template <typename Dtype>
 void HDF5OutputLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
     const vector<Blob<Dtype>*>& top) {
-  file_name_ = this->layer_param_.hdf5_output_param().file_name();
+  const HDF5OutputParameter& param = this->layer_param_.hdf5_output_param();
+  CHECK_LE(param.compression(), 9) << "gzip levels go from 1 to 9";
+  CHECK_GE(param.queue_size(), 1);
+  file_name_ = param.file_name();
+  boost::mutex::scoped_lock lock(hdf5_mutex());
   file_id_ = H5Fcreate(file_name_.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
                        H5P_DEFAULT);
   CHECK_GE(file_id_, 0) << "Failed to open HDF5 file" << file_name_;
   file_opened_ = true;
+  lock.unlock();
+
+  buffers_.resize(param.queue_size());
+  for (int i = 0; i < buffers_.size(); ++i) {
+    buffers_[i].resize(bottom.size());
+    for (int j = 0; j < bottom.size(); ++j) {
+      buffers_[i][j].reset(new Blob<Dtype>());
+    }
+    free_.push(i);
+  }
+  CHECK(StartInternalThread()) << "Thread execution failed";
 }
 
 template <typename Dtype>
 HDF5OutputLayer<Dtype>::~HDF5OutputLayer<Dtype>() {
   if (file_opened_) {
+    // Flush the queue.
+    full_.push(-1);
+    CHECK(WaitForInternalThreadToExit()) << "Thread joining failed";
+    boost::mutex::scoped_lock lock(hdf5_mutex());
+    for (int i = 0; i < dataset_ids_.size(); ++i) {
+      H5Dclose(dataset_ids_[i]);
+    }
     herr_t status = H5Fclose(file_id_);
     CHECK_GE(status, 0) << "Failed to close HDF5 file " << file_name_;
   }
 }
 
 template <typename Dtype>
-void HDF5OutputLayer<Dtype>::SaveBlobs() {
-  // TODO: no limit on the number of blobs
-  LOG(INFO) << "Saving HDF5 file " << file_name_;
-  CHECK_EQ(data_blob_.num(), label_blob_.num()) <<
+void HDF5OutputLayer<Dtype>::CreateDataset(const char* name,
+    const Blob<Dtype>& blob) {
+  const HDF5OutputParameter& param = this->layer_param_.hdf5_output_param();
+  vector<hsize_t> dims(blob.shape().begin(), blob.shape().end());
+  vector<hsize_t> max_dims(dims);
+  vector<hsize_t> chunk_dims(dims);
+  dims[0] = 0;
+  max_dims[0] = H5S_UNLIMITED;
+  chunk_dims[0] = param.chunk_rows() > 0 ? param.chunk_rows() : blob.shape(0);
+  hid_t space = H5Screate_simple(dims.size(), dims.data(), max_dims.data());
+  hid_t plist = H5Pcreate(H5P_DATASET_CREATE);
+  CHECK_GE(H5Pset_chunk(plist, chunk_dims.size(), chunk_dims.data()), 0);
+  if (param.compression() > 0) {
+    CHECK_GE(H5Pset_deflate(plist, param.compression()), 0);
+  }
+  hid_t type = param.float16() ? hdf5_float16_type() :
+      H5Tcopy(hdf5_native_type<Dtype>());
+  hid_t dataset = H5Dcreate2(file_id_, name, type, space, H5P_DEFAULT, plist,
+      H5P_DEFAULT);
+  CHECK_GE(dataset, 0) << "Failed to make dataset " << name;
+  H5Tclose(type);
+  H5Pclose(plist);
+  H5Sclose(space);
+  dataset_ids_.push_back(dataset);
+  dataset_rows_.push_back(0);
+  row_shapes_.push_back(blob.shape());
+  row_shapes_.back()[0] = 1;
+}
+
+template <typename Dtype>
+void HDF5OutputLayer<Dtype>::SaveBlobs(
+    const vector<shared_ptr<Blob<Dtype> > >& blobs) {
+  DLOG(INFO) << "Saving HDF5 file " << file_name_;
+  CHECK_EQ(blobs[0]->shape(0), blobs[1]->shape(0)) <<
       "data blob and label blob must have the same batch size";
-  hdf5_save_nd_dataset(file_id_, HDF5_DATA_DATASET_NAME, data_blob_);
-  hdf5_save_nd_dataset(file_id_, HDF5_DATA_LABEL_NAME, label_blob_);
-  LOG(INFO) << "Successfully saved " << data_blob_.num() << " rows";
+  boost::mutex::scoped_lock lock(hdf5_mutex());
+  if (dataset_ids_.empty()) {
+    CreateDataset(HDF5_DATA_DATASET_NAME, *blobs[0]);
+    CreateDataset(HDF5_DATA_LABEL_NAME, *blobs[1]);
+  }
+  for (int i = 0; i < blobs.size(); ++i) {
+    vector<int> row_shape = blobs[i]->shape();
+    row_shape[0] = 1;
+    CHECK(row_shape == row_shapes_[i])
+        << "Rows must keep their shape across batches";
+    vector<hsize_t> dims(row_shape.begin(), row_shape.end());
+    vector<hsize_t> offset(dims.size(), 0);
+    dims[0] = blobs[i]->shape(0);
+    offset[0] = dataset_rows_[i];
+    dataset_rows_[i] += dims[0];
+    vector<hsize_t> extent(dims);
+    extent[0] = dataset_rows_[i];
+    CHECK_GE(H5Dset_extent(dataset_ids_[i], extent.data()), 0);
+    hid_t file_space = H5Dget_space(dataset_ids_[i]);
+    CHECK_GE(H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset.data(),
+        NULL, dims.data(), NULL), 0);
+    hid_t mem_space = H5Screate_simple(dims.size(), dims.data(), NULL);
+    herr_t status = H5Dwrite(dataset_ids_[i], hdf5_native_type<Dtype>(),
+        mem_space, file_space, H5P_DEFAULT, blobs[i]->cpu_data());
+    CHECK_GE(status, 0) << "Failed to append to HDF5 file " << file_name_;
+    H5Sclose(mem_space);
+    H5Sclose(file_space);
+  }
+  DLOG(INFO) << "Successfully saved " << blobs[0]->shape(0) << " rows";
 }
 
 template <typename Dtype>
-void HDF5OutputLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top) {
+void HDF5OutputLayer<Dtype>::InternalThreadEntry() {
+  for (int i = full_.pop(); i >= 0; i = full_.pop()) {
+    SaveBlobs(buffers_[i]);
+    free_.push(i);
+  }
+}
+
+template <typename Dtype>
+void HDF5OutputLayer<Dtype>::QueueBlobs(const vector<Blob<Dtype>*>& bottom,
+    bool from_gpu) {
   CHECK_GE(bottom.size(), 2);
   CHECK_EQ(bottom[0]->num(), bottom[1]->num());
-  data_blob_.Reshape(bottom[0]->num(), bottom[0]->channels(),
-                     bottom[0]->height(), bottom[0]->width());
-  label_blob_.Reshape(bottom[1]->num(), bottom[1]->channels(),
-                     bottom[1]->height(), bottom[1]->width());
-  const int data_datum_dim = bottom[0]->count() / bottom[0]->num();
-  const int label_datum_dim = bottom[1]->count() / bottom[1]->num();
-
-  for (int i = 0; i < bottom[0]->num(); ++i) {
-    caffe_copy(data_datum_dim, &bottom[0]->cpu_data()[i * data_datum_dim],
-        &data_blob_.mutable_cpu_data()[i * data_datum_dim]);
-    caffe_copy(label_datum_dim, &bottom[1]->cpu_data()[i * label_datum_dim],
-        &label_blob_.mutable_cpu_data()[i * label_datum_dim]);
+  const int i = free_.pop();
+  for (int j = 0; j < bottom.size(); ++j) {
+    buffers_[i][j]->ReshapeLike(*bottom[j]);
+    caffe_copy(bottom[j]->count(),
+        from_gpu ? bottom[j]->gpu_data() : bottom[j]->cpu_data(),
+        buffers_[i][j]->mutable_cpu_data());
   }
-  SaveBlobs();
+  full_.push(i);
+}
+
+template <typename Dtype>
+void HDF5OutputLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  QueueBlobs(bottom, false);
 }
 
 template <typename Dtype>
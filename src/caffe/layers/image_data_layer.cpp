@@ -1,5 +1,9 @@
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 
+#include <algorithm>
 #include <fstream>  // NOLINT(readability/streams)
 #include <iostream>  // NOLINT(readability/streams)
 #include <string>
@@ -15,6 +19,22 @@
 
 namespace caffe {
 
+namespace {
+
+// Largest decoder downscaling factor that keeps a height x width image at
+// least as large as new_height x new_width.
+int ReduceFactor(const int height, const int width, const int new_height,
+    const int new_width) {
+  for (int factor = 8; factor > 1; factor /= 2) {
+    if (height >= factor * new_height && width >= factor * new_width) {
+      return factor;
+    }
+  }
+  return 1;
+}
+
+}  // namespace
+
 template <typename Dtype>
 ImageDataLayer<Dtype>::~ImageDataLayer<Dtype>() {
   this->JoinPrefetchThread();
@@ -124,24 +144,16 @@ void ImageDataLayer<Dtype>::InternalThreadEntry() {
   Dtype* prefetch_data = this->prefetch_data_.mutable_cpu_data();
   Dtype* prefetch_label = this->prefetch_label_.mutable_cpu_data();
 
-  // datum scales
+  // Pick the lines of the batch first, so their images can be decoded in
+  // parallel.
   const int lines_size = lines_.size();
+  batch_lines_.resize(batch_size);
+  batch_images_.resize(batch_size);
+  batch_reduce_.assign(batch_size, 0);
   for (int item_id = 0; item_id < batch_size; ++item_id) {
-    // get a blob
-    timer.Start();
     CHECK_GT(lines_size, lines_id_);
-    cv::Mat cv_img = ReadImageToCVMat(root_folder + lines_[lines_id_].first,
-        new_height, new_width, is_color);
-    CHECK(cv_img.data) << "Could not load " << lines_[lines_id_].first;
-    read_time += timer.MicroSeconds();
-    timer.Start();
-    // Apply transformations (mirror, crop...) to the image
-    int offset = this->prefetch_data_.offset(item_id);
-    this->transformed_data_.set_cpu_data(prefetch_data + offset);
-    this->data_transformer_->Transform(cv_img, &(this->transformed_data_));
-    trans_time += timer.MicroSeconds();
-
-    prefetch_label[item_id] = lines_[lines_id_].second;
+    batch_lines_[item_id] = lines_[lines_id_];
+    batch_images_[item_id].reset(new cv::Mat());
     // go to the next iter
     lines_id_++;
     if (lines_id_ >= lines_size) {
@@ -153,10 +165,97 @@ void ImageDataLayer<Dtype>::InternalThreadEntry() {
       }
     }
   }
+
+  // Decode the batch. The workers only read reduce_factor_ and image_cache_,
+  // which are updated below once they are done.
+  timer.Start();
+  const int num_threads = std::max(1, std::min(batch_size,
+      static_cast<int>(image_data_param.decode_threads())));
+  if (num_threads == 1) {
+    DecodeImages(0, 1);
+  } else {
+    boost::thread_group workers;
+    for (int i = 0; i < num_threads; ++i) {
+      workers.create_thread(boost::bind(&ImageDataLayer<Dtype>::DecodeImages,
+          this, i, num_threads));
+    }
+    workers.join_all();
+  }
+  read_time += timer.MicroSeconds();
+
+  const size_t cache_bytes = image_data_param.cache_bytes();
+  for (int item_id = 0; item_id < batch_size; ++item_id) {
+    const string& filename = batch_lines_[item_id].first;
+    const cv::Mat& cv_img = *batch_images_[item_id];
+    CHECK(cv_img.data) << "Could not load " << filename;
+    if (batch_reduce_[item_id] > 0) {
+      reduce_factor_[filename] = batch_reduce_[item_id];
+    }
+    if (cache_bytes > 0 && !image_cache_.count(filename)) {
+      const size_t bytes = cv_img.total() * cv_img.elemSize();
+      if (image_cache_bytes_ + bytes <= cache_bytes) {
+        image_cache_[filename] = batch_images_[item_id];
+        image_cache_bytes_ += bytes;
+      }
+    }
+    timer.Start();
+    // Apply transformations (mirror, crop...) to the image
+    int offset = this->prefetch_data_.offset(item_id);
+    this->transformed_data_.set_cpu_data(prefetch_data + offset);
+    this->data_transformer_->Transform(cv_img, &(this->transformed_data_));
+    trans_time += timer.MicroSeconds();
+
+    prefetch_label[item_id] = batch_lines_[item_id].second;
+  }
   batch_timer.Stop();
   DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
   DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
   DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+  if (image_cache_bytes_ > 0) {
+    DLOG(INFO) << "    Image cache: " << image_cache_.size() << " images, "
+        << image_cache_bytes_ / 1048576.0 << " MB.";
+  }
+}
+
+template <typename Dtype>
+void ImageDataLayer<Dtype>::DecodeImages(const int thread_id,
+    const int num_threads) {
+  const ImageDataParameter& image_data_param =
+      this->layer_param_.image_data_param();
+  const int new_height = image_data_param.new_height();
+  const int new_width = image_data_param.new_width();
+  const bool is_color = image_data_param.is_color();
+  const bool reduced_decode = image_data_param.reduced_decode() &&
+      new_height > 0 && new_width > 0;
+  const string& root_folder = image_data_param.root_folder();
+  for (int i = thread_id; i < batch_lines_.size(); i += num_threads) {
+    const string& filename = batch_lines_[i].first;
+    map<string, shared_ptr<cv::Mat> >::const_iterator cached =
+        image_cache_.find(filename);
+    if (cached != image_cache_.end()) {
+      batch_images_[i] = cached->second;
+      continue;
+    }
+    cv::Mat& image = *batch_images_[i];
+    if (!reduced_decode) {
+      image = ReadImageToCVMat(root_folder + filename, new_height, new_width,
+          is_color);
+      continue;
+    }
+    map<string, int>::const_iterator reduce = reduce_factor_.find(filename);
+    if (reduce != reduce_factor_.end()) {
+      image = ReadImageToCVMatReduced(root_folder + filename, new_height,
+          new_width, is_color, reduce->second);
+      continue;
+    }
+    // First time we see this image: decode it fully to learn its size.
+    cv::Mat cv_img = ReadImageToCVMat(root_folder + filename, is_color);
+    if (cv_img.data) {
+      batch_reduce_[i] =
+          ReduceFactor(cv_img.rows, cv_img.cols, new_height, new_width);
+      cv::resize(cv_img, image, cv::Size(new_width, new_height));
+    }
+  }
 }
 
 INSTANTIATE_CLASS(ImageDataLayer);
@@ -1,6 +1,7 @@
 #include <leveldb/db.h>
 #include <stdint.h>
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -44,14 +45,24 @@ void MapDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   iter_.reset(db_->NewCursor());
 
   // Check if we would need to randomly skip a few data points
+  pass_from_start_ = true;
   if (this->layer_param_.data_param().rand_skip()) {
     unsigned int skip = caffe_rng_rand() %
                         this->layer_param_.data_param().rand_skip();
     LOG(INFO) << "Skipping first" << skip << " data points.";
+    pass_from_start_ = (skip == 0);
     while (skip-- > 0) {
       iter_->Next();
     }
   }
+  if (this->layer_param_.data_param().cache_bytes() > 0) {
+    sample_cache_.reset(new SampleCache(
+        this->layer_param_.data_param().cache_bytes(),
+        this->layer_param_.data_param().cache_shuffle()));
+  }
+  if (this->layer_param_.data_param().bucket_by_shape()) {
+    IndexShapes();
+  }
 
   // Read a data point and use it to initialize the top blob.
   BlobProtoVector maps;
@@ -61,11 +72,10 @@ void MapDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   BlobProto dataMap = maps.blobs(0);
   BlobProto labelMap = maps.blobs(1);
 
-  // do not support mirror and crop for the moment
+  // do not support crop for the moment; mirror and augmentation are drawn
+  // once per sample and shared between data and label maps
   int crop_size = this->layer_param_.transform_param().crop_size();
-  bool mirror = this->layer_param_.transform_param().mirror();
   CHECK(crop_size == 0) << "MapDataLayer does not support cropping.";
-  CHECK(!mirror) << "MapDataLayer does not support mirroring";
 
   // reshape data map
   top[0]->Reshape(
@@ -97,36 +107,166 @@ Datum BlobProto2Datum(const BlobProto& blob){
   return datum;
 }
 
+// Appends the channels, height and width of a Datum or BlobProto to shape.
+template <typename Proto>
+static void AppendShape(const Proto& proto, vector<int>* shape) {
+  shape->push_back(proto.channels());
+  shape->push_back(proto.height());
+  shape->push_back(proto.width());
+}
+
 template<typename Dtype>
-void MapDataLayer<Dtype>::InternalThreadEntry() {
+void MapDataLayer<Dtype>::IndexShapes() {
+  shared_ptr<db::Cursor> cursor(db_->NewCursor());
+  std::map<vector<int>, int> counts;
   BlobProtoVector maps;
+  for (; cursor->valid(); cursor->Next()) {
+    maps.ParseFromString(cursor->value());
+    vector<int> shape;
+    AppendShape(maps.blobs(0), &shape);
+    AppendShape(maps.blobs(1), &shape);
+    ++counts[shape];
+  }
+  const int batch_size = this->layer_param_.data_param().batch_size();
+  for (std::map<vector<int>, int>::const_iterator it = counts.begin();
+      it != counts.end(); ++it) {
+    const int bucket = bucket_ids_.size();
+    bucket_ids_[it->first] = bucket;
+    const vector<int>& shape = it->first;
+    LOG(INFO) << "Bucket " << bucket << ": data " << shape[0] << "x"
+        << shape[1] << "x" << shape[2] << ", label " << shape[3] << "x"
+        << shape[4] << "x" << shape[5] << ", " << it->second << " records";
+    if (it->second < batch_size) {
+      LOG(WARNING) << "Bucket " << bucket << " has fewer records than"
+          << " batch_size; its batches repeat records";
+    }
+  }
+  bucket_data_.resize(bucket_ids_.size());
+  bucket_labels_.resize(bucket_ids_.size());
+}
+
+template<typename Dtype>
+int MapDataLayer<Dtype>::FillBucket() {
+  const int batch_size = this->layer_param_.data_param().batch_size();
   Datum dataMap, labelMap;
+  while (true) {
+    ReadMaps(&dataMap, &labelMap);
+    vector<int> shape;
+    AppendShape(dataMap, &shape);
+    AppendShape(labelMap, &shape);
+    std::map<vector<int>, int>::const_iterator it = bucket_ids_.find(shape);
+    CHECK(it != bucket_ids_.end()) << "Record shape missing from the index";
+    const int bucket = it->second;
+    bucket_data_[bucket].push_back(Datum());
+    bucket_data_[bucket].back().Swap(&dataMap);
+    bucket_labels_[bucket].push_back(Datum());
+    bucket_labels_[bucket].back().Swap(&labelMap);
+    if (static_cast<int>(bucket_data_[bucket].size()) == batch_size) {
+      return bucket;
+    }
+  }
+}
+
+template<typename Dtype>
+void MapDataLayer<Dtype>::InternalThreadEntry() {
   CHECK(this->prefetch_data_.count());
-  Dtype* top_data = this->prefetch_data_.mutable_cpu_data();
-  Dtype* top_label = this->prefetch_label_.mutable_cpu_data();
   const int batch_size = this->layer_param_.data_param().batch_size();
 
+  if (bucket_ids_.empty()) {
+    Datum dataMap, labelMap;
+    for (int item_id = 0; item_id < batch_size; ++item_id) {
+      ReadMaps(&dataMap, &labelMap);
+      TransformMaps(item_id, dataMap, labelMap);
+    }
+    return;
+  }
+  // Emit the first bucket to fill up, in the shape of its maps.
+  const int bucket = FillBucket();
+  const Datum& dataMap = bucket_data_[bucket][0];
+  const Datum& labelMap = bucket_labels_[bucket][0];
+  this->prefetch_data_.Reshape(batch_size, dataMap.channels(),
+      dataMap.height(), dataMap.width());
+  this->transformed_data_.Reshape(1, dataMap.channels(),
+      dataMap.height(), dataMap.width());
+  this->prefetch_label_.Reshape(batch_size, labelMap.channels(),
+      labelMap.height(), labelMap.width());
+  this->transformed_label_.Reshape(1, labelMap.channels(),
+      labelMap.height(), labelMap.width());
   for (int item_id = 0; item_id < batch_size; ++item_id) {
-    maps.ParseFromString(iter_->value());
-    // Data transformer only accepts Datum
-    dataMap = BlobProto2Datum(maps.blobs(0));
-    labelMap = BlobProto2Datum(maps.blobs(1));
-
-    // Apply data and label transformations (mirror, scale, crop...)
-    int offset = this->prefetch_data_.offset(item_id);
-    this->transformed_data_.set_cpu_data(top_data + offset);
-    this->data_transformer_->Transform(dataMap, &(this->transformed_data_));
-    
-    int label_offset = this->prefetch_label_.offset(item_id);
-    this->transformed_label_.set_cpu_data(top_label + label_offset);
-    this->label_transformer_.Transform(labelMap, &(this->transformed_label_));
-
-    // go to the next iter
+    TransformMaps(item_id, bucket_data_[bucket][item_id],
+        bucket_labels_[bucket][item_id]);
+  }
+  bucket_data_[bucket].clear();
+  bucket_labels_[bucket].clear();
+}
+
+template<typename Dtype>
+void MapDataLayer<Dtype>::ReadMaps(Datum* data_map, Datum* label_map) {
+  if (sample_cache_) {
+    ReadCachedMaps(data_map, label_map);
+    return;
+  }
+  BlobProtoVector maps;
+  maps.ParseFromString(iter_->value());
+  // Data transformer only accepts Datum
+  *data_map = BlobProto2Datum(maps.blobs(0));
+  *label_map = BlobProto2Datum(maps.blobs(1));
+  // go to the next iter
+  iter_->Next();
+  if (!iter_->valid()) {
+    iter_->SeekToFirst();
+  }
+}
+
+template<typename Dtype>
+void MapDataLayer<Dtype>::TransformMaps(const int item_id,
+    const Datum& data_map, const Datum& label_map) {
+  // Apply data and label transformations (mirror, scale, crop...)
+  // The label map follows the geometric part of the data's draw.
+  Augmentation aug = this->data_transformer_->SampleAugmentation();
+  int offset = this->prefetch_data_.offset(item_id);
+  this->transformed_data_.set_cpu_data(
+      this->prefetch_data_.mutable_cpu_data() + offset);
+  this->data_transformer_->Transform(data_map, aug,
+      &(this->transformed_data_));
+
+  aug.ClearPhotometric();
+  int label_offset = this->prefetch_label_.offset(item_id);
+  Dtype* top_label = this->prefetch_label_.mutable_cpu_data() + label_offset;
+  this->transformed_label_.set_cpu_data(top_label);
+  this->label_transformer_.Transform(label_map, aug,
+      &(this->transformed_label_));
+  // Zooming spreads each person over scale^2 as many pixels; keep the
+  // density map integrating to the same count.
+  if (aug.scale != 1) {
+    caffe_scal(this->transformed_label_.count(),
+        Dtype(1. / (aug.scale * aug.scale)), top_label);
+  }
+}
+
+template<typename Dtype>
+void MapDataLayer<Dtype>::ReadCachedMaps(Datum* data_map, Datum* label_map) {
+  vector<Datum> sample;
+  if (sample_cache_->in_memory()) {
+    sample_cache_->Next(&sample);
+  } else {
+    const string key = iter_->key();
+    if (!sample_cache_->Get(key, &sample)) {
+      BlobProtoVector maps;
+      maps.ParseFromString(iter_->value());
+      sample.push_back(BlobProto2Datum(maps.blobs(0)));
+      sample.push_back(BlobProto2Datum(maps.blobs(1)));
+      sample_cache_->Put(key, sample);
+    }
     iter_->Next();
     if (!iter_->valid()) {
       iter_->SeekToFirst();
+      sample_cache_->EndEpoch(pass_from_start_);
+      pass_from_start_ = true;
     }
   }
+  data_map->Swap(&sample[0]);
+  label_map->Swap(&sample[1]);
 }
 
 INSTANTIATE_CLASS(MapDataLayer);
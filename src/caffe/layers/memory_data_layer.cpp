@@ -1,3 +1,5 @@
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <opencv2/core/core.hpp>
 
 #include <vector>
@@ -8,18 +10,65 @@
 
 namespace caffe {
 
+template <typename Dtype>
+class MemoryDataLayer<Dtype>::ProducerSync {
+ public:
+  ProducerSync() : producers_(0), closing_(false), next_sample_(0) {}
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  int producers_;
+  bool closing_;
+  unsigned int next_sample_;
+};
+
+template <typename Dtype>
+MemoryDataLayer<Dtype>::~MemoryDataLayer() {
+  if (!producer_sync_) {
+    return;
+  }
+  // Producers waiting for a free slot would never get one: wake them with
+  // -1, which each passes on, and wait until all have left Push.
+  {
+    boost::mutex::scoped_lock lock(producer_sync_->mutex_);
+    producer_sync_->closing_ = true;
+  }
+  free_slots_.push(-1);
+  {
+    boost::mutex::scoped_lock lock(producer_sync_->mutex_);
+    while (producer_sync_->producers_ > 0) {
+      producer_sync_->condition_.wait(lock);
+    }
+  }
+  for (int i = 0; i < workers_.size(); ++i) {
+    pending_slots_.push(-1);
+  }
+  for (int i = 0; i < workers_.size(); ++i) {
+    workers_[i]->join();
+  }
+}
+
 template <typename Dtype>
 void MemoryDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
      const vector<Blob<Dtype>*>& top) {
-  batch_size_ = this->layer_param_.memory_data_param().batch_size();
-  channels_ = this->layer_param_.memory_data_param().channels();
-  height_ = this->layer_param_.memory_data_param().height();
-  width_ = this->layer_param_.memory_data_param().width();
+  const MemoryDataParameter& param = this->layer_param_.memory_data_param();
+  batch_size_ = param.batch_size();
+  channels_ = param.channels();
+  height_ = param.height();
+  width_ = param.width();
   size_ = channels_ * height_ * width_;
   CHECK_GT(batch_size_ * size_, 0) <<
       "batch_size, channels, height, and width must be specified and"
       " positive in memory_data_param";
+  label_shape_.clear();
+  label_size_ = 1;
+  for (int i = 0; i < param.label_shape().dim_size(); ++i) {
+    label_shape_.push_back(param.label_shape().dim(i));
+    label_size_ *= label_shape_.back();
+  }
+  CHECK_GT(label_size_, 0) << "label_shape must be positive";
   vector<int> label_shape(1, batch_size_);
+  label_shape.insert(label_shape.end(), label_shape_.begin(),
+      label_shape_.end());
   top[0]->Reshape(batch_size_, channels_, height_, width_);
   top[1]->Reshape(label_shape);
   added_data_.Reshape(batch_size_, channels_, height_, width_);
@@ -28,12 +77,51 @@ void MemoryDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   labels_ = NULL;
   added_data_.cpu_data();
   added_label_.cpu_data();
+
+  ring_size_ = param.ring_size();
+  batch_start_ = -1;
+  if (ring_size_ == 0) {
+    return;
+  }
+  CHECK_EQ(ring_size_ % batch_size_, 0) <<
+      "ring_size must be a multiple of the batch size.";
+  ring_data_.Reshape(ring_size_, channels_, height_, width_);
+  label_shape[0] = ring_size_;
+  ring_labels_.Reshape(label_shape);
+  data_ = ring_data_.mutable_cpu_data();
+  labels_ = ring_labels_.mutable_cpu_data();
+  n_ = ring_size_;
+  slot_images_.resize(ring_size_);
+  slot_datums_.resize(ring_size_);
+  slot_ready_.assign(ring_size_, false);
+  slot_samples_.resize(ring_size_);
+  for (int i = 0; i < ring_size_; ++i) {
+    free_slots_.push(i);
+  }
+  const AugmentationParameter& aug_param =
+      this->transform_param_.augmentation();
+  sample_seed_ = aug_param.has_seed() ? aug_param.seed() : caffe_rng_rand();
+  producer_sync_.reset(new ProducerSync());
+  const int num_workers = param.transform_threads();
+  CHECK_GT(num_workers, 0);
+  for (int i = 0; i < num_workers; ++i) {
+    worker_transformers_.push_back(shared_ptr<DataTransformer<Dtype> >(
+        new DataTransformer<Dtype>(this->transform_param_, this->phase_)));
+    worker_transformers_.back()->InitRand();
+    worker_blobs_.push_back(shared_ptr<Blob<Dtype> >(
+        new Blob<Dtype>(1, channels_, height_, width_)));
+  }
+  for (int i = 0; i < num_workers; ++i) {
+    workers_.push_back(shared_ptr<boost::thread>(new boost::thread(
+        boost::bind(&MemoryDataLayer<Dtype>::TransformSlots, this, i))));
+  }
 }
 
 template <typename Dtype>
 void MemoryDataLayer<Dtype>::AddDatumVector(const vector<Datum>& datum_vector) {
   CHECK(!has_new_data_) <<
       "Can't add data until current data has been consumed.";
+  CHECK_EQ(label_size_, 1) << "Datum labels are single values.";
   size_t num = datum_vector.size();
   CHECK_GT(num, 0) << "There is no datum to add.";
   CHECK_EQ(num % batch_size_, 0) <<
@@ -59,6 +147,7 @@ void MemoryDataLayer<Dtype>::AddMatVector(const vector<cv::Mat>& mat_vector,
   size_t num = mat_vector.size();
   CHECK(!has_new_data_) <<
       "Can't add mat until current data has been consumed.";
+  CHECK_EQ(label_size_, 1) << "Mat labels are single values.";
   CHECK_GT(num, 0) << "There is no mat to add";
   CHECK_EQ(num % batch_size_, 0) <<
       "The added data must be a multiple of the batch size.";
@@ -81,6 +170,7 @@ template <typename Dtype>
 void MemoryDataLayer<Dtype>::Reset(Dtype* data, Dtype* labels, int n) {
   CHECK(data);
   CHECK(labels);
+  CHECK_EQ(ring_size_, 0) << "Push samples into a ring instead.";
   CHECK_EQ(n % batch_size_, 0) << "n must be a multiple of batch size";
   // Warn with transformation parameters since a memory array is meant to
   // be generic and no transformations are done with Reset().
@@ -97,19 +187,125 @@ template <typename Dtype>
 void MemoryDataLayer<Dtype>::set_batch_size(int new_size) {
   CHECK(!has_new_data_) <<
       "Can't change batch_size until current data has been consumed.";
+  CHECK_EQ(ring_size_, 0) << "Can't change the batch size of a ring.";
   batch_size_ = new_size;
   added_data_.Reshape(batch_size_, channels_, height_, width_);
   added_label_.Reshape(batch_size_, 1, 1, 1);
 }
 
+template <typename Dtype>
+int MemoryDataLayer<Dtype>::AcquireSlot(const Dtype* label) {
+  CHECK_GT(ring_size_, 0) << "Push needs memory_data_param.ring_size";
+  {
+    boost::mutex::scoped_lock lock(producer_sync_->mutex_);
+    if (producer_sync_->closing_) {
+      return -1;
+    }
+    ++producer_sync_->producers_;
+  }
+  const int slot = free_slots_.pop();
+  if (slot < 0) {
+    free_slots_.push(-1);
+    ReleaseProducer();
+    return -1;
+  }
+  {
+    boost::mutex::scoped_lock lock(producer_sync_->mutex_);
+    slot_samples_[slot] = producer_sync_->next_sample_++;
+  }
+  caffe_copy(label_size_, label, labels_ + slot * label_size_);
+  return slot;
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::ReleaseProducer() {
+  boost::mutex::scoped_lock lock(producer_sync_->mutex_);
+  if (--producer_sync_->producers_ == 0) {
+    producer_sync_->condition_.notify_all();
+  }
+}
+
+template <typename Dtype>
+bool MemoryDataLayer<Dtype>::Push(const cv::Mat& image, const Dtype* label) {
+  const int slot = AcquireSlot(label);
+  if (slot < 0) {
+    return false;
+  }
+  slot_images_[slot].reset(new cv::Mat(image));
+  pending_slots_.push(slot);
+  ReleaseProducer();
+  return true;
+}
+
+template <typename Dtype>
+bool MemoryDataLayer<Dtype>::Push(const Datum& datum, const Dtype* label) {
+  const int slot = AcquireSlot(label);
+  if (slot < 0) {
+    return false;
+  }
+  slot_datums_[slot] = datum;
+  pending_slots_.push(slot);
+  ReleaseProducer();
+  return true;
+}
+
+template <typename Dtype>
+void MemoryDataLayer<Dtype>::TransformSlots(const int worker) {
+  DataTransformer<Dtype>* transformer = worker_transformers_[worker].get();
+  Blob<Dtype>* blob = worker_blobs_[worker].get();
+  for (int slot = pending_slots_.pop(); slot >= 0;
+       slot = pending_slots_.pop()) {
+    blob->set_cpu_data(data_ + slot * size_);
+    transformer->SeedSample(sample_seed_ + 2654435761u * slot_samples_[slot]);
+    if (slot_images_[slot]) {
+      transformer->Transform(*slot_images_[slot], blob);
+      slot_images_[slot].reset();
+    } else {
+      transformer->Transform(slot_datums_[slot], blob);
+    }
+    done_slots_.push(slot);
+  }
+}
+
 template <typename Dtype>
 void MemoryDataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   CHECK(data_) << "MemoryDataLayer needs to be initalized by calling Reset";
+  vector<int> label_shape(1, batch_size_);
+  label_shape.insert(label_shape.end(), label_shape_.begin(),
+      label_shape_.end());
+  if (label_shape_.empty()) {
+    label_shape.resize(4, 1);
+  }
   top[0]->Reshape(batch_size_, channels_, height_, width_);
-  top[1]->Reshape(batch_size_, 1, 1, 1);
+  top[1]->Reshape(label_shape);
+  if (ring_size_ > 0) {
+    // The Net is done with the previous batch, so its slots are free again.
+    if (batch_start_ >= 0) {
+      for (int i = 0; i < batch_size_; ++i) {
+        free_slots_.push(batch_start_ + i);
+      }
+      pos_ = (batch_start_ + batch_size_) % ring_size_;
+    } else {
+      pos_ = 0;
+    }
+    for (int i = 0; i < batch_size_; ) {
+      if (slot_ready_[pos_ + i]) {
+        ++i;
+      } else {
+        slot_ready_[done_slots_.pop()] = true;
+      }
+    }
+    for (int i = 0; i < batch_size_; ++i) {
+      slot_ready_[pos_ + i] = false;
+    }
+    batch_start_ = pos_;
+    top[0]->set_cpu_data(data_ + pos_ * size_);
+    top[1]->set_cpu_data(labels_ + pos_ * label_size_);
+    return;
+  }
   top[0]->set_cpu_data(data_ + pos_ * size_);
-  top[1]->set_cpu_data(labels_ + pos_);
+  top[1]->set_cpu_data(labels_ + pos_ * label_size_);
   pos_ = (pos_ + batch_size_) % n_;
   if (pos_ == 0)
     has_new_data_ = false;
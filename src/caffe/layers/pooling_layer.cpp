@@ -2,6 +2,10 @@
 #include <cfloat>
 #include <vector>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "caffe/common.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/syncedmem.hpp"
@@ -13,6 +17,137 @@ namespace caffe {
 using std::min;
 using std::max;
 
+// Outputs smaller than this many elements are pooled on one thread.
+static const int kParallelPoolSize = 32768;
+
+namespace {
+
+// Max over the rows x cols window at window, in a plane of the given width,
+// and the offset from window of its first maximum; -FLT_MAX and -1 if the
+// window is empty.
+template <typename Dtype>
+inline void max_window(const Dtype* window, const int width, const int rows,
+    const int cols, Dtype* value, int* offset) {
+  Dtype m = -FLT_MAX;
+  int m_offset = -1;
+  for (int h = 0; h < rows; ++h) {
+    for (int w = 0; w < cols; ++w) {
+      const int i = h * width + w;
+      // Selects rather than branches, which compile to conditional moves.
+      const bool greater = window[i] > m;
+      m = greater ? window[i] : m;
+      m_offset = greater ? i : m_offset;
+    }
+  }
+  *value = m;
+  *offset = m_offset;
+}
+
+template <typename Dtype>
+inline Dtype sum_window(const Dtype* window, const int width, const int rows,
+    const int cols) {
+  Dtype sum = 0;
+  for (int h = 0; h < rows; ++h) {
+    for (int w = 0; w < cols; ++w) {
+      sum += window[h * width + w];
+    }
+  }
+  return sum;
+}
+
+// Max or average pools one height x width plane into pooled_height x
+// pooled_width. Windows inside the plane, all but those on the border, have
+// the kernel and stride as the compile-time K and S when these are nonzero,
+// so that the window loops unroll; border windows are clipped as before.
+// The index of each maximum goes to mask or top_mask if either is given.
+template <typename Dtype, int K, int S>
+void pool_plane_cpu(const Dtype* bottom, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int pooled_height,
+    const int pooled_width, const bool is_max, Dtype* top, int* mask,
+    Dtype* top_mask) {
+  const int kh = K ? K : kernel_h;
+  const int kw = K ? K : kernel_w;
+  const int sh = S ? S : stride_h;
+  const int sw = S ? S : stride_w;
+  // The windows inside the plane are in columns [pw_begin, pw_end).
+  int pw_begin = 0;
+  while (pw_begin < pooled_width && pw_begin * sw < pad_w) {
+    ++pw_begin;
+  }
+  int pw_end = pw_begin;
+  while (pw_end < pooled_width && pw_end * sw - pad_w + kw <= width) {
+    ++pw_end;
+  }
+  for (int ph = 0; ph < pooled_height; ++ph) {
+    const int hstart = ph * sh - pad_h;
+    const bool row_inside = hstart >= 0 && hstart + kh <= height;
+    for (int pw = 0; pw < pooled_width; ++pw) {
+      const int wstart = pw * sw - pad_w;
+      const int pool_index = ph * pooled_width + pw;
+      int window_index, offset;
+      if (row_inside && pw >= pw_begin && pw < pw_end) {
+        // kh and kw are constants here when K is given.
+        window_index = hstart * width + wstart;
+        if (is_max) {
+          max_window(bottom + window_index, width, kh, kw, &top[pool_index],
+              &offset);
+        } else {
+          top[pool_index] =
+              sum_window(bottom + window_index, width, kh, kw) / (kh * kw);
+        }
+      } else {
+        const int hend = min(hstart + kh, height + pad_h);
+        const int wend = min(wstart + kw, width + pad_w);
+        const int pool_size = (hend - hstart) * (wend - wstart);
+        const int rows = min(hend, height) - max(hstart, 0);
+        const int cols = min(wend, width) - max(wstart, 0);
+        window_index = max(hstart, 0) * width + max(wstart, 0);
+        if (is_max) {
+          max_window(bottom + window_index, width, rows, cols,
+              &top[pool_index], &offset);
+        } else {
+          top[pool_index] = sum_window(bottom + window_index, width, rows,
+              cols) / pool_size;
+        }
+      }
+      if (!is_max) {
+        continue;
+      }
+      const int index = offset < 0 ? -1 : window_index + offset;
+      if (mask) {
+        mask[pool_index] = index;
+      } else if (top_mask) {
+        top_mask[pool_index] = index;
+      }
+    }
+  }
+}
+
+// Pools each of the planes planes of bottom into top with pool_plane_cpu,
+// the planes split among OpenMP threads.
+template <typename Dtype, int K, int S>
+void pool_planes_cpu(const Dtype* bottom, const int planes, const int height,
+    const int width, const int kernel_h, const int kernel_w, const int pad_h,
+    const int pad_w, const int stride_h, const int stride_w,
+    const int pooled_height, const int pooled_width, const bool is_max,
+    Dtype* top, int* mask, Dtype* top_mask) {
+  const int bottom_dim = height * width;
+  const int top_dim = pooled_height * pooled_width;
+#ifdef _OPENMP
+#pragma omp parallel for if (planes * top_dim >= kParallelPoolSize)
+#endif
+  for (int p = 0; p < planes; ++p) {
+    pool_plane_cpu<Dtype, K, S>(bottom + p * bottom_dim, height, width,
+        kernel_h, kernel_w, pad_h, pad_w, stride_h, stride_w, pooled_height,
+        pooled_width, is_max, top + p * top_dim,
+        mask ? mask + p * top_dim : NULL,
+        top_mask ? top_mask + p * top_dim : NULL);
+  }
+}
+
+}  // namespace
+
 template <typename Dtype>
 void PoolingLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
@@ -39,8 +174,8 @@ void PoolingLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       << "Stride is stride OR stride_h and stride_w are required.";
   global_pooling_ = pool_param.global_pooling();
   if (global_pooling_) {
-    kernel_h_ = bottom[0]->height();
-    kernel_w_ = bottom[0]->width();
+    kernel_h_ = bottom[0]->shape(2);
+    kernel_w_ = bottom[0]->shape(3);
   } else {
     if (pool_param.has_kernel_size()) {
       kernel_h_ = kernel_w_ = pool_param.kernel_size();
@@ -81,14 +216,23 @@ void PoolingLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
 template <typename Dtype>
 void PoolingLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
-  CHECK_EQ(4, bottom[0]->num_axes()) << "Input must have 4 axes, "
-      << "corresponding to (num, channels, height, width)";
-  channels_ = bottom[0]->channels();
-  height_ = bottom[0]->height();
-  width_ = bottom[0]->width();
+  // Five axes are the channel-blocked layout, pooled block by block.
+  blocked_ = bottom[0]->num_axes() == 5;
+  CHECK(bottom[0]->num_axes() == 4 || blocked_) << "Input must have 4 axes, "
+      << "corresponding to (num, channels, height, width), or 5 axes, "
+      << "corresponding to (num, channel blocks, height, width, block)";
+  if (blocked_) {
+    CHECK(this->layer_param_.pooling_param().pool() !=
+        PoolingParameter_PoolMethod_STOCHASTIC && top.size() == 1)
+        << "Blocked inputs support max and average pooling to one top.";
+  }
+  block_ = blocked_ ? bottom[0]->shape(4) : 1;
+  channels_ = bottom[0]->shape(1);
+  height_ = bottom[0]->shape(2);
+  width_ = bottom[0]->shape(3);
   if (global_pooling_) {
-    kernel_h_ = bottom[0]->height();
-    kernel_w_ = bottom[0]->width();
+    kernel_h_ = height_;
+    kernel_w_ = width_;
   }
   pooled_height_ = static_cast<int>(ceil(static_cast<float>(
       height_ + 2 * pad_h_ - kernel_h_) / stride_h_)) + 1;
@@ -106,6 +250,13 @@ void PoolingLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
     CHECK_LT((pooled_height_ - 1) * stride_h_, height_ + pad_h_);
     CHECK_LT((pooled_width_ - 1) * stride_w_, width_ + pad_w_);
   }
+  if (blocked_) {
+    vector<int> top_shape = bottom[0]->shape();
+    top_shape[2] = pooled_height_;
+    top_shape[3] = pooled_width_;
+    top[0]->Reshape(top_shape);
+    return;
+  }
   top[0]->Reshape(bottom[0]->num(), channels_, pooled_height_,
       pooled_width_);
   if (top.size() > 1) {
@@ -113,7 +264,8 @@ void PoolingLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
   }
   // If max pooling, we will initialize the vector index part.
   if (this->layer_param_.pooling_param().pool() ==
-      PoolingParameter_PoolMethod_MAX && top.size() == 1) {
+      PoolingParameter_PoolMethod_MAX && top.size() == 1 &&
+      !this->layer_param_.pooling_param().forward_only()) {
     max_idx_.Reshape(bottom[0]->num(), channels_, pooled_height_,
         pooled_width_);
   }
@@ -125,101 +277,90 @@ void PoolingLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
   }
 }
 
-// TODO(Yangqing): Is there a faster way to do pooling in the channel-first
-// case?
+template <typename Dtype>
+void PoolingLayer<Dtype>::ForwardBlocked_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  const Dtype* bottom_data = bottom[0]->cpu_data();
+  Dtype* top_data = top[0]->mutable_cpu_data();
+  const bool is_max = this->layer_param_.pooling_param().pool() ==
+      PoolingParameter_PoolMethod_MAX;
+  const int planes = bottom[0]->shape(0) * channels_;
+#ifdef _OPENMP
+#pragma omp parallel for if (top[0]->count() >= kParallelPoolSize)
+#endif
+  for (int p = 0; p < planes; ++p) {
+    const Dtype* bottom_plane = bottom_data + p * height_ * width_ * block_;
+    Dtype* top_plane =
+        top_data + p * pooled_height_ * pooled_width_ * block_;
+    for (int ph = 0; ph < pooled_height_; ++ph) {
+      for (int pw = 0; pw < pooled_width_; ++pw) {
+        int hstart = ph * stride_h_ - pad_h_;
+        int wstart = pw * stride_w_ - pad_w_;
+        int hend = min(hstart + kernel_h_, height_ + pad_h_);
+        int wend = min(wstart + kernel_w_, width_ + pad_w_);
+        const int pool_size = (hend - hstart) * (wend - wstart);
+        hstart = max(hstart, 0);
+        wstart = max(wstart, 0);
+        hend = min(hend, height_);
+        wend = min(wend, width_);
+        // All block_ channels of a pixel are pooled at once.
+        Dtype* out = top_plane + (ph * pooled_width_ + pw) * block_;
+        if (is_max) {
+          for (int k = 0; k < block_; ++k) {
+            out[k] = -FLT_MAX;
+          }
+          for (int h = hstart; h < hend; ++h) {
+            for (int w = wstart; w < wend; ++w) {
+              const Dtype* in = bottom_plane + (h * width_ + w) * block_;
+              for (int k = 0; k < block_; ++k) {
+                out[k] = max(out[k], in[k]);
+              }
+            }
+          }
+        } else {
+          for (int k = 0; k < block_; ++k) {
+            out[k] = 0;
+          }
+          for (int h = hstart; h < hend; ++h) {
+            for (int w = wstart; w < wend; ++w) {
+              const Dtype* in = bottom_plane + (h * width_ + w) * block_;
+              for (int k = 0; k < block_; ++k) {
+                out[k] += in[k];
+              }
+            }
+          }
+          for (int k = 0; k < block_; ++k) {
+            out[k] /= pool_size;
+          }
+        }
+      }
+    }
+  }
+}
+
 template <typename Dtype>
 void PoolingLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+  if (blocked_) {
+    ForwardBlocked_cpu(bottom, top);
+    return;
+  }
   const Dtype* bottom_data = bottom[0]->cpu_data();
   Dtype* top_data = top[0]->mutable_cpu_data();
-  const int top_count = top[0]->count();
   // We'll output the mask to top[1] if it's of size >1.
   const bool use_top_mask = top.size() > 1;
-  int* mask = NULL;  // suppress warnings about uninitalized variables
+  int* mask = NULL;
   Dtype* top_mask = NULL;
-  // Different pooling methods. We explicitly do the switch outside the for
-  // loop to save time, although this results in more code.
-  switch (this->layer_param_.pooling_param().pool()) {
+  const PoolingParameter& pool_param = this->layer_param_.pooling_param();
+  switch (pool_param.pool()) {
   case PoolingParameter_PoolMethod_MAX:
-    // Initialize
     if (use_top_mask) {
       top_mask = top[1]->mutable_cpu_data();
-      caffe_set(top_count, Dtype(-1), top_mask);
-    } else {
+    } else if (!pool_param.forward_only()) {
       mask = max_idx_.mutable_cpu_data();
-      caffe_set(top_count, -1, mask);
-    }
-    caffe_set(top_count, Dtype(-FLT_MAX), top_data);
-    // The main loop
-    for (int n = 0; n < bottom[0]->num(); ++n) {
-      for (int c = 0; c < channels_; ++c) {
-        for (int ph = 0; ph < pooled_height_; ++ph) {
-          for (int pw = 0; pw < pooled_width_; ++pw) {
-            int hstart = ph * stride_h_ - pad_h_;
-            int wstart = pw * stride_w_ - pad_w_;
-            int hend = min(hstart + kernel_h_, height_);
-            int wend = min(wstart + kernel_w_, width_);
-            hstart = max(hstart, 0);
-            wstart = max(wstart, 0);
-            const int pool_index = ph * pooled_width_ + pw;
-            for (int h = hstart; h < hend; ++h) {
-              for (int w = wstart; w < wend; ++w) {
-                const int index = h * width_ + w;
-                if (bottom_data[index] > top_data[pool_index]) {
-                  top_data[pool_index] = bottom_data[index];
-                  if (use_top_mask) {
-                    top_mask[pool_index] = static_cast<Dtype>(index);
-                  } else {
-                    mask[pool_index] = index;
-                  }
-                }
-              }
-            }
-          }
-        }
-        // compute offset
-        bottom_data += bottom[0]->offset(0, 1);
-        top_data += top[0]->offset(0, 1);
-        if (use_top_mask) {
-          top_mask += top[0]->offset(0, 1);
-        } else {
-          mask += top[0]->offset(0, 1);
-        }
-      }
     }
     break;
   case PoolingParameter_PoolMethod_AVE:
-    for (int i = 0; i < top_count; ++i) {
-      top_data[i] = 0;
-    }
-    // The main loop
-    for (int n = 0; n < bottom[0]->num(); ++n) {
-      for (int c = 0; c < channels_; ++c) {
-        for (int ph = 0; ph < pooled_height_; ++ph) {
-          for (int pw = 0; pw < pooled_width_; ++pw) {
-            int hstart = ph * stride_h_ - pad_h_;
-            int wstart = pw * stride_w_ - pad_w_;
-            int hend = min(hstart + kernel_h_, height_ + pad_h_);
-            int wend = min(wstart + kernel_w_, width_ + pad_w_);
-            int pool_size = (hend - hstart) * (wend - wstart);
-            hstart = max(hstart, 0);
-            wstart = max(wstart, 0);
-            hend = min(hend, height_);
-            wend = min(wend, width_);
-            for (int h = hstart; h < hend; ++h) {
-              for (int w = wstart; w < wend; ++w) {
-                top_data[ph * pooled_width_ + pw] +=
-                    bottom_data[h * width_ + w];
-              }
-            }
-            top_data[ph * pooled_width_ + pw] /= pool_size;
-          }
-        }
-        // compute offset
-        bottom_data += bottom[0]->offset(0, 1);
-        top_data += top[0]->offset(0, 1);
-      }
-    }
     break;
   case PoolingParameter_PoolMethod_STOCHASTIC:
     NOT_IMPLEMENTED;
@@ -227,6 +368,24 @@ void PoolingLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
   default:
     LOG(FATAL) << "Unknown pooling method.";
   }
+  const bool is_max =
+      pool_param.pool() == PoolingParameter_PoolMethod_MAX;
+  const int planes = bottom[0]->num() * channels_;
+  // The common 2x2 and 3x3 windows of stride 2 get unrolled kernels.
+  if (kernel_h_ == 2 && kernel_w_ == 2 && stride_h_ == 2 && stride_w_ == 2) {
+    pool_planes_cpu<Dtype, 2, 2>(bottom_data, planes, height_, width_,
+        kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+        pooled_height_, pooled_width_, is_max, top_data, mask, top_mask);
+  } else if (kernel_h_ == 3 && kernel_w_ == 3 && stride_h_ == 2 &&
+      stride_w_ == 2) {
+    pool_planes_cpu<Dtype, 3, 2>(bottom_data, planes, height_, width_,
+        kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+        pooled_height_, pooled_width_, is_max, top_data, mask, top_mask);
+  } else {
+    pool_planes_cpu<Dtype, 0, 0>(bottom_data, planes, height_, width_,
+        kernel_h_, kernel_w_, pad_h_, pad_w_, stride_h_, stride_w_,
+        pooled_height_, pooled_width_, is_max, top_data, mask, top_mask);
+  }
 }
 
 template <typename Dtype>
@@ -235,69 +394,66 @@ void PoolingLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
   if (!propagate_down[0]) {
     return;
   }
+  CHECK(!blocked_) << "Blocked pooling is for inference only.";
   const Dtype* top_diff = top[0]->cpu_diff();
   Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
-  // Different pooling methods. We explicitly do the switch outside the for
-  // loop to save time, although this results in more codes.
   caffe_set(bottom[0]->count(), Dtype(0), bottom_diff);
   // We'll output the mask to top[1] if it's of size >1.
   const bool use_top_mask = top.size() > 1;
   const int* mask = NULL;  // suppress warnings about uninitialized variables
   const Dtype* top_mask = NULL;
+  const int planes = top[0]->num() * channels_;
+  const int bottom_dim = height_ * width_;
+  const int top_dim = pooled_height_ * pooled_width_;
+  // The windows of a plane only reach into that plane, so the planes are
+  // split among OpenMP threads as in Forward_cpu.
   switch (this->layer_param_.pooling_param().pool()) {
   case PoolingParameter_PoolMethod_MAX:
-    // The main loop
     if (use_top_mask) {
       top_mask = top[1]->cpu_data();
     } else {
+      CHECK(!this->layer_param_.pooling_param().forward_only())
+          << "forward_only MAX pooling keeps no argmax to backpropagate.";
       mask = max_idx_.cpu_data();
     }
-    for (int n = 0; n < top[0]->num(); ++n) {
-      for (int c = 0; c < channels_; ++c) {
-        for (int ph = 0; ph < pooled_height_; ++ph) {
-          for (int pw = 0; pw < pooled_width_; ++pw) {
-            const int index = ph * pooled_width_ + pw;
-            const int bottom_index =
-                use_top_mask ? top_mask[index] : mask[index];
-            bottom_diff[bottom_index] += top_diff[index];
-          }
-        }
-        bottom_diff += bottom[0]->offset(0, 1);
-        top_diff += top[0]->offset(0, 1);
-        if (use_top_mask) {
-          top_mask += top[0]->offset(0, 1);
-        } else {
-          mask += top[0]->offset(0, 1);
-        }
+#ifdef _OPENMP
+#pragma omp parallel for if (top[0]->count() >= kParallelPoolSize)
+#endif
+    for (int p = 0; p < planes; ++p) {
+      Dtype* plane_diff = bottom_diff + p * bottom_dim;
+      for (int i = p * top_dim; i < (p + 1) * top_dim; ++i) {
+        const int bottom_index =
+            use_top_mask ? static_cast<int>(top_mask[i]) : mask[i];
+        plane_diff[bottom_index] += top_diff[i];
       }
     }
     break;
   case PoolingParameter_PoolMethod_AVE:
-    // The main loop
-    for (int n = 0; n < top[0]->num(); ++n) {
-      for (int c = 0; c < channels_; ++c) {
-        for (int ph = 0; ph < pooled_height_; ++ph) {
-          for (int pw = 0; pw < pooled_width_; ++pw) {
-            int hstart = ph * stride_h_ - pad_h_;
-            int wstart = pw * stride_w_ - pad_w_;
-            int hend = min(hstart + kernel_h_, height_ + pad_h_);
-            int wend = min(wstart + kernel_w_, width_ + pad_w_);
-            int pool_size = (hend - hstart) * (wend - wstart);
-            hstart = max(hstart, 0);
-            wstart = max(wstart, 0);
-            hend = min(hend, height_);
-            wend = min(wend, width_);
-            for (int h = hstart; h < hend; ++h) {
-              for (int w = wstart; w < wend; ++w) {
-                bottom_diff[h * width_ + w] +=
-                  top_diff[ph * pooled_width_ + pw] / pool_size;
-              }
+#ifdef _OPENMP
+#pragma omp parallel for if (top[0]->count() >= kParallelPoolSize)
+#endif
+    for (int p = 0; p < planes; ++p) {
+      Dtype* plane_diff = bottom_diff + p * bottom_dim;
+      const Dtype* plane_top_diff = top_diff + p * top_dim;
+      for (int ph = 0; ph < pooled_height_; ++ph) {
+        for (int pw = 0; pw < pooled_width_; ++pw) {
+          int hstart = ph * stride_h_ - pad_h_;
+          int wstart = pw * stride_w_ - pad_w_;
+          int hend = min(hstart + kernel_h_, height_ + pad_h_);
+          int wend = min(wstart + kernel_w_, width_ + pad_w_);
+          int pool_size = (hend - hstart) * (wend - wstart);
+          hstart = max(hstart, 0);
+          wstart = max(wstart, 0);
+          hend = min(hend, height_);
+          wend = min(wend, width_);
+          const Dtype diff =
+              plane_top_diff[ph * pooled_width_ + pw] / pool_size;
+          for (int h = hstart; h < hend; ++h) {
+            for (int w = wstart; w < wend; ++w) {
+              plane_diff[h * width_ + w] += diff;
             }
           }
         }
-        // offset
-        bottom_diff += bottom[0]->offset(0, 1);
-        top_diff += top[0]->offset(0, 1);
       }
     }
     break;
@@ -40,7 +40,7 @@ __global__ void MaxPoolForward(const int nthreads, const Dtype* bottom_data,
     top_data[index] = maxval;
     if (mask) {
       mask[index] = maxidx;
-    } else {
+    } else if (top_mask) {
       top_mask[index] = maxidx;
     }
   }
@@ -153,6 +153,10 @@ __global__ void StoPoolForwardTest(const int nthreads,
 template <typename Dtype>
 void PoolingLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
+  if (blocked_) {
+    ForwardBlocked_cpu(bottom, top);
+    return;
+  }
   const Dtype* bottom_data = bottom[0]->gpu_data();
   Dtype* top_data = top[0]->mutable_gpu_data();
   int count = top[0]->count();
@@ -164,7 +168,7 @@ void PoolingLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
   case PoolingParameter_PoolMethod_MAX:
     if (use_top_mask) {
       top_mask = top[1]->mutable_gpu_data();
-    } else {
+    } else if (!this->layer_param_.pooling_param().forward_only()) {
       mask = max_idx_.mutable_gpu_data();
     }
     // NOLINT_NEXT_LINE(whitespace/operators)
@@ -342,6 +346,8 @@ void PoolingLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
     if (use_top_mask) {
       top_mask = top[1]->gpu_data();
     } else {
+      CHECK(!this->layer_param_.pooling_param().forward_only())
+          << "forward_only MAX pooling keeps no argmax to backpropagate.";
       mask = max_idx_.gpu_data();
     }
     // NOLINT_NEXT_LINE(whitespace/operators)
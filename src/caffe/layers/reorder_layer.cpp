@@ -0,0 +1,65 @@
+#include <vector>
+
+#include "caffe/common_layers.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/util/blocked_layout.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void ReorderLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  const int num_axes = bottom[0]->num_axes();
+  CHECK(num_axes == 4 || num_axes == 5) << "Input must have 4 axes, "
+      << "corresponding to (num, channels, height, width), or 5 axes, "
+      << "corresponding to (num, channel blocks, height, width, block)";
+  to_blocked_ = num_axes == 4;
+  num_ = bottom[0]->shape(0);
+  spatial_dim_ = bottom[0]->count(2, 4);
+  vector<int> top_shape(bottom[0]->shape().begin(),
+      bottom[0]->shape().begin() + 4);
+  if (to_blocked_) {
+    block_ = this->layer_param_.reorder_param().channel_block();
+    channels_ = bottom[0]->shape(1);
+    CHECK_GT(block_, 0);
+    CHECK_EQ(channels_ % block_, 0)
+        << "channel_block must divide the channels.";
+    top_shape[1] = channels_ / block_;
+    top_shape.push_back(block_);
+  } else {
+    block_ = bottom[0]->shape(4);
+    channels_ = bottom[0]->shape(1) * block_;
+    top_shape[1] = channels_;
+  }
+  top[0]->Reshape(top_shape);
+}
+
+template <typename Dtype>
+void ReorderLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+  if (to_blocked_) {
+    nchw_to_blocked(bottom[0]->cpu_data(), num_, channels_, spatial_dim_,
+        block_, top[0]->mutable_cpu_data());
+  } else {
+    blocked_to_nchw(bottom[0]->cpu_data(), num_, channels_, spatial_dim_,
+        block_, top[0]->mutable_cpu_data());
+  }
+}
+
+template <typename Dtype>
+void ReorderLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+  if (!propagate_down[0]) { return; }
+  if (to_blocked_) {
+    blocked_to_nchw(top[0]->cpu_diff(), num_, channels_, spatial_dim_,
+        block_, bottom[0]->mutable_cpu_diff());
+  } else {
+    nchw_to_blocked(top[0]->cpu_diff(), num_, channels_, spatial_dim_,
+        block_, bottom[0]->mutable_cpu_diff());
+  }
+}
+
+INSTANTIATE_CLASS(ReorderLayer);
+REGISTER_LAYER_CLASS(Reorder);
+
+}  // namespace caffe
@@ -1,3 +1,5 @@
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <opencv2/highgui/highgui_c.h>
 #include <stdint.h>
 
@@ -15,6 +17,7 @@
 #include "caffe/data_layers.hpp"
 #include "caffe/layer.hpp"
 #include "caffe/util/benchmark.hpp"
+#include "caffe/util/hwc_to_chw.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
@@ -225,31 +228,18 @@ void WindowDataLayer<Dtype>::InternalThreadEntry() {
   CPUTimer batch_timer;
   batch_timer.Start();
   double read_time = 0;
-  double trans_time = 0;
   CPUTimer timer;
   Dtype* top_data = this->prefetch_data_.mutable_cpu_data();
   Dtype* top_label = this->prefetch_label_.mutable_cpu_data();
-  const Dtype scale = this->layer_param_.window_data_param().scale();
-  const int batch_size = this->layer_param_.window_data_param().batch_size();
-  const int context_pad = this->layer_param_.window_data_param().context_pad();
-  const int crop_size = this->transform_param_.crop_size();
+  const WindowDataParameter& window_data_param =
+      this->layer_param_.window_data_param();
+  const int batch_size = window_data_param.batch_size();
   const bool mirror = this->transform_param_.mirror();
-  const float fg_fraction =
-      this->layer_param_.window_data_param().fg_fraction();
-  Dtype* mean = NULL;
-  int mean_off = 0;
-  int mean_width = 0;
-  int mean_height = 0;
+  const float fg_fraction = window_data_param.fg_fraction();
   if (this->has_mean_file_) {
-    mean = this->data_mean_.mutable_cpu_data();
-    mean_off = (this->data_mean_.width() - crop_size) / 2;
-    mean_width = this->data_mean_.width();
-    mean_height = this->data_mean_.height();
+    // Sync the mean before the workers read it.
+    this->data_mean_.cpu_data();
   }
-  cv::Size cv_crop_size(crop_size, crop_size);
-  const string& crop_mode = this->layer_param_.window_data_param().crop_mode();
-
-  bool use_square = (crop_mode == "square") ? true : false;
 
   // zero out batch
   caffe_set(this->prefetch_data_.count(), Dtype(0), top_data);
@@ -258,206 +248,288 @@ void WindowDataLayer<Dtype>::InternalThreadEntry() {
       * fg_fraction);
   const int num_samples[2] = { batch_size - num_fg, num_fg };
 
+  // Sample the windows of the batch and group them by image, so that each
+  // image is decoded once per batch.
+  batch_windows_.resize(batch_size);
+  batch_mirror_.resize(batch_size);
+  batch_images_.clear();
+  batch_image_items_.clear();
+  map<int, int> batch_image_ids;
   int item_id = 0;
   // sample from bg set then fg set
   for (int is_fg = 0; is_fg < 2; ++is_fg) {
     for (int dummy = 0; dummy < num_samples[is_fg]; ++dummy) {
       // sample a window
-      timer.Start();
       const unsigned int rand_index = PrefetchRand();
-      vector<float> window = (is_fg) ?
+      batch_windows_[item_id] = (is_fg) ?
           fg_windows_[rand_index % fg_windows_.size()] :
           bg_windows_[rand_index % bg_windows_.size()];
+      batch_mirror_[item_id] = mirror && PrefetchRand() % 2;
+
+      const int image_index =
+          batch_windows_[item_id][WindowDataLayer<Dtype>::IMAGE_INDEX];
+      map<int, int>::iterator id = batch_image_ids.find(image_index);
+      if (id == batch_image_ids.end()) {
+        id = batch_image_ids.insert(
+            std::make_pair(image_index, batch_images_.size())).first;
+        batch_images_.push_back(std::make_pair(image_index,
+            shared_ptr<cv::Mat>()));
+        batch_image_items_.push_back(vector<int>());
+        // Take the image from the cache and mark it as the most recently
+        // used.
+        typename map<int, CachedImage>::iterator cached =
+            image_cache_.find(image_index);
+        if (cached != image_cache_.end()) {
+          batch_images_.back().second = cached->second.first;
+          image_lru_.splice(image_lru_.begin(), image_lru_,
+              cached->second.second);
+        }
+      }
+      batch_image_items_[id->second].push_back(item_id);
+      // get window label
+      top_label[item_id] =
+          batch_windows_[item_id][WindowDataLayer<Dtype>::LABEL];
+      item_id++;
+    }
+  }
 
-      bool do_mirror = mirror && PrefetchRand() % 2;
-
-      // load the image containing the window
-      pair<std::string, vector<int> > image =
-          image_database_[window[WindowDataLayer<Dtype>::IMAGE_INDEX]];
+  // Decode the images and crop their windows.
+  timer.Start();
+  const int num_threads = std::max(1, std::min<int>(batch_images_.size(),
+      window_data_param.prefetch_threads()));
+  vector<bool> was_cached(batch_images_.size());
+  for (int i = 0; i < batch_images_.size(); ++i) {
+    was_cached[i] = batch_images_[i].second.get() != NULL;
+  }
+  if (num_threads == 1) {
+    ProcessImages(0, 1, top_data);
+  } else {
+    boost::thread_group workers;
+    for (int i = 0; i < num_threads; ++i) {
+      workers.create_thread(boost::bind(
+          &WindowDataLayer<Dtype>::ProcessImages, this, i, num_threads,
+          top_data));
+    }
+    workers.join_all();
+  }
+  read_time += timer.MicroSeconds();
+
+  // Cache the newly decoded images, evicting the least recently used ones.
+  const size_t cache_bytes = window_data_param.cache_bytes();
+  for (int i = 0; i < batch_images_.size() && cache_bytes > 0; ++i) {
+    const shared_ptr<cv::Mat>& cv_img = batch_images_[i].second;
+    if (was_cached[i] || !cv_img || !cv_img->data) {
+      continue;
+    }
+    const size_t bytes = cv_img->total() * cv_img->elemSize();
+    if (bytes > cache_bytes) {
+      continue;
+    }
+    while (image_cache_bytes_ + bytes > cache_bytes) {
+      typename map<int, CachedImage>::iterator lru =
+          image_cache_.find(image_lru_.back());
+      image_cache_bytes_ -=
+          lru->second.first->total() * lru->second.first->elemSize();
+      image_cache_.erase(lru);
+      image_lru_.pop_back();
+    }
+    image_lru_.push_front(batch_images_[i].first);
+    image_cache_[batch_images_[i].first] =
+        std::make_pair(cv_img, image_lru_.begin());
+    image_cache_bytes_ += bytes;
+  }
+  batch_timer.Stop();
+  DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
+  DLOG(INFO) << "Read and transform time: " << read_time / 1000 << " ms, "
+      << batch_images_.size() << " images.";
+  if (image_cache_bytes_ > 0) {
+    DLOG(INFO) << "    Image cache: " << image_cache_.size() << " images, "
+        << image_cache_bytes_ / 1048576.0 << " MB.";
+  }
+}
 
-      cv::Mat cv_img;
+template <typename Dtype>
+void WindowDataLayer<Dtype>::ProcessImages(const int thread_id,
+    const int num_threads, Dtype* top_data) {
+  for (int i = thread_id; i < batch_images_.size(); i += num_threads) {
+    shared_ptr<cv::Mat>& cv_img = batch_images_[i].second;
+    // load the image containing the window
+    if (!cv_img) {
+      const int image_index = batch_images_[i].first;
+      cv_img.reset(new cv::Mat());
       if (this->cache_images_) {
-        pair<std::string, Datum> image_cached =
-          image_database_cache_[window[WindowDataLayer<Dtype>::IMAGE_INDEX]];
-        cv_img = DecodeDatumToCVMat(image_cached.second, true);
+        *cv_img = DecodeDatumToCVMat(
+            image_database_cache_[image_index].second, true);
       } else {
-        cv_img = cv::imread(image.first, CV_LOAD_IMAGE_COLOR);
-        if (!cv_img.data) {
-          LOG(ERROR) << "Could not open or find file " << image.first;
-          return;
+        const string& filename = image_database_[image_index].first;
+        *cv_img = cv::imread(filename, CV_LOAD_IMAGE_COLOR);
+        if (!cv_img->data) {
+          LOG(ERROR) << "Could not open or find file " << filename;
+          continue;
         }
       }
-      read_time += timer.MicroSeconds();
-      timer.Start();
-      const int channels = cv_img.channels();
-
-      // crop window out of image and warp it
-      int x1 = window[WindowDataLayer<Dtype>::X1];
-      int y1 = window[WindowDataLayer<Dtype>::Y1];
-      int x2 = window[WindowDataLayer<Dtype>::X2];
-      int y2 = window[WindowDataLayer<Dtype>::Y2];
-
-      int pad_w = 0;
-      int pad_h = 0;
-      if (context_pad > 0 || use_square) {
-        // scale factor by which to expand the original region
-        // such that after warping the expanded region to crop_size x crop_size
-        // there's exactly context_pad amount of padding on each side
-        Dtype context_scale = static_cast<Dtype>(crop_size) /
-            static_cast<Dtype>(crop_size - 2*context_pad);
-
-        // compute the expanded region
-        Dtype half_height = static_cast<Dtype>(y2-y1+1)/2.0;
-        Dtype half_width = static_cast<Dtype>(x2-x1+1)/2.0;
-        Dtype center_x = static_cast<Dtype>(x1) + half_width;
-        Dtype center_y = static_cast<Dtype>(y1) + half_height;
-        if (use_square) {
-          if (half_height > half_width) {
-            half_width = half_height;
-          } else {
-            half_height = half_width;
-          }
-        }
-        x1 = static_cast<int>(round(center_x - half_width*context_scale));
-        x2 = static_cast<int>(round(center_x + half_width*context_scale));
-        y1 = static_cast<int>(round(center_y - half_height*context_scale));
-        y2 = static_cast<int>(round(center_y + half_height*context_scale));
-
-        // the expanded region may go outside of the image
-        // so we compute the clipped (expanded) region and keep track of
-        // the extent beyond the image
-        int unclipped_height = y2-y1+1;
-        int unclipped_width = x2-x1+1;
-        int pad_x1 = std::max(0, -x1);
-        int pad_y1 = std::max(0, -y1);
-        int pad_x2 = std::max(0, x2 - cv_img.cols + 1);
-        int pad_y2 = std::max(0, y2 - cv_img.rows + 1);
-        // clip bounds
-        x1 = x1 + pad_x1;
-        x2 = x2 - pad_x2;
-        y1 = y1 + pad_y1;
-        y2 = y2 - pad_y2;
-        CHECK_GT(x1, -1);
-        CHECK_GT(y1, -1);
-        CHECK_LT(x2, cv_img.cols);
-        CHECK_LT(y2, cv_img.rows);
-
-        int clipped_height = y2-y1+1;
-        int clipped_width = x2-x1+1;
-
-        // scale factors that would be used to warp the unclipped
-        // expanded region
-        Dtype scale_x =
-            static_cast<Dtype>(crop_size)/static_cast<Dtype>(unclipped_width);
-        Dtype scale_y =
-            static_cast<Dtype>(crop_size)/static_cast<Dtype>(unclipped_height);
-
-        // size to warp the clipped expanded region to
-        cv_crop_size.width =
-            static_cast<int>(round(static_cast<Dtype>(clipped_width)*scale_x));
-        cv_crop_size.height =
-            static_cast<int>(round(static_cast<Dtype>(clipped_height)*scale_y));
-        pad_x1 = static_cast<int>(round(static_cast<Dtype>(pad_x1)*scale_x));
-        pad_x2 = static_cast<int>(round(static_cast<Dtype>(pad_x2)*scale_x));
-        pad_y1 = static_cast<int>(round(static_cast<Dtype>(pad_y1)*scale_y));
-        pad_y2 = static_cast<int>(round(static_cast<Dtype>(pad_y2)*scale_y));
-
-        pad_h = pad_y1;
-        // if we're mirroring, we mirror the padding too (to be pedantic)
-        if (do_mirror) {
-          pad_w = pad_x2;
-        } else {
-          pad_w = pad_x1;
-        }
+    }
+    const vector<int>& items = batch_image_items_[i];
+    for (int j = 0; j < items.size(); ++j) {
+      CropWindow(*cv_img, batch_windows_[items[j]], batch_mirror_[items[j]],
+          items[j], top_data);
+    }
+  }
+}
 
-        // ensure that the warped, clipped region plus the padding fits in the
-        // crop_size x crop_size image (it might not due to rounding)
-        if (pad_h + cv_crop_size.height > crop_size) {
-          cv_crop_size.height = crop_size - pad_h;
-        }
-        if (pad_w + cv_crop_size.width > crop_size) {
-          cv_crop_size.width = crop_size - pad_w;
-        }
-      }
+template <typename Dtype>
+void WindowDataLayer<Dtype>::CropWindow(const cv::Mat& cv_img,
+    const vector<float>& window, const bool do_mirror, const int item_id,
+    Dtype* top_data) {
+  const Dtype scale = this->layer_param_.window_data_param().scale();
+  const int context_pad = this->layer_param_.window_data_param().context_pad();
+  const int crop_size = this->transform_param_.crop_size();
+  const Dtype* mean = NULL;
+  int mean_off = 0;
+  int mean_width = 0;
+  int mean_height = 0;
+  if (this->has_mean_file_) {
+    mean = this->data_mean_.cpu_data();
+    mean_off = (this->data_mean_.width() - crop_size) / 2;
+    mean_width = this->data_mean_.width();
+    mean_height = this->data_mean_.height();
+  }
+  cv::Size cv_crop_size(crop_size, crop_size);
+  const string& crop_mode = this->layer_param_.window_data_param().crop_mode();
 
-      cv::Rect roi(x1, y1, x2-x1+1, y2-y1+1);
-      cv::Mat cv_cropped_img = cv_img(roi);
-      cv::resize(cv_cropped_img, cv_cropped_img,
-          cv_crop_size, 0, 0, cv::INTER_LINEAR);
+  bool use_square = (crop_mode == "square") ? true : false;
 
-      // horizontal flip at random
-      if (do_mirror) {
-        cv::flip(cv_cropped_img, cv_cropped_img, 1);
+  const int channels = cv_img.channels();
+
+  // crop window out of image and warp it
+  int x1 = window[WindowDataLayer<Dtype>::X1];
+  int y1 = window[WindowDataLayer<Dtype>::Y1];
+  int x2 = window[WindowDataLayer<Dtype>::X2];
+  int y2 = window[WindowDataLayer<Dtype>::Y2];
+
+  int pad_w = 0;
+  int pad_h = 0;
+  if (context_pad > 0 || use_square) {
+    // scale factor by which to expand the original region
+    // such that after warping the expanded region to crop_size x crop_size
+    // there's exactly context_pad amount of padding on each side
+    Dtype context_scale = static_cast<Dtype>(crop_size) /
+        static_cast<Dtype>(crop_size - 2*context_pad);
+
+    // compute the expanded region
+    Dtype half_height = static_cast<Dtype>(y2-y1+1)/2.0;
+    Dtype half_width = static_cast<Dtype>(x2-x1+1)/2.0;
+    Dtype center_x = static_cast<Dtype>(x1) + half_width;
+    Dtype center_y = static_cast<Dtype>(y1) + half_height;
+    if (use_square) {
+      if (half_height > half_width) {
+        half_width = half_height;
+      } else {
+        half_height = half_width;
       }
+    }
+    x1 = static_cast<int>(round(center_x - half_width*context_scale));
+    x2 = static_cast<int>(round(center_x + half_width*context_scale));
+    y1 = static_cast<int>(round(center_y - half_height*context_scale));
+    y2 = static_cast<int>(round(center_y + half_height*context_scale));
+
+    // the expanded region may go outside of the image
+    // so we compute the clipped (expanded) region and keep track of
+    // the extent beyond the image
+    int unclipped_height = y2-y1+1;
+    int unclipped_width = x2-x1+1;
+    int pad_x1 = std::max(0, -x1);
+    int pad_y1 = std::max(0, -y1);
+    int pad_x2 = std::max(0, x2 - cv_img.cols + 1);
+    int pad_y2 = std::max(0, y2 - cv_img.rows + 1);
+    // clip bounds
+    x1 = x1 + pad_x1;
+    x2 = x2 - pad_x2;
+    y1 = y1 + pad_y1;
+    y2 = y2 - pad_y2;
+    CHECK_GT(x1, -1);
+    CHECK_GT(y1, -1);
+    CHECK_LT(x2, cv_img.cols);
+    CHECK_LT(y2, cv_img.rows);
+
+    int clipped_height = y2-y1+1;
+    int clipped_width = x2-x1+1;
+
+    // scale factors that would be used to warp the unclipped
+    // expanded region
+    Dtype scale_x =
+        static_cast<Dtype>(crop_size)/static_cast<Dtype>(unclipped_width);
+    Dtype scale_y =
+        static_cast<Dtype>(crop_size)/static_cast<Dtype>(unclipped_height);
+
+    // size to warp the clipped expanded region to
+    cv_crop_size.width =
+        static_cast<int>(round(static_cast<Dtype>(clipped_width)*scale_x));
+    cv_crop_size.height =
+        static_cast<int>(round(static_cast<Dtype>(clipped_height)*scale_y));
+    pad_x1 = static_cast<int>(round(static_cast<Dtype>(pad_x1)*scale_x));
+    pad_x2 = static_cast<int>(round(static_cast<Dtype>(pad_x2)*scale_x));
+    pad_y1 = static_cast<int>(round(static_cast<Dtype>(pad_y1)*scale_y));
+    pad_y2 = static_cast<int>(round(static_cast<Dtype>(pad_y2)*scale_y));
+
+    pad_h = pad_y1;
+    // if we're mirroring, we mirror the padding too (to be pedantic)
+    if (do_mirror) {
+      pad_w = pad_x2;
+    } else {
+      pad_w = pad_x1;
+    }
+
+    // ensure that the warped, clipped region plus the padding fits in the
+    // crop_size x crop_size image (it might not due to rounding)
+    if (pad_h + cv_crop_size.height > crop_size) {
+      cv_crop_size.height = crop_size - pad_h;
+    }
+    if (pad_w + cv_crop_size.width > crop_size) {
+      cv_crop_size.width = crop_size - pad_w;
+    }
+  }
 
-      // copy the warped window into top_data
-      for (int h = 0; h < cv_cropped_img.rows; ++h) {
-        const uchar* ptr = cv_cropped_img.ptr<uchar>(h);
-        int img_index = 0;
-        for (int w = 0; w < cv_cropped_img.cols; ++w) {
-          for (int c = 0; c < channels; ++c) {
-            int top_index = ((item_id * channels + c) * crop_size + h + pad_h)
-                     * crop_size + w + pad_w;
-            // int top_index = (c * height + h) * width + w;
-            Dtype pixel = static_cast<Dtype>(ptr[img_index++]);
-            if (this->has_mean_file_) {
-              int mean_index = (c * mean_height + h + mean_off + pad_h)
-                           * mean_width + w + mean_off + pad_w;
-              top_data[top_index] = (pixel - mean[mean_index]) * scale;
-            } else {
-              if (this->has_mean_values_) {
-                top_data[top_index] = (pixel - this->mean_values_[c]) * scale;
-              } else {
-                top_data[top_index] = pixel * scale;
-              }
-            }
-          }
+  // Warp into a new Mat: cv_img may be shared with other windows and the
+  // cache.
+  cv::Rect roi(x1, y1, x2-x1+1, y2-y1+1);
+  cv::Mat cv_cropped_img;
+  cv::resize(cv_img(roi), cv_cropped_img,
+      cv_crop_size, 0, 0, cv::INTER_LINEAR);
+
+  // horizontal flip at random
+  if (do_mirror) {
+    cv::flip(cv_cropped_img, cv_cropped_img, 1);
+  }
+
+  // copy the warped window into top_data, one channel row at a time
+  const int rows = cv_cropped_img.rows;
+  const int cols = cv_cropped_img.cols;
+  vector<Dtype> planes(channels * rows * cols);
+  if (!planes.empty()) {
+    hwc_to_chw(cv_cropped_img.ptr<uint8_t>(0), channels, rows, cols,
+        cv_cropped_img.step, &planes[0]);
+  }
+  for (int c = 0; c < channels; ++c) {
+    for (int h = 0; h < rows; ++h) {
+      const Dtype* pixel = &planes[0] + (c * rows + h) * cols;
+      Dtype* top_row = top_data + ((item_id * channels + c) * crop_size + h
+          + pad_h) * crop_size + pad_w;
+      if (this->has_mean_file_) {
+        const Dtype* mean_row = mean + (c * mean_height + h + mean_off
+            + pad_h) * mean_width + mean_off + pad_w;
+        for (int w = 0; w < cols; ++w) {
+          top_row[w] = (pixel[w] - mean_row[w]) * scale;
         }
-      }
-      trans_time += timer.MicroSeconds();
-      // get window label
-      top_label[item_id] = window[WindowDataLayer<Dtype>::LABEL];
-
-      #if 0
-      // useful debugging code for dumping transformed windows to disk
-      string file_id;
-      std::stringstream ss;
-      ss << PrefetchRand();
-      ss >> file_id;
-      std::ofstream inf((string("dump/") + file_id +
-          string("_info.txt")).c_str(), std::ofstream::out);
-      inf << image.first << std::endl
-          << window[WindowDataLayer<Dtype>::X1]+1 << std::endl
-          << window[WindowDataLayer<Dtype>::Y1]+1 << std::endl
-          << window[WindowDataLayer<Dtype>::X2]+1 << std::endl
-          << window[WindowDataLayer<Dtype>::Y2]+1 << std::endl
-          << do_mirror << std::endl
-          << top_label[item_id] << std::endl
-          << is_fg << std::endl;
-      inf.close();
-      std::ofstream top_data_file((string("dump/") + file_id +
-          string("_data.txt")).c_str(),
-          std::ofstream::out | std::ofstream::binary);
-      for (int c = 0; c < channels; ++c) {
-        for (int h = 0; h < crop_size; ++h) {
-          for (int w = 0; w < crop_size; ++w) {
-            top_data_file.write(reinterpret_cast<char*>(
-                &top_data[((item_id * channels + c) * crop_size + h)
-                          * crop_size + w]),
-                sizeof(Dtype));
-          }
+      } else {
+        const Dtype mean_value =
+            this->has_mean_values_ ? this->mean_values_[c] : Dtype(0);
+        for (int w = 0; w < cols; ++w) {
+          top_row[w] = (pixel[w] - mean_value) * scale;
         }
       }
-      top_data_file.close();
-      #endif
-
-      item_id++;
     }
   }
-  batch_timer.Stop();
-  DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
-  DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
-  DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
 }
 
 INSTANTIATE_CLASS(WindowDataLayer);
@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <vector>
+
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/winograd.hpp"
+#include "caffe/vision_layers.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void WinogradConvolutionLayer<Dtype>::LayerSetUp(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  ConvolutionLayer<Dtype>::LayerSetUp(bottom, top);
+  CHECK(this->kernel_h_ == 3 && this->kernel_w_ == 3)
+      << "WINOGRAD only supports 3x3 filters.";
+  CHECK(this->stride_h_ == 1 && this->stride_w_ == 1)
+      << "WINOGRAD only supports stride 1.";
+  tile_ = this->layer_param_.convolution_param().winograd_tile();
+  CHECK(tile_ == 2 || tile_ == 4) << "winograd_tile must be 2 or 4.";
+  winograd_backward_ = this->pad_h_ <= 2 && this->pad_w_ <= 2;
+}
+
+template <typename Dtype>
+void WinogradConvolutionLayer<Dtype>::Reshape(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  ConvolutionLayer<Dtype>::Reshape(bottom, top);
+  const int channels = this->channels_ / this->group_;
+  const int num_output = this->num_output_ / this->group_;
+  vector<int> filters_shape(1,
+      this->group_ * winograd_filters_size(tile_, num_output, channels));
+  filters_.Reshape(filters_shape);
+  flipped_filters_.Reshape(filters_shape);
+  int workspace_size = winograd_workspace_size(tile_, channels, num_output,
+      this->height_out_, this->width_out_);
+  if (winograd_backward_) {
+    workspace_size = std::max(workspace_size, winograd_workspace_size(tile_,
+        num_output, channels, this->height_, this->width_));
+  }
+  workspace_.Reshape(vector<int>(1, workspace_size));
+}
+
+template <typename Dtype>
+void WinogradConvolutionLayer<Dtype>::UpdateFilters() {
+  const Blob<Dtype>& weights = *this->blobs_[0];
+  if (cached_weights_.count() == weights.count() &&
+      std::equal(weights.cpu_data(), weights.cpu_data() + weights.count(),
+          cached_weights_.cpu_data())) {
+    return;
+  }
+  cached_weights_.CopyFrom(weights, false, true);
+  const int channels = this->channels_ / this->group_;
+  const int num_output = this->num_output_ / this->group_;
+  const int weights_dim = weights.count() / this->group_;
+  const int filters_dim = filters_.count() / this->group_;
+  for (int g = 0; g < this->group_; ++g) {
+    winograd_transform_filters(tile_, weights.cpu_data() + g * weights_dim,
+        num_output, channels, false,
+        filters_.mutable_cpu_data() + g * filters_dim);
+    winograd_transform_filters(tile_, weights.cpu_data() + g * weights_dim,
+        num_output, channels, true,
+        flipped_filters_.mutable_cpu_data() + g * filters_dim);
+  }
+}
+
+template <typename Dtype>
+void WinogradConvolutionLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  UpdateFilters();
+  const int channels = this->channels_ / this->group_;
+  const int num_output = this->num_output_ / this->group_;
+  const int bottom_dim = channels * this->height_ * this->width_;
+  const int top_dim = num_output * this->height_out_ * this->width_out_;
+  const int filters_dim = filters_.count() / this->group_;
+  const Dtype* filters = filters_.cpu_data();
+  Dtype* workspace = workspace_.mutable_cpu_data();
+  for (int i = 0; i < bottom.size(); ++i) {
+    const Dtype* bottom_data = bottom[i]->cpu_data();
+    Dtype* top_data = top[i]->mutable_cpu_data();
+    for (int n = 0; n < this->num_; ++n) {
+      for (int g = 0; g < this->group_; ++g) {
+        winograd_conv_cpu(tile_, bottom_data + bottom[i]->offset(n) +
+            g * bottom_dim, channels, this->height_, this->width_,
+            this->pad_h_, this->pad_w_, filters + g * filters_dim,
+            num_output, workspace,
+            top_data + top[i]->offset(n) + g * top_dim);
+      }
+      if (this->bias_term_) {
+        const Dtype* bias = this->blobs_[1]->cpu_data();
+        this->forward_cpu_bias(top_data + top[i]->offset(n), bias);
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void WinogradConvolutionLayer<Dtype>::Backward_cpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  if (!winograd_backward_) {
+    ConvolutionLayer<Dtype>::Backward_cpu(top, propagate_down, bottom);
+    return;
+  }
+  // Weight and bias gradients through im2col.
+  ConvolutionLayer<Dtype>::Backward_cpu(top,
+      vector<bool>(propagate_down.size(), false), bottom);
+  UpdateFilters();
+  const int channels = this->channels_ / this->group_;
+  const int num_output = this->num_output_ / this->group_;
+  const int bottom_dim = channels * this->height_ * this->width_;
+  const int top_dim = num_output * this->height_out_ * this->width_out_;
+  const int filters_dim = flipped_filters_.count() / this->group_;
+  const Dtype* filters = flipped_filters_.cpu_data();
+  Dtype* workspace = workspace_.mutable_cpu_data();
+  for (int i = 0; i < top.size(); ++i) {
+    if (!propagate_down[i]) {
+      continue;
+    }
+    const Dtype* top_diff = top[i]->cpu_diff();
+    Dtype* bottom_diff = bottom[i]->mutable_cpu_diff();
+    for (int n = 0; n < this->num_; ++n) {
+      for (int g = 0; g < this->group_; ++g) {
+        winograd_conv_cpu(tile_, top_diff + top[i]->offset(n) + g * top_dim,
+            num_output, this->height_out_, this->width_out_,
+            2 - this->pad_h_, 2 - this->pad_w_, filters + g * filters_dim,
+            channels, workspace,
+            bottom_diff + bottom[i]->offset(n) + g * bottom_dim);
+      }
+    }
+  }
+}
+
+INSTANTIATE_CLASS(WinogradConvolutionLayer);
+
+}  // namespace caffe
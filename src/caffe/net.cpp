@@ -9,6 +9,7 @@
 #include "caffe/layer.hpp"
 #include "caffe/net.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocked_layout.hpp"
 #include "caffe/util/insert_splits.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
@@ -18,6 +19,25 @@
 
 namespace caffe {
 
+namespace {
+
+// The checkpointing segment that layer_id falls in, -1 for none.
+int SegmentOf(const vector<int>& segment_begin, const int layer_id) {
+  return std::upper_bound(segment_begin.begin(), segment_begin.end(),
+      layer_id) - segment_begin.begin() - 1;
+}
+
+// Whether a layer draws random numbers in Forward.
+bool DrawsRandomNumbers(const LayerParameter& param, const Phase phase) {
+  if (phase != TRAIN) { return false; }
+  const string& type = param.type();
+  return type == "Dropout" ||
+      ((type == "Pooling" || type == "PoolingSK") &&
+       param.pooling_param().pool() == PoolingParameter_PoolMethod_STOCHASTIC);
+}
+
+}  // namespace
+
 template <typename Dtype>
 Net<Dtype>::Net(const NetParameter& param) {
   Init(param);
@@ -35,10 +55,24 @@ template <typename Dtype>
 void Net<Dtype>::Init(const NetParameter& in_param) {
   // Set phase from the state.
   phase_ = in_param.state().phase();
+  inference_ = in_param.state().inference();
+  if (inference_) {
+    CHECK_EQ(phase_, TEST) << "Inference nets must be in the TEST phase.";
+    CHECK(!in_param.force_backward())
+        << "Inference nets cannot force backward.";
+  }
   // Filter layers based on their include/exclude rules and
   // the current NetState.
   NetParameter filtered_param;
   FilterNet(in_param, &filtered_param);
+  // Keep activations channel-blocked where asked to; only forward passes on
+  // CPU support the blocked layout.
+  if (filtered_param.channel_block() > 0 && phase_ == TEST &&
+      !filtered_param.force_backward() && Caffe::mode() == Caffe::CPU) {
+    NetParameter nchw_param;
+    nchw_param.Swap(&filtered_param);
+    InsertBlockedLayout(nchw_param, &filtered_param);
+  }
   LOG(INFO) << "Initializing net from parameters: " << std::endl
             << filtered_param.DebugString();
   // Create a copy of filtered_param with splits added where necessary.
@@ -77,6 +111,11 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
     if (!param.layer(layer_id).has_phase()) {
       param.mutable_layer(layer_id)->set_phase(phase_);
     }
+    // Without backward, MAX pooling need not keep its argmax.
+    if (inference_ && param.layer(layer_id).type() == "Pooling") {
+      param.mutable_layer(layer_id)->mutable_pooling_param()->set_forward_only(
+          true);
+    }
     // Setup layer.
     const LayerParameter& layer_param = param.layer(layer_id);
     layers_.push_back(LayerRegistry<Dtype>::CreateLayer(layer_param));
@@ -132,7 +171,8 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
     for (int param_id = 0; param_id < num_param_blobs; ++param_id) {
       const ParamSpec* param_spec = (param_id < param_size) ?
           &layer_param.param(param_id) : &default_param_spec;
-      const bool param_need_backward = param_spec->lr_mult() > 0;
+      const bool param_need_backward =
+          param_spec->lr_mult() > 0 && !inference_;
       need_backward |= param_need_backward;
       layers_[layer_id]->set_param_propagate_down(param_id,
                                                   param_need_backward);
@@ -141,6 +181,7 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
       AppendParam(param, layer_id, param_id);
     }
     // Finally, set the backward flag
+    need_backward &= !inference_;
     layer_need_backward_.push_back(need_backward);
     if (need_backward) {
       for (int top_id = 0; top_id < top_id_vecs_[layer_id].size(); ++top_id) {
@@ -214,8 +255,356 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
   }
   GetLearningRateAndWeightDecay();
   debug_info_ = param.debug_info();
+  inference_memory_saved_ = 0;
+  if (inference_) {
+    // Diffs are only allocated when first written, so a net that never runs
+    // backward does not allocate them whether or not it is in inference
+    // mode. What inference mode does avoid are the buffers that forward
+    // fills only for backward: the argmax of MAX pooling without a mask top,
+    // and the Dropout mask (which no TEST net fills any more).
+    for (int layer_id = 0; layer_id < layers_.size(); ++layer_id) {
+      const LayerParameter& layer_param = layers_[layer_id]->layer_param();
+      if (layer_param.type() == "Pooling" &&
+          layer_param.pooling_param().pool() ==
+          PoolingParameter_PoolMethod_MAX &&
+          top_vecs_[layer_id].size() == 1) {
+        inference_memory_saved_ +=
+            top_vecs_[layer_id][0]->count() * sizeof(int);
+      } else if (layer_param.type() == "Dropout") {
+        inference_memory_saved_ +=
+            bottom_vecs_[layer_id][0]->count() * sizeof(unsigned int);
+      }
+    }
+  }
   LOG(INFO) << "Network initialization done.";
   LOG(INFO) << "Memory required for data: " << memory_used_ * sizeof(Dtype);
+  if (inference_) {
+    LOG(INFO) << "Memory saved by inference mode (backward-only buffers): "
+              << inference_memory_saved_;
+  }
+  if (param.share_activations()) {
+    CHECK(inference_) << "Only inference nets can share activation memory.";
+    PlanActivationMemory();
+  }
+  InitCheckpoints(param);
+}
+
+template <typename Dtype>
+void Net<Dtype>::BlobLifetimes(vector<int>* root, vector<int>* first,
+    vector<int>* last, vector<int>* last_write) const {
+  const int num_blobs = blobs_.size();
+  // Split, Flatten and Reshape make their tops share the memory of their
+  // bottom, so such tops count as uses of the blob they alias, their root.
+  root->resize(num_blobs);
+  for (int blob_id = 0; blob_id < num_blobs; ++blob_id) {
+    (*root)[blob_id] = blob_id;
+  }
+  first->assign(num_blobs, -1);
+  last->assign(num_blobs, -1);
+  last_write->assign(num_blobs, -1);
+  for (int layer_id = 0; layer_id < layers_.size(); ++layer_id) {
+    const string type = layers_[layer_id]->type();
+    const bool aliases_bottom =
+        type == string("Split") || type == string("Flatten") ||
+        type == string("Reshape");
+    for (int i = 0; i < bottom_id_vecs_[layer_id].size(); ++i) {
+      (*last)[(*root)[bottom_id_vecs_[layer_id][i]]] = layer_id;
+    }
+    for (int i = 0; i < top_id_vecs_[layer_id].size(); ++i) {
+      const int blob_id = top_id_vecs_[layer_id][i];
+      if (aliases_bottom) {
+        (*root)[blob_id] = (*root)[bottom_id_vecs_[layer_id][0]];
+      }
+      const int r = (*root)[blob_id];
+      if ((*first)[r] < 0) {
+        (*first)[r] = layer_id;
+      }
+      (*last)[r] = layer_id;
+      (*last_write)[r] = layer_id;
+    }
+  }
+}
+
+template <typename Dtype>
+void Net<Dtype>::KeptBlobs(const vector<int>& root, vector<bool>* kept) const {
+  kept->assign(blobs_.size(), false);
+  for (int i = 0; i < net_input_blob_indices_.size(); ++i) {
+    (*kept)[root[net_input_blob_indices_[i]]] = true;
+  }
+  for (int i = 0; i < net_output_blob_indices_.size(); ++i) {
+    (*kept)[root[net_output_blob_indices_[i]]] = true;
+  }
+  for (int blob_id = 0; blob_id < blob_loss_weights_.size(); ++blob_id) {
+    if (blob_loss_weights_[blob_id] != Dtype(0)) {
+      (*kept)[root[blob_id]] = true;
+    }
+  }
+  // Data layers fill their tops from outside the net, and some (MemoryData)
+  // point them at memory of their own, which must not be shared.
+  for (int layer_id = 0; layer_id < layers_.size(); ++layer_id) {
+    if (!bottom_vecs_[layer_id].empty()) { continue; }
+    for (int i = 0; i < top_id_vecs_[layer_id].size(); ++i) {
+      (*kept)[root[top_id_vecs_[layer_id][i]]] = true;
+    }
+  }
+}
+
+template <typename Dtype>
+size_t Net<Dtype>::PlanActivationMemory() {
+  CHECK(inference_) << "Only inference nets can share activation memory.";
+  const int num_blobs = blobs_.size();
+  vector<int> root, first, last, last_write;
+  BlobLifetimes(&root, &first, &last, &last_write);
+  // The inputs, outputs, loss blobs and data layer tops keep their memory.
+  vector<bool> fixed;
+  KeptBlobs(root, &fixed);
+  // Blobs are numbered in the order layers first write them, so each takes
+  // in turn a buffer whose last user comes before it is written: the
+  // smallest that holds it, or else the largest, grown to fit.
+  vector<size_t> buffer_bytes;
+  vector<int> buffer_last;
+  vector<int> blob_buffer(num_blobs, -1);
+  size_t fixed_bytes = 0;
+  size_t planned_bytes = 0;
+  int planned_blobs = 0;
+  for (int blob_id = 0; blob_id < num_blobs; ++blob_id) {
+    if (root[blob_id] != blob_id) { continue; }
+    const size_t bytes = blobs_[blob_id]->count() * sizeof(Dtype);
+    if (fixed[blob_id]) {
+      fixed_bytes += bytes;
+      continue;
+    }
+    planned_bytes += bytes;
+    ++planned_blobs;
+    int best = -1;
+    for (int b = 0; b < buffer_bytes.size(); ++b) {
+      if (buffer_last[b] >= first[blob_id]) { continue; }
+      if (best < 0) {
+        best = b;
+        continue;
+      }
+      const bool fits = buffer_bytes[b] >= bytes;
+      const bool best_fits = buffer_bytes[best] >= bytes;
+      if ((fits && (!best_fits || buffer_bytes[b] < buffer_bytes[best])) ||
+          (!fits && !best_fits && buffer_bytes[b] > buffer_bytes[best])) {
+        best = b;
+      }
+    }
+    if (best < 0) {
+      best = buffer_bytes.size();
+      buffer_bytes.push_back(0);
+      buffer_last.push_back(-1);
+    }
+    buffer_bytes[best] = std::max(buffer_bytes[best], bytes);
+    buffer_last[best] = last[blob_id];
+    blob_buffer[blob_id] = best;
+  }
+  vector<shared_ptr<SyncedMemory> > buffers(buffer_bytes.size());
+  size_t shared_bytes = 0;
+  for (int b = 0; b < buffers.size(); ++b) {
+    buffers[b].reset(new SyncedMemory(buffer_bytes[b]));
+    shared_bytes += buffer_bytes[b];
+  }
+  for (int blob_id = 0; blob_id < num_blobs; ++blob_id) {
+    if (blob_buffer[blob_id] >= 0) {
+      blobs_[blob_id]->ShareDataMemory(buffers[blob_buffer[blob_id]]);
+    }
+  }
+  LOG(INFO) << "Activation memory: " << fixed_bytes + planned_bytes
+            << " bytes before sharing, " << fixed_bytes + shared_bytes
+            << " after; " << planned_blobs << " blobs in " << buffers.size()
+            << " shared buffers.";
+  return fixed_bytes + shared_bytes;
+}
+
+template <typename Dtype>
+void Net<Dtype>::InitCheckpoints(const NetParameter& param) {
+  segment_begin_.clear();
+  segment_blobs_.clear();
+  segment_random_.clear();
+  segment_seed_.clear();
+  resident_segment_ = -1;
+  if (param.checkpoint_size() == 0 && param.checkpoint_memory_budget() == 0) {
+    return;
+  }
+  CHECK(!inference_) << "Inference nets have no backward pass to checkpoint.";
+  const int num_layers = layers_.size();
+  vector<int> root, first, last, last_write;
+  BlobLifetimes(&root, &first, &last, &last_write);
+  // Recomputing a segment neither refills the inputs nor reruns the layers
+  // without bottoms, so it would apply an in-place layer on their blobs twice.
+  vector<bool> fixed(root.size(), false);
+  for (int i = 0; i < net_input_blob_indices_.size(); ++i) {
+    fixed[root[net_input_blob_indices_[i]]] = true;
+  }
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    const vector<int>& bottom_ids = bottom_id_vecs_[layer_id];
+    const vector<int>& top_ids = top_id_vecs_[layer_id];
+    for (int i = 0; i < top_ids.size(); ++i) {
+      if (bottom_ids.empty()) {
+        fixed[root[top_ids[i]]] = true;
+      } else if (fixed[root[top_ids[i]]] && std::find(bottom_ids.begin(),
+          bottom_ids.end(), top_ids[i]) != bottom_ids.end()) {
+        LOG(FATAL) << "Layer " << layer_names_[layer_id] << " cannot work "
+            << "in place on " << blob_names_[top_ids[i]] << ", an input or "
+            << "data layer top, in a checkpointed net.";
+      }
+    }
+  }
+  // A segment may not begin between two layers writing the same blob, as
+  // recomputing it would apply the later writes (e.g. in-place) twice.
+  vector<bool> can_begin(num_layers, true);
+  for (int blob_id = 0; blob_id < root.size(); ++blob_id) {
+    if (root[blob_id] != blob_id) { continue; }
+    for (int layer_id = std::max(first[blob_id] + 1, 1);
+         layer_id <= last_write[blob_id]; ++layer_id) {
+      can_begin[layer_id] = false;
+    }
+  }
+  vector<int> segment_begin(1, 0);
+  if (param.checkpoint_size() > 0) {
+    // Cut after the last layer writing each checkpoint, or the first
+    // place after it where a segment may begin.
+    set<int> cuts;
+    for (int i = 0; i < param.checkpoint_size(); ++i) {
+      const string& blob_name = param.checkpoint(i);
+      map<string, int>::const_iterator it = blob_names_index_.find(blob_name);
+      CHECK(it != blob_names_index_.end())
+          << "Unknown checkpoint blob " << blob_name;
+      int layer_id = last_write[root[it->second]] + 1;
+      while (layer_id < num_layers && !can_begin[layer_id]) { ++layer_id; }
+      if (layer_id > 0 && layer_id < num_layers) {
+        cuts.insert(layer_id);
+      }
+    }
+    segment_begin.insert(segment_begin.end(), cuts.begin(), cuts.end());
+  } else {
+    // Cut wherever the data and diffs of the blobs written since the last
+    // cut reach 1/n of the total, for n = 1, 2, ..., and keep the first
+    // segmentation that fits the budget, or else the smallest.
+    const size_t budget = param.checkpoint_memory_budget();
+    vector<size_t> layer_bytes(num_layers, 0);
+    size_t total_bytes = 0;
+    for (int blob_id = 0; blob_id < root.size(); ++blob_id) {
+      if (root[blob_id] != blob_id || first[blob_id] < 0) { continue; }
+      const size_t bytes = 2 * blobs_[blob_id]->count() * sizeof(Dtype);
+      layer_bytes[first[blob_id]] += bytes;
+      total_bytes += bytes;
+    }
+    size_t best_bytes = 0;
+    for (int n = 1; n <= num_layers; ++n) {
+      vector<int> begin(1, 0);
+      size_t bytes = 0;
+      for (int layer_id = 1; layer_id < num_layers; ++layer_id) {
+        bytes += layer_bytes[layer_id - 1];
+        if (bytes * n >= total_bytes && can_begin[layer_id]) {
+          begin.push_back(layer_id);
+          bytes = 0;
+        }
+      }
+      const size_t segment_bytes = SegmentMemory(begin, false);
+      if (n == 1 || segment_bytes < best_bytes) {
+        segment_begin = begin;
+        best_bytes = segment_bytes;
+      }
+      if (segment_bytes <= budget) {
+        segment_begin = begin;
+        best_bytes = segment_bytes;
+        break;
+      }
+    }
+    LOG_IF(WARNING, best_bytes > budget) << "No checkpoints fit the budget of "
+        << budget << " bytes; the fewest bytes needed are " << best_bytes;
+  }
+  segment_begin_ = segment_begin;
+  segment_random_.assign(segment_begin_.size(), false);
+  segment_seed_.assign(segment_begin_.size(), 0);
+  for (int layer_id = 0; layer_id < num_layers; ++layer_id) {
+    if (!bottom_vecs_[layer_id].empty() &&
+        DrawsRandomNumbers(layers_[layer_id]->layer_param(), phase_)) {
+      segment_random_[SegmentOf(segment_begin_, layer_id)] = true;
+    }
+  }
+  const size_t unsegmented_bytes = SegmentMemory(vector<int>(1, 0), false);
+  const size_t bytes = SegmentMemory(segment_begin_, true);
+  LOG(INFO) << "Checkpointing in " << segment_begin_.size()
+            << " segments: activation memory " << bytes << " bytes, "
+            << unsegmented_bytes << " without.";
+}
+
+template <typename Dtype>
+size_t Net<Dtype>::SegmentMemory(const vector<int>& segment_begin,
+    bool share) {
+  const int num_blobs = blobs_.size();
+  const int num_segments = segment_begin.size();
+  vector<int> root, first, last, last_write;
+  BlobLifetimes(&root, &first, &last, &last_write);
+  vector<bool> kept;
+  KeptBlobs(root, &kept);
+  // A segment recomputes the blobs it alone uses; the others keep their
+  // data and diffs (aliasing tops only their diffs).
+  vector<vector<pair<int, int> > > segment_blobs(num_segments);
+  size_t bytes = 0;
+  for (int blob_id = 0; blob_id < num_blobs; ++blob_id) {
+    const int r = root[blob_id];
+    const int segment = SegmentOf(segment_begin, first[r]);
+    const int count = blobs_[blob_id]->count();
+    if (kept[r] || segment < 0 ||
+        segment != SegmentOf(segment_begin, last[r])) {
+      bytes += (r == blob_id ? 2 : 1) * count * sizeof(Dtype);
+    } else {
+      segment_blobs[segment].push_back(make_pair(-count, blob_id));
+    }
+  }
+  // The largest blobs of each segment take the first data and diff
+  // buffers, which are sized to the largest blob of any segment using them.
+  vector<size_t> data_bytes, diff_bytes;
+  vector<int> data_buffer(num_blobs, -1);
+  vector<int> diff_buffer(num_blobs, -1);
+  for (int segment = 0; segment < num_segments; ++segment) {
+    std::sort(segment_blobs[segment].begin(), segment_blobs[segment].end());
+    int num_data = 0;
+    int num_diff = 0;
+    for (int i = 0; i < segment_blobs[segment].size(); ++i) {
+      const int blob_id = segment_blobs[segment][i].second;
+      const size_t blob_bytes = blobs_[blob_id]->count() * sizeof(Dtype);
+      if (root[blob_id] == blob_id) {
+        if (num_data == data_bytes.size()) { data_bytes.push_back(0); }
+        data_bytes[num_data] = std::max(data_bytes[num_data], blob_bytes);
+        data_buffer[blob_id] = num_data++;
+      }
+      if (num_diff == diff_bytes.size()) { diff_bytes.push_back(0); }
+      diff_bytes[num_diff] = std::max(diff_bytes[num_diff], blob_bytes);
+      diff_buffer[blob_id] = num_diff++;
+    }
+  }
+  vector<shared_ptr<SyncedMemory> > data_buffers(data_bytes.size());
+  for (int b = 0; b < data_bytes.size(); ++b) {
+    bytes += data_bytes[b];
+    if (share) { data_buffers[b].reset(new SyncedMemory(data_bytes[b])); }
+  }
+  vector<shared_ptr<SyncedMemory> > diff_buffers(diff_bytes.size());
+  for (int b = 0; b < diff_bytes.size(); ++b) {
+    bytes += diff_bytes[b];
+    if (share) { diff_buffers[b].reset(new SyncedMemory(diff_bytes[b])); }
+  }
+  if (share) {
+    for (int blob_id = 0; blob_id < num_blobs; ++blob_id) {
+      if (data_buffer[blob_id] >= 0) {
+        blobs_[blob_id]->ShareDataMemory(data_buffers[data_buffer[blob_id]]);
+      }
+      if (diff_buffer[blob_id] >= 0) {
+        blobs_[blob_id]->ShareDiffMemory(diff_buffers[diff_buffer[blob_id]]);
+      }
+    }
+    segment_blobs_.assign(num_segments, vector<int>());
+    for (int segment = 0; segment < num_segments; ++segment) {
+      for (int i = 0; i < segment_blobs[segment].size(); ++i) {
+        segment_blobs_[segment].push_back(segment_blobs[segment][i].second);
+      }
+    }
+  }
+  return bytes;
 }
 
 template <typename Dtype>
@@ -468,12 +857,29 @@ Dtype Net<Dtype>::ForwardFromTo(int start, int end) {
       InputDebugInfo(i);
     }
   }
+  int segment = -1;
   for (int i = start; i <= end; ++i) {
+    if (!segment_begin_.empty() && SegmentOf(segment_begin_, i) != segment) {
+      if (segment >= 0 && segment_random_[segment]) { EndSegmentDraws(); }
+      segment = SegmentOf(segment_begin_, i);
+      if (segment_random_[segment]) {
+        CHECK_EQ(i, segment_begin_[segment]) << "Forward must start at the "
+            << "beginning of a checkpointing segment with random layers.";
+        segment_seed_[segment] = caffe_rng_rand();
+        BeginSegmentDraws(segment);
+      }
+    }
     // LOG(ERROR) << "Forwarding " << layer_names_[i];
     Dtype layer_loss = layers_[i]->Forward(bottom_vecs_[i], top_vecs_[i]);
     loss += layer_loss;
     if (debug_info_) { ForwardDebugInfo(i); }
   }
+  if (segment >= 0 && segment_random_[segment]) { EndSegmentDraws(); }
+  if (!segment_begin_.empty()) {
+    // Only a whole segment leaves all its blobs with their forward values.
+    const int segment = SegmentOf(segment_begin_, end);
+    resident_segment_ = start <= segment_begin_[segment] ? segment : -1;
+  }
   return loss;
 }
 
@@ -530,10 +936,17 @@ string Net<Dtype>::Forward(const string& input_blob_protos, Dtype* loss) {
 
 template <typename Dtype>
 void Net<Dtype>::BackwardFromTo(int start, int end) {
+  CHECK(!inference_) << "Inference nets have no backward pass.";
   CHECK_GE(end, 0);
   CHECK_LT(start, layers_.size());
+  int segment = -1;
   for (int i = start; i >= end; --i) {
     if (layer_need_backward_[i]) {
+      if (!segment_begin_.empty() &&
+          (segment < 0 || i < segment_begin_[segment])) {
+        segment = SegmentOf(segment_begin_, i);
+        RestoreSegment(segment);
+      }
       layers_[i]->Backward(
           top_vecs_[i], bottom_need_backward_[i], bottom_vecs_[i]);
       if (debug_info_) { BackwardDebugInfo(i); }
@@ -541,6 +954,70 @@ void Net<Dtype>::BackwardFromTo(int start, int end) {
   }
 }
 
+template <typename Dtype>
+void Net<Dtype>::BeginSegmentDraws(const int segment) {
+  const unsigned int seed = segment_seed_[segment];
+  // main_rng_ holds the main stream until EndSegmentDraws swaps it back.
+  main_rng_.reset(new Caffe::RNG(seed));
+  Caffe::rng_stream().swap(*main_rng_);
+#ifndef CPU_ONLY
+  if (Caffe::curand_generator()) {
+    CURAND_CHECK(curandSetPseudoRandomGeneratorSeed(Caffe::curand_generator(),
+        seed));
+    CURAND_CHECK(curandSetGeneratorOffset(Caffe::curand_generator(), 0));
+  }
+#endif
+}
+
+template <typename Dtype>
+void Net<Dtype>::EndSegmentDraws() {
+  Caffe::rng_stream().swap(*main_rng_);
+#ifndef CPU_ONLY
+  // cuRAND cannot return to its earlier state, so it moves on to a seed
+  // drawn from the main stream rather than repeat the segment's draws.
+  if (Caffe::curand_generator()) {
+    CURAND_CHECK(curandSetPseudoRandomGeneratorSeed(Caffe::curand_generator(),
+        caffe_rng_rand()));
+    CURAND_CHECK(curandSetGeneratorOffset(Caffe::curand_generator(), 0));
+  }
+#endif
+}
+
+template <typename Dtype>
+void Net<Dtype>::RestoreSegment(const int segment) {
+  if (segment != resident_segment_) {
+    const int end = segment + 1 < segment_begin_.size() ?
+        segment_begin_[segment + 1] : layers_.size();
+    if (segment_random_[segment]) { BeginSegmentDraws(segment); }
+    for (int i = segment_begin_[segment]; i < end; ++i) {
+      // Layers without bottoms would move on to new data.
+      if (bottom_vecs_[i].empty()) { continue; }
+      layers_[i]->Forward(bottom_vecs_[i], top_vecs_[i]);
+    }
+    if (segment_random_[segment]) { EndSegmentDraws(); }
+    resident_segment_ = segment;
+  }
+  // The diffs are shared with other segments, so start from zero, as
+  // freshly allocated ones would.
+  for (int i = 0; i < segment_blobs_[segment].size(); ++i) {
+    Blob<Dtype>* blob = blobs_[segment_blobs_[segment][i]].get();
+    switch (Caffe::mode()) {
+    case Caffe::CPU:
+      caffe_set(blob->count(), Dtype(0), blob->mutable_cpu_diff());
+      break;
+    case Caffe::GPU:
+#ifndef CPU_ONLY
+      caffe_gpu_set(blob->count(), Dtype(0), blob->mutable_gpu_diff());
+#else
+      NO_GPU;
+#endif
+      break;
+    default:
+      LOG(FATAL) << "Unknown caffe mode: " << Caffe::mode();
+    }
+  }
+}
+
 template <typename Dtype>
 void Net<Dtype>::InputDebugInfo(const int input_id) {
   const Blob<Dtype>& blob = *net_input_blobs_[input_id];
@@ -740,6 +1217,7 @@ void Net<Dtype>::ToProto(NetParameter* param, bool write_diff) const {
 
 template <typename Dtype>
 void Net<Dtype>::Update() {
+  CHECK(!inference_) << "Inference nets have no gradients to update with.";
   // First, accumulate the diffs of any shared parameters into their owner's
   // diff. (Assumes that the learning rate, weight decay, etc. have already been
   // accounted for in the current diff.)
@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/text_format.h"
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/common_layers.hpp"
+#include "caffe/filler.hpp"
+#include "caffe/net.hpp"
+#include "caffe/util/blocked_layout.hpp"
+#include "caffe/vision_layers.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class BlockedLayoutTest : public ::testing::Test {
+ protected:
+  BlockedLayoutTest()
+      : blob_bottom_(new Blob<Dtype>(2, 3, 7, 6)),
+        blob_blocked_(new Blob<Dtype>()),
+        blob_top_(new Blob<Dtype>()),
+        blob_ref_top_(new Blob<Dtype>()) {
+    Caffe::set_mode(Caffe::CPU);
+    Caffe::set_random_seed(1701);
+    FillerParameter filler_param;
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(blob_bottom_);
+  }
+  virtual ~BlockedLayoutTest() {
+    delete blob_bottom_;
+    delete blob_blocked_;
+    delete blob_top_;
+    delete blob_ref_top_;
+  }
+
+  // Runs layer on blob_bottom_, reordered into blocks of bottom_block
+  // channels first unless it is 0, into blob_top_, and checks it against
+  // ref_layer run on blob_bottom_ in NCHW.
+  void CheckAgainstNCHW(Layer<Dtype>* layer, Layer<Dtype>* ref_layer,
+      const int bottom_block) {
+    vector<Blob<Dtype>*> bottom_vec(1, blob_bottom_);
+    vector<Blob<Dtype>*> top_vec(1, blob_top_);
+    vector<Blob<Dtype>*> ref_top_vec(1, blob_ref_top_);
+    ref_layer->SetUp(bottom_vec, ref_top_vec);
+    ref_layer->Forward(bottom_vec, ref_top_vec);
+    if (bottom_block > 0) {
+      LayerParameter reorder_param;
+      reorder_param.mutable_reorder_param()->set_channel_block(bottom_block);
+      ReorderLayer<Dtype> reorder(reorder_param);
+      bottom_vec[0] = blob_blocked_;
+      vector<Blob<Dtype>*> nchw_vec(1, blob_bottom_);
+      reorder.SetUp(nchw_vec, bottom_vec);
+      reorder.Forward(nchw_vec, bottom_vec);
+    }
+    layer->SetUp(bottom_vec, top_vec);
+    for (int i = 0; i < layer->blobs().size(); ++i) {
+      layer->blobs()[i]->CopyFrom(*ref_layer->blobs()[i]);
+    }
+    layer->Forward(bottom_vec, top_vec);
+    ASSERT_EQ(5, blob_top_->num_axes());
+    const int block = blob_top_->shape(4);
+    EXPECT_EQ(blob_ref_top_->num(), blob_top_->shape(0));
+    EXPECT_EQ(blob_ref_top_->channels(), blob_top_->shape(1) * block);
+    EXPECT_EQ(blob_ref_top_->height(), blob_top_->shape(2));
+    EXPECT_EQ(blob_ref_top_->width(), blob_top_->shape(3));
+    vector<Dtype> top(blob_top_->count());
+    blocked_to_nchw(blob_top_->cpu_data(), blob_ref_top_->num(),
+        blob_ref_top_->channels(), blob_ref_top_->count(2), block, &top[0]);
+    for (int i = 0; i < blob_ref_top_->count(); ++i) {
+      EXPECT_NEAR(blob_ref_top_->cpu_data()[i], top[i], 1e-4);
+    }
+  }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_blocked_;
+  Blob<Dtype>* const blob_top_;
+  Blob<Dtype>* const blob_ref_top_;
+};
+
+TYPED_TEST_CASE(BlockedLayoutTest, TestDtypes);
+
+TYPED_TEST(BlockedLayoutTest, TestReorder) {
+  this->blob_bottom_->Reshape(2, 16, 3, 5);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  layer_param.mutable_reorder_param()->set_channel_block(8);
+  ReorderLayer<TypeParam> to_blocked(layer_param);
+  ReorderLayer<TypeParam> to_nchw(layer_param);
+  vector<Blob<TypeParam>*> bottom_vec(1, this->blob_bottom_);
+  vector<Blob<TypeParam>*> blocked_vec(1, this->blob_blocked_);
+  vector<Blob<TypeParam>*> top_vec(1, this->blob_top_);
+  to_blocked.SetUp(bottom_vec, blocked_vec);
+  to_blocked.Forward(bottom_vec, blocked_vec);
+  ASSERT_EQ(5, this->blob_blocked_->num_axes());
+  EXPECT_EQ(2, this->blob_blocked_->shape(0));
+  EXPECT_EQ(2, this->blob_blocked_->shape(1));
+  EXPECT_EQ(3, this->blob_blocked_->shape(2));
+  EXPECT_EQ(5, this->blob_blocked_->shape(3));
+  EXPECT_EQ(8, this->blob_blocked_->shape(4));
+  for (int n = 0; n < 2; ++n) {
+    for (int c = 0; c < 16; ++c) {
+      for (int h = 0; h < 3; ++h) {
+        for (int w = 0; w < 5; ++w) {
+          EXPECT_EQ(this->blob_bottom_->data_at(n, c, h, w),
+              this->blob_blocked_->cpu_data()[
+                  (((n * 2 + c / 8) * 3 + h) * 5 + w) * 8 + c % 8]);
+        }
+      }
+    }
+  }
+  to_nchw.SetUp(blocked_vec, top_vec);
+  to_nchw.Forward(blocked_vec, top_vec);
+  ASSERT_TRUE(this->blob_top_->shape() == this->blob_bottom_->shape());
+  for (int i = 0; i < this->blob_bottom_->count(); ++i) {
+    EXPECT_EQ(this->blob_bottom_->cpu_data()[i],
+        this->blob_top_->cpu_data()[i]);
+  }
+}
+
+TYPED_TEST(BlockedLayoutTest, TestConvolutionNCHWBottom) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_pad(1);
+  convolution_param->set_num_output(16);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  ConvolutionLayer<TypeParam> ref_layer(layer_param);
+  convolution_param->set_channel_block(8);
+  BlockedConvolutionLayer<TypeParam> layer(layer_param);
+  this->CheckAgainstNCHW(&layer, &ref_layer, 0);
+}
+
+TYPED_TEST(BlockedLayoutTest, TestConvolutionBlockedBottom) {
+  this->blob_bottom_->Reshape(2, 16, 6, 5);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_h(3);
+  convolution_param->set_kernel_w(2);
+  convolution_param->set_pad_h(2);
+  convolution_param->set_pad_w(0);
+  convolution_param->set_num_output(16);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  ConvolutionLayer<TypeParam> ref_layer(layer_param);
+  convolution_param->set_channel_block(16);
+  BlockedConvolutionLayer<TypeParam> layer(layer_param);
+  this->CheckAgainstNCHW(&layer, &ref_layer, 8);
+}
+
+TYPED_TEST(BlockedLayoutTest, TestMaxPooling) {
+  this->blob_bottom_->Reshape(2, 16, 7, 6);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+  pooling_param->set_kernel_size(3);
+  pooling_param->set_stride(2);
+  pooling_param->set_pad(1);
+  pooling_param->set_pool(PoolingParameter_PoolMethod_MAX);
+  PoolingLayer<TypeParam> ref_layer(layer_param);
+  PoolingLayer<TypeParam> layer(layer_param);
+  this->CheckAgainstNCHW(&layer, &ref_layer, 8);
+}
+
+TYPED_TEST(BlockedLayoutTest, TestAvePooling) {
+  this->blob_bottom_->Reshape(2, 16, 7, 6);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+  pooling_param->set_kernel_size(3);
+  pooling_param->set_stride(2);
+  pooling_param->set_pad(1);
+  pooling_param->set_pool(PoolingParameter_PoolMethod_AVE);
+  PoolingLayer<TypeParam> ref_layer(layer_param);
+  PoolingLayer<TypeParam> layer(layer_param);
+  this->CheckAgainstNCHW(&layer, &ref_layer, 16);
+}
+
+TYPED_TEST(BlockedLayoutTest, TestNet) {
+  // conv1 -> relu1 (in place) -> pool1 -> conv2, conv3 -> eltwise, concat
+  // -> ip, with conv3 narrower than a block and ip without blocked support.
+  const string proto =
+      "input: 'data' "
+      "input_shape { dim: 2 dim: 3 dim: 9 dim: 8 } "
+      "state { phase: TEST } "
+      "layer { name: 'conv1' type: 'Convolution' bottom: 'data' "
+      "  top: 'conv1' convolution_param { num_output: 16 kernel_size: 3 "
+      "  pad: 1 weight_filler { type: 'gaussian' } "
+      "  bias_filler { type: 'gaussian' } } } "
+      "layer { name: 'relu1' type: 'ReLU' bottom: 'conv1' top: 'conv1' } "
+      "layer { name: 'pool1' type: 'Pooling' bottom: 'conv1' top: 'pool1' "
+      "  pooling_param { pool: MAX kernel_size: 2 stride: 2 } } "
+      "layer { name: 'conv2' type: 'Convolution' bottom: 'pool1' "
+      "  top: 'conv2' convolution_param { num_output: 16 kernel_size: 3 "
+      "  pad: 1 weight_filler { type: 'gaussian' } } } "
+      "layer { name: 'conv3' type: 'Convolution' bottom: 'pool1' "
+      "  top: 'conv3' convolution_param { num_output: 4 kernel_size: 1 "
+      "  weight_filler { type: 'gaussian' } } } "
+      "layer { name: 'sum' type: 'Eltwise' bottom: 'conv2' bottom: 'pool1' "
+      "  top: 'sum' } "
+      "layer { name: 'concat' type: 'Concat' bottom: 'sum' bottom: 'conv2' "
+      "  top: 'concat' } "
+      "layer { name: 'ip' type: 'InnerProduct' bottom: 'concat' top: 'ip' "
+      "  inner_product_param { num_output: 5 "
+      "  weight_filler { type: 'gaussian' } } } ";
+  NetParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+  Net<TypeParam> ref_net(param);
+  param.set_channel_block(8);
+  Net<TypeParam> net(param);
+  NetParameter weights;
+  ref_net.ToProto(&weights);
+  net.CopyTrainedLayersFrom(weights);
+  EXPECT_TRUE(net.has_blob("conv1_blocked"));
+  EXPECT_TRUE(net.has_blob("concat_blocked"));
+  EXPECT_FALSE(net.has_blob("conv3_blocked"));
+  Blob<TypeParam>* data = ref_net.input_blobs()[0];
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(data);
+  net.input_blobs()[0]->CopyFrom(*data);
+  ref_net.ForwardPrefilled();
+  net.ForwardPrefilled();
+  const char* outputs[] = {"conv3", "concat", "ip"};
+  for (int i = 0; i < 3; ++i) {
+    const Blob<TypeParam>& ref = *ref_net.blob_by_name(outputs[i]);
+    const Blob<TypeParam>& blob = *net.blob_by_name(outputs[i]);
+    ASSERT_TRUE(ref.shape() == blob.shape()) << outputs[i];
+    for (int j = 0; j < ref.count(); ++j) {
+      const TypeParam tolerance =
+          1e-4 * std::max(TypeParam(1), std::fabs(ref.cpu_data()[j]));
+      EXPECT_NEAR(ref.cpu_data()[j], blob.cpu_data()[j], tolerance)
+          << outputs[i];
+    }
+  }
+}
+
+}  // namespace caffe
@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <cmath>
 #include <cstring>
+#include <typeinfo>
 #include <vector>
 
 #include "gtest/gtest.h"
@@ -6,6 +9,7 @@
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
 #include "caffe/filler.hpp"
+#include "caffe/layer_factory.hpp"
 #include "caffe/vision_layers.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
@@ -272,6 +276,41 @@ TYPED_TEST(ConvolutionLayerTest, TestSimpleConvolutionGroup) {
   }
 }
 
+TYPED_TEST(ConvolutionLayerTest, TestBatchedIm2colConvolutionGroup) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Three images in batches of two leave a batch of one.
+  this->blob_bottom_->Reshape(3, 3, 6, 4);
+  FillerParameter filler_param;
+  filler_param.set_value(1.);
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_pad(1);
+  convolution_param->set_num_output(6);
+  convolution_param->set_group(3);
+  convolution_param->set_im2col_batch(2);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  shared_ptr<Layer<Dtype> > layer(
+      new ConvolutionLayer<Dtype>(layer_param));
+  layer->SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer->Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  // Check against reference convolution.
+  const Dtype* top_data;
+  const Dtype* ref_top_data;
+  caffe_conv(this->blob_bottom_, convolution_param, layer->blobs(),
+      this->MakeReferenceTop(this->blob_top_));
+  top_data = this->blob_top_->cpu_data();
+  ref_top_data = this->ref_blob_top_->cpu_data();
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_NEAR(top_data[i], ref_top_data[i], 1e-4);
+  }
+}
+
 TYPED_TEST(ConvolutionLayerTest, TestSobelConvolution) {
   // Test separable convolution by computing the Sobel operator
   // as a single filter then comparing the result
@@ -404,6 +443,52 @@ TYPED_TEST(ConvolutionLayerTest, Test1x1Gradient) {
       this->blob_top_vec_);
 }
 
+TYPED_TEST(ConvolutionLayerTest, Test1x1GradientGroup) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(1);
+  convolution_param->set_stride(1);
+  convolution_param->set_num_output(6);
+  convolution_param->set_group(3);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  ConvolutionLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+TYPED_TEST(ConvolutionLayerTest, Test1x1SinglePixel) {
+  // Maps of one pixel take the single GEMM over all images.
+  typedef typename TypeParam::Dtype Dtype;
+  this->blob_bottom_->Reshape(4, 3, 1, 1);
+  FillerParameter filler_param;
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(1);
+  convolution_param->set_stride(1);
+  convolution_param->set_num_output(5);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  ConvolutionLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  caffe_conv(this->blob_bottom_, convolution_param, layer.blobs(),
+      this->MakeReferenceTop(this->blob_top_));
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_NEAR(this->blob_top_->cpu_data()[i],
+        this->ref_blob_top_->cpu_data()[i], 1e-4);
+  }
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
 TYPED_TEST(ConvolutionLayerTest, TestGradientGroup) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter layer_param;
@@ -421,6 +506,299 @@ TYPED_TEST(ConvolutionLayerTest, TestGradientGroup) {
       this->blob_top_vec_);
 }
 
+TYPED_TEST(ConvolutionLayerTest, TestImageParallelGradientGroup) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kernel_size(3);
+  convolution_param->set_stride(2);
+  convolution_param->set_num_output(3);
+  convolution_param->set_group(3);
+  convolution_param->set_image_threads(2);
+  convolution_param->mutable_weight_filler()->set_type("gaussian");
+  convolution_param->mutable_bias_filler()->set_type("gaussian");
+  ConvolutionLayer<Dtype> layer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+// A CPU convolution engine checked against the im2col convolution.
+template <typename TypeParam, ConvolutionParameter_Engine kEngine>
+struct ConvolutionEngine {
+  typedef TypeParam Dtype;
+  static const ConvolutionParameter_Engine engine = kEngine;
+};
+
+typedef ::testing::Types<
+    ConvolutionEngine<float, ConvolutionParameter_Engine_WINOGRAD>,
+    ConvolutionEngine<double, ConvolutionParameter_Engine_WINOGRAD>,
+    ConvolutionEngine<float, ConvolutionParameter_Engine_FFT>,
+    ConvolutionEngine<double, ConvolutionParameter_Engine_FFT> >
+    TestConvolutionEngines;
+
+template <typename TypeParam>
+class ConvolutionEngineTest : public ::testing::Test {
+  typedef typename TypeParam::Dtype Dtype;
+
+ protected:
+  ConvolutionEngineTest()
+      : blob_bottom_(new Blob<Dtype>(2, 4, 13, 11)),
+        blob_top_(new Blob<Dtype>()),
+        ref_blob_top_(new Blob<Dtype>()) {}
+  virtual void SetUp() {
+    Caffe::set_mode(Caffe::CPU);
+    FillerParameter filler_param;
+    filler_param.set_value(1.);
+    GaussianFiller<Dtype> filler(filler_param);
+    filler.Fill(this->blob_bottom_);
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_top_vec_.push_back(blob_top_);
+    ref_blob_top_vec_.push_back(ref_blob_top_);
+  }
+
+  virtual ~ConvolutionEngineTest() {
+    delete blob_bottom_;
+    delete blob_top_;
+    delete ref_blob_top_;
+  }
+
+  void MakeLayerParameter(const int kernel, const int pad, const int stride,
+      const int group, LayerParameter* layer_param) {
+    layer_param->set_type("Convolution");
+    ConvolutionParameter* convolution_param =
+        layer_param->mutable_convolution_param();
+    convolution_param->set_kernel_size(kernel);
+    convolution_param->set_pad(pad);
+    convolution_param->set_stride(stride);
+    convolution_param->set_num_output(6);
+    convolution_param->set_group(group);
+    convolution_param->set_engine(TypeParam::engine);
+    convolution_param->mutable_weight_filler()->set_type("gaussian");
+    convolution_param->mutable_bias_filler()->set_type("gaussian");
+  }
+
+  // Creates the layer of the engine, which must not fall back to im2col.
+  shared_ptr<Layer<Dtype> > MakeLayer(const LayerParameter& layer_param) {
+    shared_ptr<Layer<Dtype> > layer =
+        LayerRegistry<Dtype>::CreateLayer(layer_param);
+    EXPECT_TRUE(typeid(*layer) != typeid(ConvolutionLayer<Dtype>));
+    return layer;
+  }
+
+  // Winograd differs from im2col by rounding only, so double must match far
+  // closer. The FFT error grows with the magnitude of the result.
+  Dtype Tolerance(const Dtype ref, const bool backward) const {
+    if (TypeParam::engine == ConvolutionParameter_Engine_WINOGRAD) {
+      if (sizeof(Dtype) == sizeof(double)) {
+        return 1e-8;
+      }
+      return backward ? 1e-2 : 1e-3;
+    }
+    return 1e-4 * std::max(Dtype(10), static_cast<Dtype>(std::fabs(ref)));
+  }
+
+  void ExpectBlobsNear(const Dtype* data, const Dtype* ref, const int count,
+      const bool backward, const string& what) {
+    for (int i = 0; i < count; ++i) {
+      EXPECT_NEAR(data[i], ref[i], Tolerance(ref[i], backward))
+          << what << " " << i;
+    }
+  }
+
+  // Checks the forward pass and all gradients against the im2col
+  // convolution with the same weights.
+  void TestMatchesCaffe(const LayerParameter& layer_param) {
+    shared_ptr<Layer<Dtype> > layer = MakeLayer(layer_param);
+    layer->SetUp(blob_bottom_vec_, blob_top_vec_);
+    ConvolutionLayer<Dtype> ref_layer(layer_param);
+    ref_layer.SetUp(blob_bottom_vec_, ref_blob_top_vec_);
+    const vector<shared_ptr<Blob<Dtype> > >& blobs = layer->blobs();
+    for (int iter = 0; iter < 2; ++iter) {
+      // The second pass runs on changed weights, which must not be served
+      // from the cached transforms.
+      for (int i = 0; i < blobs.size(); ++i) {
+        if (iter > 0) {
+          caffe_scal(blobs[i]->count(), Dtype(-0.5),
+              blobs[i]->mutable_cpu_data());
+        }
+        ref_layer.blobs()[i]->CopyFrom(*blobs[i]);
+      }
+      layer->Forward(blob_bottom_vec_, blob_top_vec_);
+      ref_layer.Forward(blob_bottom_vec_, ref_blob_top_vec_);
+      ASSERT_EQ(blob_top_->count(), ref_blob_top_->count());
+      ExpectBlobsNear(blob_top_->cpu_data(), ref_blob_top_->cpu_data(),
+          blob_top_->count(), false, "top");
+      caffe_copy(blob_top_->count(), blob_top_->cpu_data(),
+          blob_top_->mutable_cpu_diff());
+      vector<bool> propagate_down(1, true);
+      layer->Backward(blob_top_vec_, propagate_down, blob_bottom_vec_);
+      vector<Dtype> bottom_diff(blob_bottom_->cpu_diff(),
+          blob_bottom_->cpu_diff() + blob_bottom_->count());
+      caffe_copy(blob_top_->count(), blob_top_->cpu_data(),
+          ref_blob_top_->mutable_cpu_diff());
+      ref_layer.Backward(ref_blob_top_vec_, propagate_down, blob_bottom_vec_);
+      ExpectBlobsNear(&bottom_diff[0], blob_bottom_->cpu_diff(),
+          blob_bottom_->count(), true, "bottom diff");
+      for (int i = 0; i < blobs.size(); ++i) {
+        ExpectBlobsNear(blobs[i]->cpu_diff(), ref_layer.blobs()[i]->cpu_diff(),
+            blobs[i]->count(), true, "param diff");
+      }
+    }
+  }
+
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_;
+  Blob<Dtype>* const ref_blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+  vector<Blob<Dtype>*> ref_blob_top_vec_;
+};
+
+TYPED_TEST_CASE(ConvolutionEngineTest, TestConvolutionEngines);
+
+TYPED_TEST(ConvolutionEngineTest, TestMatchesCaffe) {
+  // 3x3 filters of stride 1, which every engine supports; FFT ignores the
+  // Winograd tile.
+  for (int tile = 2; tile <= 4; tile += 2) {
+    for (int pad = 0; pad <= 2; ++pad) {
+      LayerParameter layer_param;
+      this->MakeLayerParameter(3, pad, 1, 1, &layer_param);
+      layer_param.mutable_convolution_param()->set_winograd_tile(tile);
+      this->TestMatchesCaffe(layer_param);
+    }
+    LayerParameter layer_param;
+    this->MakeLayerParameter(3, 1, 1, 2, &layer_param);
+    layer_param.mutable_convolution_param()->set_winograd_tile(tile);
+    this->TestMatchesCaffe(layer_param);
+  }
+}
+
+TYPED_TEST(ConvolutionEngineTest, TestGradient) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->blob_bottom_->Reshape(2, 4, 7, 9);
+  FillerParameter filler_param;
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  this->MakeLayerParameter(3, 1, 1, 2, &layer_param);
+  // The smaller Winograd tile rounds better, within the checker's step.
+  layer_param.mutable_convolution_param()->set_winograd_tile(2);
+  shared_ptr<Layer<Dtype> > layer = this->MakeLayer(layer_param);
+  GradientChecker<Dtype> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(layer.get(), this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+// Cases only the FFT engine supports: larger and strided kernels.
+template <typename Dtype>
+class FFTConvolutionLayerTest : public ConvolutionEngineTest<
+    ConvolutionEngine<Dtype, ConvolutionParameter_Engine_FFT> > {};
+
+TYPED_TEST_CASE(FFTConvolutionLayerTest, TestDtypes);
+
+TYPED_TEST(FFTConvolutionLayerTest, TestMatchesCaffe) {
+  LayerParameter layer_param;
+  this->MakeLayerParameter(5, 2, 1, 1, &layer_param);
+  this->TestMatchesCaffe(layer_param);
+  this->MakeLayerParameter(7, 3, 2, 2, &layer_param);
+  this->TestMatchesCaffe(layer_param);
+}
+
+TYPED_TEST(FFTConvolutionLayerTest, TestGradient) {
+  this->blob_bottom_->Reshape(2, 4, 6, 5);
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  LayerParameter layer_param;
+  this->MakeLayerParameter(3, 1, 2, 2, &layer_param);
+  shared_ptr<Layer<TypeParam> > layer = this->MakeLayer(layer_param);
+  GradientChecker<TypeParam> checker(1e-2, 1e-3);
+  checker.CheckGradientExhaustive(layer.get(), this->blob_bottom_vec_,
+      this->blob_top_vec_);
+}
+
+TYPED_TEST(FFTConvolutionLayerTest, TestDefaultEngine) {
+  // Only with fft_min_kernel_area set do large stride 1 kernels go to FFT on
+  // CPU; the others stay on im2col.
+  LayerParameter layer_param;
+  this->MakeLayerParameter(7, 3, 1, 1, &layer_param);
+  layer_param.mutable_convolution_param()->set_engine(
+      ConvolutionParameter_Engine_DEFAULT);
+  shared_ptr<Layer<TypeParam> > layer =
+      LayerRegistry<TypeParam>::CreateLayer(layer_param);
+  EXPECT_FALSE(dynamic_cast<FFTConvolutionLayer<TypeParam>*>(layer.get()));
+  layer_param.mutable_convolution_param()->set_fft_min_kernel_area(49);
+  layer = LayerRegistry<TypeParam>::CreateLayer(layer_param);
+  EXPECT_TRUE(dynamic_cast<FFTConvolutionLayer<TypeParam>*>(layer.get()));
+  layer_param.mutable_convolution_param()->set_stride(2);
+  layer = LayerRegistry<TypeParam>::CreateLayer(layer_param);
+  EXPECT_FALSE(dynamic_cast<FFTConvolutionLayer<TypeParam>*>(layer.get()));
+  this->MakeLayerParameter(5, 2, 1, 1, &layer_param);
+  layer_param.mutable_convolution_param()->set_engine(
+      ConvolutionParameter_Engine_DEFAULT);
+  layer = LayerRegistry<TypeParam>::CreateLayer(layer_param);
+  EXPECT_FALSE(dynamic_cast<FFTConvolutionLayer<TypeParam>*>(layer.get()));
+}
+
+TYPED_TEST(FFTConvolutionLayerTest, TestConvolutionSK) {
+  // Dilated kernels, compared with the im2col path of the same layer.
+  LayerParameter layer_param;
+  this->MakeLayerParameter(3, 0, 1, 2, &layer_param);
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kstride(2);
+  convolution_param->set_engine(ConvolutionParameter_Engine_FFT);
+  ConvolutionSKLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  convolution_param->set_engine(ConvolutionParameter_Engine_CAFFE);
+  ConvolutionSKLayer<TypeParam> ref_layer(layer_param);
+  ref_layer.SetUp(this->blob_bottom_vec_, this->ref_blob_top_vec_);
+  EXPECT_EQ(this->blob_top_->height(), 9);
+  EXPECT_EQ(this->blob_top_->width(), 7);
+  for (int i = 0; i < layer.blobs().size(); ++i) {
+    ref_layer.blobs()[i]->CopyFrom(*layer.blobs()[i]);
+  }
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  ref_layer.Forward(this->blob_bottom_vec_, this->ref_blob_top_vec_);
+  this->ExpectBlobsNear(this->blob_top_->cpu_data(),
+      this->ref_blob_top_->cpu_data(), this->blob_top_->count(), false,
+      "top");
+}
+
+TYPED_TEST(FFTConvolutionLayerTest, TestConvolutionSKReshape) {
+  // With stride 2, 13x11 and 14x12 inputs give the same 5x4 output, but
+  // need FFTs of their own.
+  LayerParameter layer_param;
+  this->MakeLayerParameter(3, 0, 2, 1, &layer_param);
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->set_kstride(2);
+  convolution_param->set_engine(ConvolutionParameter_Engine_FFT);
+  ConvolutionSKLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  convolution_param->set_engine(ConvolutionParameter_Engine_CAFFE);
+  ConvolutionSKLayer<TypeParam> ref_layer(layer_param);
+  ref_layer.SetUp(this->blob_bottom_vec_, this->ref_blob_top_vec_);
+  for (int i = 0; i < layer.blobs().size(); ++i) {
+    ref_layer.blobs()[i]->CopyFrom(*layer.blobs()[i]);
+  }
+  FillerParameter filler_param;
+  GaussianFiller<TypeParam> filler(filler_param);
+  for (int size = 0; size < 2; ++size) {
+    this->blob_bottom_->Reshape(2, 4, 13 + size, 11 + size);
+    filler.Fill(this->blob_bottom_);
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    ref_layer.Forward(this->blob_bottom_vec_, this->ref_blob_top_vec_);
+    EXPECT_EQ(this->blob_top_->height(), 5);
+    EXPECT_EQ(this->blob_top_->width(), 4);
+    this->ExpectBlobsNear(this->blob_top_->cpu_data(),
+        this->ref_blob_top_->cpu_data(), this->blob_top_->count(), false,
+        "top");
+  }
+}
+
 #ifdef USE_CUDNN
 
 template <typename Dtype>
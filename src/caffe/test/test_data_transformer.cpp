@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cmath>
 #include <string>
 #include <vector>
 
@@ -352,4 +354,347 @@ TYPED_TEST(DataTransformTest, TestMeanFile) {
   }
 }
 
+TYPED_TEST(DataTransformTest, TestCropMirrorMeanFileScale) {
+  // Row widths that are not a multiple of the SIMD block exercise both the
+  // vectorized body and the scalar tail of the row kernels.
+  TransformationParameter transform_param;
+  const bool unique_pixels = true;  // pixels are consecutive ints [0,size]
+  const int label = 0;
+  const int channels = 3;
+  const int height = 37;
+  const int width = 37;
+  const int crop_size = 33;
+  const int off = (height - crop_size) / 2;
+  const TypeParam scale = 0.5;
+  const int size = channels * height * width;
+
+  string* mean_file = new string();
+  MakeTempFilename(mean_file);
+  BlobProto blob_mean;
+  blob_mean.set_num(1);
+  blob_mean.set_channels(channels);
+  blob_mean.set_height(height);
+  blob_mean.set_width(width);
+  for (int j = 0; j < size; ++j) {
+    blob_mean.add_data(j % 7);
+  }
+  WriteProtoToBinaryFile(blob_mean, *mean_file);
+
+  transform_param.set_mean_file(*mean_file);
+  transform_param.set_crop_size(crop_size);
+  transform_param.set_mirror(true);
+  transform_param.set_scale(scale);
+  Datum datum;
+  FillDatum(label, channels, height, width, unique_pixels, &datum);
+  Blob<TypeParam>* blob =
+      new Blob<TypeParam>(1, channels, crop_size, crop_size);
+  DataTransformer<TypeParam>* transformer =
+      new DataTransformer<TypeParam>(transform_param, TEST);
+  transformer->InitRand();
+  int num_plain = 0;
+  int num_mirrored = 0;
+  for (int iter = 0; iter < 4; ++iter) {
+    transformer->Transform(datum, blob);
+    bool plain = true;
+    bool mirrored = true;
+    for (int c = 0; c < channels; ++c) {
+      for (int h = 0; h < crop_size; ++h) {
+        for (int w = 0; w < crop_size; ++w) {
+          const int data_index = (c * height + h + off) * width + w + off;
+          const TypeParam expected = (static_cast<TypeParam>(
+              static_cast<uint8_t>(data_index)) - data_index % 7) * scale;
+          const TypeParam* top = blob->cpu_data() + blob->offset(0, c, h);
+          plain &= (top[w] == expected);
+          mirrored &= (top[crop_size - 1 - w] == expected);
+        }
+      }
+    }
+    EXPECT_TRUE(plain || mirrored);
+    num_plain += plain;
+    num_mirrored += mirrored;
+  }
+  EXPECT_EQ(num_plain + num_mirrored, 4);
+}
+
+TYPED_TEST(DataTransformTest, TestMeanPerChannel) {
+  // A per-channel mean applies to inputs of any size.
+  TransformationParameter transform_param;
+  const bool unique_pixels = false;  // all pixels the same equal to label
+  const int label = 50;
+  const int channels = 3;
+  const int height = 4;
+  const int width = 5;
+  const int size = channels * height * width;
+
+  string* mean_file = new string();
+  MakeTempFilename(mean_file);
+  BlobProto blob_mean;
+  blob_mean.set_num(1);
+  blob_mean.set_channels(channels);
+  blob_mean.set_height(height);
+  blob_mean.set_width(width);
+  for (int j = 0; j < size; ++j) {
+    const int c = j / (height * width);
+    blob_mean.add_data(c * 10 + (j % 2 ? 1 : -1));
+  }
+  WriteProtoToBinaryFile(blob_mean, *mean_file);
+
+  transform_param.set_mean_file(*mean_file);
+  transform_param.set_mean_per_channel(true);
+  Datum datum;
+  FillDatum(label, channels, 6, 7, unique_pixels, &datum);
+  Blob<TypeParam>* blob = new Blob<TypeParam>(1, channels, 6, 7);
+  DataTransformer<TypeParam>* transformer =
+      new DataTransformer<TypeParam>(transform_param, TEST);
+  transformer->InitRand();
+  transformer->Transform(datum, blob);
+  for (int c = 0; c < channels; ++c) {
+    for (int j = 0; j < 6 * 7; ++j) {
+      EXPECT_EQ(blob->cpu_data()[blob->offset(0, c) + j], label - c * 10);
+    }
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestResizeMean) {
+  TransformationParameter transform_param;
+  const bool unique_pixels = true;  // pixels are consecutive ints [0,size]
+  const int label = 0;
+  const int channels = 3;
+  const int height = 8;
+  const int width = 10;
+  const int crop_size = 6;
+  const int off_h = (height - crop_size) / 2;
+  const int off_w = (width - crop_size) / 2;
+
+  // A mean file of half the input size, constant in each channel.
+  string* mean_file = new string();
+  MakeTempFilename(mean_file);
+  BlobProto blob_mean;
+  blob_mean.set_num(1);
+  blob_mean.set_channels(channels);
+  blob_mean.set_height(height / 2);
+  blob_mean.set_width(width / 2);
+  for (int j = 0; j < channels * height * width / 4; ++j) {
+    blob_mean.add_data(j / (height * width / 4) + 1);
+  }
+  WriteProtoToBinaryFile(blob_mean, *mean_file);
+
+  transform_param.set_mean_file(*mean_file);
+  transform_param.set_resize_mean(true);
+  transform_param.set_crop_size(crop_size);
+  Datum datum;
+  FillDatum(label, channels, height, width, unique_pixels, &datum);
+  Blob<TypeParam>* blob =
+      new Blob<TypeParam>(1, channels, crop_size, crop_size);
+  DataTransformer<TypeParam>* transformer =
+      new DataTransformer<TypeParam>(transform_param, TEST);
+  transformer->InitRand();
+  // The second pass reuses the resized mean and the cached tile.
+  for (int iter = 0; iter < 2; ++iter) {
+    transformer->Transform(datum, blob);
+    for (int c = 0; c < channels; ++c) {
+      for (int h = 0; h < crop_size; ++h) {
+        for (int w = 0; w < crop_size; ++w) {
+          const int data_index =
+              (c * height + h + off_h) * width + w + off_w;
+          EXPECT_NEAR(blob->data_at(0, c, h, w),
+              static_cast<uint8_t>(data_index) - (c + 1), 1e-5);
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestBlobCropMeanFile) {
+  // Blob inputs are cropped before the mean is subtracted and are left
+  // unchanged.
+  TransformationParameter transform_param;
+  const int channels = 2;
+  const int height = 6;
+  const int width = 6;
+  const int crop_size = 4;
+  const int off = (height - crop_size) / 2;
+  const int size = channels * height * width;
+
+  string* mean_file = new string();
+  MakeTempFilename(mean_file);
+  BlobProto blob_mean;
+  blob_mean.set_num(1);
+  blob_mean.set_channels(channels);
+  blob_mean.set_height(height);
+  blob_mean.set_width(width);
+  for (int j = 0; j < size; ++j) {
+    blob_mean.add_data(j % 5);
+  }
+  WriteProtoToBinaryFile(blob_mean, *mean_file);
+
+  transform_param.set_mean_file(*mean_file);
+  transform_param.set_crop_size(crop_size);
+  Blob<TypeParam>* input = new Blob<TypeParam>(2, channels, height, width);
+  for (int j = 0; j < input->count(); ++j) {
+    input->mutable_cpu_data()[j] = j;
+  }
+  Blob<TypeParam>* blob =
+      new Blob<TypeParam>(2, channels, crop_size, crop_size);
+  DataTransformer<TypeParam>* transformer =
+      new DataTransformer<TypeParam>(transform_param, TEST);
+  transformer->InitRand();
+  transformer->Transform(input, blob);
+  for (int n = 0; n < 2; ++n) {
+    for (int c = 0; c < channels; ++c) {
+      for (int h = 0; h < crop_size; ++h) {
+        for (int w = 0; w < crop_size; ++w) {
+          const int mean_index = (c * height + h + off) * width + w + off;
+          EXPECT_EQ(blob->data_at(n, c, h, w),
+              input->data_at(n, c, h + off, w + off) - mean_index % 5);
+        }
+      }
+    }
+  }
+  for (int j = 0; j < input->count(); ++j) {
+    EXPECT_EQ(input->cpu_data()[j], j);
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestAugmentationIdentity) {
+  // An augmentation block with default ranges must not change the output.
+  TransformationParameter transform_param;
+  const bool unique_pixels = true;
+  const int label = 0;
+  const int channels = 3;
+  const int height = 5;
+  const int width = 7;
+  transform_param.add_mean_value(10);
+  transform_param.set_scale(0.5);
+  Datum datum;
+  FillDatum(label, channels, height, width, unique_pixels, &datum);
+  Blob<TypeParam> expected(1, channels, height, width);
+  DataTransformer<TypeParam> transformer(transform_param, TRAIN);
+  transformer.InitRand();
+  transformer.Transform(datum, &expected);
+
+  transform_param.mutable_augmentation()->set_seed(1701);
+  Blob<TypeParam> blob(1, channels, height, width);
+  DataTransformer<TypeParam> augmenter(transform_param, TRAIN);
+  augmenter.InitRand();
+  augmenter.Transform(datum, &blob);
+  for (int j = 0; j < blob.count(); ++j) {
+    EXPECT_EQ(blob.cpu_data()[j], expected.cpu_data()[j]);
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestAugmentationReproducible) {
+  TransformationParameter transform_param;
+  const bool unique_pixels = true;
+  const int label = 0;
+  const int channels = 3;
+  const int height = 9;
+  const int width = 9;
+  transform_param.set_mirror(true);
+  transform_param.set_crop_size(7);
+  AugmentationParameter* aug_param = transform_param.mutable_augmentation();
+  aug_param->set_brightness(20);
+  aug_param->set_contrast(0.2);
+  aug_param->set_gamma(0.3);
+  aug_param->set_max_rotation(10);
+  aug_param->set_min_scale(0.8);
+  aug_param->set_max_scale(1.2);
+  aug_param->set_seed(1701);
+  Datum datum;
+  FillDatum(label, channels, height, width, unique_pixels, &datum);
+  DataTransformer<TypeParam> transformer(transform_param, TRAIN);
+  DataTransformer<TypeParam> same_seed(transform_param, TRAIN);
+  aug_param->set_seed(1702);
+  DataTransformer<TypeParam> other_seed(transform_param, TRAIN);
+  Blob<TypeParam> blob(1, channels, 7, 7);
+  Blob<TypeParam> same_blob(1, channels, 7, 7);
+  Blob<TypeParam> other_blob(1, channels, 7, 7);
+  int num_same = 0;
+  int num_other = 0;
+  for (int iter = 0; iter < this->num_iter_; ++iter) {
+    transformer.Transform(datum, &blob);
+    same_seed.Transform(datum, &same_blob);
+    other_seed.Transform(datum, &other_blob);
+    for (int j = 0; j < blob.count(); ++j) {
+      num_same += (blob.cpu_data()[j] == same_blob.cpu_data()[j]);
+      num_other += (blob.cpu_data()[j] == other_blob.cpu_data()[j]);
+    }
+  }
+  EXPECT_EQ(num_same, this->num_iter_ * blob.count());
+  EXPECT_LT(num_other, this->num_iter_ * blob.count());
+}
+
+TYPED_TEST(DataTransformTest, TestAugmentationPhotometric) {
+  TransformationParameter transform_param;
+  const bool unique_pixels = true;
+  const int label = 0;
+  const int channels = 1;
+  const int height = 4;
+  const int width = 5;
+  Datum datum;
+  FillDatum(label, channels, height, width, unique_pixels, &datum);
+  // Pixels 118..137 around the contrast center 128, so nothing clamps.
+  std::string* data = datum.mutable_data();
+  for (int j = 0; j < data->size(); ++j) {
+    (*data)[j] = static_cast<char>(118 + j);
+  }
+  Blob<TypeParam> blob(1, channels, height, width);
+  DataTransformer<TypeParam> transformer(transform_param, TRAIN);
+  transformer.InitRand();
+  Augmentation aug;
+  aug.brightness = 10;
+  aug.contrast = 2;
+  transformer.Transform(datum, aug, &blob);
+  for (int j = 0; j < blob.count(); ++j) {
+    EXPECT_NEAR(blob.cpu_data()[j], 2 * (118 + j - 128) + 128 + 10, 1e-3);
+  }
+  aug.brightness = -20;
+  aug.contrast = 1;
+  aug.gamma = 2;
+  transformer.Transform(datum, aug, &blob);
+  for (int j = 0; j < blob.count(); ++j) {
+    const float expected = 255 * std::pow((118 + j - 20) / 255.f, 2.f);
+    EXPECT_NEAR(blob.cpu_data()[j], expected, 1e-3);
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestAugmentationSharedGeometry) {
+  // Rotating by 180 degrees equals flipping both axes, and the label map
+  // (float data, no photometric ops) sees the same geometry as the data.
+  TransformationParameter transform_param;
+  const bool unique_pixels = true;
+  const int label = 0;
+  const int channels = 2;
+  const int height = 5;
+  const int width = 6;
+  Datum datum;
+  FillDatum(label, channels, height, width, unique_pixels, &datum);
+  Datum label_map;
+  label_map.set_channels(channels);
+  label_map.set_height(height);
+  label_map.set_width(width);
+  for (int j = 0; j < channels * height * width; ++j) {
+    label_map.add_float_data(j);
+  }
+  Blob<TypeParam> blob(1, channels, height, width);
+  Blob<TypeParam> label_blob(1, channels, height, width);
+  DataTransformer<TypeParam> transformer(transform_param, TRAIN);
+  transformer.InitRand();
+  Augmentation aug;
+  aug.angle = 180;
+  aug.mirror = true;
+  transformer.Transform(datum, aug, &blob);
+  transformer.Transform(label_map, aug, &label_blob);
+  for (int c = 0; c < channels; ++c) {
+    for (int h = 0; h < height; ++h) {
+      for (int w = 0; w < width; ++w) {
+        // Mirror undoes the horizontal flip of the rotation.
+        const int expected = (c * height + height - 1 - h) * width + w;
+        EXPECT_NEAR(blob.data_at(0, c, h, w), expected, 1e-3);
+        EXPECT_NEAR(label_blob.data_at(0, c, h, w), expected, 1e-3);
+      }
+    }
+  }
+}
+
 }  // namespace caffe
@@ -131,4 +131,35 @@ TYPED_TEST(DBTest, TestWrite) {
   txn->Commit();
 }
 
+TEST(LMDBTest, TestMapGrowth) {
+  string source;
+  MakeTempDir(&source);
+  source += "/db";
+  // 4 MB of values into a 1 MB map, which has to double a few times.
+  const int num_values = 64;
+  const string value(1 << 16, 'x');
+  {
+    db::LMDB lmdb;
+    lmdb.set_map_size(1 << 20);
+    lmdb.set_grow_map(true);
+    lmdb.Open(source, db::NEW);
+    scoped_ptr<db::Transaction> txn(lmdb.NewTransaction());
+    for (int i = 0; i < num_values; ++i) {
+      char key[16];
+      snprintf(key, sizeof(key), "%08d", i);
+      txn->Put(key, value);
+    }
+    txn->Commit();
+  }
+  db::LMDB lmdb;
+  lmdb.Open(source, db::READ);
+  scoped_ptr<db::Cursor> cursor(lmdb.NewCursor());
+  int count = 0;
+  for (; cursor->valid(); cursor->Next()) {
+    EXPECT_EQ(cursor->value(), value);
+    ++count;
+  }
+  EXPECT_EQ(count, num_values);
+}
+
 }  // namespace caffe
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cmath>
 #include <string>
 #include <vector>
 
@@ -117,4 +119,68 @@ TYPED_TEST(HDF5OutputLayerTest, TestForward) {
       this->output_file_name_;
 }
 
+TYPED_TEST(HDF5OutputLayerTest, TestAppendFloat16) {
+  typedef typename TypeParam::Dtype Dtype;
+  hid_t file_id = H5Fopen(this->input_file_name_.c_str(), H5F_ACC_RDONLY,
+                          H5P_DEFAULT);
+  ASSERT_GE(file_id, 0) << "Failed to open HDF5 file" <<
+      this->input_file_name_;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_DATASET_NAME, 0, 4,
+                       this->blob_data_);
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_LABEL_NAME, 0, 4,
+                       this->blob_label_);
+  EXPECT_GE(H5Fclose(file_id), 0);
+  this->blob_bottom_vec_.push_back(this->blob_data_);
+  this->blob_bottom_vec_.push_back(this->blob_label_);
+
+  // Append three batches through a queue of two, in compressed float16
+  // chunks that do not align with the batches.
+  const int num_batches = 3;
+  LayerParameter param;
+  HDF5OutputParameter* hdf5_output_param =
+      param.mutable_hdf5_output_param();
+  hdf5_output_param->set_file_name(this->output_file_name_);
+  hdf5_output_param->set_chunk_rows(3);
+  hdf5_output_param->set_compression(6);
+  hdf5_output_param->set_float16(true);
+  hdf5_output_param->set_queue_size(2);
+  {
+    HDF5OutputLayer<Dtype> layer(param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int i = 0; i < num_batches; ++i) {
+      layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    }
+  }
+  file_id = H5Fopen(this->output_file_name_.c_str(), H5F_ACC_RDONLY,
+                    H5P_DEFAULT);
+  ASSERT_GE(file_id, 0) << "Failed to open HDF5 file" <<
+      this->output_file_name_;
+  size_t type_size;
+  H5T_class_t type_class;
+  hsize_t dims[4];
+  EXPECT_GE(H5LTget_dataset_info(file_id, HDF5_DATA_DATASET_NAME, dims,
+      &type_class, &type_size), 0);
+  EXPECT_EQ(type_class, H5T_FLOAT);
+  EXPECT_EQ(type_size, 2);
+
+  Blob<Dtype> blob_data;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_DATASET_NAME, 0, 4, &blob_data);
+  Blob<Dtype> blob_label;
+  hdf5_load_nd_dataset(file_id, HDF5_DATA_LABEL_NAME, 0, 4, &blob_label);
+  EXPECT_GE(H5Fclose(file_id), 0);
+  ASSERT_EQ(blob_data.count(), num_batches * this->blob_data_->count());
+  ASSERT_EQ(blob_label.count(), num_batches * this->blob_label_->count());
+  EXPECT_EQ(blob_data.num(), num_batches * this->blob_data_->num());
+  for (int i = 0; i < blob_data.count(); ++i) {
+    const Dtype expected =
+        this->blob_data_->cpu_data()[i % this->blob_data_->count()];
+    EXPECT_NEAR(expected, blob_data.cpu_data()[i],
+        1e-3 * std::max(Dtype(1), std::abs(expected)));
+  }
+  for (int i = 0; i < blob_label.count(); ++i) {
+    EXPECT_EQ(this->blob_label_->cpu_data()[i % this->blob_label_->count()],
+        blob_label.cpu_data()[i]);
+  }
+}
+
 }  // namespace caffe
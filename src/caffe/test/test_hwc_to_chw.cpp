@@ -0,0 +1,51 @@
+#include <stdint.h>
+
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/hwc_to_chw.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class HWCToCHWTest : public ::testing::Test {
+ protected:
+  // Checks hwc_to_chw against the naive loop on a random image whose rows
+  // are padded by a few bytes, as in a cv::Mat ROI.
+  void TestShape(const int channels, const int height, const int width) {
+    const size_t row_step = width * channels + 5;
+    vector<uint8_t> hwc(height * row_step);
+    for (int i = 0; i < hwc.size(); ++i) {
+      hwc[i] = static_cast<uint8_t>((i * 131 + 7) % 256);
+    }
+    vector<Dtype> chw(channels * height * width);
+    hwc_to_chw(&hwc[0], channels, height, width, row_step, &chw[0]);
+    for (int c = 0; c < channels; ++c) {
+      for (int h = 0; h < height; ++h) {
+        for (int w = 0; w < width; ++w) {
+          EXPECT_EQ(chw[(c * height + h) * width + w],
+              static_cast<Dtype>(hwc[h * row_step + w * channels + c]));
+        }
+      }
+    }
+  }
+};
+
+typedef ::testing::Types<uint8_t, float, double> PixelTypes;
+TYPED_TEST_CASE(HWCToCHWTest, PixelTypes);
+
+TYPED_TEST(HWCToCHWTest, TestChannels) {
+  // Widths below, at and past the 16 pixel SIMD blocks, with tails.
+  const int widths[] = { 1, 15, 16, 37 };
+  for (int channels = 1; channels <= 5; ++channels) {
+    for (int i = 0; i < 4; ++i) {
+      this->TestShape(channels, 3, widths[i]);
+    }
+  }
+}
+
+}  // namespace caffe
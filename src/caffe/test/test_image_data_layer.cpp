@@ -142,6 +142,43 @@ TYPED_TEST(ImageDataLayerTest, TestReshape) {
   EXPECT_EQ(this->blob_top_data_->width(), 481);
 }
 
+TYPED_TEST(ImageDataLayerTest, TestParallelDecodeCache) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  ImageDataParameter* image_data_param = param.mutable_image_data_param();
+  image_data_param->set_batch_size(5);
+  image_data_param->set_source(this->filename_.c_str());
+  image_data_param->set_new_height(64);
+  image_data_param->set_new_width(80);
+  image_data_param->set_shuffle(false);
+  image_data_param->set_decode_threads(3);
+  image_data_param->set_reduced_decode(true);
+  image_data_param->set_cache_bytes(1 << 20);
+  ImageDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(this->blob_top_data_->num(), 5);
+  EXPECT_EQ(this->blob_top_data_->channels(), 3);
+  EXPECT_EQ(this->blob_top_data_->height(), 64);
+  EXPECT_EQ(this->blob_top_data_->width(), 80);
+  // The first pass decodes and caches the image, the second is served from
+  // the cache and must be identical.
+  vector<Dtype> first_pass;
+  for (int iter = 0; iter < 2; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int i = 0; i < 5; ++i) {
+      EXPECT_EQ(i, this->blob_top_label_->cpu_data()[i]);
+    }
+    const Dtype* data = this->blob_top_data_->cpu_data();
+    if (iter == 0) {
+      first_pass.assign(data, data + this->blob_top_data_->count());
+    } else {
+      for (int j = 0; j < this->blob_top_data_->count(); ++j) {
+        EXPECT_EQ(first_pass[j], data[j]);
+      }
+    }
+  }
+}
+
 TYPED_TEST(ImageDataLayerTest, TestShuffle) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter param;
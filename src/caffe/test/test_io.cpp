@@ -3,6 +3,8 @@
 #include <opencv2/highgui/highgui_c.h>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <cstdio>
+#include <fstream>  // NOLINT(readability/streams)
 #include <string>
 
 #include "gtest/gtest.h"
@@ -285,6 +287,26 @@ TEST_F(IOTest, TestReadFileToDatum) {
   EXPECT_EQ(datum.data().size(), 140391);
 }
 
+TEST_F(IOTest, TestReadImageToDatumEncodedGray) {
+  string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
+  Datum datum;
+  EXPECT_TRUE(ReadImageToDatum(filename, 0, 0, 0, false, "jpg", &datum));
+  EXPECT_TRUE(datum.encoded());
+  EXPECT_EQ(DecodeDatumToCVMatNative(datum).channels(), 1);
+}
+
+TEST_F(IOTest, TestReadImageToDatumEncodedUnreadable) {
+  string filename;
+  MakeTempFilename(&filename);
+  filename += ".jpg";
+  std::ofstream file(filename.c_str());
+  file << "not a jpeg";
+  file.close();
+  Datum datum;
+  EXPECT_FALSE(ReadImageToDatum(filename, 0, 0, 0, true, "jpg", &datum));
+  std::remove(filename.c_str());
+}
+
 TEST_F(IOTest, TestDecodeDatum) {
   string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
   Datum datum;
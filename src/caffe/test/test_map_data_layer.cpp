@@ -168,6 +168,82 @@ class MapDataLayerTest : public MultiDeviceTest<TypeParam> {
     }
   }
 
+  // Fill the LevelDB with records alternating between two shapes; record i
+  // holds the value i in its data and label maps.
+  void FillMixedLevelDB() {
+    backend_ = DataParameter_DB_LEVELDB;
+    leveldb::DB* db;
+    leveldb::Options options;
+    options.error_if_exists = true;
+    options.create_if_missing = true;
+    leveldb::Status status =
+        leveldb::DB::Open(options, filename_->c_str(), &db);
+    CHECK(status.ok());
+    for (int i = 0; i < 6; ++i) {
+      const int height = i % 2 ? 5 : 3;
+      const int width = i % 2 ? 2 : 4;
+      BlobProtoVector sample;
+      BlobProto* dataMap = sample.add_blobs();
+      dataMap->set_channels(2);
+      dataMap->set_height(height);
+      dataMap->set_width(width);
+      for (int j = 0; j < 2 * height * width; ++j) {
+        dataMap->add_data(i);
+      }
+      BlobProto* labelMap = sample.add_blobs();
+      labelMap->set_channels(1);
+      labelMap->set_height(height);
+      labelMap->set_width(width);
+      for (int j = 0; j < height * width; ++j) {
+        labelMap->add_data(i);
+      }
+      stringstream ss;
+      ss << i;
+      db->Put(leveldb::WriteOptions(), ss.str(), sample.SerializeAsString());
+    }
+    delete db;
+  }
+
+  void TestReadBucketed() {
+    LayerParameter param;
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(3);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_bucket_by_shape(true);
+
+    MapDataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    // Records 0, 2, 4 have one shape, 1, 3, 5 the other; the even ones fill
+    // their bucket first in every pass.
+    for (int iter = 0; iter < 6; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      const int parity = iter % 2;
+      EXPECT_EQ(blob_top_data_->num(), 3);
+      EXPECT_EQ(blob_top_data_->channels(), 2);
+      EXPECT_EQ(blob_top_data_->height(), parity ? 5 : 3);
+      EXPECT_EQ(blob_top_data_->width(), parity ? 2 : 4);
+      EXPECT_EQ(blob_top_label_->num(), 3);
+      EXPECT_EQ(blob_top_label_->channels(), 1);
+      EXPECT_EQ(blob_top_label_->height(), parity ? 5 : 3);
+      EXPECT_EQ(blob_top_label_->width(), parity ? 2 : 4);
+      const int data_dim = blob_top_data_->count() / 3;
+      const int label_dim = blob_top_label_->count() / 3;
+      for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < data_dim; ++j) {
+          EXPECT_EQ(2 * i + parity,
+              blob_top_data_->cpu_data()[i * data_dim + j])
+              << "debug: iter " << iter << " i " << i << " j " << j;
+        }
+        for (int j = 0; j < label_dim; ++j) {
+          EXPECT_EQ(2 * i + parity,
+              blob_top_label_->cpu_data()[i * label_dim + j])
+              << "debug: iter " << iter << " i " << i << " j " << j;
+        }
+      }
+    }
+  }
+
   virtual ~MapDataLayerTest() { delete blob_top_data_; delete blob_top_label_; }
 
   DataParameter_DB backend_;
@@ -193,5 +269,9 @@ TYPED_TEST(MapDataLayerTest, TestReadLMDB) {
   this->TestRead();
 }
 
+TYPED_TEST(MapDataLayerTest, TestReadBucketedLevelDB) {
+  this->FillMixedLevelDB();
+  this->TestReadBucketed();
+}
 
 }  // namespace caffe
@@ -1,3 +1,4 @@
+#include <boost/thread.hpp>
 #include <opencv2/core/core.hpp>
 
 #include <string>
@@ -293,4 +294,176 @@ TYPED_TEST(MemoryDataLayerTest, TestSetBatchSize) {
   }
 }
 
+template <typename Dtype>
+void PushMats(MemoryDataLayer<Dtype>* layer, const vector<cv::Mat>* mats,
+    const vector<Dtype>* labels) {
+  for (int i = 0; i < mats->size(); ++i) {
+    layer->Push((*mats)[i], &(*labels)[i * layer->label_size()]);
+  }
+}
+
+TYPED_TEST(MemoryDataLayerTest, TestRing) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  MemoryDataParameter* memory_data_param = param.mutable_memory_data_param();
+  memory_data_param->set_batch_size(this->batch_size_);
+  memory_data_param->set_channels(this->channels_);
+  memory_data_param->set_height(this->height_);
+  memory_data_param->set_width(this->width_);
+  memory_data_param->mutable_label_shape()->add_dim(2);
+  memory_data_param->mutable_label_shape()->add_dim(3);
+  memory_data_param->set_ring_size(2 * this->batch_size_);
+  memory_data_param->set_transform_threads(3);
+  param.mutable_transform_param()->set_scale(0.5);
+  MemoryDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  EXPECT_EQ(layer.label_size(), 6);
+  EXPECT_EQ(this->label_blob_->num_axes(), 3);
+  EXPECT_EQ(this->label_blob_->shape(2), 3);
+
+  // A producer thread pushes more samples than the ring holds, so it waits
+  // for Forward to free slots.
+  const int num = this->batch_size_ * this->batches_;
+  vector<cv::Mat> mat_vector(num);
+  vector<Dtype> labels(num * 6);
+  for (int i = 0; i < num; ++i) {
+    mat_vector[i] = cv::Mat(this->height_, this->width_, CV_8UC4);
+    cv::randu(mat_vector[i], cv::Scalar::all(0), cv::Scalar::all(255));
+    for (int j = 0; j < 6; ++j) {
+      labels[i * 6 + j] = i * 6 + j;
+    }
+  }
+  boost::thread producer(&PushMats<Dtype>, &layer, &mat_vector, &labels);
+
+  const int count = this->channels_ * this->height_ * this->width_;
+  for (int iter = 0; iter < this->batches_; ++iter) {
+    const int offset = this->batch_size_ * iter;
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    EXPECT_EQ(this->label_blob_->count(), this->batch_size_ * 6);
+    for (int i = 0; i < this->batch_size_ * 6; ++i) {
+      EXPECT_EQ(offset * 6 + i, this->label_blob_->cpu_data()[i]);
+    }
+    const Dtype* data = this->data_blob_->cpu_data();
+    for (int i = 0; i < this->batch_size_; ++i) {
+      for (int h = 0; h < this->height_; ++h) {
+        const unsigned char* ptr_mat = mat_vector[offset + i].ptr<uchar>(h);
+        int index = 0;
+        for (int w = 0; w < this->width_; ++w) {
+          for (int c = 0; c < this->channels_; ++c) {
+            const int data_index =
+                (i * count) + (c * this->height_ + h) * this->width_ + w;
+            EXPECT_EQ(Dtype(0.5) * ptr_mat[index++], data[data_index]);
+          }
+        }
+      }
+    }
+  }
+  producer.join();
+}
+
+template <typename Dtype>
+void PushDatums(MemoryDataLayer<Dtype>* layer, const vector<Datum>* datums,
+    const vector<Dtype>* labels) {
+  for (int i = 0; i < datums->size(); ++i) {
+    layer->Push((*datums)[i], &(*labels)[i * layer->label_size()]);
+  }
+}
+
+// Pushes the datums until the layer refuses one, counting them in *pushed.
+template <typename Dtype>
+void PushDatumsCounted(MemoryDataLayer<Dtype>* layer,
+    const vector<Datum>* datums, const vector<Dtype>* labels, int* pushed) {
+  *pushed = 0;
+  const int label_size = layer->label_size();
+  for (int i = 0; i < datums->size(); ++i) {
+    if (!layer->Push((*datums)[i], &(*labels)[i * label_size])) {
+      return;
+    }
+    ++*pushed;
+  }
+}
+
+TYPED_TEST(MemoryDataLayerTest, TestRingTransformThreads) {
+  // Each sample is mirrored or not depending on its index alone, so the
+  // batches do not depend on the number of workers nor on their timing.
+  typedef typename TypeParam::Dtype Dtype;
+  const int num = this->batch_size_ * this->batches_;
+  vector<Datum> datum_vector(num);
+  vector<Dtype> labels(num);
+  for (int i = 0; i < num; ++i) {
+    Datum& datum = datum_vector[i];
+    datum.set_channels(this->channels_);
+    datum.set_height(this->height_);
+    datum.set_width(this->width_);
+    string* data = datum.mutable_data();
+    for (int j = 0; j < this->channels_ * this->height_ * this->width_; ++j) {
+      data->push_back(static_cast<char>((i + j) % 256));
+    }
+    labels[i] = i;
+  }
+  vector<vector<Dtype> > data(2);
+  for (int run = 0; run < 2; ++run) {
+    LayerParameter param;
+    MemoryDataParameter* memory_data_param =
+        param.mutable_memory_data_param();
+    memory_data_param->set_batch_size(this->batch_size_);
+    memory_data_param->set_channels(this->channels_);
+    memory_data_param->set_height(this->height_);
+    memory_data_param->set_width(this->width_);
+    memory_data_param->set_ring_size(2 * this->batch_size_);
+    memory_data_param->set_transform_threads(run == 0 ? 1 : 3);
+    param.mutable_transform_param()->set_mirror(true);
+    Caffe::set_random_seed(1701);
+    MemoryDataLayer<Dtype> layer(param);
+    layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+    boost::thread producer(&PushDatums<Dtype>, &layer, &datum_vector,
+        &labels);
+    for (int iter = 0; iter < this->batches_; ++iter) {
+      layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+      data[run].insert(data[run].end(), this->data_blob_->cpu_data(),
+          this->data_blob_->cpu_data() + this->data_blob_->count());
+    }
+    producer.join();
+  }
+  ASSERT_EQ(data[0].size(), data[1].size());
+  for (int i = 0; i < data[0].size(); ++i) {
+    EXPECT_EQ(data[0][i], data[1][i]);
+  }
+}
+
+TYPED_TEST(MemoryDataLayerTest, TestRingDestroyWithBlockedProducer) {
+  // A producer waiting for a free slot when the layer is destroyed gets
+  // false from Push instead of waiting forever.
+  typedef typename TypeParam::Dtype Dtype;
+  const int ring_size = 2 * this->batch_size_;
+  const int num = ring_size + this->batch_size_;
+  Datum datum;
+  datum.set_channels(this->channels_);
+  datum.set_height(this->height_);
+  datum.set_width(this->width_);
+  datum.mutable_data()->assign(
+      this->channels_ * this->height_ * this->width_, 1);
+  vector<Datum> datum_vector(num, datum);
+  vector<Dtype> labels(num, 0);
+  LayerParameter param;
+  MemoryDataParameter* memory_data_param = param.mutable_memory_data_param();
+  memory_data_param->set_batch_size(this->batch_size_);
+  memory_data_param->set_channels(this->channels_);
+  memory_data_param->set_height(this->height_);
+  memory_data_param->set_width(this->width_);
+  memory_data_param->set_ring_size(ring_size);
+  memory_data_param->set_transform_threads(2);
+  shared_ptr<MemoryDataLayer<Dtype> > layer(
+      new MemoryDataLayer<Dtype>(param));
+  layer->SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  int pushed = 0;
+  boost::thread producer(&PushDatumsCounted<Dtype>, layer.get(),
+      &datum_vector, &labels, &pushed);
+  // Give the producer time to fill the ring and wait for a slot.
+  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  layer.reset();
+  producer.join();
+  EXPECT_EQ(pushed, ring_size);
+}
+
 }  // namespace caffe
@@ -7,6 +7,7 @@
 #include "gtest/gtest.h"
 
 #include "caffe/common.hpp"
+#include "caffe/data_layers.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/net.hpp"
 #include "caffe/util/math_functions.hpp"
@@ -551,8 +552,9 @@ class NetTest : public MultiDeviceTest<TypeParam> {
     InitNetFromProtoString(proto);
   }
 
-  virtual void InitReshapableNet() {
-    const string& proto =
+  virtual void InitReshapableNet(const bool inference = false) {
+    const string proto =
+        string(inference ? "state { inference: true } " : "") +
         "name: 'ReshapableNetwork' "
         "input: 'data' "
         "input_dim: 1 "
@@ -613,6 +615,100 @@ class NetTest : public MultiDeviceTest<TypeParam> {
     InitNetFromProtoString(proto);
   }
 
+  virtual void InitCheckpointedNet(const string& checkpoint) {
+    const string proto = checkpoint +
+        "state { phase: TRAIN } "
+        "name: 'CheckpointedNetwork' "
+        "input: 'data' "
+        "input_dim: 2 "
+        "input_dim: 3 "
+        "input_dim: 12 "
+        "input_dim: 12 "
+        "input: 'target' "
+        "input_dim: 2 "
+        "input_dim: 4 "
+        "input_dim: 1 "
+        "input_dim: 1 "
+        "layer { "
+        "  name: 'conv1' "
+        "  type: 'Convolution' "
+        "  bottom: 'data' "
+        "  top: 'conv1' "
+        "  convolution_param { "
+        "    num_output: 4 "
+        "    kernel_size: 3 "
+        "    weight_filler { "
+        "      type: 'gaussian' "
+        "      std: 0.1 "
+        "    } "
+        "  } "
+        "} "
+        "layer { "
+        "  name: 'relu1' "
+        "  type: 'ReLU' "
+        "  bottom: 'conv1' "
+        "  top: 'conv1' "
+        "} "
+        "layer { "
+        "  name: 'drop1' "
+        "  type: 'Dropout' "
+        "  bottom: 'conv1' "
+        "  top: 'conv1' "
+        "} "
+        "layer { "
+        "  name: 'pool1' "
+        "  type: 'Pooling' "
+        "  bottom: 'conv1' "
+        "  top: 'pool1' "
+        "  pooling_param { "
+        "    pool: MAX "
+        "    kernel_size: 2 "
+        "    stride: 2 "
+        "  } "
+        "} "
+        "layer { "
+        "  name: 'conv2' "
+        "  type: 'Convolution' "
+        "  bottom: 'pool1' "
+        "  top: 'conv2' "
+        "  convolution_param { "
+        "    num_output: 4 "
+        "    kernel_size: 3 "
+        "    weight_filler { "
+        "      type: 'gaussian' "
+        "      std: 0.1 "
+        "    } "
+        "  } "
+        "} "
+        "layer { "
+        "  name: 'relu2' "
+        "  type: 'ReLU' "
+        "  bottom: 'conv2' "
+        "  top: 'conv2' "
+        "} "
+        "layer { "
+        "  name: 'ip' "
+        "  type: 'InnerProduct' "
+        "  bottom: 'conv2' "
+        "  top: 'ip' "
+        "  inner_product_param { "
+        "    num_output: 4 "
+        "    weight_filler { "
+        "      type: 'gaussian' "
+        "      std: 0.1 "
+        "    } "
+        "  } "
+        "} "
+        "layer { "
+        "  name: 'loss' "
+        "  type: 'EuclideanLoss' "
+        "  bottom: 'ip' "
+        "  bottom: 'target' "
+        "  top: 'loss' "
+        "} ";
+    InitNetFromProtoString(proto);
+  }
+
   int seed_;
   shared_ptr<Net<Dtype> > net_;
 };
@@ -2224,4 +2320,208 @@ TYPED_TEST(NetTest, TestReshape) {
   }
 }
 
+TYPED_TEST(NetTest, TestInference) {
+  typedef typename TypeParam::Dtype Dtype;
+  // An inference net computes the same outputs as the plain net without
+  // allocating any diff.
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> input(1, 3, 100, 100);
+  filler.Fill(&input);
+  Caffe::set_random_seed(this->seed_);
+  this->InitReshapableNet();
+  EXPECT_FALSE(this->net_->inference());
+  EXPECT_EQ(this->net_->inference_memory_saved(), 0);
+  caffe_copy(input.count(), input.cpu_data(),
+      this->net_->input_blobs()[0]->mutable_cpu_data());
+  this->net_->ForwardPrefilled();
+  Blob<Dtype> output;
+  output.CopyFrom(*this->net_->output_blobs()[0], false, true);
+
+  Caffe::set_random_seed(this->seed_);
+  this->InitReshapableNet(true);
+  EXPECT_TRUE(this->net_->inference());
+  // Only the argmax of the MAX pooling layer is saved.
+  EXPECT_EQ(this->net_->inference_memory_saved(),
+      this->net_->blob_by_name("pool1")->count() * sizeof(int));
+  caffe_copy(input.count(), input.cpu_data(),
+      this->net_->input_blobs()[0]->mutable_cpu_data());
+  this->net_->ForwardPrefilled();
+  const Blob<Dtype>* output_blob = this->net_->output_blobs()[0];
+  ASSERT_EQ(output.count(), output_blob->count());
+  for (int i = 0; i < output.count(); ++i) {
+    EXPECT_EQ(output.cpu_data()[i], output_blob->cpu_data()[i]);
+  }
+  for (int i = 0; i < this->net_->blobs().size(); ++i) {
+    EXPECT_EQ(this->net_->blobs()[i]->diff()->head(),
+        SyncedMemory::UNINITIALIZED) << this->net_->blob_names()[i];
+  }
+  for (int i = 0; i < this->net_->params().size(); ++i) {
+    EXPECT_EQ(this->net_->params()[i]->diff()->head(),
+        SyncedMemory::UNINITIALIZED);
+  }
+}
+
+TYPED_TEST(NetTest, TestPlanActivationMemory) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Caffe::set_random_seed(this->seed_);
+  this->InitReshapableNet(true);
+  filler.Fill(this->net_->input_blobs()[0]);
+  this->net_->ForwardPrefilled();
+  Blob<Dtype> output;
+  output.CopyFrom(*this->net_->output_blobs()[0], false, true);
+  size_t bytes = 0;
+  for (int i = 0; i < this->net_->blobs().size(); ++i) {
+    bytes += this->net_->blobs()[i]->count() * sizeof(Dtype);
+  }
+  EXPECT_LT(this->net_->PlanActivationMemory(), bytes);
+  // conv1 is last read by pool1, before norm1 is written, so they share;
+  // pool1 is read while norm1 is written, so they do not.
+  EXPECT_EQ(this->net_->blob_by_name("conv1")->data(),
+      this->net_->blob_by_name("norm1")->data());
+  EXPECT_NE(this->net_->blob_by_name("pool1")->data(),
+      this->net_->blob_by_name("norm1")->data());
+  this->net_->ForwardPrefilled();
+  const Blob<Dtype>* output_blob = this->net_->output_blobs()[0];
+  for (int i = 0; i < output.count(); ++i) {
+    EXPECT_EQ(output.cpu_data()[i], output_blob->cpu_data()[i]);
+  }
+  // MemoryData points its tops at the caller's arrays, so they must keep
+  // their memory: pool1 would otherwise take the buffer of data.
+  const string proto =
+      "state { inference: true } "
+      "name: 'MemoryDataNetwork' "
+      "layer { "
+      "  name: 'data' "
+      "  type: 'MemoryData' "
+      "  top: 'data' "
+      "  top: 'label' "
+      "  memory_data_param { "
+      "    batch_size: 1 "
+      "    channels: 3 "
+      "    height: 8 "
+      "    width: 8 "
+      "  } "
+      "} "
+      "layer { "
+      "  name: 'conv1' "
+      "  type: 'Convolution' "
+      "  bottom: 'data' "
+      "  top: 'conv1' "
+      "  convolution_param { "
+      "    num_output: 3 "
+      "    kernel_size: 3 "
+      "    pad: 1 "
+      "    weight_filler { "
+      "      type: 'gaussian' "
+      "      std: 0.1 "
+      "    } "
+      "  } "
+      "} "
+      "layer { "
+      "  name: 'pool1' "
+      "  type: 'Pooling' "
+      "  bottom: 'conv1' "
+      "  top: 'pool1' "
+      "  pooling_param { "
+      "    pool: MAX "
+      "    kernel_size: 2 "
+      "    stride: 2 "
+      "  } "
+      "} "
+      "layer { "
+      "  name: 'conv2' "
+      "  type: 'Convolution' "
+      "  bottom: 'pool1' "
+      "  top: 'conv2' "
+      "  convolution_param { "
+      "    num_output: 3 "
+      "    kernel_size: 3 "
+      "    pad: 1 "
+      "    weight_filler { "
+      "      type: 'gaussian' "
+      "      std: 0.1 "
+      "    } "
+      "  } "
+      "} ";
+  this->InitNetFromProtoString(proto);
+  this->net_->PlanActivationMemory();
+  EXPECT_NE(this->net_->blob_by_name("data")->data(),
+      this->net_->blob_by_name("pool1")->data());
+  Blob<Dtype> data(2, 3, 8, 8);
+  Blob<Dtype> label(2, 1, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&label);
+  Blob<Dtype> data_copy;
+  data_copy.CopyFrom(data, false, true);
+  shared_ptr<MemoryDataLayer<Dtype> > memory_data =
+      boost::dynamic_pointer_cast<MemoryDataLayer<Dtype> >(
+          this->net_->layers()[0]);
+  ASSERT_TRUE(memory_data != NULL);
+  memory_data->Reset(data.mutable_cpu_data(), label.mutable_cpu_data(), 2);
+  this->net_->ForwardPrefilled();
+  this->net_->ForwardPrefilled();
+  for (int i = 0; i < data.count(); ++i) {
+    EXPECT_EQ(data_copy.cpu_data()[i], data.cpu_data()[i]);
+  }
+}
+
+TYPED_TEST(NetTest, TestCheckpointing) {
+  typedef typename TypeParam::Dtype Dtype;
+  FillerParameter filler_param;
+  filler_param.set_std(1);
+  GaussianFiller<Dtype> filler(filler_param);
+  Blob<Dtype> data(2, 3, 12, 12);
+  Blob<Dtype> target(2, 4, 1, 1);
+  filler.Fill(&data);
+  filler.Fill(&target);
+  vector<Blob<Dtype>*> bottom;
+  bottom.push_back(&data);
+  bottom.push_back(&target);
+  Caffe::set_random_seed(this->seed_);
+  this->InitCheckpointedNet("");
+  shared_ptr<Net<Dtype> > reference = this->net_;
+  EXPECT_TRUE(reference->checkpoint_segments().empty());
+  // The segment with drop1 draws its mask from a stream seeded by the first
+  // number of the main one; draw the reference mask from the same stream.
+  Caffe::set_random_seed(this->seed_);
+  Caffe::set_random_seed(caffe_rng_rand());
+  const Dtype loss = reference->ForwardBackward(bottom);
+  const string checkpoints[] = {
+    "checkpoint: 'pool1' ",
+    "checkpoint_memory_budget: 1 "
+  };
+  for (int c = 0; c < 2; ++c) {
+    Caffe::set_random_seed(this->seed_);
+    this->InitCheckpointedNet(checkpoints[c]);
+    EXPECT_GT(this->net_->checkpoint_segments().size(), 1);
+    Caffe::set_random_seed(this->seed_);
+    EXPECT_EQ(loss, this->net_->ForwardBackward(bottom));
+    // Backward recomputes drop1 with the mask of the forward pass, and the
+    // second Backward recomputes every segment, the last one included.
+    for (int pass = 0; pass < 2; ++pass) {
+      if (pass > 0) { this->net_->Backward(); }
+      for (int i = 0; i < reference->params().size(); ++i) {
+        const Blob<Dtype>* expected = reference->params()[i].get();
+        const Blob<Dtype>* param = this->net_->params()[i].get();
+        for (int j = 0; j < expected->count(); ++j) {
+          EXPECT_EQ(expected->cpu_diff()[j], param->cpu_diff()[j]);
+        }
+      }
+    }
+  }
+  // With a checkpoint at pool1, conv1 and conv2 are recomputed in separate
+  // segments and so share memory.
+  this->InitCheckpointedNet(checkpoints[0]);
+  EXPECT_EQ(2, this->net_->checkpoint_segments().size());
+  EXPECT_EQ(this->net_->blob_by_name("conv1")->data(),
+      this->net_->blob_by_name("conv2")->data());
+  EXPECT_NE(this->net_->blob_by_name("pool1")->data(),
+      this->net_->blob_by_name("conv2")->data());
+}
+
 }  // namespace caffe
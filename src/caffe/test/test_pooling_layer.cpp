@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cfloat>
 #include <cstring>
 #include <vector>
 
@@ -606,6 +608,96 @@ TYPED_TEST(PoolingLayerTest, TestGradientAvePadded) {
   }
 }
 
+TYPED_TEST(PoolingLayerTest, TestForwardStride2) {
+  typedef typename TypeParam::Dtype Dtype;
+  // The unrolled 2x2 and 3x3 stride 2 windows, with clipped windows on the
+  // borders of odd sizes and padding, against direct pooling.
+  this->blob_bottom_->Reshape(2, 3, 7, 8);
+  FillerParameter filler_param;
+  GaussianFiller<Dtype> filler(filler_param);
+  filler.Fill(this->blob_bottom_);
+  this->blob_top_vec_.push_back(this->blob_top_mask_);
+  for (int pool = 0; pool < 2; ++pool) {
+    for (int kernel = 2; kernel <= 3; ++kernel) {
+      for (int pad = 0; pad < kernel - 1; ++pad) {
+        LayerParameter layer_param;
+        PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+        pooling_param->set_kernel_size(kernel);
+        pooling_param->set_stride(2);
+        pooling_param->set_pad(pad);
+        pooling_param->set_pool(pool == 0 ? PoolingParameter_PoolMethod_MAX :
+            PoolingParameter_PoolMethod_AVE);
+        vector<Blob<Dtype>*> top_vec(this->blob_top_vec_.begin(),
+            this->blob_top_vec_.begin() + (pool == 0 ? 2 : 1));
+        PoolingLayer<Dtype> layer(layer_param);
+        layer.SetUp(this->blob_bottom_vec_, top_vec);
+        layer.Forward(this->blob_bottom_vec_, top_vec);
+        const int height = this->blob_bottom_->height();
+        const int width = this->blob_bottom_->width();
+        const int pooled_height = this->blob_top_->height();
+        const int pooled_width = this->blob_top_->width();
+        for (int p = 0; p < 6; ++p) {
+          const Dtype* bottom_data =
+              this->blob_bottom_->cpu_data() + p * height * width;
+          for (int ph = 0; ph < pooled_height; ++ph) {
+            for (int pw = 0; pw < pooled_width; ++pw) {
+              const int hstart = ph * 2 - pad;
+              const int wstart = pw * 2 - pad;
+              const int pool_size =
+                  (std::min(hstart + kernel, height + pad) - hstart) *
+                  (std::min(wstart + kernel, width + pad) - wstart);
+              Dtype max_value = -FLT_MAX;
+              Dtype sum = 0;
+              int max_index = -1;
+              for (int h = std::max(hstart, 0);
+                   h < std::min(hstart + kernel, height); ++h) {
+                for (int w = std::max(wstart, 0);
+                     w < std::min(wstart + kernel, width); ++w) {
+                  sum += bottom_data[h * width + w];
+                  if (bottom_data[h * width + w] > max_value) {
+                    max_value = bottom_data[h * width + w];
+                    max_index = h * width + w;
+                  }
+                }
+              }
+              const int index = (p * pooled_height + ph) * pooled_width + pw;
+              if (pool == 0) {
+                EXPECT_EQ(this->blob_top_->cpu_data()[index], max_value);
+                EXPECT_EQ(this->blob_top_mask_->cpu_data()[index], max_index);
+              } else {
+                EXPECT_NEAR(this->blob_top_->cpu_data()[index],
+                    sum / pool_size, 1e-5);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+TYPED_TEST(PoolingLayerTest, TestForwardMaxForwardOnly) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter layer_param;
+  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+  pooling_param->set_kernel_size(3);
+  pooling_param->set_stride(2);
+  pooling_param->set_pool(PoolingParameter_PoolMethod_MAX);
+  PoolingLayer<Dtype> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  Blob<Dtype> top_forward_only;
+  vector<Blob<Dtype>*> top_vec(1, &top_forward_only);
+  pooling_param->set_forward_only(true);
+  PoolingLayer<Dtype> layer_forward_only(layer_param);
+  layer_forward_only.SetUp(this->blob_bottom_vec_, top_vec);
+  layer_forward_only.Forward(this->blob_bottom_vec_, top_vec);
+  ASSERT_EQ(top_forward_only.count(), this->blob_top_->count());
+  for (int i = 0; i < this->blob_top_->count(); ++i) {
+    EXPECT_EQ(top_forward_only.cpu_data()[i], this->blob_top_->cpu_data()[i]);
+  }
+}
+
 #ifdef USE_CUDNN
 template <typename Dtype>
 class CuDNNPoolingLayerTest : public ::testing::Test {
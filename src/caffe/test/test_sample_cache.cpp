@@ -0,0 +1,173 @@
+#include <set>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/sample_cache.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class SampleCacheTest : public ::testing::Test {
+ protected:
+  // A single uint8 datum of about bytes bytes, labeled label.
+  vector<Datum> MakeSample(const int label, const int bytes) {
+    vector<Datum> sample(1);
+    sample[0].set_channels(1);
+    sample[0].set_height(1);
+    sample[0].set_width(bytes);
+    sample[0].set_label(label);
+    string* data = sample[0].mutable_data();
+    for (int i = 0; i < bytes; ++i) {
+      data->push_back(static_cast<char>((label + i) % 256));
+    }
+    return sample;
+  }
+};
+
+TEST_F(SampleCacheTest, TestRoundTrip) {
+  SampleCache cache(1 << 20, false);
+  vector<Datum> sample = MakeSample(3, 100);
+  // Integer float_data is stored as uint8, other values as float.
+  Datum integral;
+  integral.set_channels(2);
+  integral.set_height(1);
+  integral.set_width(2);
+  Datum density = integral;
+  for (int i = 0; i < 4; ++i) {
+    integral.add_float_data(i * 50);
+    density.add_float_data(i * 0.25);
+  }
+  sample.push_back(integral);
+  sample.push_back(density);
+  EXPECT_TRUE(cache.Put("a", sample));
+
+  vector<Datum> cached;
+  EXPECT_FALSE(cache.Get("b", &cached));
+  EXPECT_TRUE(cache.Get("a", &cached));
+  ASSERT_EQ(cached.size(), 3);
+  EXPECT_EQ(cached[0].label(), 3);
+  EXPECT_EQ(cached[0].width(), 100);
+  EXPECT_EQ(cached[0].data(), sample[0].data());
+  EXPECT_EQ(cached[1].channels(), 2);
+  EXPECT_EQ(cached[1].float_data_size(), 0);
+  EXPECT_EQ(cached[2].data().size(), 0);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(static_cast<uint8_t>(cached[1].data()[i]), i * 50);
+    EXPECT_EQ(cached[2].float_data(i), density.float_data(i));
+  }
+  EXPECT_EQ(cache.hits(), 1);
+  EXPECT_EQ(cache.misses(), 1);
+  EXPECT_EQ(cache.hit_rate(), 0.5);
+}
+
+TEST_F(SampleCacheTest, TestLRUEviction) {
+  // Room for two samples.
+  const int bytes = 1000;
+  SampleCache cache(2 * bytes + 100, false);
+  vector<Datum> sample;
+  EXPECT_TRUE(cache.Put("a", MakeSample(0, bytes)));
+  const size_t sample_bytes = cache.bytes();
+  EXPECT_GT(sample_bytes, bytes);
+  EXPECT_LT(sample_bytes, bytes + 50);
+  EXPECT_TRUE(cache.Put("b", MakeSample(1, bytes)));
+  EXPECT_TRUE(cache.Get("a", &sample));
+  EXPECT_TRUE(cache.Put("c", MakeSample(2, bytes)));
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_EQ(cache.bytes(), 2 * sample_bytes);
+  EXPECT_FALSE(cache.Get("b", &sample));
+  EXPECT_TRUE(cache.Get("a", &sample));
+  EXPECT_EQ(sample[0].label(), 0);
+  EXPECT_TRUE(cache.Get("c", &sample));
+  EXPECT_EQ(sample[0].label(), 2);
+  // A sample larger than the whole cache is not stored.
+  EXPECT_FALSE(cache.Put("d", MakeSample(3, 3 * bytes)));
+  EXPECT_EQ(cache.size(), 2);
+  // Not every sample of the pass is resident.
+  EXPECT_FALSE(cache.EndEpoch(true));
+  EXPECT_FALSE(cache.in_memory());
+}
+
+TEST_F(SampleCacheTest, TestSmallSamples) {
+  // Small samples are packed together, so the capacity holds them all.
+  const int num_samples = 1000;
+  SampleCache cache(64 * 1024, false);
+  for (int i = 0; i < num_samples; ++i) {
+    EXPECT_TRUE(cache.Put(string(1, 'a' + i % 26) + string(i / 26, 'z'),
+        MakeSample(i, 40)));
+  }
+  EXPECT_EQ(cache.size(), num_samples);
+  EXPECT_LE(cache.bytes(), 64 * 1024);
+  EXPECT_TRUE(cache.EndEpoch(true));
+}
+
+TEST_F(SampleCacheTest, TestCompaction) {
+  // Evicting a and c frees room for e, but not in one piece, so the
+  // samples left are packed together first.
+  const int bytes = 1000;
+  SampleCache cache(1 << 20, false);
+  EXPECT_TRUE(cache.Put("a", MakeSample(0, bytes)));
+  const size_t sample_bytes = cache.bytes();
+  SampleCache small_cache(4 * sample_bytes, false);
+  const char* keys[] = { "a", "b", "c", "d" };
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(small_cache.Put(keys[i], MakeSample(i, bytes)));
+  }
+  EXPECT_EQ(small_cache.bytes(), 4 * sample_bytes);
+  vector<Datum> sample;
+  EXPECT_TRUE(small_cache.Get("b", &sample));
+  EXPECT_TRUE(small_cache.Get("d", &sample));
+  // e takes exactly two samples' bytes.
+  const int e_bytes = 2 * bytes + (sample_bytes - bytes);
+  EXPECT_TRUE(small_cache.Put("e", MakeSample(4, e_bytes)));
+  EXPECT_EQ(small_cache.size(), 3);
+  EXPECT_EQ(small_cache.bytes(), 4 * sample_bytes);
+  EXPECT_FALSE(small_cache.Get("a", &sample));
+  EXPECT_FALSE(small_cache.Get("c", &sample));
+  const char* kept_keys[] = { "b", "d", "e" };
+  const int kept_labels[] = { 1, 3, 4 };
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(small_cache.Get(kept_keys[i], &sample));
+    EXPECT_EQ(sample[0].label(), kept_labels[i]);
+    EXPECT_EQ(sample[0].data(), MakeSample(kept_labels[i],
+        kept_labels[i] == 4 ? e_bytes : bytes)[0].data());
+  }
+}
+
+TEST_F(SampleCacheTest, TestInMemoryEpochs) {
+  SampleCache cache(1 << 20, true);
+  const int num_samples = 10;
+  for (int i = 0; i < num_samples; ++i) {
+    EXPECT_TRUE(cache.Put(string(1, 'a' + i), MakeSample(i, 10)));
+  }
+  EXPECT_TRUE(cache.EndEpoch(true));
+  EXPECT_TRUE(cache.in_memory());
+  // Every epoch serves each sample exactly once.
+  for (int epoch = 0; epoch < 3; ++epoch) {
+    std::set<int> labels;
+    vector<Datum> sample;
+    for (int i = 0; i < num_samples; ++i) {
+      cache.Next(&sample);
+      labels.insert(sample[0].label());
+    }
+    EXPECT_EQ(labels.size(), num_samples);
+  }
+  EXPECT_EQ(cache.misses(), 0);
+}
+
+TEST_F(SampleCacheTest, TestIncompletePass) {
+  // A pass that started after rand_skip does not cover the source.
+  SampleCache cache(1 << 20, false);
+  EXPECT_TRUE(cache.Put("a", MakeSample(0, 10)));
+  EXPECT_FALSE(cache.EndEpoch(false));
+  vector<Datum> sample;
+  EXPECT_TRUE(cache.Get("a", &sample));
+  EXPECT_TRUE(cache.Put("b", MakeSample(1, 10)));
+  EXPECT_TRUE(cache.EndEpoch(true));
+}
+
+}  // namespace caffe
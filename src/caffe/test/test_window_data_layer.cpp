@@ -0,0 +1,133 @@
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/data_layers.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class WindowDataLayerTest : public ::testing::Test {
+ protected:
+  WindowDataLayerTest() : seed_(1701) {}
+  virtual void SetUp() {
+    Caffe::set_mode(Caffe::CPU);
+    // Two images with a foreground and a background window each.
+    MakeTempFilename(&filename_);
+    std::ofstream outfile(filename_.c_str(), std::ofstream::out);
+    LOG(INFO) << "Using temporary file " << filename_;
+    outfile << "# 0\n" << "cat.jpg\n" << "3 360 480\n" << "2\n"
+        << "1 0.9 10 20 200 180\n" << "0 0.1 300 100 470 350\n";
+    outfile << "# 1\n" << "fish-bike.jpg\n" << "3 323 481\n" << "2\n"
+        << "2 0.8 0 0 240 160\n" << "0 0.0 250 150 480 322\n";
+    outfile.close();
+  }
+
+  void MakeLayerParameter(const int prefetch_threads, const size_t cache_bytes,
+      LayerParameter* param) {
+    WindowDataParameter* window_data_param =
+        param->mutable_window_data_param();
+    window_data_param->set_source(filename_);
+    window_data_param->set_root_folder(EXAMPLES_SOURCE_DIR "images/");
+    window_data_param->set_batch_size(8);
+    window_data_param->set_fg_threshold(0.5);
+    window_data_param->set_bg_threshold(0.5);
+    window_data_param->set_fg_fraction(0.5);
+    window_data_param->set_context_pad(4);
+    window_data_param->set_prefetch_threads(prefetch_threads);
+    window_data_param->set_cache_bytes(cache_bytes);
+    TransformationParameter* transform_param =
+        param->mutable_transform_param();
+    transform_param->set_crop_size(24);
+    transform_param->set_mirror(true);
+  }
+
+  // Reads num_batches batches with the given settings into data and label.
+  void Read(const int prefetch_threads, const size_t cache_bytes,
+      const int num_batches, vector<Dtype>* data, vector<Dtype>* label) {
+    LayerParameter param;
+    MakeLayerParameter(prefetch_threads, cache_bytes, &param);
+    Caffe::set_random_seed(seed_);
+    WindowDataLayer<Dtype> layer(param);
+    Blob<Dtype> top_data;
+    Blob<Dtype> top_label;
+    vector<Blob<Dtype>*> bottom_vec;
+    vector<Blob<Dtype>*> top_vec;
+    top_vec.push_back(&top_data);
+    top_vec.push_back(&top_label);
+    layer.SetUp(bottom_vec, top_vec);
+    EXPECT_EQ(top_data.num(), 8);
+    EXPECT_EQ(top_data.channels(), 3);
+    EXPECT_EQ(top_data.height(), 24);
+    EXPECT_EQ(top_data.width(), 24);
+    data->clear();
+    label->clear();
+    for (int iter = 0; iter < num_batches; ++iter) {
+      layer.Forward(bottom_vec, top_vec);
+      data->insert(data->end(), top_data.cpu_data(),
+          top_data.cpu_data() + top_data.count());
+      label->insert(label->end(), top_label.cpu_data(),
+          top_label.cpu_data() + top_label.count());
+      // Wait for the next batch, which the next Forward then takes.
+      layer.JoinPrefetchThread();
+      EXPECT_LE(layer.image_cache_bytes(), cache_bytes);
+      if (cache_bytes > 0) {
+        EXPECT_GT(layer.image_cache_bytes(), 0);
+      }
+    }
+  }
+
+  int seed_;
+  string filename_;
+};
+
+TYPED_TEST_CASE(WindowDataLayerTest, TestDtypes);
+
+TYPED_TEST(WindowDataLayerTest, TestRead) {
+  vector<TypeParam> data;
+  vector<TypeParam> label;
+  this->Read(1, 0, 1, &data, &label);
+  // The first half of the batch is background, the rest foreground.
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(label[i], 0);
+  }
+  for (int i = 4; i < 8; ++i) {
+    EXPECT_TRUE(label[i] == 1 || label[i] == 2);
+  }
+}
+
+TYPED_TEST(WindowDataLayerTest, TestPrefetchThreads) {
+  // The crops and labels do not depend on the number of threads, nor on
+  // whether the images come from the cache. Each image takes about 500 kB
+  // decoded, so a 600 kB cache holds one and evicts it for the other.
+  vector<TypeParam> data;
+  vector<TypeParam> label;
+  this->Read(1, 0, 4, &data, &label);
+  const size_t cache_bytes[] = { 0, 600000, 2000000 };
+  for (int c = 0; c < 3; ++c) {
+    for (int threads = 1; threads <= 3; threads += 2) {
+      vector<TypeParam> threaded_data;
+      vector<TypeParam> threaded_label;
+      this->Read(threads, cache_bytes[c], 4, &threaded_data,
+          &threaded_label);
+      ASSERT_EQ(data.size(), threaded_data.size());
+      for (int i = 0; i < data.size(); ++i) {
+        EXPECT_EQ(data[i], threaded_data[i]);
+      }
+      ASSERT_EQ(label.size(), threaded_label.size());
+      for (int i = 0; i < label.size(); ++i) {
+        EXPECT_EQ(label[i], threaded_label[i]);
+      }
+    }
+  }
+}
+
+}  // namespace caffe
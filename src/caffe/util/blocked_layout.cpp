@@ -0,0 +1,192 @@
+#include <set>
+#include <string>
+
+#include "caffe/common.hpp"
+#include "caffe/util/blocked_layout.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+void nchw_to_blocked(const Dtype* nchw, const int num, const int channels,
+    const int spatial_dim, const int block, Dtype* blocked) {
+  CHECK_EQ(channels % block, 0) << "block must divide channels.";
+  for (int nb = 0; nb < num * channels / block; ++nb) {
+    const Dtype* src = nchw + nb * block * spatial_dim;
+    Dtype* dst = blocked + nb * block * spatial_dim;
+    for (int i = 0; i < spatial_dim; ++i) {
+      for (int k = 0; k < block; ++k) {
+        dst[i * block + k] = src[k * spatial_dim + i];
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void blocked_to_nchw(const Dtype* blocked, const int num, const int channels,
+    const int spatial_dim, const int block, Dtype* nchw) {
+  CHECK_EQ(channels % block, 0) << "block must divide channels.";
+  for (int nb = 0; nb < num * channels / block; ++nb) {
+    const Dtype* src = blocked + nb * block * spatial_dim;
+    Dtype* dst = nchw + nb * block * spatial_dim;
+    for (int k = 0; k < block; ++k) {
+      for (int i = 0; i < spatial_dim; ++i) {
+        dst[k * spatial_dim + i] = src[i * block + k];
+      }
+    }
+  }
+}
+
+template void nchw_to_blocked<float>(const float* nchw, const int num,
+    const int channels, const int spatial_dim, const int block,
+    float* blocked);
+template void nchw_to_blocked<double>(const double* nchw, const int num,
+    const int channels, const int spatial_dim, const int block,
+    double* blocked);
+template void blocked_to_nchw<float>(const float* blocked, const int num,
+    const int channels, const int spatial_dim, const int block, float* nchw);
+template void blocked_to_nchw<double>(const double* blocked, const int num,
+    const int channels, const int spatial_dim, const int block, double* nchw);
+
+namespace {
+
+// Whether layer_param can run on the blocked layout. All but convolution
+// need every bottom to be blocked already; convolution also takes NCHW.
+bool RunsBlocked(const LayerParameter& layer_param, const int block,
+    const bool bottoms_blocked) {
+  if (layer_param.loss_weight_size() > 0) {
+    return false;
+  }
+  const string& type = layer_param.type();
+  if (type == "Convolution") {
+    const ConvolutionParameter& conv_param = layer_param.convolution_param();
+    return (conv_param.engine() == ConvolutionParameter_Engine_DEFAULT ||
+        conv_param.engine() == ConvolutionParameter_Engine_CAFFE) &&
+        conv_param.group() == 1 && conv_param.num_output() % block == 0 &&
+        layer_param.bottom_size() == 1 && layer_param.top_size() == 1;
+  }
+  if (!bottoms_blocked) {
+    return false;
+  }
+  if (type == "ReLU" || type == "Eltwise") {
+    return true;
+  }
+  if (type == "Pooling") {
+    const PoolingParameter& pool_param = layer_param.pooling_param();
+    return (pool_param.pool() == PoolingParameter_PoolMethod_MAX ||
+        pool_param.pool() == PoolingParameter_PoolMethod_AVE) &&
+        layer_param.top_size() == 1;
+  }
+  if (type == "Concat") {
+    // Blocked blobs hold whole blocks, so they concatenate along the block
+    // axis just as along the channels.
+    const ConcatParameter& concat_param = layer_param.concat_param();
+    return (concat_param.has_concat_dim() ? concat_param.concat_dim() :
+        concat_param.axis()) == 1;
+  }
+  return false;
+}
+
+void ConfigureReorderLayer(const string& blob_name,
+    LayerParameter* reorder_layer_param) {
+  reorder_layer_param->Clear();
+  reorder_layer_param->set_name(blob_name + "_to_nchw");
+  reorder_layer_param->set_type("Reorder");
+  reorder_layer_param->add_bottom(BlockedBlobName(blob_name));
+  reorder_layer_param->add_top(blob_name);
+}
+
+}  // namespace
+
+void InsertBlockedLayout(const NetParameter& param,
+    NetParameter* param_blocked) {
+  const int block = param.channel_block();
+  CHECK(block == 8 || block == 16) << "channel_block must be 8 or 16.";
+  param_blocked->CopyFrom(param);
+  param_blocked->clear_layer();
+  // The blobs that are outputs of the net: produced and not consumed after.
+  std::set<string> outputs;
+  for (int i = 0; i < param.layer_size(); ++i) {
+    const LayerParameter& layer_param = param.layer(i);
+    for (int j = 0; j < layer_param.bottom_size(); ++j) {
+      outputs.erase(layer_param.bottom(j));
+    }
+    for (int j = 0; j < layer_param.top_size(); ++j) {
+      outputs.insert(layer_param.top(j));
+    }
+  }
+  // The blobs whose current value is held under their BlockedBlobName, and
+  // those whose current value is held in NCHW under their own name; a blob
+  // can be in both once a ReorderLayer has copied it back.
+  std::set<string> blocked;
+  std::set<string> nchw(param.input().begin(), param.input().end());
+  for (int i = 0; i < param.layer_size(); ++i) {
+    const LayerParameter& layer_param = param.layer(i);
+    bool bottoms_blocked = layer_param.bottom_size() > 0;
+    bool nchw_in_place = false;
+    for (int j = 0; j < layer_param.bottom_size(); ++j) {
+      const string& blob_name = layer_param.bottom(j);
+      bottoms_blocked &= blocked.count(blob_name) > 0;
+      // Writing a blob in place that has an NCHW copy under its own name
+      // would leave the copy stale, so such layers keep to NCHW.
+      for (int k = 0; k < layer_param.top_size(); ++k) {
+        nchw_in_place |= layer_param.top(k) == blob_name &&
+            nchw.count(blob_name) > 0;
+      }
+    }
+    if (!nchw_in_place && RunsBlocked(layer_param, block, bottoms_blocked)) {
+      LayerParameter* blocked_layer_param = param_blocked->add_layer();
+      blocked_layer_param->CopyFrom(layer_param);
+      blocked_layer_param->clear_bottom();
+      blocked_layer_param->clear_top();
+      for (int j = 0; j < layer_param.bottom_size(); ++j) {
+        const string& blob_name = layer_param.bottom(j);
+        blocked_layer_param->add_bottom(blocked.count(blob_name) ?
+            BlockedBlobName(blob_name) : blob_name);
+      }
+      for (int j = 0; j < layer_param.top_size(); ++j) {
+        const string& blob_name = layer_param.top(j);
+        blocked_layer_param->add_top(BlockedBlobName(blob_name));
+        blocked.insert(blob_name);
+        nchw.erase(blob_name);
+      }
+      const string& type = layer_param.type();
+      if (type == "Convolution") {
+        ConvolutionParameter* conv_param =
+            blocked_layer_param->mutable_convolution_param();
+        conv_param->set_engine(ConvolutionParameter_Engine_BLOCKED);
+        conv_param->set_channel_block(block);
+      } else if (type == "Pooling") {
+        blocked_layer_param->mutable_pooling_param()->set_engine(
+            PoolingParameter_Engine_CAFFE);
+      } else if (type == "ReLU") {
+        blocked_layer_param->mutable_relu_param()->set_engine(
+            ReLUParameter_Engine_CAFFE);
+      }
+      continue;
+    }
+    for (int j = 0; j < layer_param.bottom_size(); ++j) {
+      const string& blob_name = layer_param.bottom(j);
+      if (!nchw.count(blob_name) && blocked.count(blob_name)) {
+        ConfigureReorderLayer(blob_name, param_blocked->add_layer());
+        nchw.insert(blob_name);
+      }
+    }
+    param_blocked->add_layer()->CopyFrom(layer_param);
+    for (int j = 0; j < layer_param.top_size(); ++j) {
+      nchw.insert(layer_param.top(j));
+      blocked.erase(layer_param.top(j));
+    }
+  }
+  for (std::set<string>::const_iterator it = outputs.begin();
+       it != outputs.end(); ++it) {
+    if (!nchw.count(*it) && blocked.count(*it)) {
+      ConfigureReorderLayer(*it, param_blocked->add_layer());
+    }
+  }
+}
+
+string BlockedBlobName(const string& blob_name) {
+  return blob_name + "_blocked";
+}
+
+}  // namespace caffe
@@ -0,0 +1,57 @@
+#include <boost/thread.hpp>
+
+#include "caffe/util/blocking_queue.hpp"
+
+namespace caffe {
+
+template <typename T>
+class BlockingQueue<T>::sync {
+ public:
+  mutable boost::mutex mutex_;
+  boost::condition_variable condition_;
+};
+
+template <typename T>
+BlockingQueue<T>::BlockingQueue()
+    : sync_(new sync()) {
+}
+
+template <typename T>
+void BlockingQueue<T>::push(const T& t) {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  queue_.push(t);
+  lock.unlock();
+  sync_->condition_.notify_one();
+}
+
+template <typename T>
+bool BlockingQueue<T>::try_pop(T* t) {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  if (queue_.empty()) {
+    return false;
+  }
+  *t = queue_.front();
+  queue_.pop();
+  return true;
+}
+
+template <typename T>
+T BlockingQueue<T>::pop() {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  while (queue_.empty()) {
+    sync_->condition_.wait(lock);
+  }
+  T t = queue_.front();
+  queue_.pop();
+  return t;
+}
+
+template <typename T>
+size_t BlockingQueue<T>::size() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return queue_.size();
+}
+
+template class BlockingQueue<int>;
+
+}  // namespace caffe
@@ -22,7 +22,8 @@ void LevelDB::Open(const string& source, Mode mode) {
 
 void LMDB::Open(const string& source, Mode mode) {
   MDB_CHECK(mdb_env_create(&mdb_env_));
-  MDB_CHECK(mdb_env_set_mapsize(mdb_env_, LMDB_MAP_SIZE));
+  MDB_CHECK(mdb_env_set_mapsize(mdb_env_,
+      map_size_ > 0 ? map_size_ : LMDB_MAP_SIZE));
   if (mode == NEW) {
     CHECK_EQ(mkdir(source.c_str(), 0744), 0) << "mkdir " << source << "failed";
   }
@@ -44,6 +45,9 @@ LMDBCursor* LMDB::NewCursor() {
 }
 
 LMDBTransaction* LMDB::NewTransaction() {
+  if (grow_map_) {
+    return new LMDBTransaction(mdb_env_, &mdb_dbi_);
+  }
   MDB_txn* mdb_txn;
   MDB_CHECK(mdb_txn_begin(mdb_env_, NULL, 0, &mdb_txn));
   MDB_CHECK(mdb_dbi_open(mdb_txn, NULL, 0, &mdb_dbi_));
@@ -51,6 +55,11 @@ LMDBTransaction* LMDB::NewTransaction() {
 }
 
 void LMDBTransaction::Put(const string& key, const string& value) {
+  if (!mdb_txn_) {
+    keys_.push_back(key);
+    values_.push_back(value);
+    return;
+  }
   MDB_val mdb_key, mdb_value;
   mdb_key.mv_data = const_cast<char*>(key.data());
   mdb_key.mv_size = key.size();
@@ -59,6 +68,50 @@ void LMDBTransaction::Put(const string& key, const string& value) {
   MDB_CHECK(mdb_put(mdb_txn_, *mdb_dbi_, &mdb_key, &mdb_value, 0));
 }
 
+void LMDBTransaction::Commit() {
+  if (mdb_txn_) {
+    MDB_CHECK(mdb_txn_commit(mdb_txn_));
+    return;
+  }
+  // The map size can only change with no transaction open, so a commit
+  // that fills the map is aborted, and the puts are written again.
+  for (;;) {
+    MDB_txn* mdb_txn;
+    MDB_CHECK(mdb_txn_begin(mdb_env_, NULL, 0, &mdb_txn));
+    MDB_CHECK(mdb_dbi_open(mdb_txn, NULL, 0, mdb_dbi_));
+    int mdb_status = MDB_SUCCESS;
+    for (int i = 0; i < keys_.size() && mdb_status == MDB_SUCCESS; ++i) {
+      MDB_val mdb_key, mdb_value;
+      mdb_key.mv_data = const_cast<char*>(keys_[i].data());
+      mdb_key.mv_size = keys_[i].size();
+      mdb_value.mv_data = const_cast<char*>(values_[i].data());
+      mdb_value.mv_size = values_[i].size();
+      mdb_status = mdb_put(mdb_txn, *mdb_dbi_, &mdb_key, &mdb_value, 0);
+    }
+    if (mdb_status == MDB_SUCCESS) {
+      // Frees the transaction, also when it fails.
+      mdb_status = mdb_txn_commit(mdb_txn);
+    } else {
+      mdb_txn_abort(mdb_txn);
+    }
+    if (mdb_status != MDB_MAP_FULL) {
+      MDB_CHECK(mdb_status);
+      break;
+    }
+    DoubleMapSize();
+  }
+  keys_.clear();
+  values_.clear();
+}
+
+void LMDBTransaction::DoubleMapSize() {
+  MDB_envinfo mdb_info;
+  MDB_CHECK(mdb_env_info(mdb_env_, &mdb_info));
+  const size_t map_size = mdb_info.me_mapsize * 2;
+  LOG(INFO) << "Doubling the LMDB map size to " << (map_size >> 20) << " MB";
+  MDB_CHECK(mdb_env_set_mapsize(mdb_env_, map_size));
+}
+
 DB* GetDB(DataParameter::DB backend) {
   switch (backend) {
   case DataParameter_DB_LEVELDB:
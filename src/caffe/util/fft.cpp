@@ -0,0 +1,439 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/util/fft.hpp"
+
+namespace caffe {
+
+namespace {
+
+// The FFT size is the smallest power of two of at least kTileExtents times
+// the dilated kernel extent, or of the whole padded input when smaller.
+// Larger windows waste less of each FFT on the overlap but make the filter
+// spectra bigger.
+const int kTileExtents = 4;
+
+int NextPowerOfTwo(const int n) {
+  int p = 1;
+  while (p < n) {
+    p <<= 1;
+  }
+  return p;
+}
+
+int FFTSize(const int extent, const int dense) {
+  return std::min(NextPowerOfTwo(kTileExtents * extent),
+      NextPowerOfTwo(dense + extent - 1));
+}
+
+}  // namespace
+
+template <typename Dtype>
+FFTConvolution<Dtype>::FFTConvolution(const int channels,
+    const int out_channels, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int kstride_h,
+    const int kstride_w)
+    : channels_(channels), out_channels_(out_channels), height_(height),
+      width_(width), kernel_h_(kernel_h), kernel_w_(kernel_w), pad_h_(pad_h),
+      pad_w_(pad_w), stride_h_(stride_h), stride_w_(stride_w),
+      kstride_h_(kstride_h), kstride_w_(kstride_w) {
+  const int extent_h = (kernel_h - 1) * kstride_h + 1;
+  const int extent_w = (kernel_w - 1) * kstride_w + 1;
+  height_out_ = (height + 2 * pad_h - extent_h) / stride_h + 1;
+  width_out_ = (width + 2 * pad_w - extent_w) / stride_w + 1;
+  CHECK_GT(height_out_, 0) << "The kernel is larger than the padded input.";
+  CHECK_GT(width_out_, 0) << "The kernel is larger than the padded input.";
+  dense_h_ = (height_out_ - 1) * stride_h + 1;
+  dense_w_ = (width_out_ - 1) * stride_w + 1;
+  fft_h_ = FFTSize(extent_h, dense_h_);
+  fft_w_ = FFTSize(extent_w, dense_w_);
+  tile_h_ = fft_h_ - extent_h + 1;
+  tile_w_ = fft_w_ - extent_w + 1;
+  bins_w_ = fft_w_ / 2 + 1;
+  spectrum_size_ = fft_h_ * bins_w_;
+  MakePlan(fft_h_, &plan_h_);
+  MakePlan(fft_w_, &plan_w_);
+  filter_re_.resize(out_channels * channels * spectrum_size_);
+  filter_im_.resize(out_channels * channels * spectrum_size_);
+  input_re_.resize(channels * spectrum_size_);
+  input_im_.resize(channels * spectrum_size_);
+  output_re_.resize(out_channels * spectrum_size_);
+  output_im_.resize(out_channels * spectrum_size_);
+}
+
+template <typename Dtype>
+void FFTConvolution<Dtype>::MakePlan(const int n, Plan* plan) {
+  plan->n = n;
+  int bits = 0;
+  while ((1 << bits) < n) {
+    ++bits;
+  }
+  plan->bit_reverse.resize(n);
+  for (int i = 0; i < n; ++i) {
+    int reversed = 0;
+    for (int b = 0; b < bits; ++b) {
+      reversed |= ((i >> b) & 1) << (bits - 1 - b);
+    }
+    plan->bit_reverse[i] = reversed;
+  }
+  plan->cos.resize(n / 2);
+  plan->sin.resize(n / 2);
+  for (int k = 0; k < n / 2; ++k) {
+    const double angle = 2 * M_PI * k / n;
+    plan->cos[k] = std::cos(angle);
+    plan->sin[k] = std::sin(angle);
+  }
+}
+
+template <typename Dtype>
+void FFTConvolution<Dtype>::Transform(const Plan& plan, const bool inverse,
+    Dtype* re, Dtype* im) {
+  const int n = plan.n;
+  for (int i = 0; i < n; ++i) {
+    const int j = plan.bit_reverse[i];
+    if (i < j) {
+      std::swap(re[i], re[j]);
+      std::swap(im[i], im[j]);
+    }
+  }
+  const Dtype sign = inverse ? 1 : -1;
+  for (int len = 2; len <= n; len <<= 1) {
+    const int half = len / 2;
+    const int step = n / len;
+    for (int k = 0; k < half; ++k) {
+      const Dtype wr = plan.cos[k * step];
+      const Dtype wi = sign * plan.sin[k * step];
+      for (int a = k; a < n; a += len) {
+        const int b = a + half;
+        const Dtype tr = re[b] * wr - im[b] * wi;
+        const Dtype ti = re[b] * wi + im[b] * wr;
+        re[b] = re[a] - tr;
+        im[b] = im[a] - ti;
+        re[a] += tr;
+        im[a] += ti;
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void FFTConvolution<Dtype>::ForwardReal(const Dtype* window, Dtype* spec_re,
+    Dtype* spec_im) const {
+  const int n = fft_w_;
+  std::vector<Dtype> re(n), im(n);
+  // Two real rows at a time, one as the real and one as the imaginary part;
+  // their spectra are the even and odd parts of the result.
+  for (int r = 0; r < fft_h_; r += 2) {
+    std::copy(window + r * n, window + (r + 1) * n, re.begin());
+    if (r + 1 < fft_h_) {
+      std::copy(window + (r + 1) * n, window + (r + 2) * n, im.begin());
+    } else {
+      std::fill(im.begin(), im.end(), Dtype(0));
+    }
+    Transform(plan_w_, false, &re[0], &im[0]);
+    for (int v = 0; v < bins_w_; ++v) {
+      const int u = (n - v) % n;
+      spec_re[r * bins_w_ + v] = (re[v] + re[u]) / 2;
+      spec_im[r * bins_w_ + v] = (im[v] - im[u]) / 2;
+      if (r + 1 < fft_h_) {
+        spec_re[(r + 1) * bins_w_ + v] = (im[v] + im[u]) / 2;
+        spec_im[(r + 1) * bins_w_ + v] = (re[u] - re[v]) / 2;
+      }
+    }
+  }
+  std::vector<Dtype> col_re(fft_h_), col_im(fft_h_);
+  for (int v = 0; v < bins_w_; ++v) {
+    for (int r = 0; r < fft_h_; ++r) {
+      col_re[r] = spec_re[r * bins_w_ + v];
+      col_im[r] = spec_im[r * bins_w_ + v];
+    }
+    Transform(plan_h_, false, &col_re[0], &col_im[0]);
+    for (int r = 0; r < fft_h_; ++r) {
+      spec_re[r * bins_w_ + v] = col_re[r];
+      spec_im[r * bins_w_ + v] = col_im[r];
+    }
+  }
+}
+
+template <typename Dtype>
+void FFTConvolution<Dtype>::InverseReal(Dtype* spec_re, Dtype* spec_im,
+    const int rows, Dtype* window) const {
+  std::vector<Dtype> col_re(fft_h_), col_im(fft_h_);
+  for (int v = 0; v < bins_w_; ++v) {
+    for (int r = 0; r < fft_h_; ++r) {
+      col_re[r] = spec_re[r * bins_w_ + v];
+      col_im[r] = spec_im[r * bins_w_ + v];
+    }
+    Transform(plan_h_, true, &col_re[0], &col_im[0]);
+    for (int r = 0; r < fft_h_; ++r) {
+      spec_re[r * bins_w_ + v] = col_re[r];
+      spec_im[r * bins_w_ + v] = col_im[r];
+    }
+  }
+  const int n = fft_w_;
+  const Dtype scale = Dtype(1) / (fft_h_ * fft_w_);
+  std::vector<Dtype> re(n), im(n);
+  // Rows r and r + 1 have real results, so they are inverted together as
+  // row r + i * row r + 1, with the missing bins from Hermitian symmetry.
+  for (int r = 0; r < rows; r += 2) {
+    const bool pair = r + 1 < fft_h_;
+    for (int v = 0; v < n; ++v) {
+      const int bin = v < bins_w_ ? v : n - v;
+      const Dtype conj = v < bins_w_ ? 1 : -1;
+      const Dtype ar = spec_re[r * bins_w_ + bin];
+      const Dtype ai = conj * spec_im[r * bins_w_ + bin];
+      const Dtype br = pair ? spec_re[(r + 1) * bins_w_ + bin] : Dtype(0);
+      const Dtype bi = pair ? conj * spec_im[(r + 1) * bins_w_ + bin] :
+          Dtype(0);
+      re[v] = ar - bi;
+      im[v] = ai + br;
+    }
+    Transform(plan_w_, true, &re[0], &im[0]);
+    for (int x = 0; x < n; ++x) {
+      window[r * n + x] = re[x] * scale;
+    }
+    if (r + 1 < rows) {
+      for (int x = 0; x < n; ++x) {
+        window[(r + 1) * n + x] = im[x] * scale;
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void FFTConvolution<Dtype>::SetFilters(const Dtype* weights) {
+  const int kernel_dim = kernel_h_ * kernel_w_;
+  const int count = out_channels_ * channels_ * kernel_dim;
+  if (static_cast<int>(weights_.size()) == count &&
+      std::equal(weights, weights + count, weights_.begin())) {
+    return;
+  }
+  weights_.assign(weights, weights + count);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int kc = 0; kc < out_channels_ * channels_; ++kc) {
+    std::vector<Dtype> window(fft_h_ * fft_w_, Dtype(0));
+    for (int i = 0; i < kernel_h_; ++i) {
+      for (int j = 0; j < kernel_w_; ++j) {
+        window[i * kstride_h_ * fft_w_ + j * kstride_w_] =
+            weights[kc * kernel_dim + i * kernel_w_ + j];
+      }
+    }
+    ForwardReal(&window[0], &filter_re_[kc * spectrum_size_],
+        &filter_im_[kc * spectrum_size_]);
+  }
+}
+
+template <typename Dtype>
+void FFTConvolution<Dtype>::InputSpectra(const Dtype* input, const int oy,
+    const int ox) {
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int c = 0; c < channels_; ++c) {
+    const Dtype* im = input + c * height_ * width_;
+    std::vector<Dtype> window(fft_h_ * fft_w_, Dtype(0));
+    const int y0 = oy - pad_h_;
+    const int x0 = ox - pad_w_;
+    const int x_begin = std::max(0, -x0);
+    const int x_end = std::min(fft_w_, width_ - x0);
+    for (int r = std::max(0, -y0); r < std::min(fft_h_, height_ - y0); ++r) {
+      if (x_begin < x_end) {
+        std::copy(im + (y0 + r) * width_ + x0 + x_begin,
+            im + (y0 + r) * width_ + x0 + x_end,
+            &window[r * fft_w_ + x_begin]);
+      }
+    }
+    ForwardReal(&window[0], &input_re_[c * spectrum_size_],
+        &input_im_[c * spectrum_size_]);
+  }
+}
+
+template <typename Dtype>
+void FFTConvolution<Dtype>::OutputDiffSpectra(const Dtype* output_diff,
+    const int oy, const int ox) {
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int k = 0; k < out_channels_; ++k) {
+    const Dtype* diff = output_diff + k * height_out_ * width_out_;
+    // The strided gradient spread back to stride 1, zero in between.
+    std::vector<Dtype> window(fft_h_ * fft_w_, Dtype(0));
+    for (int a = 0; a < tile_h_ && oy + a < dense_h_; ++a) {
+      if ((oy + a) % stride_h_ != 0) {
+        continue;
+      }
+      const int y = (oy + a) / stride_h_;
+      for (int b = 0; b < tile_w_ && ox + b < dense_w_; ++b) {
+        if ((ox + b) % stride_w_ == 0) {
+          window[a * fft_w_ + b] = diff[y * width_out_ + (ox + b) / stride_w_];
+        }
+      }
+    }
+    ForwardReal(&window[0], &output_re_[k * spectrum_size_],
+        &output_im_[k * spectrum_size_]);
+  }
+}
+
+template <typename Dtype>
+void FFTConvolution<Dtype>::Forward(const Dtype* input, Dtype* output) {
+  const int size = spectrum_size_;
+  for (int oy = 0; oy < dense_h_; oy += tile_h_) {
+    for (int ox = 0; ox < dense_w_; ox += tile_w_) {
+      InputSpectra(input, oy, ox);
+      const int rows = std::min(tile_h_, dense_h_ - oy);
+      const int cols = std::min(tile_w_, dense_w_ - ox);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+      for (int k = 0; k < out_channels_; ++k) {
+        // The cross-correlation of the windows with the filters, summed over
+        // the channels: X conj(W).
+        Dtype* out_re = &output_re_[k * size];
+        Dtype* out_im = &output_im_[k * size];
+        std::fill(out_re, out_re + size, Dtype(0));
+        std::fill(out_im, out_im + size, Dtype(0));
+        for (int c = 0; c < channels_; ++c) {
+          const Dtype* w_re = &filter_re_[(k * channels_ + c) * size];
+          const Dtype* w_im = &filter_im_[(k * channels_ + c) * size];
+          const Dtype* x_re = &input_re_[c * size];
+          const Dtype* x_im = &input_im_[c * size];
+          for (int s = 0; s < size; ++s) {
+            out_re[s] += x_re[s] * w_re[s] + x_im[s] * w_im[s];
+            out_im[s] += x_im[s] * w_re[s] - x_re[s] * w_im[s];
+          }
+        }
+        std::vector<Dtype> window(fft_h_ * fft_w_);
+        InverseReal(out_re, out_im, rows, &window[0]);
+        Dtype* out = output + k * height_out_ * width_out_;
+        for (int a = 0; a < rows; ++a) {
+          if ((oy + a) % stride_h_ != 0) {
+            continue;
+          }
+          const int y = (oy + a) / stride_h_;
+          for (int b = 0; b < cols; ++b) {
+            if ((ox + b) % stride_w_ == 0) {
+              out[y * width_out_ + (ox + b) / stride_w_] =
+                  window[a * fft_w_ + b];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void FFTConvolution<Dtype>::BackwardData(const Dtype* output_diff,
+    Dtype* input_diff) {
+  const int size = spectrum_size_;
+  std::fill(input_diff, input_diff + channels_ * height_ * width_, Dtype(0));
+  for (int oy = 0; oy < dense_h_; oy += tile_h_) {
+    for (int ox = 0; ox < dense_w_; ox += tile_w_) {
+      OutputDiffSpectra(output_diff, oy, ox);
+      const int y0 = oy - pad_h_;
+      const int x0 = ox - pad_w_;
+      const int rows = std::min(fft_h_, height_ - y0);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+      for (int c = 0; c < channels_; ++c) {
+        // The convolution of the gradient with the filters, summed over the
+        // output channels: D W. The window spectra are free to reuse here.
+        Dtype* in_re = &input_re_[c * size];
+        Dtype* in_im = &input_im_[c * size];
+        std::fill(in_re, in_re + size, Dtype(0));
+        std::fill(in_im, in_im + size, Dtype(0));
+        for (int k = 0; k < out_channels_; ++k) {
+          const Dtype* w_re = &filter_re_[(k * channels_ + c) * size];
+          const Dtype* w_im = &filter_im_[(k * channels_ + c) * size];
+          const Dtype* d_re = &output_re_[k * size];
+          const Dtype* d_im = &output_im_[k * size];
+          for (int s = 0; s < size; ++s) {
+            in_re[s] += d_re[s] * w_re[s] - d_im[s] * w_im[s];
+            in_im[s] += d_re[s] * w_im[s] + d_im[s] * w_re[s];
+          }
+        }
+        std::vector<Dtype> window(fft_h_ * fft_w_);
+        InverseReal(in_re, in_im, rows, &window[0]);
+        // Overlap-add of the windows.
+        Dtype* diff = input_diff + c * height_ * width_;
+        for (int r = std::max(0, -y0); r < rows; ++r) {
+          for (int x = std::max(0, -x0); x < std::min(fft_w_, width_ - x0);
+              ++x) {
+            diff[(y0 + r) * width_ + x0 + x] += window[r * fft_w_ + x];
+          }
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void FFTConvolution<Dtype>::AccumulateFilterDiff(const Dtype* input,
+    const Dtype* output_diff) {
+  const int size = spectrum_size_;
+  if (filter_diff_re_.empty()) {
+    filter_diff_re_.resize(filter_re_.size(), Dtype(0));
+    filter_diff_im_.resize(filter_im_.size(), Dtype(0));
+  }
+  for (int oy = 0; oy < dense_h_; oy += tile_h_) {
+    for (int ox = 0; ox < dense_w_; ox += tile_w_) {
+      InputSpectra(input, oy, ox);
+      OutputDiffSpectra(output_diff, oy, ox);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+      for (int k = 0; k < out_channels_; ++k) {
+        // The cross-correlation of the windows with the gradient: X conj(D).
+        const Dtype* d_re = &output_re_[k * size];
+        const Dtype* d_im = &output_im_[k * size];
+        for (int c = 0; c < channels_; ++c) {
+          Dtype* g_re = &filter_diff_re_[(k * channels_ + c) * size];
+          Dtype* g_im = &filter_diff_im_[(k * channels_ + c) * size];
+          const Dtype* x_re = &input_re_[c * size];
+          const Dtype* x_im = &input_im_[c * size];
+          for (int s = 0; s < size; ++s) {
+            g_re[s] += x_re[s] * d_re[s] + x_im[s] * d_im[s];
+            g_im[s] += x_im[s] * d_re[s] - x_re[s] * d_im[s];
+          }
+        }
+      }
+    }
+  }
+}
+
+template <typename Dtype>
+void FFTConvolution<Dtype>::FilterDiff(Dtype* weights_diff) {
+  if (filter_diff_re_.empty()) {
+    return;
+  }
+  const int size = spectrum_size_;
+  const int kernel_dim = kernel_h_ * kernel_w_;
+  const int rows = (kernel_h_ - 1) * kstride_h_ + 1;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (int kc = 0; kc < out_channels_ * channels_; ++kc) {
+    Dtype* g_re = &filter_diff_re_[kc * size];
+    Dtype* g_im = &filter_diff_im_[kc * size];
+    std::vector<Dtype> window(fft_h_ * fft_w_);
+    InverseReal(g_re, g_im, rows, &window[0]);
+    for (int i = 0; i < kernel_h_; ++i) {
+      for (int j = 0; j < kernel_w_; ++j) {
+        weights_diff[kc * kernel_dim + i * kernel_w_ + j] +=
+            window[i * kstride_h_ * fft_w_ + j * kstride_w_];
+      }
+    }
+    std::fill(g_re, g_re + size, Dtype(0));
+    std::fill(g_im, g_im + size, Dtype(0));
+  }
+}
+
+INSTANTIATE_CLASS(FFTConvolution);
+
+}  // namespace caffe
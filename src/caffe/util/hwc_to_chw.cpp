@@ -0,0 +1,160 @@
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "caffe/util/hwc_to_chw.hpp"
+
+namespace caffe {
+
+namespace {
+
+// Scalar body of the row kernels below; also handles the tail of a row that
+// the SIMD kernels leave over. plane is the distance between channel planes
+// of dst.
+template <typename Dtype>
+inline void DeinterleaveRowScalar(const uint8_t* src, const int channels,
+    const int width, const int plane, Dtype* dst) {
+  for (int c = 0; c < channels; ++c) {
+    const uint8_t* src_c = src + c;
+    Dtype* dst_c = dst + c * plane;
+    for (int w = 0; w < width; ++w) {
+      dst_c[w] = static_cast<Dtype>(src_c[w * channels]);
+    }
+  }
+}
+
+#ifdef __SSE2__
+// Stores the 16 uint8 lanes of v as Dtype.
+template <typename Dtype>
+inline void Store16(const __m128i v, Dtype* dst) {
+  uint8_t bytes[16];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(bytes), v);
+  for (int i = 0; i < 16; ++i) {
+    dst[i] = static_cast<Dtype>(bytes[i]);
+  }
+}
+
+template <>
+inline void Store16<uint8_t>(const __m128i v, uint8_t* dst) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), v);
+}
+
+template <>
+inline void Store16<float>(const __m128i v, float* dst) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i lo = _mm_unpacklo_epi8(v, zero);
+  const __m128i hi = _mm_unpackhi_epi8(v, zero);
+  _mm_storeu_ps(dst, _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)));
+  _mm_storeu_ps(dst + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)));
+  _mm_storeu_ps(dst + 8, _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)));
+  _mm_storeu_ps(dst + 12, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)));
+}
+
+// Splits 16 interleaved 3 channel pixels (48 bytes) into their planes. Each
+// round interleaves the low half of one register with the high half of the
+// next; after four rounds the bytes are sorted by channel.
+inline void Deinterleave3(const uint8_t* src, __m128i* a, __m128i* b,
+    __m128i* c) {
+  __m128i x0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+  __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+  __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+  for (int round = 0; round < 4; ++round) {
+    const __m128i y0 =
+        _mm_unpacklo_epi8(x0, _mm_unpackhi_epi64(x1, x1));
+    const __m128i y1 =
+        _mm_unpacklo_epi8(_mm_unpackhi_epi64(x0, x0), x2);
+    const __m128i y2 =
+        _mm_unpacklo_epi8(x1, _mm_unpackhi_epi64(x2, x2));
+    x0 = y0;
+    x1 = y1;
+    x2 = y2;
+  }
+  *a = x0;
+  *b = x1;
+  *c = x2;
+}
+
+// Splits 16 interleaved 4 channel pixels (64 bytes) into their planes.
+inline void Deinterleave4(const uint8_t* src, __m128i* a, __m128i* b,
+    __m128i* c, __m128i* d) {
+  __m128i x[4];
+  for (int i = 0; i < 4; ++i) {
+    x[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16 * i));
+  }
+  for (int round = 0; round < 4; ++round) {
+    const __m128i y0 = _mm_unpacklo_epi8(x[0], x[2]);
+    const __m128i y1 = _mm_unpackhi_epi8(x[0], x[2]);
+    const __m128i y2 = _mm_unpacklo_epi8(x[1], x[3]);
+    const __m128i y3 = _mm_unpackhi_epi8(x[1], x[3]);
+    x[0] = y0;
+    x[1] = y1;
+    x[2] = y2;
+    x[3] = y3;
+  }
+  *a = x[0];
+  *b = x[1];
+  *c = x[2];
+  *d = x[3];
+}
+#endif  // __SSE2__
+
+// Deinterleaves one row of width pixels.
+template <typename Dtype>
+void DeinterleaveRow(const uint8_t* src, const int channels, const int width,
+    const int plane, Dtype* dst) {
+  int w = 0;
+#ifdef __SSE2__
+  if (channels == 1) {
+    for (; w + 16 <= width; w += 16) {
+      Store16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + w)),
+          dst + w);
+    }
+  } else if (channels == 3) {
+    __m128i p[3];
+    for (; w + 16 <= width; w += 16) {
+      Deinterleave3(src + 3 * w, &p[0], &p[1], &p[2]);
+      for (int c = 0; c < 3; ++c) {
+        Store16(p[c], dst + c * plane + w);
+      }
+    }
+  } else if (channels == 4) {
+    __m128i p[4];
+    for (; w + 16 <= width; w += 16) {
+      Deinterleave4(src + 4 * w, &p[0], &p[1], &p[2], &p[3]);
+      for (int c = 0; c < 4; ++c) {
+        Store16(p[c], dst + c * plane + w);
+      }
+    }
+  }
+#endif  // __SSE2__
+  DeinterleaveRowScalar(src + channels * w, channels, width - w, plane,
+      dst + w);
+}
+
+}  // namespace
+
+template <typename Dtype>
+void hwc_to_chw(const uint8_t* data_hwc, const int channels,
+    const int height, const int width, const size_t row_step,
+    Dtype* data_chw) {
+  const int plane = height * width;
+  for (int h = 0; h < height; ++h) {
+    DeinterleaveRow(data_hwc + h * row_step, channels, width, plane,
+        data_chw + h * width);
+  }
+}
+
+// Explicit instantiation
+template void hwc_to_chw<uint8_t>(const uint8_t* data_hwc, const int channels,
+    const int height, const int width, const size_t row_step,
+    uint8_t* data_chw);
+template void hwc_to_chw<float>(const uint8_t* data_hwc, const int channels,
+    const int height, const int width, const size_t row_step,
+    float* data_chw);
+template void hwc_to_chw<double>(const uint8_t* data_hwc, const int channels,
+    const int height, const int width, const size_t row_step,
+    double* data_chw);
+
+}  // namespace caffe
@@ -7,6 +7,10 @@
 
 namespace caffe {
 
+// Column buffers smaller than this many elements are filled on one thread;
+// below it the cost of waking the OpenMP team outweighs the copy.
+static const int kParallelColSize = 32768;
+
 template <typename Dtype>
  void im2col_sk_cpu(const Dtype* data_im, const int channels,
      const int height, const int width, const int kernel_h, const int kernel_w,
@@ -14,9 +18,15 @@ template <typename Dtype>
      const int stride_h, const int stride_w,
      const int kstride_h, const int kstride_w,
      Dtype* data_col) {
-   int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
-   int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+   int ext_kernel_h = (kernel_h - 1) * kstride_h + 1;
+   int ext_kernel_w = (kernel_w - 1) * kstride_w + 1;
+   int height_col = (height + 2 * pad_h - ext_kernel_h) / stride_h + 1;
+   int width_col = (width + 2 * pad_w - ext_kernel_w) / stride_w + 1;
    int channels_col = channels * kernel_h * kernel_w;
+#ifdef _OPENMP
+#pragma omp parallel for \
+    if (channels_col * height_col * width_col >= kParallelColSize)
+#endif
    for (int c = 0; c < channels_col; ++c) {
      int w_offset = c % kernel_w;
      int h_offset = (c / kernel_w) % kernel_h;
@@ -46,14 +56,19 @@ template <typename Dtype>
      const int stride_w, const int kstride_h, const int kstride_w, double* data_col);
 
 template <typename Dtype>
-void im2col_cpu(const Dtype* data_im, const int channels,
+void im2col_strided_cpu(const Dtype* data_im, const int channels,
     const int height, const int width, const int kernel_h, const int kernel_w,
     const int pad_h, const int pad_w,
     const int stride_h, const int stride_w,
-    Dtype* data_col) {
+    const int row_stride, Dtype* data_col) {
   int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
   int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
   int channels_col = channels * kernel_h * kernel_w;
+  // Every row of data_col is written by one thread.
+#ifdef _OPENMP
+#pragma omp parallel for \
+    if (channels_col * height_col * width_col >= kParallelColSize)
+#endif
   for (int c = 0; c < channels_col; ++c) {
     int w_offset = c % kernel_w;
     int h_offset = (c / kernel_w) % kernel_h;
@@ -63,15 +78,39 @@ void im2col_cpu(const Dtype* data_im, const int channels,
         int h_pad = h * stride_h - pad_h + h_offset;
         int w_pad = w * stride_w - pad_w + w_offset;
         if (h_pad >= 0 && h_pad < height && w_pad >= 0 && w_pad < width)
-          data_col[(c * height_col + h) * width_col + w] =
+          data_col[c * row_stride + h * width_col + w] =
             data_im[(c_im * height + h_pad) * width + w_pad];
         else
-          data_col[(c * height_col + h) * width_col + w] = 0;
+          data_col[c * row_stride + h * width_col + w] = 0;
       }
     }
   }
 }
 
+// Explicit instantiation
+template void im2col_strided_cpu<float>(const float* data_im,
+    const int channels, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int row_stride,
+    float* data_col);
+template void im2col_strided_cpu<double>(const double* data_im,
+    const int channels, const int height, const int width,
+    const int kernel_h, const int kernel_w, const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w, const int row_stride,
+    double* data_col);
+
+template <typename Dtype>
+void im2col_cpu(const Dtype* data_im, const int channels,
+    const int height, const int width, const int kernel_h, const int kernel_w,
+    const int pad_h, const int pad_w,
+    const int stride_h, const int stride_w,
+    Dtype* data_col) {
+  int height_col = (height + 2 * pad_h - kernel_h) / stride_h + 1;
+  int width_col = (width + 2 * pad_w - kernel_w) / stride_w + 1;
+  im2col_strided_cpu(data_im, channels, height, width, kernel_h, kernel_w,
+      pad_h, pad_w, stride_h, stride_w, height_col * width_col, data_col);
+}
+
 // Explicit instantiation
 template void im2col_cpu<float>(const float* data_im, const int channels,
     const int height, const int width, const int kernel_h, const int kernel_w,
@@ -92,17 +131,25 @@ void col2im_cpu(const Dtype* data_col, const int channels,
   int height_col = (height + 2 * pad_h - patch_h) / stride_h + 1;
   int width_col = (width + 2 * pad_w - patch_w) / stride_w + 1;
   int channels_col = channels * patch_h * patch_w;
-  for (int c = 0; c < channels_col; ++c) {
-    int w_offset = c % patch_w;
-    int h_offset = (c / patch_w) % patch_h;
-    int c_im = c / patch_h / patch_w;
-    for (int h = 0; h < height_col; ++h) {
-      for (int w = 0; w < width_col; ++w) {
-        int h_pad = h * stride_h - pad_h + h_offset;
-        int w_pad = w * stride_w - pad_w + w_offset;
-        if (h_pad >= 0 && h_pad < height && w_pad >= 0 && w_pad < width)
-          data_im[(c_im * height + h_pad) * width + w_pad] +=
-              data_col[(c * height_col + h) * width_col + w];
+  // Rows of data_col from the same image channel add into the same pixels,
+  // so the threads split the image channels rather than the rows.
+#ifdef _OPENMP
+#pragma omp parallel for \
+    if (channels_col * height_col * width_col >= kParallelColSize)
+#endif
+  for (int c_im = 0; c_im < channels; ++c_im) {
+    for (int h_offset = 0; h_offset < patch_h; ++h_offset) {
+      for (int w_offset = 0; w_offset < patch_w; ++w_offset) {
+        int c = (c_im * patch_h + h_offset) * patch_w + w_offset;
+        for (int h = 0; h < height_col; ++h) {
+          for (int w = 0; w < width_col; ++w) {
+            int h_pad = h * stride_h - pad_h + h_offset;
+            int w_pad = w * stride_w - pad_w + w_offset;
+            if (h_pad >= 0 && h_pad < height && w_pad >= 0 && w_pad < width)
+              data_im[(c_im * height + h_pad) * width + w_pad] +=
+                  data_col[(c * height_col + h) * width_col + w];
+          }
+        }
       }
     }
   }
@@ -1,3 +1,4 @@
+#include <boost/thread.hpp>
 #include <fcntl.h>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
@@ -15,6 +16,7 @@
 
 #include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/hwc_to_chw.hpp"
 #include "caffe/util/io.hpp"
 
 const int kProtoReadBytesLimit = INT_MAX;  // Max size of 2 GB minus 1 byte.
@@ -98,28 +100,129 @@ cv::Mat ReadImageToCVMat(const string& filename,
 cv::Mat ReadImageToCVMat(const string& filename) {
   return ReadImageToCVMat(filename, 0, 0, true);
 }
+
+cv::Mat ReadImageToCVMatReduced(const string& filename,
+    const int height, const int width, const bool is_color,
+    const int reduce_factor) {
+#if defined(CV_VERSION_EPOCH) || CV_VERSION_MAJOR < 3 || \
+    (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR < 2)
+  // IMREAD_REDUCED_* was added in OpenCV 3.2.
+  return ReadImageToCVMat(filename, height, width, is_color);
+#else
+  int cv_read_flag;
+  switch (reduce_factor) {
+  case 2:
+    cv_read_flag = (is_color ? cv::IMREAD_REDUCED_COLOR_2 :
+        cv::IMREAD_REDUCED_GRAYSCALE_2);
+    break;
+  case 4:
+    cv_read_flag = (is_color ? cv::IMREAD_REDUCED_COLOR_4 :
+        cv::IMREAD_REDUCED_GRAYSCALE_4);
+    break;
+  case 8:
+    cv_read_flag = (is_color ? cv::IMREAD_REDUCED_COLOR_8 :
+        cv::IMREAD_REDUCED_GRAYSCALE_8);
+    break;
+  default:
+    return ReadImageToCVMat(filename, height, width, is_color);
+  }
+  cv::Mat cv_img;
+  cv::Mat cv_img_origin = cv::imread(filename, cv_read_flag);
+  if (!cv_img_origin.data) {
+    LOG(ERROR) << "Could not open or find file " << filename;
+    return cv_img_origin;
+  }
+  if (height > 0 && width > 0) {
+    cv::resize(cv_img_origin, cv_img, cv::Size(width, height));
+  } else {
+    cv_img = cv_img_origin;
+  }
+  return cv_img;
+#endif
+}
 // Do the file extension and encoding match?
 static bool matchExt(const std::string & fn,
                      std::string en) {
   size_t p = fn.rfind('.');
-  std::string ext = p != fn.npos ? fn.substr(p) : fn;
+  std::string ext = p != fn.npos ? fn.substr(p + 1) : fn;
   std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
   std::transform(en.begin(), en.end(), en.begin(), ::tolower);
+  if (!en.empty() && en[0] == '.')
+    en.erase(0, 1);
   if ( ext == en )
     return true;
   if ( en == "jpg" && ext == "jpeg" )
     return true;
   return false;
 }
+// Number of channels an unchanged decode of a PNG or JPEG gives, read from
+// its header (PNG IHDR, JPEG SOF) without decoding. Returns 0 if unknown.
+static int EncodedChannels(const std::string& data) {
+  const unsigned char* d =
+      reinterpret_cast<const unsigned char*>(data.data());
+  const size_t size = data.size();
+  static const unsigned char kPNG[8] = {0x89, 'P', 'N', 'G', '\r', '\n',
+                                        0x1a, '\n'};
+  if (size >= 26 && std::equal(kPNG, kPNG + 8, d) &&
+      !data.compare(12, 4, "IHDR")) {
+    switch (d[25]) {  // Color type.
+    case 0: return 1;
+    case 2: case 3: return 3;
+    case 4: return 2;
+    case 6: return 4;
+    default: return 0;
+    }
+  }
+  if (size < 4 || d[0] != 0xff || d[1] != 0xd8) {
+    return 0;
+  }
+  // Walk the JPEG markers up to the first start of frame.
+  size_t i = 2;
+  while (i + 4 <= size) {
+    if (d[i] != 0xff) {
+      return 0;
+    }
+    const unsigned char marker = d[i + 1];
+    if (marker == 0xff) {  // Fill byte.
+      ++i;
+      continue;
+    }
+    const size_t length = (d[i + 2] << 8) | d[i + 3];
+    if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 &&
+        marker != 0xc8 && marker != 0xcc) {
+      if (i + 9 >= size) {
+        return 0;
+      }
+      const int components = d[i + 9];
+      // CMYK and YCCK decode to three channels.
+      return components == 4 ? 3 : components;
+    }
+    if (marker == 0xd9 || marker == 0xda || length < 2) {
+      return 0;
+    }
+    i += 2 + length;
+  }
+  return 0;
+}
 bool ReadImageToDatum(const string& filename, const int label,
     const int height, const int width, const bool is_color,
     const std::string & encoding, Datum* datum) {
+  // The file already has the requested encoding: store its bytes as they
+  // are when its header gives the requested channels. Files with other
+  // channels, or a header we cannot read, are decoded and re-encoded.
+  if (encoding.size() && !height && !width && matchExt(filename, encoding)) {
+    if (!ReadFileToDatum(filename, label, datum)) {
+      LOG(ERROR) << "Could not open or find file " << filename;
+      return false;
+    }
+    const int channels = EncodedChannels(datum->data());
+    if (channels && (channels == 3) == is_color) {
+      return true;
+    }
+  }
   cv::Mat cv_img = ReadImageToCVMat(filename, height, width, is_color);
   if (cv_img.data) {
     if (encoding.size()) {
-      if ( (cv_img.channels() == 3) == is_color && !height && !width &&
-          matchExt(filename, encoding) )
-        return ReadFileToDatum(filename, label, datum);
       std::vector<uchar> buf;
       cv::imencode("."+encoding, cv_img, buf);
       datum->set_data(std::string(reinterpret_cast<char*>(&buf[0]),
@@ -214,18 +317,13 @@ void CVMatToDatum(const cv::Mat& cv_img, Datum* datum) {
   int datum_height = datum->height();
   int datum_width = datum->width();
   int datum_size = datum_channels * datum_height * datum_width;
-  std::string buffer(datum_size, ' ');
-  for (int h = 0; h < datum_height; ++h) {
-    const uchar* ptr = cv_img.ptr<uchar>(h);
-    int img_index = 0;
-    for (int w = 0; w < datum_width; ++w) {
-      for (int c = 0; c < datum_channels; ++c) {
-        int datum_index = (c * datum_height + h) * datum_width + w;
-        buffer[datum_index] = static_cast<char>(ptr[img_index++]);
-      }
-    }
+  // Deinterleave straight into the datum's own buffer.
+  string* data = datum->mutable_data();
+  data->resize(datum_size);
+  if (datum_size > 0) {
+    hwc_to_chw(cv_img.ptr<uint8_t>(0), datum_channels, datum_height,
+        datum_width, cv_img.step, reinterpret_cast<uint8_t*>(&(*data)[0]));
   }
-  datum->set_data(buffer);
 }
 
 bool ReadImagePairToBlobProtoVector(const string& imgname,
@@ -260,15 +358,9 @@ bool ReadImagePairToBlobProtoVector(const string& imgname,
   data_blob->set_height(cv_img.rows);
   data_blob->set_width(cv_img.cols);
   data_blob->clear_data();
-  ::google::protobuf::RepeatedField<float>* data_blob_string = data_blob->mutable_data();
-  for (int c = 0; c < 3; ++c) {
-    for (int h = 0; h < cv_img.rows; ++h) {
-      for (int w = 0; w < cv_img.cols; ++w) {
-        data_blob_string->Add(
-          static_cast<float>(cv_img.at<cv::Vec3b>(h, w)[c]));
-      }
-    }
-  }
+  data_blob->mutable_data()->Resize(3 * cv_img.rows * cv_img.cols, 0);
+  hwc_to_chw(cv_img.ptr<uint8_t>(0), 3, cv_img.rows, cv_img.cols,
+      cv_img.step, data_blob->mutable_data()->mutable_data());
 
   label_blob->set_num(1);
   label_blob->set_channels(1);
@@ -286,10 +378,9 @@ bool ReadImagePairToBlobProtoVector(const string& imgname,
 }
 
 // Verifies format of data stored in HDF5 file and reshapes blob accordingly.
-template <typename Dtype>
-void hdf5_load_nd_dataset_helper(
+void hdf5_get_nd_dataset_shape(
     hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
-    Blob<Dtype>* blob) {
+    vector<int>* shape) {
   // Verify that the dataset exists.
   CHECK(H5LTfind_dataset(file_id, dataset_name_))
       << "Failed to find HDF5 dataset " << dataset_name_;
@@ -309,10 +400,19 @@ void hdf5_load_nd_dataset_helper(
   CHECK_GE(status, 0) << "Failed to get dataset info for " << dataset_name_;
   CHECK_EQ(class_, H5T_FLOAT) << "Expected float or double data";
 
-  vector<int> blob_dims(dims.size());
+  shape->resize(dims.size());
   for (int i = 0; i < dims.size(); ++i) {
-    blob_dims[i] = dims[i];
+    (*shape)[i] = dims[i];
   }
+}
+
+template <typename Dtype>
+void hdf5_load_nd_dataset_helper(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    Blob<Dtype>* blob) {
+  vector<int> blob_dims;
+  hdf5_get_nd_dataset_shape(file_id, dataset_name_, min_dim, max_dim,
+      &blob_dims);
   blob->Reshape(blob_dims);
 }
 
@@ -334,6 +434,58 @@ void hdf5_load_nd_dataset<double>(hid_t file_id, const char* dataset_name_,
   CHECK_GE(status, 0) << "Failed to read double dataset " << dataset_name_;
 }
 
+// Reads the hyperslab of rows into blob as mem_type, which HDF5 converts to.
+template <typename Dtype>
+static void hdf5_load_rows_helper(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    int start, int num, hid_t mem_type, Blob<Dtype>* blob) {
+  vector<int> shape;
+  hdf5_get_nd_dataset_shape(file_id, dataset_name_, min_dim, max_dim, &shape);
+  CHECK_GE(start, 0);
+  CHECK_LE(start + num, shape[0]) << "Rows out of range for dataset "
+      << dataset_name_;
+  shape[0] = num;
+  blob->Reshape(shape);
+  std::vector<hsize_t> offset(shape.size(), 0);
+  std::vector<hsize_t> count(shape.begin(), shape.end());
+  offset[0] = start;
+
+  hid_t dataset = H5Dopen2(file_id, dataset_name_, H5P_DEFAULT);
+  CHECK_GE(dataset, 0) << "Failed to open HDF5 dataset " << dataset_name_;
+  hid_t file_space = H5Dget_space(dataset);
+  herr_t status = H5Sselect_hyperslab(file_space, H5S_SELECT_SET,
+      offset.data(), NULL, count.data(), NULL);
+  CHECK_GE(status, 0) << "Failed to select rows of " << dataset_name_;
+  hid_t mem_space = H5Screate_simple(count.size(), count.data(), NULL);
+  status = H5Dread(dataset, mem_type, mem_space, file_space, H5P_DEFAULT,
+      blob->mutable_cpu_data());
+  CHECK_GE(status, 0) << "Failed to read rows of " << dataset_name_;
+  H5Sclose(mem_space);
+  H5Sclose(file_space);
+  H5Dclose(dataset);
+}
+
+template <>
+void hdf5_load_nd_dataset_rows<float>(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    int start, int num, Blob<float>* blob) {
+  hdf5_load_rows_helper(file_id, dataset_name_, min_dim, max_dim, start, num,
+      H5T_NATIVE_FLOAT, blob);
+}
+
+template <>
+void hdf5_load_nd_dataset_rows<double>(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    int start, int num, Blob<double>* blob) {
+  hdf5_load_rows_helper(file_id, dataset_name_, min_dim, max_dim, start, num,
+      H5T_NATIVE_DOUBLE, blob);
+}
+
+boost::mutex& hdf5_mutex() {
+  static boost::mutex mutex;
+  return mutex;
+}
+
 template <>
 void hdf5_save_nd_dataset<float>(
     const hid_t file_id, const string& dataset_name, const Blob<float>& blob) {
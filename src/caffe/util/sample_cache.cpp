@@ -0,0 +1,266 @@
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/rng.hpp"
+#include "caffe/util/sample_cache.hpp"
+
+namespace caffe {
+
+namespace {
+
+enum PixelType { UINT8_PIXELS = 0, FLOAT_PIXELS = 1 };
+
+template <typename T>
+inline void Append(const T& value, vector<char>* buffer) {
+  const char* p = reinterpret_cast<const char*>(&value);
+  buffer->insert(buffer->end(), p, p + sizeof(T));
+}
+
+template <typename T>
+inline T Read(const char** p) {
+  T value;
+  memcpy(&value, *p, sizeof(T));
+  *p += sizeof(T);
+  return value;
+}
+
+// Serialized layout of a sample: the number of datums, then for each datum
+// channels, height, width, label, the pixel type and the pixels.
+void SerializeSample(const vector<Datum>& sample, vector<char>* buffer) {
+  buffer->clear();
+  Append<int32_t>(sample.size(), buffer);
+  for (int i = 0; i < sample.size(); ++i) {
+    const Datum& datum = sample[i];
+    CHECK(!datum.encoded()) << "Decode the datum before caching it.";
+    const int count = datum.channels() * datum.height() * datum.width();
+    Append<int32_t>(datum.channels(), buffer);
+    Append<int32_t>(datum.height(), buffer);
+    Append<int32_t>(datum.width(), buffer);
+    Append<int32_t>(datum.label(), buffer);
+    if (datum.data().size() > 0) {
+      CHECK_EQ(datum.data().size(), count);
+      Append<uint8_t>(UINT8_PIXELS, buffer);
+      buffer->insert(buffer->end(), datum.data().begin(), datum.data().end());
+      continue;
+    }
+    CHECK_EQ(datum.float_data_size(), count);
+    const float* data = datum.float_data().data();
+    bool is_uint8 = true;
+    for (int j = 0; j < count && is_uint8; ++j) {
+      is_uint8 = data[j] >= 0 && data[j] <= 255 &&
+          data[j] == static_cast<int>(data[j]);
+    }
+    Append<uint8_t>(is_uint8 ? UINT8_PIXELS : FLOAT_PIXELS, buffer);
+    if (is_uint8) {
+      for (int j = 0; j < count; ++j) {
+        buffer->push_back(static_cast<char>(static_cast<uint8_t>(data[j])));
+      }
+    } else {
+      const char* p = reinterpret_cast<const char*>(data);
+      buffer->insert(buffer->end(), p, p + count * sizeof(float));
+    }
+  }
+}
+
+void DeserializeSample(const char* p, vector<Datum>* sample) {
+  sample->resize(Read<int32_t>(&p));
+  for (int i = 0; i < sample->size(); ++i) {
+    Datum* datum = &(*sample)[i];
+    datum->Clear();
+    datum->set_channels(Read<int32_t>(&p));
+    datum->set_height(Read<int32_t>(&p));
+    datum->set_width(Read<int32_t>(&p));
+    datum->set_label(Read<int32_t>(&p));
+    const int count = datum->channels() * datum->height() * datum->width();
+    if (Read<uint8_t>(&p) == UINT8_PIXELS) {
+      // Pixels that were float_data come back as data; DataTransformer
+      // treats both the same.
+      datum->set_data(p, count);
+      p += count;
+    } else {
+      datum->mutable_float_data()->Resize(count, 0);
+      memcpy(datum->mutable_float_data()->mutable_data(), p,
+          count * sizeof(float));
+      p += count * sizeof(float);
+    }
+  }
+}
+
+}  // namespace
+
+SampleCache::SampleCache(const size_t capacity_bytes, const bool shuffle)
+    : capacity_bytes_(capacity_bytes), shuffle_(shuffle), used_bytes_(0),
+      in_memory_(false), next_key_(0), hits_(0), misses_(0) {
+  if (shuffle_) {
+    rng_.reset(new Caffe::RNG(caffe_rng_rand()));
+  }
+}
+
+bool SampleCache::Get(const string& key, vector<Datum>* sample) {
+  map<string, Entry>::iterator it = entries_.find(key);
+  if (it == entries_.end()) {
+    ++misses_;
+    return false;
+  }
+  ++hits_;
+  Entry& entry = it->second;
+  lru_.splice(lru_.begin(), lru_, entry.lru);
+  if (!in_memory_) {
+    pass_keys_.push_back(key);
+  }
+  DeserializeSample(&arena_[entry.offset], sample);
+  return true;
+}
+
+bool SampleCache::Put(const string& key, const vector<Datum>& sample) {
+  pass_keys_.push_back(key);
+  if (entries_.count(key)) {
+    return true;
+  }
+  SerializeSample(sample, &buffer_);
+  const size_t bytes = buffer_.size();
+  if (bytes > capacity_bytes_) {
+    return false;
+  }
+  while (capacity_bytes_ - used_bytes_ < bytes) {
+    Evict();
+  }
+  size_t offset;
+  if (!Allocate(bytes, &offset)) {
+    if (arena_.size() < capacity_bytes_) {
+      Grow(bytes);
+    }
+    if (!Allocate(bytes, &offset)) {
+      Compact();
+      CHECK(Allocate(bytes, &offset));
+    }
+  }
+  memcpy(&arena_[offset], &buffer_[0], bytes);
+  used_bytes_ += bytes;
+  Entry& entry = entries_[key];
+  entry.offset = offset;
+  entry.bytes = bytes;
+  lru_.push_front(key);
+  entry.lru = lru_.begin();
+  return true;
+}
+
+bool SampleCache::Allocate(const size_t bytes, size_t* offset) {
+  for (map<size_t, size_t>::iterator it = free_ranges_.begin();
+       it != free_ranges_.end(); ++it) {
+    if (it->second < bytes) {
+      continue;
+    }
+    *offset = it->first;
+    const size_t rest = it->second - bytes;
+    free_ranges_.erase(it);
+    if (rest > 0) {
+      free_ranges_[*offset + bytes] = rest;
+    }
+    return true;
+  }
+  return false;
+}
+
+void SampleCache::Free(const size_t offset, const size_t bytes) {
+  map<size_t, size_t>::iterator it =
+      free_ranges_.insert(std::make_pair(offset, bytes)).first;
+  map<size_t, size_t>::iterator next = it;
+  ++next;
+  if (next != free_ranges_.end() && it->first + it->second == next->first) {
+    it->second += next->second;
+    free_ranges_.erase(next);
+  }
+  if (it != free_ranges_.begin()) {
+    map<size_t, size_t>::iterator prev = it;
+    --prev;
+    if (prev->first + prev->second == it->first) {
+      prev->second += it->second;
+      free_ranges_.erase(it);
+    }
+  }
+}
+
+void SampleCache::Grow(const size_t bytes) {
+  // Doubling keeps the copies of a growing arena linear in its size.
+  const size_t old_size = arena_.size();
+  const size_t new_size = std::min(capacity_bytes_,
+      std::max(2 * old_size, old_size + bytes));
+  arena_.resize(new_size);
+  Free(old_size, new_size - old_size);
+}
+
+void SampleCache::Compact() {
+  vector<std::pair<size_t, Entry*> > by_offset;
+  for (map<string, Entry>::iterator it = entries_.begin();
+       it != entries_.end(); ++it) {
+    by_offset.push_back(std::make_pair(it->second.offset, &it->second));
+  }
+  std::sort(by_offset.begin(), by_offset.end());
+  size_t offset = 0;
+  for (int i = 0; i < by_offset.size(); ++i) {
+    Entry* entry = by_offset[i].second;
+    if (entry->offset != offset) {
+      memmove(&arena_[offset], &arena_[entry->offset], entry->bytes);
+      entry->offset = offset;
+    }
+    offset += entry->bytes;
+  }
+  free_ranges_.clear();
+  if (offset < arena_.size()) {
+    free_ranges_[offset] = arena_.size() - offset;
+  }
+}
+
+void SampleCache::Evict() {
+  CHECK(!lru_.empty());
+  map<string, Entry>::iterator it = entries_.find(lru_.back());
+  Free(it->second.offset, it->second.bytes);
+  used_bytes_ -= it->second.bytes;
+  entries_.erase(it);
+  lru_.pop_back();
+}
+
+bool SampleCache::EndEpoch(const bool complete) {
+  if (in_memory_) {
+    return true;
+  }
+  bool resident = complete && pass_keys_.size() > 0;
+  for (int i = 0; i < pass_keys_.size() && resident; ++i) {
+    resident = entries_.count(pass_keys_[i]) > 0;
+  }
+  if (resident) {
+    in_memory_ = true;
+    next_key_ = pass_keys_.size();
+    LogStats("holds the whole source");
+  } else {
+    pass_keys_.clear();
+    LogStats("epoch");
+  }
+  return in_memory_;
+}
+
+void SampleCache::Next(vector<Datum>* sample) {
+  CHECK(in_memory_);
+  if (next_key_ >= pass_keys_.size()) {
+    if (shuffle_) {
+      caffe::rng_t* rng = static_cast<caffe::rng_t*>(rng_->generator());
+      shuffle(pass_keys_.begin(), pass_keys_.end(), rng);
+    }
+    next_key_ = 0;
+  }
+  CHECK(Get(pass_keys_[next_key_++], sample));
+}
+
+void SampleCache::LogStats(const char* event) const {
+  LOG(INFO) << "Sample cache " << event << ": " << size() << " samples in "
+      << bytes() / 1048576.0 << " MB, hit rate " << 100 * hit_rate() << "%";
+}
+
+}  // namespace caffe
@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <cstring>
+
+#include "caffe/common.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/winograd.hpp"
+
+namespace caffe {
+
+namespace {
+
+// Transforms with fewer channels x tiles than this stay on one thread.
+const int kParallelTiles = 256;
+
+// The filter transforms G of Lavin and Gray, "Fast Algorithms for
+// Convolutional Neural Networks", alpha x 3 with alpha = m + 2. Their B^T
+// and A^T are written out in the row transforms below. G is kept in
+// double, so the double transforms are as accurate as double allows.
+const double kG2[4 * 3] = {
+  1,    0,   0,
+  0.5,  0.5, 0.5,
+  0.5, -0.5, 0.5,
+  0,    0,   1,
+};
+const double kG4[6 * 3] = {
+  1. / 4,   0,         0,
+  -1. / 6,  -1. / 6,   -1. / 6,
+  -1. / 6,  1. / 6,    -1. / 6,
+  1. / 24,  1. / 12,   1. / 6,
+  1. / 24,  -1. / 12,  1. / 6,
+  0,        0,         1,
+};
+
+int Alpha(const int tile) {
+  CHECK(tile == 2 || tile == 4) << "Winograd tile must be 2 or 4";
+  return tile + 2;
+}
+
+// y = B^T x for x and y of alpha elements spaced by the strides.
+template <typename Dtype>
+inline void InputRow2(const Dtype* x, const int sx, Dtype* y, const int sy) {
+  const Dtype x0 = x[0], x1 = x[sx], x2 = x[2 * sx], x3 = x[3 * sx];
+  y[0] = x0 - x2;
+  y[sy] = x1 + x2;
+  y[2 * sy] = x2 - x1;
+  y[3 * sy] = x1 - x3;
+}
+
+template <typename Dtype>
+inline void InputRow4(const Dtype* x, const int sx, Dtype* y, const int sy) {
+  const Dtype x0 = x[0], x1 = x[sx], x2 = x[2 * sx], x3 = x[3 * sx],
+      x4 = x[4 * sx], x5 = x[5 * sx];
+  y[0] = 4 * x0 - 5 * x2 + x4;
+  y[sy] = x3 + x4 - 4 * (x1 + x2);
+  y[2 * sy] = x4 - x3 + 4 * (x1 - x2);
+  y[3 * sy] = x4 - x2 + 2 * (x3 - x1);
+  y[4 * sy] = x4 - x2 + 2 * (x1 - x3);
+  y[5 * sy] = 4 * x1 - 5 * x3 + x5;
+}
+
+// y = A^T x for x of alpha and y of m elements.
+template <typename Dtype>
+inline void OutputRow2(const Dtype* x, const int sx, Dtype* y, const int sy) {
+  const Dtype x0 = x[0], x1 = x[sx], x2 = x[2 * sx], x3 = x[3 * sx];
+  y[0] = x0 + x1 + x2;
+  y[sy] = x1 - x2 - x3;
+}
+
+template <typename Dtype>
+inline void OutputRow4(const Dtype* x, const int sx, Dtype* y, const int sy) {
+  const Dtype x0 = x[0], x1 = x[sx], x2 = x[2 * sx], x3 = x[3 * sx],
+      x4 = x[4 * sx], x5 = x[5 * sx];
+  const Dtype sum12 = x1 + x2, diff12 = x1 - x2;
+  const Dtype sum34 = x3 + x4, diff34 = x3 - x4;
+  y[0] = x0 + sum12 + sum34;
+  y[sy] = diff12 + 2 * diff34;
+  y[2 * sy] = sum12 + 4 * sum34;
+  y[3 * sy] = diff12 + 8 * diff34 + x5;
+}
+
+// V = B^T d B for the alpha x alpha tile d.
+template <typename Dtype>
+inline void InputTile(const int alpha, const Dtype* d, Dtype* v) {
+  Dtype t[6 * 6];
+  for (int j = 0; j < alpha; ++j) {
+    if (alpha == 4) {
+      InputRow2(d + j, alpha, t + j, alpha);
+    } else {
+      InputRow4(d + j, alpha, t + j, alpha);
+    }
+  }
+  for (int i = 0; i < alpha; ++i) {
+    if (alpha == 4) {
+      InputRow2(t + i * alpha, 1, v + i * alpha, 1);
+    } else {
+      InputRow4(t + i * alpha, 1, v + i * alpha, 1);
+    }
+  }
+}
+
+// Y = A^T M A for the alpha x alpha tile M and the m x m tile Y.
+template <typename Dtype>
+inline void OutputTile(const int alpha, const Dtype* mt, Dtype* y) {
+  const int m = alpha - 2;
+  Dtype t[4 * 6];
+  for (int j = 0; j < alpha; ++j) {
+    if (alpha == 4) {
+      OutputRow2(mt + j, alpha, t + j, alpha);
+    } else {
+      OutputRow4(mt + j, alpha, t + j, alpha);
+    }
+  }
+  for (int i = 0; i < m; ++i) {
+    if (alpha == 4) {
+      OutputRow2(t + i * alpha, 1, y + i * m, 1);
+    } else {
+      OutputRow4(t + i * alpha, 1, y + i * m, 1);
+    }
+  }
+}
+
+}  // namespace
+
+int winograd_filters_size(const int tile, const int out_channels,
+    const int in_channels) {
+  const int alpha = Alpha(tile);
+  return alpha * alpha * out_channels * in_channels;
+}
+
+template <typename Dtype>
+void winograd_transform_filters(const int tile, const Dtype* weights,
+    const int out_channels, const int in_channels, const bool flip,
+    Dtype* transformed) {
+  const int alpha = Alpha(tile);
+  const double* G = alpha == 4 ? kG2 : kG4;
+  // transformed is alpha^2 x rows x cols, each element of the tile holding
+  // the filter matrix of one GEMM.
+  const int rows = flip ? in_channels : out_channels;
+  const int cols = flip ? out_channels : in_channels;
+  for (int k = 0; k < out_channels; ++k) {
+    for (int c = 0; c < in_channels; ++c) {
+      const Dtype* g = weights + (k * in_channels + c) * 9;
+      Dtype f[9];
+      for (int i = 0; i < 9; ++i) {
+        f[i] = flip ? g[8 - i] : g[i];
+      }
+      // G f G^T
+      Dtype gf[6 * 3];
+      for (int i = 0; i < alpha; ++i) {
+        for (int j = 0; j < 3; ++j) {
+          Dtype sum = 0;
+          for (int l = 0; l < 3; ++l) {
+            sum += Dtype(G[i * 3 + l]) * f[l * 3 + j];
+          }
+          gf[i * 3 + j] = sum;
+        }
+      }
+      const int row = flip ? c : k;
+      const int col = flip ? k : c;
+      for (int i = 0; i < alpha; ++i) {
+        for (int j = 0; j < alpha; ++j) {
+          Dtype sum = 0;
+          for (int l = 0; l < 3; ++l) {
+            sum += gf[i * 3 + l] * Dtype(G[j * 3 + l]);
+          }
+          transformed[((i * alpha + j) * rows + row) * cols + col] = sum;
+        }
+      }
+    }
+  }
+}
+
+template void winograd_transform_filters<float>(const int tile,
+    const float* weights, const int out_channels, const int in_channels,
+    const bool flip, float* transformed);
+template void winograd_transform_filters<double>(const int tile,
+    const double* weights, const int out_channels, const int in_channels,
+    const bool flip, double* transformed);
+
+int winograd_workspace_size(const int tile, const int channels,
+    const int out_channels, const int height_out, const int width_out) {
+  const int alpha = Alpha(tile);
+  const int num_tiles = ((height_out + tile - 1) / tile) *
+      ((width_out + tile - 1) / tile);
+  return alpha * alpha * num_tiles * (channels + out_channels);
+}
+
+template <typename Dtype>
+void winograd_conv_cpu(const int tile, const Dtype* data_im,
+    const int channels, const int height, const int width, const int pad_h,
+    const int pad_w, const Dtype* filters, const int out_channels,
+    Dtype* workspace, Dtype* data_out) {
+  const int m = tile;
+  const int alpha = Alpha(tile);
+  const int height_out = height + 2 * pad_h - 2;
+  const int width_out = width + 2 * pad_w - 2;
+  const int tiles_w = (width_out + m - 1) / m;
+  const int num_tiles = ((height_out + m - 1) / m) * tiles_w;
+  // The transformed input and the products, alpha^2 x channels x tiles and
+  // alpha^2 x out_channels x tiles.
+  Dtype* input_t = workspace;
+  Dtype* output_t = workspace + alpha * alpha * channels * num_tiles;
+  const int input_stride = channels * num_tiles;
+  const int output_stride = out_channels * num_tiles;
+
+  // B^T d B for every input tile d.
+#ifdef _OPENMP
+#pragma omp parallel for if (channels * num_tiles >= kParallelTiles)
+#endif
+  for (int c = 0; c < channels; ++c) {
+    const Dtype* im = data_im + c * height * width;
+    Dtype* v_c = input_t + c * num_tiles;
+    Dtype d[6 * 6];
+    Dtype v[6 * 6];
+    for (int p = 0; p < num_tiles; ++p) {
+      const int y0 = p / tiles_w * m - pad_h;
+      const int x0 = p % tiles_w * m - pad_w;
+      if (y0 >= 0 && y0 + alpha <= height && x0 >= 0 && x0 + alpha <= width) {
+        for (int i = 0; i < alpha; ++i) {
+          std::copy(im + (y0 + i) * width + x0,
+              im + (y0 + i) * width + x0 + alpha, d + i * alpha);
+        }
+      } else {
+        for (int i = 0; i < alpha; ++i) {
+          const int y = y0 + i;
+          for (int j = 0; j < alpha; ++j) {
+            const int x = x0 + j;
+            d[i * alpha + j] = (y >= 0 && y < height && x >= 0 && x < width) ?
+                im[y * width + x] : Dtype(0);
+          }
+        }
+      }
+      InputTile(alpha, d, v);
+      for (int e = 0; e < alpha * alpha; ++e) {
+        v_c[e * input_stride + p] = v[e];
+      }
+    }
+  }
+
+  // The element-wise products summed over the channels: one GEMM per
+  // element of the transformed tile.
+  for (int e = 0; e < alpha * alpha; ++e) {
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, out_channels,
+        num_tiles, channels, (Dtype)1., filters + e * out_channels * channels,
+        input_t + e * input_stride, (Dtype)0., output_t + e * output_stride);
+  }
+
+  // A^T M A back to m x m output tiles, clipped at the border.
+#ifdef _OPENMP
+#pragma omp parallel for if (out_channels * num_tiles >= kParallelTiles)
+#endif
+  for (int k = 0; k < out_channels; ++k) {
+    Dtype* out = data_out + k * height_out * width_out;
+    const Dtype* m_k = output_t + k * num_tiles;
+    Dtype mt[6 * 6];
+    Dtype y[4 * 4];
+    for (int p = 0; p < num_tiles; ++p) {
+      for (int e = 0; e < alpha * alpha; ++e) {
+        mt[e] = m_k[e * output_stride + p];
+      }
+      OutputTile(alpha, mt, y);
+      const int y0 = p / tiles_w * m;
+      const int x0 = p % tiles_w * m;
+      const int rows = std::min(m, height_out - y0);
+      const int cols = std::min(m, width_out - x0);
+      for (int i = 0; i < rows; ++i) {
+        std::copy(y + i * m, y + i * m + cols,
+            out + (y0 + i) * width_out + x0);
+      }
+    }
+  }
+}
+
+template void winograd_conv_cpu<float>(const int tile, const float* data_im,
+    const int channels, const int height, const int width, const int pad_h,
+    const int pad_w, const float* filters, const int out_channels,
+    float* workspace, float* data_out);
+template void winograd_conv_cpu<double>(const int tile,
+    const double* data_im, const int channels, const int height,
+    const int width, const int pad_h, const int pad_w, const double* filters,
+    const int out_channels, double* workspace, double* data_out);
+
+}  // namespace caffe
@@ -1,14 +1,19 @@
 #include <stdint.h>
 #include <algorithm>
+#include <cmath>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "boost/bind.hpp"
 #include "boost/scoped_ptr.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread.hpp"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 
@@ -17,9 +22,173 @@ using namespace caffe;  // NOLINT(build/namespaces)
 using std::max;
 using std::pair;
 using boost::scoped_ptr;
+using boost::shared_ptr;
 
 DEFINE_string(backend, "lmdb",
         "The backend {leveldb, lmdb} containing the images");
+DEFINE_int32(threads, 0,
+        "Number of threads parsing the records, 0 for one per core");
+DEFINE_bool(map_data, false,
+        "Records are BlobProtoVector maps (as read by MapData layers) rather"
+        " than Datum; statistics are computed for every map and the mean of"
+        " the first one is written");
+
+// Running statistics of one blob of the records, accumulated in double. The
+// element means follow Welford's update, the per-channel mean and sum of
+// squared deviations (m2) are merged per record and across threads with
+// Chan et al.'s pairwise formula, so no large sums are ever formed.
+class BlobStats {
+ public:
+  BlobStats() : num_(0), channels_(0), height_(0), width_(0) {}
+
+  template <typename T>
+  void Add(const T* data, const int channels, const int height,
+      const int width) {
+    if (num_ == 0) {
+      Reset(channels, height, width);
+    }
+    CHECK(channels == channels_ && height == height_ && width == width_)
+        << "Incorrect data shape " << channels << "x" << height << "x"
+        << width << ", expected " << channels_ << "x" << height_ << "x"
+        << width_;
+    ++num_;
+    const int dim = height_ * width_;
+    for (int i = 0; i < mean_.size(); ++i) {
+      mean_[i] += (static_cast<double>(data[i]) - mean_[i]) / num_;
+    }
+    for (int c = 0; c < channels_; ++c) {
+      const T* plane = data + c * dim;
+      double sum = 0;
+      for (int i = 0; i < dim; ++i) {
+        sum += plane[i];
+      }
+      const double plane_mean = sum / dim;
+      double m2 = 0;
+      for (int i = 0; i < dim; ++i) {
+        const double d = plane[i] - plane_mean;
+        m2 += d * d;
+      }
+      MergeChannel(c, dim, plane_mean, m2);
+    }
+  }
+
+  void Merge(const BlobStats& other) {
+    if (other.num_ == 0) {
+      return;
+    }
+    if (num_ == 0) {
+      *this = other;
+      return;
+    }
+    CHECK(other.channels_ == channels_ && other.height_ == height_ &&
+        other.width_ == width_) << "Records differ in shape";
+    const double weight = static_cast<double>(other.num_) /
+        (num_ + other.num_);
+    num_ += other.num_;
+    for (int i = 0; i < mean_.size(); ++i) {
+      mean_[i] += (other.mean_[i] - mean_[i]) * weight;
+    }
+    for (int c = 0; c < channels_; ++c) {
+      MergeChannel(c, other.channel_n_[c], other.channel_mean_[c],
+          other.channel_m2_[c]);
+    }
+  }
+
+  // The element-wise mean as a 1 x channels x height x width blob.
+  void MeanToProto(BlobProto* blob) const {
+    blob->set_num(1);
+    blob->set_channels(channels_);
+    blob->set_height(height_);
+    blob->set_width(width_);
+    blob->clear_data();
+    for (int i = 0; i < mean_.size(); ++i) {
+      blob->add_data(static_cast<float>(mean_[i]));
+    }
+  }
+
+  int num() const { return num_; }
+  int channels() const { return channels_; }
+  double channel_mean(const int c) const { return channel_mean_[c]; }
+  double channel_std(const int c) const {
+    return std::sqrt(channel_m2_[c] / channel_n_[c]);
+  }
+
+ private:
+  void Reset(const int channels, const int height, const int width) {
+    channels_ = channels;
+    height_ = height;
+    width_ = width;
+    mean_.assign(channels * height * width, 0);
+    channel_n_.assign(channels, 0);
+    channel_mean_.assign(channels, 0);
+    channel_m2_.assign(channels, 0);
+  }
+
+  void MergeChannel(const int c, const double n, const double mean,
+      const double m2) {
+    const double total = channel_n_[c] + n;
+    const double delta = mean - channel_mean_[c];
+    channel_mean_[c] += delta * n / total;
+    channel_m2_[c] += m2 + delta * delta * channel_n_[c] * n / total;
+    channel_n_[c] = total;
+  }
+
+  int num_;
+  int channels_;
+  int height_;
+  int width_;
+  vector<double> mean_;
+  vector<double> channel_n_;
+  vector<double> channel_mean_;
+  vector<double> channel_m2_;
+};
+
+void AddDatum(const string& value, vector<BlobStats>* stats) {
+  Datum datum;
+  datum.ParseFromString(value);
+  DecodeDatumNative(&datum);
+  const std::string& data = datum.data();
+  const int data_size = datum.channels() * datum.height() * datum.width();
+  if (data.size() != 0) {
+    CHECK_EQ(data.size(), data_size) << "Incorrect data field size";
+    (*stats)[0].Add(reinterpret_cast<const uint8_t*>(data.data()),
+        datum.channels(), datum.height(), datum.width());
+  } else {
+    CHECK_EQ(datum.float_data_size(), data_size)
+        << "Incorrect data field size";
+    (*stats)[0].Add(datum.float_data().data(), datum.channels(),
+        datum.height(), datum.width());
+  }
+}
+
+void AddMaps(const string& value, vector<BlobStats>* stats) {
+  BlobProtoVector maps;
+  maps.ParseFromString(value);
+  CHECK_EQ(maps.blobs_size(), stats->size())
+      << "Records differ in their number of maps";
+  for (int i = 0; i < maps.blobs_size(); ++i) {
+    const BlobProto& map = maps.blobs(i);
+    CHECK_EQ(map.data_size(), map.channels() * map.height() * map.width())
+        << "Incorrect data field size";
+    (*stats)[i].Add(map.data().data(), map.channels(), map.height(),
+        map.width());
+  }
+}
+
+// Parses and accumulates the records that the reader queues in full_slots,
+// until it pops -1, and hands their slots back through free_slots.
+void ComputeStats(const vector<string>* records,
+    BlockingQueue<int>* free_slots, BlockingQueue<int>* full_slots,
+    vector<BlobStats>* stats) {
+  for (int slot = full_slots->pop(); slot >= 0; slot = full_slots->pop()) {
+    if (FLAGS_map_data) {
+      AddMaps((*records)[slot], stats);
+    } else {
+      AddDatum((*records)[slot], stats);
+    }
+    free_slots->push(slot);
+  }
+}
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
@@ -29,7 +198,7 @@ int main(int argc, char** argv) {
 #endif
 
   gflags::SetUsageMessage("Compute the mean_image of a set of images given by"
-        " a leveldb/lmdb\n"
+        " a leveldb/lmdb, and the mean and standard deviation of each channel\n"
         "Usage:\n"
         "    compute_image_mean [FLAGS] INPUT_DB [OUTPUT_FILE]\n");
 
@@ -42,78 +211,78 @@ int main(int argc, char** argv) {
 
   scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
   db->Open(argv[1], db::READ);
-  scoped_ptr<db::Cursor> cursor(db->NewCursor());
 
-  BlobProto sum_blob;
-  int count = 0;
-  // load first datum
-  Datum datum;
-  datum.ParseFromString(cursor->value());
-
-  if (DecodeDatumNative(&datum)) {
-    LOG(INFO) << "Decoding Datum";
+  // The number of maps per record comes from the first one.
+  int num_blobs = 1;
+  {
+    scoped_ptr<db::Cursor> cursor(db->NewCursor());
+    CHECK(cursor->valid()) << "The database is empty";
+    if (FLAGS_map_data) {
+      BlobProtoVector maps;
+      maps.ParseFromString(cursor->value());
+      num_blobs = maps.blobs_size();
+      CHECK_GT(num_blobs, 0) << "Records have no maps";
+    }
   }
 
-  sum_blob.set_num(1);
-  sum_blob.set_channels(datum.channels());
-  sum_blob.set_height(datum.height());
-  sum_blob.set_width(datum.width());
-  const int data_size = datum.channels() * datum.height() * datum.width();
-  int size_in_datum = std::max<int>(datum.data().size(),
-                                    datum.float_data_size());
-  for (int i = 0; i < size_in_datum; ++i) {
-    sum_blob.add_data(0.);
-  }
-  LOG(INFO) << "Starting Iteration";
-  while (cursor->valid()) {
-    Datum datum;
-    datum.ParseFromString(cursor->value());
-    DecodeDatumNative(&datum);
-
-    const std::string& data = datum.data();
-    size_in_datum = std::max<int>(datum.data().size(),
-        datum.float_data_size());
-    CHECK_EQ(size_in_datum, data_size) << "Incorrect data field size " <<
-        size_in_datum;
-    if (data.size() != 0) {
-      CHECK_EQ(data.size(), size_in_datum);
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) + (uint8_t)data[i]);
-      }
-    } else {
-      CHECK_EQ(datum.float_data_size(), size_in_datum);
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) +
-            static_cast<float>(datum.float_data(i)));
-      }
-    }
-    ++count;
-    if (count % 10000 == 0) {
-      LOG(INFO) << "Processed " << count << " files.";
+  const int num_threads = FLAGS_threads > 0 ? FLAGS_threads :
+      std::max<int>(boost::thread::hardware_concurrency(), 1);
+  LOG(INFO) << "Starting Iteration with " << num_threads << " workers";
+  // This thread reads each record once into a free slot, and the workers
+  // parse them; a few slots per worker keep them all busy.
+  vector<string> records(4 * num_threads);
+  BlockingQueue<int> free_slots;
+  BlockingQueue<int> full_slots;
+  for (int i = 0; i < records.size(); ++i) {
+    free_slots.push(i);
+  }
+  vector<vector<BlobStats> > thread_stats(num_threads,
+      vector<BlobStats>(num_blobs));
+  boost::thread_group workers;
+  for (int i = 0; i < num_threads; ++i) {
+    workers.create_thread(boost::bind(&ComputeStats, &records, &free_slots,
+        &full_slots, &thread_stats[i]));
+  }
+  scoped_ptr<db::Cursor> cursor(db->NewCursor());
+  int count = 0;
+  for (cursor->SeekToFirst(); cursor->valid(); cursor->Next()) {
+    const int slot = free_slots.pop();
+    records[slot] = cursor->value();
+    full_slots.push(slot);
+    if (++count % 10000 == 0) {
+      LOG(INFO) << "Read " << count << " files.";
     }
-    cursor->Next();
   }
-
-  if (count % 10000 != 0) {
-    LOG(INFO) << "Processed " << count << " files.";
+  for (int i = 0; i < num_threads; ++i) {
+    full_slots.push(-1);
   }
-  for (int i = 0; i < sum_blob.data_size(); ++i) {
-    sum_blob.set_data(i, sum_blob.data(i) / count);
+  workers.join_all();
+
+  vector<BlobStats> stats(num_blobs);
+  for (int i = 0; i < num_threads; ++i) {
+    for (int j = 0; j < num_blobs; ++j) {
+      stats[j].Merge(thread_stats[i][j]);
+    }
   }
+  LOG(INFO) << "Processed " << stats[0].num() << " files.";
+
   // Write to disk
   if (argc == 3) {
     LOG(INFO) << "Write to " << argv[2];
-    WriteProtoToBinaryFile(sum_blob, argv[2]);
-  }
-  const int channels = sum_blob.channels();
-  const int dim = sum_blob.height() * sum_blob.width();
-  std::vector<float> mean_values(channels, 0.0);
-  LOG(INFO) << "Number of channels: " << channels;
-  for (int c = 0; c < channels; ++c) {
-    for (int i = 0; i < dim; ++i) {
-      mean_values[c] += sum_blob.data(dim * c + i);
+    BlobProto mean_blob;
+    stats[0].MeanToProto(&mean_blob);
+    WriteProtoToBinaryFile(mean_blob, argv[2]);
+  }
+  for (int j = 0; j < num_blobs; ++j) {
+    if (FLAGS_map_data) {
+      LOG(INFO) << "Map " << j << ":";
+    }
+    LOG(INFO) << "Number of channels: " << stats[j].channels();
+    for (int c = 0; c < stats[j].channels(); ++c) {
+      LOG(INFO) << "mean_value channel [" << c << "]:"
+                << stats[j].channel_mean(c) << " std: "
+                << stats[j].channel_std(c);
     }
-    LOG(INFO) << "mean_value channel [" << c << "]:" << mean_values[c] / dim;
   }
   return 0;
 }
@@ -18,6 +18,7 @@
 
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/db.hpp"
+#include "caffe/util/hwc_to_chw.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/rng.hpp"
 
@@ -51,16 +52,8 @@ void CVMatToBlobProto(const cv::Mat& cv_img, BlobProto* blob) {
   int blob_width = blob->width();
   int blob_size = blob_channels * blob_height * blob_width;
   blob->mutable_data()->Resize(blob_size, 0.);
-  for (int h = 0; h < blob_height; ++h) {
-    const uchar* ptr = cv_img.ptr<uchar>(h);
-    int img_index = 0;
-    for (int w = 0; w < blob_width; ++w) {
-      for (int c = 0; c < blob_channels; ++c) {
-        int blob_index = (c * blob_height + h) * blob_width + w;
-        blob->set_data(blob_index, static_cast<float>(ptr[img_index++]));
-      }
-    }
-  }
+  hwc_to_chw(cv_img.ptr<uint8_t>(0), blob_channels, blob_height, blob_width,
+      cv_img.step, blob->mutable_data()->mutable_data());
 }
 
 int main(int argc, char** argv) {
@@ -14,11 +14,16 @@
 #include <utility>
 #include <vector>
 
+#include "boost/bind.hpp"
 #include "boost/scoped_ptr.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread.hpp"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/rng.hpp"
@@ -26,6 +31,7 @@
 using namespace caffe;  // NOLINT(build/namespaces)
 using std::pair;
 using boost::scoped_ptr;
+using boost::shared_ptr;
 
 DEFINE_bool(gray, false,
     "When this option is on, treat images as grayscale ones");
@@ -41,6 +47,65 @@ DEFINE_bool(encoded, false,
     "When this option is on, the encoded image will be save in datum");
 DEFINE_string(encode_type, "",
     "Optional: What type should we encode the image as ('png','jpg',...).");
+DEFINE_int32(threads, 0,
+    "Number of threads reading and converting images, 0 for one per core");
+DEFINE_int64(lmdb_map_size, 0,
+    "Optional: initial LMDB map size in MB; the map doubles whenever it is"
+    " full");
+
+// Serialized datums of one worker, passed to the writer through a ring of
+// kWorkerBuffers buffers.
+const int kWorkerBuffers = 8;
+
+struct ConvertedImage {
+  bool status;
+  int data_size;
+  size_t data_bytes;
+  string value;
+};
+
+struct Worker {
+  vector<ConvertedImage> buffers;
+  BlockingQueue<int> free, full;
+};
+
+// Worker thread_id of num_threads converts lines thread_id,
+// thread_id + num_threads, ... in order, so the writer finds line i at the
+// head of the full queue of worker i % num_threads.
+void ConvertImages(const vector<pair<string, int> >* lines,
+    const string* root_folder, const int thread_id, const int num_threads,
+    Worker* worker) {
+  const bool is_color = !FLAGS_gray;
+  const int resize_height = std::max<int>(0, FLAGS_resize_height);
+  const int resize_width = std::max<int>(0, FLAGS_resize_width);
+  Datum datum;
+  for (int line_id = thread_id; line_id < lines->size();
+       line_id += num_threads) {
+    const string& fn = (*lines)[line_id].first;
+    std::string enc = FLAGS_encode_type;
+    if (FLAGS_encoded && !enc.size()) {
+      // Guess the encoding type from the file name
+      size_t p = fn.rfind('.');
+      if ( p == fn.npos ) {
+        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
+      } else {
+        enc = fn.substr(p + 1);
+        std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
+      }
+    }
+    const int b = worker->free.pop();
+    ConvertedImage* image = &worker->buffers[b];
+    image->status = ReadImageToDatum(*root_folder + fn,
+        (*lines)[line_id].second, resize_height, resize_width, is_color,
+        enc, &datum);
+    if (image->status) {
+      image->data_size = datum.channels() * datum.height() * datum.width();
+      image->data_bytes = datum.data().size();
+      CHECK(datum.SerializeToString(&image->value));
+    }
+    worker->full.push(b);
+  }
+}
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
@@ -62,7 +127,6 @@ int main(int argc, char** argv) {
     return 1;
   }
 
-  const bool is_color = !FLAGS_gray;
   const bool check_size = FLAGS_check_size;
   const bool encoded = FLAGS_encoded;
   const string encode_type = FLAGS_encode_type;
@@ -84,47 +148,60 @@ int main(int argc, char** argv) {
   if (encode_type.size() && !encoded)
     LOG(INFO) << "encode_type specified, assuming encoded=true.";
 
-  int resize_height = std::max<int>(0, FLAGS_resize_height);
-  int resize_width = std::max<int>(0, FLAGS_resize_width);
-
   // Create new DB
   scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
+  if (FLAGS_backend == "lmdb") {
+    db::LMDB* lmdb = static_cast<db::LMDB*>(db.get());
+    lmdb->set_grow_map(true);
+    if (FLAGS_lmdb_map_size > 0) {
+      lmdb->set_map_size(static_cast<size_t>(FLAGS_lmdb_map_size) << 20);
+    }
+  }
   db->Open(argv[3], db::NEW);
   scoped_ptr<db::Transaction> txn(db->NewTransaction());
 
-  // Storing to db
+  // Decoding, resizing and encoding run on the workers; this thread writes
+  // their results in list order.
   std::string root_folder(argv[1]);
-  Datum datum;
+  const int num_threads = FLAGS_threads > 0 ? FLAGS_threads :
+      std::max<int>(boost::thread::hardware_concurrency(), 1);
+  LOG(INFO) << "Converting with " << num_threads << " threads";
+  vector<shared_ptr<Worker> > workers(num_threads);
+  boost::thread_group threads;
+  for (int i = 0; i < num_threads; ++i) {
+    workers[i].reset(new Worker());
+    workers[i]->buffers.resize(kWorkerBuffers);
+    for (int b = 0; b < kWorkerBuffers; ++b) {
+      workers[i]->free.push(b);
+    }
+    threads.create_thread(boost::bind(&ConvertImages, &lines, &root_folder,
+        i, num_threads, workers[i].get()));
+  }
+
   int count = 0;
   const int kMaxKeyLength = 256;
   char key_cstr[kMaxKeyLength];
   int data_size = 0;
   bool data_size_initialized = false;
+  size_t bytes = 0;
+  CPUTimer timer;
+  timer.Start();
 
   for (int line_id = 0; line_id < lines.size(); ++line_id) {
-    bool status;
-    std::string enc = encode_type;
-    if (encoded && !enc.size()) {
-      // Guess the encoding type from the file name
-      string fn = lines[line_id].first;
-      size_t p = fn.rfind('.');
-      if ( p == fn.npos )
-        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
-      enc = fn.substr(p);
-      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
+    Worker* worker = workers[line_id % num_threads].get();
+    const int b = worker->full.pop();
+    const ConvertedImage& image = worker->buffers[b];
+    if (image.status == false) {
+      worker->free.push(b);
+      continue;
     }
-    status = ReadImageToDatum(root_folder + lines[line_id].first,
-        lines[line_id].second, resize_height, resize_width, is_color,
-        enc, &datum);
-    if (status == false) continue;
     if (check_size) {
       if (!data_size_initialized) {
-        data_size = datum.channels() * datum.height() * datum.width();
+        data_size = image.data_size;
         data_size_initialized = true;
       } else {
-        const std::string& data = datum.data();
-        CHECK_EQ(data.size(), data_size) << "Incorrect data field size "
-            << data.size();
+        CHECK_EQ(image.data_bytes, data_size) << "Incorrect data field size "
+            << image.data_bytes;
       }
     }
     // sequential
@@ -132,9 +209,9 @@ int main(int argc, char** argv) {
         lines[line_id].first.c_str());
 
     // Put in db
-    string out;
-    CHECK(datum.SerializeToString(&out));
-    txn->Put(string(key_cstr, length), out);
+    txn->Put(string(key_cstr, length), image.value);
+    bytes += image.value.size();
+    worker->free.push(b);
 
     if (++count % 1000 == 0) {
       // Commit db
@@ -143,10 +220,15 @@ int main(int argc, char** argv) {
       LOG(ERROR) << "Processed " << count << " files.";
     }
   }
+  threads.join_all();
   // write the last batch
   if (count % 1000 != 0) {
     txn->Commit();
     LOG(ERROR) << "Processed " << count << " files.";
   }
+  const float seconds = timer.Seconds();
+  LOG(INFO) << "Wrote " << count << " items, " << (bytes >> 20) << " MB in "
+            << seconds << " s: " << count / seconds << " items/s, "
+            << bytes / seconds / (1 << 20) << " MB/s.";
   return 0;
 }
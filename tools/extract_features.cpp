@@ -1,19 +1,24 @@
 #include <stdio.h>  // for snprintf
+#include <algorithm>
 #include <string>
 #include <vector>
 
 #include "boost/algorithm/string.hpp"
+#include "boost/thread.hpp"
 #include "google/protobuf/text_format.h"
+#include "hdf5.h"
 
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
 #include "caffe/net.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/vision_layers.hpp"
 
 using caffe::Blob;
+using caffe::BlockingQueue;
 using caffe::Caffe;
 using caffe::Datum;
 using caffe::Net;
@@ -21,6 +26,178 @@ using boost::shared_ptr;
 using std::string;
 namespace db = caffe::db;
 
+// Batches copied out of the net and not yet written; the net runs ahead of
+// the writer by at most this many.
+const int kQueuedBatches = 4;
+
+// Appends the rows (first axis) of successive feature blobs to a dataset.
+template <typename Dtype>
+class FeatureWriter {
+ public:
+  virtual ~FeatureWriter() {}
+  virtual void Write(const Blob<Dtype>& rows) = 0;
+  virtual void Close() = 0;
+};
+
+// One Datum with float_data per row, keyed by the row index.
+template <typename Dtype>
+class DBFeatureWriter : public FeatureWriter<Dtype> {
+ public:
+  DBFeatureWriter(const string& db_type, const string& name)
+      : db_(db::GetDB(db_type)), num_rows_(0) {
+    db_->Open(name, db::NEW);
+    txn_.reset(db_->NewTransaction());
+  }
+  virtual void Write(const Blob<Dtype>& rows) {
+    const int dim = rows.count() / rows.num();
+    datum_.set_channels(rows.channels());
+    datum_.set_height(rows.height());
+    datum_.set_width(rows.width());
+    datum_.clear_data();
+    datum_.mutable_float_data()->Resize(dim, 0);
+    const int kMaxKeyStrLength = 100;
+    char key_str[kMaxKeyStrLength];
+    for (int n = 0; n < rows.num(); ++n) {
+      const Dtype* row = rows.cpu_data() + rows.offset(n);
+      std::copy(row, row + dim, datum_.mutable_float_data()->mutable_data());
+      int length = snprintf(key_str, kMaxKeyStrLength, "%d", num_rows_);
+      CHECK(datum_.SerializeToString(&out_));
+      txn_->Put(string(key_str, length), out_);
+      if (++num_rows_ % 1000 == 0) {
+        txn_->Commit();
+        txn_.reset(db_->NewTransaction());
+      }
+    }
+  }
+  virtual void Close() {
+    if (num_rows_ % 1000 != 0) {
+      txn_->Commit();
+    }
+    txn_.reset();
+    db_->Close();
+  }
+
+ private:
+  shared_ptr<db::DB> db_;
+  shared_ptr<db::Transaction> txn_;
+  Datum datum_;
+  string out_;
+  int num_rows_;
+};
+
+// A float "data" dataset, N x C x H x W, grown by a hyperslab per batch.
+template <typename Dtype>
+class HDF5FeatureWriter : public FeatureWriter<Dtype> {
+ public:
+  explicit HDF5FeatureWriter(const string& name)
+      : name_(name), dataset_(-1), num_rows_(0) {
+    boost::mutex::scoped_lock lock(caffe::hdf5_mutex());
+    file_id_ = H5Fcreate(name.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
+        H5P_DEFAULT);
+    CHECK_GE(file_id_, 0) << "Failed to open HDF5 file " << name;
+  }
+  virtual void Write(const Blob<Dtype>& rows) {
+    // Data layers (HDF5Data) may use the library from their own threads.
+    boost::mutex::scoped_lock lock(caffe::hdf5_mutex());
+    hsize_t dims[4];
+    dims[0] = rows.num();
+    dims[1] = rows.channels();
+    dims[2] = rows.height();
+    dims[3] = rows.width();
+    if (dataset_ < 0) {
+      hsize_t max_dims[4] = { H5S_UNLIMITED, dims[1], dims[2], dims[3] };
+      hsize_t empty[4] = { 0, dims[1], dims[2], dims[3] };
+      hid_t space = H5Screate_simple(4, empty, max_dims);
+      hid_t plist = H5Pcreate(H5P_DATASET_CREATE);
+      CHECK_GE(H5Pset_chunk(plist, 4, dims), 0);
+      dataset_ = H5Dcreate2(file_id_, "data", H5T_NATIVE_FLOAT, space,
+          H5P_DEFAULT, plist, H5P_DEFAULT);
+      CHECK_GE(dataset_, 0) << "Failed to make dataset data in " << name_;
+      H5Pclose(plist);
+      H5Sclose(space);
+    }
+    hsize_t offset[4] = { num_rows_, 0, 0, 0 };
+    num_rows_ += rows.num();
+    hsize_t extent[4] = { num_rows_, dims[1], dims[2], dims[3] };
+    CHECK_GE(H5Dset_extent(dataset_, extent), 0);
+    hid_t file_space = H5Dget_space(dataset_);
+    CHECK_GE(H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset, NULL,
+        dims, NULL), 0);
+    hid_t mem_space = H5Screate_simple(4, dims, NULL);
+    herr_t status = H5Dwrite(dataset_, sizeof(Dtype) == sizeof(float) ?
+        H5T_NATIVE_FLOAT : H5T_NATIVE_DOUBLE, mem_space, file_space,
+        H5P_DEFAULT, rows.cpu_data());
+    CHECK_GE(status, 0) << "Failed to append to HDF5 file " << name_;
+    H5Sclose(mem_space);
+    H5Sclose(file_space);
+  }
+  virtual void Close() {
+    boost::mutex::scoped_lock lock(caffe::hdf5_mutex());
+    if (dataset_ >= 0) {
+      H5Dclose(dataset_);
+    }
+    CHECK_GE(H5Fclose(file_id_), 0) << "Failed to close HDF5 file " << name_;
+  }
+
+ private:
+  string name_;
+  hid_t file_id_;
+  hid_t dataset_;
+  hsize_t num_rows_;
+};
+
+// Rows of native floats back to back, without any header.
+template <typename Dtype>
+class RawFeatureWriter : public FeatureWriter<Dtype> {
+ public:
+  explicit RawFeatureWriter(const string& name) : name_(name) {
+    file_ = fopen(name.c_str(), "wb");
+    CHECK(file_) << "Failed to open " << name;
+  }
+  virtual void Write(const Blob<Dtype>& rows) {
+    buffer_.resize(rows.count());
+    std::copy(rows.cpu_data(), rows.cpu_data() + rows.count(),
+        buffer_.begin());
+    CHECK_EQ(fwrite(&buffer_[0], sizeof(float), buffer_.size(), file_),
+        buffer_.size()) << "Failed to write to " << name_;
+  }
+  virtual void Close() {
+    CHECK_EQ(fclose(file_), 0) << "Failed to close " << name_;
+  }
+
+ private:
+  string name_;
+  FILE* file_;
+  std::vector<float> buffer_;
+};
+
+// Writes the batches queued in full until it pops -1, see
+// feature_extraction_pipeline.
+template <typename Dtype>
+void write_features(
+    const std::vector<shared_ptr<FeatureWriter<Dtype> > >* writers,
+    const std::vector<std::vector<shared_ptr<Blob<Dtype> > > >* batches,
+    const std::vector<string>* blob_names, BlockingQueue<int>* free,
+    BlockingQueue<int>* full) {
+  std::vector<int> num_rows(writers->size(), 0);
+  for (int b = full->pop(); b >= 0; b = full->pop()) {
+    for (int i = 0; i < writers->size(); ++i) {
+      const Blob<Dtype>& rows = *(*batches)[b][i];
+      (*writers)[i]->Write(rows);
+      if ((num_rows[i] + rows.num()) / 1000 > num_rows[i] / 1000) {
+        LOG(ERROR)<< "Extracted features of " << num_rows[i] + rows.num() <<
+            " query images for feature blob " << (*blob_names)[i];
+      }
+      num_rows[i] += rows.num();
+    }
+    free->push(b);
+  }
+  for (int i = 0; i < writers->size(); ++i) {
+    LOG(ERROR)<< "Extracted features of " << num_rows[i] <<
+        " query images for feature blob " << (*blob_names)[i];
+  }
+}
+
 template<typename Dtype>
 int feature_extraction_pipeline(int argc, char** argv);
 
@@ -41,6 +218,9 @@ int feature_extraction_pipeline(int argc, char** argv) {
     "  feature_extraction_proto_file  extract_feature_blob_name1[,name2,...]"
     "  save_feature_dataset_name1[,name2,...]  num_mini_batches  db_type"
     "  [CPU/GPU] [DEVICE_ID=0]\n"
+    "db_type is leveldb or lmdb for one Datum per row, hdf5 for a file with"
+    " an N x C x H x W float dataset named data, or raw for the float rows"
+    " back to back.\n"
     "Note: you can extract multiple features in one pass by specifying"
     " multiple feature blob names and dataset names seperated by ','."
     " The names cannot contain white space characters and the number of blobs"
@@ -121,70 +301,54 @@ int feature_extraction_pipeline(int argc, char** argv) {
   int num_mini_batches = atoi(argv[++arg_pos]);
 
   std::string db_type(argv[++arg_pos]);
-  std::vector<shared_ptr<db::DB> > feature_dbs;
-  std::vector<shared_ptr<db::Transaction> > txns;
+  std::vector<shared_ptr<FeatureWriter<Dtype> > > writers;
   for (size_t i = 0; i < num_features; ++i) {
     LOG(INFO)<< "Opening dataset " << dataset_names[i];
-    shared_ptr<db::DB> db(db::GetDB(db_type));
-    db->Open(dataset_names.at(i), db::NEW);
-    feature_dbs.push_back(db);
-    shared_ptr<db::Transaction> txn(db->NewTransaction());
-    txns.push_back(txn);
+    if (db_type == "hdf5") {
+      writers.push_back(shared_ptr<FeatureWriter<Dtype> >(
+          new HDF5FeatureWriter<Dtype>(dataset_names[i])));
+    } else if (db_type == "raw") {
+      writers.push_back(shared_ptr<FeatureWriter<Dtype> >(
+          new RawFeatureWriter<Dtype>(dataset_names[i])));
+    } else {
+      writers.push_back(shared_ptr<FeatureWriter<Dtype> >(
+          new DBFeatureWriter<Dtype>(db_type, dataset_names[i])));
+    }
   }
 
   LOG(ERROR)<< "Extacting Features";
 
-  Datum datum;
-  std::vector<shared_ptr<leveldb::WriteBatch> > feature_batches;
-  for (size_t i = 0; i < num_features; ++i) {
-    feature_batches.push_back(shared_ptr<leveldb::WriteBatch>(new leveldb::WriteBatch()));
+  // The net fills copies of the feature blobs while a writer thread
+  // serializes the previous ones.
+  std::vector<std::vector<shared_ptr<Blob<Dtype> > > > batches(
+      kQueuedBatches);
+  BlockingQueue<int> free, full;
+  for (int b = 0; b < kQueuedBatches; ++b) {
+    for (size_t i = 0; i < num_features; ++i) {
+      batches[b].push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+    }
+    free.push(b);
   }
-  const int kMaxKeyStrLength = 100;
-  char key_str[kMaxKeyStrLength];
+  boost::thread writer(&write_features<Dtype>, &writers, &batches,
+      &blob_names, &free, &full);
   std::vector<Blob<float>*> input_vec;
-  std::vector<int> image_indices(num_features, 0);
   for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index) {
     feature_extraction_net->Forward(input_vec);
+    const int b = free.pop();
     for (int i = 0; i < num_features; ++i) {
       const shared_ptr<Blob<Dtype> > feature_blob = feature_extraction_net
           ->blob_by_name(blob_names[i]);
-      int batch_size = feature_blob->num();
-      int dim_features = feature_blob->count() / batch_size;
-      const Dtype* feature_blob_data;
-      for (int n = 0; n < batch_size; ++n) {
-        datum.set_height(feature_blob->height());
-        datum.set_width(feature_blob->width());
-        datum.set_channels(feature_blob->channels());
-        datum.clear_data();
-        datum.clear_float_data();
-        feature_blob_data = feature_blob->cpu_data() +
-            feature_blob->offset(n);
-        for (int d = 0; d < dim_features; ++d) {
-          datum.add_float_data(feature_blob_data[d]);
-        }
-        int length = snprintf(key_str, kMaxKeyStrLength, "%d",
-            image_indices[i]);
-        string out;
-        CHECK(datum.SerializeToString(&out));
-        txns.at(i)->Put(std::string(key_str, length), out);
-        ++image_indices[i];
-        if (image_indices[i] % 1000 == 0) {
-          txns.at(i)->Commit();
-          txns.at(i).reset(feature_dbs.at(i)->NewTransaction());
-          LOG(ERROR)<< "Extracted features of " << image_indices[i] <<
-              " query images for feature blob " << blob_names[i];
-        }
-      }  // for (int n = 0; n < batch_size; ++n)
-    }  // for (int i = 0; i < num_features; ++i)
+      batches[b][i]->ReshapeLike(*feature_blob);
+      caffe::caffe_copy(feature_blob->count(), feature_blob->cpu_data(),
+          batches[b][i]->mutable_cpu_data());
+    }
+    full.push(b);
   }  // for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index)
-  // write the last batch
+  // write the last batches
+  full.push(-1);
+  writer.join();
   for (int i = 0; i < num_features; ++i) {
-    if (image_indices[i] % 1000 != 0) {
-      txns.at(i)->Commit();
-    }
-    LOG(ERROR)<< "Extracted features of " << image_indices[i] <<
-        " query images for feature blob " << blob_names[i];
-    feature_dbs.at(i)->Close();
+    writers[i]->Close();
   }
 
   LOG(ERROR)<< "Successfully extracted the features!";
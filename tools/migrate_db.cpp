@@ -0,0 +1,700 @@
+// This program copies a database of Datum or MapData (BlobProtoVector)
+// records to another backend, optionally re-encoding the records on the way.
+// Usage:
+//   migrate_db [FLAGS] INPUT_DB OUTPUT_DB
+//
+// Records are read in key order, re-encoded on --threads workers and written
+// in the same order. leveldb and lmdb keep the keys; an hdf5 file holds one
+// row per record in the datasets "data" and "label", as read by HDF5Data
+// layers, and keys "%08d" of the row index are made up when reading one.
+
+#include <stdint.h>
+#include <stdio.h>  // for snprintf
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/bind.hpp"
+#include "boost/crc.hpp"
+#include "boost/scoped_ptr.hpp"
+#include "boost/shared_ptr.hpp"
+#include "boost/thread.hpp"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "hdf5.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "caffe/blob.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/db.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using namespace caffe;  // NOLINT(build/namespaces)
+using std::map;
+using std::pair;
+using boost::scoped_ptr;
+using boost::shared_ptr;
+
+DEFINE_string(in_backend, "leveldb",
+    "The backend {leveldb, lmdb, hdf5} of the input");
+DEFINE_string(out_backend, "lmdb",
+    "The backend {leveldb, lmdb, hdf5} of the output");
+DEFINE_string(records, "datum",
+    "The records: datum for Datum, map for the BlobProtoVector maps read by"
+    " MapData layers");
+DEFINE_string(encode, "none",
+    "Re-encoding of the records: none, uint8 (integral float_data to bytes),"
+    " jpg or png (raw 1 or 3 channel Datum), float16 (hdf5 output only)");
+DEFINE_int32(threads, 0,
+    "Number of threads re-encoding records, 0 for one per core");
+DEFINE_int32(verify_samples, 16,
+    "Number of records whose checksum is verified in the output");
+DEFINE_int32(hdf5_rows, 256,
+    "Rows read from or written to hdf5 files at once");
+DEFINE_int64(lmdb_map_size, 0,
+    "Optional: initial LMDB map size in MB; the map doubles whenever it is"
+    " full");
+
+// Records of one worker circulate through a ring of kWorkerRecords slots:
+// the reader fills free ones, the worker re-encodes todo ones in place and
+// the writer consumes done ones.
+const int kWorkerRecords = 8;
+
+struct Record {
+  // Marks the end of the input; the writer stops at it.
+  bool end;
+  string key;
+  // The input record, replaced by the output record for a database.
+  string value;
+  // For an hdf5 output, the blobs of the record as float rows.
+  vector<vector<float> > rows;
+  vector<vector<int> > shapes;
+};
+
+struct Worker {
+  vector<Record> records;
+  BlockingQueue<int> free, todo, done;
+};
+
+uint32_t Checksum(const void* data, const size_t bytes) {
+  boost::crc_32_type crc;
+  crc.process_bytes(data, bytes);
+  return crc.checksum();
+}
+
+// IEEE 754 half precision, see HDF5OutputLayer.
+hid_t Float16Type() {
+  hid_t type = H5Tcopy(H5T_IEEE_F32LE);
+  CHECK_GE(type, 0);
+  CHECK_GE(H5Tset_fields(type, 15, 10, 5, 0, 10), 0);
+  CHECK_GE(H5Tset_size(type, 2), 0);
+  CHECK_GE(H5Tset_ebias(type, 15), 0);
+  return type;
+}
+
+// Returns false if some value of the float_data is not a byte.
+bool IntegralFloatData(const Datum& datum) {
+  for (int i = 0; i < datum.float_data_size(); ++i) {
+    const float v = datum.float_data(i);
+    if (v < 0 || v > 255 || v != std::floor(v)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Moves integral float_data to the data bytes.
+bool DatumToUInt8(Datum* datum) {
+  if (datum->encoded() || datum->float_data_size() == 0 ||
+      !IntegralFloatData(*datum)) {
+    return false;
+  }
+  string* data = datum->mutable_data();
+  data->resize(datum->float_data_size());
+  for (int i = 0; i < datum->float_data_size(); ++i) {
+    (*data)[i] = static_cast<char>(static_cast<uint8_t>(datum->float_data(i)));
+  }
+  datum->clear_float_data();
+  return true;
+}
+
+// Encodes a raw 1 or 3 channel uint8 Datum as an image file.
+bool EncodeDatum(const string& ext, Datum* datum) {
+  if (datum->encoded() || !(datum->channels() == 1 ||
+      datum->channels() == 3)) {
+    return false;
+  }
+  if (datum->data().empty() && !DatumToUInt8(datum)) {
+    return false;
+  }
+  const int channels = datum->channels();
+  const int height = datum->height();
+  const int width = datum->width();
+  const string& data = datum->data();
+  cv::Mat cv_img(height, width, channels == 3 ? CV_8UC3 : CV_8UC1);
+  for (int h = 0; h < height; ++h) {
+    uchar* ptr = cv_img.ptr<uchar>(h);
+    for (int w = 0; w < width; ++w) {
+      for (int c = 0; c < channels; ++c) {
+        ptr[w * channels + c] = data[(c * height + h) * width + w];
+      }
+    }
+  }
+  std::vector<uchar> buf;
+  CHECK(cv::imencode("." + ext, cv_img, buf)) << "Failed to encode " << ext;
+  datum->set_data(string(reinterpret_cast<char*>(&buf[0]), buf.size()));
+  datum->set_encoded(true);
+  return true;
+}
+
+void DatumToRows(Datum* datum, Record* record) {
+  DecodeDatumNative(datum);
+  const int count = datum->channels() * datum->height() * datum->width();
+  record->rows.resize(2);
+  record->shapes.resize(2);
+  vector<float>& data = record->rows[0];
+  data.resize(count);
+  if (datum->data().size()) {
+    CHECK_EQ(datum->data().size(), count) << "Incorrect data field size";
+    const uint8_t* bytes =
+        reinterpret_cast<const uint8_t*>(datum->data().data());
+    std::copy(bytes, bytes + count, data.begin());
+  } else {
+    CHECK_EQ(datum->float_data_size(), count) << "Incorrect data field size";
+    std::copy(datum->float_data().begin(), datum->float_data().end(),
+        data.begin());
+  }
+  record->shapes[0].resize(3);
+  record->shapes[0][0] = datum->channels();
+  record->shapes[0][1] = datum->height();
+  record->shapes[0][2] = datum->width();
+  record->rows[1].assign(1, datum->label());
+  record->shapes[1].clear();
+}
+
+void MapsToRows(const BlobProtoVector& maps, Record* record) {
+  record->rows.resize(maps.blobs_size());
+  record->shapes.resize(maps.blobs_size());
+  for (int i = 0; i < maps.blobs_size(); ++i) {
+    const BlobProto& blob = maps.blobs(i);
+    CHECK_EQ(blob.data_size(), blob.channels() * blob.height() * blob.width())
+        << "Incorrect data field size";
+    record->rows[i].assign(blob.data().begin(), blob.data().end());
+    record->shapes[i].resize(3);
+    record->shapes[i][0] = blob.channels();
+    record->shapes[i][1] = blob.height();
+    record->shapes[i][2] = blob.width();
+  }
+}
+
+// Re-encodes record in place; returns false if it was left as it is.
+bool ProcessRecord(Record* record) {
+  const bool to_hdf5 = FLAGS_out_backend == "hdf5";
+  if (!to_hdf5 && FLAGS_encode == "none") {
+    return true;
+  }
+  if (FLAGS_records == "map") {
+    BlobProtoVector maps;
+    CHECK(maps.ParseFromString(record->value)) << "Bad record "
+        << record->key;
+    MapsToRows(maps, record);
+    return true;
+  }
+  Datum datum;
+  CHECK(datum.ParseFromString(record->value)) << "Bad record " << record->key;
+  if (to_hdf5) {
+    DatumToRows(&datum, record);
+    return true;
+  }
+  const bool encoded = FLAGS_encode == "uint8" ? DatumToUInt8(&datum) :
+      EncodeDatum(FLAGS_encode, &datum);
+  if (encoded) {
+    CHECK(datum.SerializeToString(&record->value));
+  }
+  return encoded;
+}
+
+void ProcessRecords(Worker* worker, int* kept) {
+  for (int r = worker->todo.pop(); r >= 0; r = worker->todo.pop()) {
+    Record* record = &worker->records[r];
+    if (!record->end && !ProcessRecord(record)) {
+      ++*kept;
+    }
+    worker->done.push(r);
+  }
+}
+
+// Source of records in key order.
+class RecordReader {
+ public:
+  virtual ~RecordReader() {}
+  // Fills the key and value of record, or returns false at the end.
+  virtual bool Read(Record* record) = 0;
+};
+
+class DBRecordReader : public RecordReader {
+ public:
+  explicit DBRecordReader(const string& source)
+      : db_(db::GetDB(FLAGS_in_backend)) {
+    db_->Open(source, db::READ);
+    cursor_.reset(db_->NewCursor());
+  }
+  virtual bool Read(Record* record) {
+    if (!cursor_->valid()) {
+      return false;
+    }
+    record->key = cursor_->key();
+    record->value = cursor_->value();
+    cursor_->Next();
+    return true;
+  }
+
+ private:
+  scoped_ptr<db::DB> db_;
+  scoped_ptr<db::Cursor> cursor_;
+};
+
+// Rows of the "data" and "label" datasets, --hdf5_rows at a time, as
+// records with float data.
+class HDF5RecordReader : public RecordReader {
+ public:
+  explicit HDF5RecordReader(const string& source)
+      : row_(0), window_(0), window_rows_(0) {
+    boost::mutex::scoped_lock lock(hdf5_mutex());
+    file_id_ = H5Fopen(source.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    CHECK_GE(file_id_, 0) << "Failed to open HDF5 file " << source;
+    vector<int> shape;
+    hdf5_get_nd_dataset_shape(file_id_, "data", 1, 4, &shape);
+    num_rows_ = shape[0];
+    hdf5_get_nd_dataset_shape(file_id_, "label", 1, 4, &shape);
+    CHECK_EQ(shape[0], num_rows_) << "data and label differ in rows";
+  }
+  virtual ~HDF5RecordReader() {
+    boost::mutex::scoped_lock lock(hdf5_mutex());
+    H5Fclose(file_id_);
+  }
+  virtual bool Read(Record* record) {
+    if (row_ == num_rows_) {
+      return false;
+    }
+    if (row_ == window_ + window_rows_) {
+      window_ = row_;
+      window_rows_ = std::min(FLAGS_hdf5_rows, num_rows_ - row_);
+      boost::mutex::scoped_lock lock(hdf5_mutex());
+      hdf5_load_nd_dataset_rows(file_id_, "data", 1, 4, window_, window_rows_,
+          &data_);
+      hdf5_load_nd_dataset_rows(file_id_, "label", 1, 4, window_,
+          window_rows_, &label_);
+    }
+    const int n = row_ - window_;
+    char key[16];
+    snprintf(key, sizeof(key), "%08d", row_);
+    record->key = key;
+    if (FLAGS_records == "map") {
+      BlobProtoVector maps;
+      RowToMap(data_, n, maps.add_blobs());
+      RowToMap(label_, n, maps.add_blobs());
+      CHECK(maps.SerializeToString(&record->value));
+    } else {
+      CHECK_EQ(label_.count(1), 1) << "Datum labels are single values";
+      Datum datum;
+      datum.set_channels(data_.shape().size() > 1 ? data_.shape(1) : 1);
+      datum.set_height(data_.shape().size() > 2 ? data_.shape(2) : 1);
+      datum.set_width(data_.shape().size() > 3 ? data_.shape(3) : 1);
+      const float* row = data_.cpu_data() + n * data_.count(1);
+      datum.mutable_float_data()->Resize(data_.count(1), 0);
+      std::copy(row, row + data_.count(1),
+          datum.mutable_float_data()->mutable_data());
+      datum.set_label(static_cast<int>(label_.cpu_data()[n]));
+      CHECK(datum.SerializeToString(&record->value));
+    }
+    ++row_;
+    return true;
+  }
+
+ private:
+  static void RowToMap(const Blob<float>& blob, const int n,
+      BlobProto* proto) {
+    proto->set_num(1);
+    proto->set_channels(blob.shape().size() > 1 ? blob.shape(1) : 1);
+    proto->set_height(blob.shape().size() > 2 ? blob.shape(2) : 1);
+    proto->set_width(blob.shape().size() > 3 ? blob.shape(3) : 1);
+    const float* row = blob.cpu_data() + n * blob.count(1);
+    proto->mutable_data()->Resize(blob.count(1), 0);
+    std::copy(row, row + blob.count(1),
+        proto->mutable_data()->mutable_data());
+  }
+
+  hid_t file_id_;
+  int num_rows_;
+  int row_;
+  // The rows [window_, window_ + window_rows_) are in data_ and label_.
+  int window_;
+  int window_rows_;
+  Blob<float> data_, label_;
+};
+
+// Sink of records in key order. Write() remembers the checksums of the
+// records sampled for Verify().
+class RecordWriter {
+ public:
+  virtual ~RecordWriter() {}
+  virtual void Write(const Record& record) = 0;
+  virtual void Close() = 0;
+  // Returns the number of sampled records that do not read back the same.
+  virtual int Verify() = 0;
+};
+
+class DBRecordWriter : public RecordWriter {
+ public:
+  explicit DBRecordWriter(const string& source)
+      : source_(source), db_(db::GetDB(FLAGS_out_backend)), count_(0) {
+    if (FLAGS_out_backend == "lmdb" && FLAGS_lmdb_map_size > 0) {
+      static_cast<db::LMDB*>(db_.get())->set_map_size(
+          static_cast<size_t>(FLAGS_lmdb_map_size) << 20);
+    }
+    db_->Open(source, db::NEW);
+    txn_.reset(db_->NewTransaction());
+  }
+  virtual void Write(const Record& record) {
+    txn_->Put(record.key, record.value);
+    // Reservoir sampling of the keys to verify.
+    const int slot = count_ < FLAGS_verify_samples ? count_ :
+        caffe_rng_rand() % (count_ + 1);
+    if (slot < FLAGS_verify_samples) {
+      if (samples_.size() == FLAGS_verify_samples) {
+        samples_.erase(sample_keys_[slot]);
+      } else {
+        sample_keys_.push_back(string());
+      }
+      sample_keys_[slot] = record.key;
+      samples_[record.key] = Checksum(record.value.data(),
+          record.value.size());
+    }
+    if (++count_ % 1000 == 0) {
+      txn_->Commit();
+      txn_.reset(db_->NewTransaction());
+    }
+  }
+  virtual void Close() {
+    if (count_ % 1000 != 0) {
+      txn_->Commit();
+    }
+    txn_.reset();
+    db_->Close();
+  }
+  virtual int Verify() {
+    // db::Cursor can not seek to a key, so scan the whole output.
+    scoped_ptr<db::DB> db(db::GetDB(FLAGS_out_backend));
+    db->Open(source_, db::READ);
+    scoped_ptr<db::Cursor> cursor(db->NewCursor());
+    int matches = 0;
+    for (; cursor->valid(); cursor->Next()) {
+      map<string, uint32_t>::const_iterator it = samples_.find(cursor->key());
+      if (it != samples_.end()) {
+        const string value = cursor->value();
+        matches += Checksum(value.data(), value.size()) == it->second;
+      }
+    }
+    return samples_.size() - matches;
+  }
+
+ private:
+  string source_;
+  scoped_ptr<db::DB> db_;
+  scoped_ptr<db::Transaction> txn_;
+  int count_;
+  vector<string> sample_keys_;
+  map<string, uint32_t> samples_;
+};
+
+// Appends the rows of the records to the datasets "data", "label" and, for
+// maps with more than two blobs, "blob2", "blob3", ..., FLAGS_hdf5_rows
+// rows at a time.
+class HDF5RecordWriter : public RecordWriter {
+ public:
+  explicit HDF5RecordWriter(const string& source)
+      : source_(source), count_(0), buffered_(0) {
+    boost::mutex::scoped_lock lock(hdf5_mutex());
+    file_id_ = H5Fcreate(source.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
+        H5P_DEFAULT);
+    CHECK_GE(file_id_, 0) << "Failed to open HDF5 file " << source;
+    file_type_ = FLAGS_encode == "float16" ? Float16Type() :
+        H5Tcopy(H5T_NATIVE_FLOAT);
+  }
+  virtual void Write(const Record& record) {
+    if (datasets_.empty()) {
+      CreateDatasets(record);
+    }
+    CHECK_EQ(record.rows.size(), datasets_.size())
+        << "Records differ in their number of blobs";
+    for (int i = 0; i < datasets_.size(); ++i) {
+      CHECK(record.shapes[i] == shapes_[i]) << "Record " << record.key
+          << " differs in shape from the first one";
+      std::copy(record.rows[i].begin(), record.rows[i].end(),
+          buffers_[i].begin() + buffered_ * record.rows[i].size());
+    }
+    const int slot = count_ < FLAGS_verify_samples ? count_ :
+        caffe_rng_rand() % (count_ + 1);
+    if (slot < FLAGS_verify_samples) {
+      if (samples_.size() < FLAGS_verify_samples) {
+        samples_.resize(samples_.size() + 1);
+      }
+      samples_[slot].first = count_;
+      samples_[slot].second = RowChecksum(record);
+    }
+    ++count_;
+    if (++buffered_ == FLAGS_hdf5_rows) {
+      Flush();
+    }
+  }
+  virtual void Close() {
+    Flush();
+    boost::mutex::scoped_lock lock(hdf5_mutex());
+    for (int i = 0; i < datasets_.size(); ++i) {
+      H5Dclose(datasets_[i]);
+    }
+    H5Tclose(file_type_);
+    CHECK_GE(H5Fclose(file_id_), 0) << "Failed to close HDF5 file "
+        << source_;
+  }
+  virtual int Verify() {
+    boost::mutex::scoped_lock lock(hdf5_mutex());
+    hid_t file_id = H5Fopen(source_.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    CHECK_GE(file_id, 0) << "Failed to open HDF5 file " << source_;
+    int mismatches = 0;
+    Blob<float> blob;
+    for (int s = 0; s < samples_.size(); ++s) {
+      boost::crc_32_type crc;
+      for (int i = 0; i < names_.size(); ++i) {
+        hdf5_load_nd_dataset_rows(file_id, names_[i].c_str(), 1, 4,
+            samples_[s].first, 1, &blob);
+        crc.process_bytes(blob.cpu_data(), blob.count() * sizeof(float));
+      }
+      mismatches += crc.checksum() != samples_[s].second;
+    }
+    H5Fclose(file_id);
+    return mismatches;
+  }
+
+ private:
+  void CreateDatasets(const Record& record) {
+    boost::mutex::scoped_lock lock(hdf5_mutex());
+    for (int i = 0; i < record.rows.size(); ++i) {
+      char name[16];
+      snprintf(name, sizeof(name), "blob%d", i);
+      names_.push_back(i == 0 ? "data" : i == 1 ? "label" : name);
+      shapes_.push_back(record.shapes[i]);
+      vector<hsize_t> dims(1, 0);
+      dims.insert(dims.end(), shapes_[i].begin(), shapes_[i].end());
+      vector<hsize_t> max_dims(dims);
+      max_dims[0] = H5S_UNLIMITED;
+      vector<hsize_t> chunk_dims(dims);
+      chunk_dims[0] = std::min(FLAGS_hdf5_rows, 16);
+      hid_t space = H5Screate_simple(dims.size(), dims.data(),
+          max_dims.data());
+      hid_t plist = H5Pcreate(H5P_DATASET_CREATE);
+      CHECK_GE(H5Pset_chunk(plist, chunk_dims.size(), chunk_dims.data()), 0);
+      hid_t dataset = H5Dcreate2(file_id_, names_[i].c_str(), file_type_,
+          space, H5P_DEFAULT, plist, H5P_DEFAULT);
+      CHECK_GE(dataset, 0) << "Failed to make dataset " << names_[i];
+      H5Pclose(plist);
+      H5Sclose(space);
+      datasets_.push_back(dataset);
+      buffers_.push_back(vector<float>(FLAGS_hdf5_rows *
+          record.rows[i].size()));
+    }
+  }
+
+  void Flush() {
+    if (buffered_ == 0) {
+      return;
+    }
+    boost::mutex::scoped_lock lock(hdf5_mutex());
+    const hsize_t start = count_ - buffered_;
+    for (int i = 0; i < datasets_.size(); ++i) {
+      vector<hsize_t> dims(1, buffered_);
+      dims.insert(dims.end(), shapes_[i].begin(), shapes_[i].end());
+      vector<hsize_t> offset(dims.size(), 0);
+      offset[0] = start;
+      vector<hsize_t> extent(dims);
+      extent[0] = count_;
+      CHECK_GE(H5Dset_extent(datasets_[i], extent.data()), 0);
+      hid_t file_space = H5Dget_space(datasets_[i]);
+      CHECK_GE(H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset.data(),
+          NULL, dims.data(), NULL), 0);
+      hid_t mem_space = H5Screate_simple(dims.size(), dims.data(), NULL);
+      CHECK_GE(H5Dwrite(datasets_[i], H5T_NATIVE_FLOAT, mem_space,
+          file_space, H5P_DEFAULT, &buffers_[i][0]), 0)
+          << "Failed to append to HDF5 file " << source_;
+      H5Sclose(mem_space);
+      H5Sclose(file_space);
+    }
+    buffered_ = 0;
+  }
+
+  // Checksum of the rows as they read back, i.e. after going through the
+  // file type, which the library converts with H5Tconvert.
+  uint32_t RowChecksum(const Record& record) {
+    boost::crc_32_type crc;
+    for (int i = 0; i < record.rows.size(); ++i) {
+      vector<float> row(record.rows[i]);
+      if (FLAGS_encode == "float16") {
+        boost::mutex::scoped_lock lock(hdf5_mutex());
+        CHECK_GE(H5Tconvert(H5T_NATIVE_FLOAT, file_type_, row.size(),
+            &row[0], NULL, H5P_DEFAULT), 0);
+        CHECK_GE(H5Tconvert(file_type_, H5T_NATIVE_FLOAT, row.size(),
+            &row[0], NULL, H5P_DEFAULT), 0);
+      }
+      crc.process_bytes(&row[0], row.size() * sizeof(float));
+    }
+    return crc.checksum();
+  }
+
+  string source_;
+  hid_t file_id_;
+  hid_t file_type_;
+  vector<string> names_;
+  vector<vector<int> > shapes_;
+  vector<hid_t> datasets_;
+  vector<vector<float> > buffers_;
+  int count_;
+  int buffered_;
+  // Sampled (row, checksum) pairs.
+  vector<pair<int, uint32_t> > samples_;
+};
+
+// Reads every record into the ring of worker i % num_workers, then marks
+// the end and stops the workers.
+void ReadRecords(RecordReader* reader, vector<shared_ptr<Worker> >* workers) {
+  const int num_workers = workers->size();
+  for (int i = 0; ; ++i) {
+    Worker* worker = (*workers)[i % num_workers].get();
+    const int r = worker->free.pop();
+    Record* record = &worker->records[r];
+    record->end = !reader->Read(record);
+    worker->todo.push(r);
+    if (record->end) {
+      break;
+    }
+  }
+  for (int i = 0; i < num_workers; ++i) {
+    (*workers)[i]->todo.push(-1);
+  }
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+
+  gflags::SetUsageMessage("Copy a leveldb/lmdb/hdf5 database of Datum or"
+        " MapData records to another backend, optionally re-encoding them.\n"
+        "Usage:\n"
+        "    migrate_db [FLAGS] INPUT_DB OUTPUT_DB\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (argc != 3) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/migrate_db");
+    return 1;
+  }
+  CHECK(FLAGS_records == "datum" || FLAGS_records == "map")
+      << "Unknown records " << FLAGS_records;
+  CHECK(FLAGS_encode == "none" || FLAGS_encode == "uint8" ||
+      FLAGS_encode == "jpg" || FLAGS_encode == "png" ||
+      FLAGS_encode == "float16") << "Unknown encoding " << FLAGS_encode;
+  const bool to_hdf5 = FLAGS_out_backend == "hdf5";
+  CHECK(FLAGS_encode != "float16" || to_hdf5)
+      << "float16 records can only be stored in hdf5";
+  CHECK(!to_hdf5 || FLAGS_encode == "none" || FLAGS_encode == "float16")
+      << "hdf5 stores float or float16 rows";
+  CHECK(FLAGS_records == "datum" || FLAGS_encode == "none" || to_hdf5)
+      << "MapData maps are float BlobProtos; use float16 in hdf5 to compact"
+      << " them";
+  CHECK_GT(FLAGS_hdf5_rows, 0);
+
+  scoped_ptr<RecordReader> reader;
+  if (FLAGS_in_backend == "hdf5") {
+    reader.reset(new HDF5RecordReader(argv[1]));
+  } else {
+    reader.reset(new DBRecordReader(argv[1]));
+  }
+  scoped_ptr<RecordWriter> writer;
+  if (to_hdf5) {
+    writer.reset(new HDF5RecordWriter(argv[2]));
+  } else {
+    writer.reset(new DBRecordWriter(argv[2]));
+  }
+
+  const int num_workers = FLAGS_threads > 0 ? FLAGS_threads :
+      std::max<int>(boost::thread::hardware_concurrency(), 1);
+  LOG(INFO) << "Migrating with " << num_workers << " threads";
+  vector<shared_ptr<Worker> > workers(num_workers);
+  vector<int> kept(num_workers, 0);
+  boost::thread_group threads;
+  for (int i = 0; i < num_workers; ++i) {
+    workers[i].reset(new Worker());
+    workers[i]->records.resize(kWorkerRecords);
+    for (int r = 0; r < kWorkerRecords; ++r) {
+      workers[i]->free.push(r);
+    }
+    threads.create_thread(boost::bind(&ProcessRecords, workers[i].get(),
+        &kept[i]));
+  }
+  threads.create_thread(boost::bind(&ReadRecords, reader.get(), &workers));
+
+  // Write in input order.
+  int count = 0;
+  size_t bytes = 0;
+  CPUTimer timer;
+  timer.Start();
+  for (int i = 0; ; ++i) {
+    Worker* worker = workers[i % num_workers].get();
+    const int r = worker->done.pop();
+    const Record& record = worker->records[r];
+    if (record.end) {
+      break;
+    }
+    writer->Write(record);
+    bytes += record.value.size();
+    worker->free.push(r);
+    if (++count % 1000 == 0) {
+      const float seconds = timer.Seconds();
+      LOG(INFO) << "Processed " << count << " records, " << count / seconds
+                << " records/s, " << bytes / seconds / (1 << 20) << " MB/s.";
+    }
+  }
+  threads.join_all();
+  writer->Close();
+  const float seconds = timer.Seconds();
+  LOG(INFO) << "Migrated " << count << " records, " << (bytes >> 20)
+            << " MB in " << seconds << " s: " << count / seconds
+            << " records/s, " << bytes / seconds / (1 << 20) << " MB/s.";
+  int num_kept = 0;
+  for (int i = 0; i < num_workers; ++i) {
+    num_kept += kept[i];
+  }
+  if (num_kept > 0) {
+    LOG(WARNING) << num_kept << " records could not be encoded as "
+                 << FLAGS_encode << " and were copied as they are.";
+  }
+
+  if (FLAGS_verify_samples > 0) {
+    const int mismatches = writer->Verify();
+    CHECK_EQ(mismatches, 0) << mismatches << " of the sampled records differ"
+        << " in the output";
+    LOG(INFO) << "Verified the checksums of "
+              << std::min(count, FLAGS_verify_samples) << " records.";
+  }
+  return 0;
+}
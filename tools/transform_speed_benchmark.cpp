@@ -0,0 +1,142 @@
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/data_transformer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/rng.hpp"
+
+using caffe::Blob;
+using caffe::Caffe;
+using caffe::CPUTimer;
+using caffe::DataTransformer;
+using caffe::Datum;
+using caffe::TransformationParameter;
+
+DEFINE_int32(channels, 3, "Channels of the synthetic datum.");
+DEFINE_int32(height, 480, "Height of the synthetic datum.");
+DEFINE_int32(width, 640, "Width of the synthetic datum.");
+DEFINE_int32(crop_size, 0, "Crop size, 0 to disable cropping.");
+DEFINE_bool(mirror, true, "Enable random mirroring.");
+DEFINE_double(scale, 0.00390625, "Scale applied after mean subtraction.");
+DEFINE_double(mean_value, 128, "Mean value for all channels, if no "
+    "mean_file is given. Negative to disable mean subtraction.");
+DEFINE_string(mean_file, "", "Optional mean file (BlobProto).");
+DEFINE_bool(float_data, false, "Store pixels in float_data instead of the "
+    "uint8 data field.");
+DEFINE_int32(iterations, 200, "Number of transforms to time.");
+
+// Per-pixel reference implementation, equivalent to what
+// DataTransformer::Transform(const Datum&, ...) computed before it used row
+// kernels. Only mean values are supported, which is enough for a baseline.
+static void ReferenceTransform(const Datum& datum, const float mean_value,
+    const float scale, const bool do_mirror, const int h_off,
+    const int w_off, const int height, const int width, float* top) {
+  const std::string& data = datum.data();
+  const bool has_uint8 = data.size() > 0;
+  for (int c = 0; c < datum.channels(); ++c) {
+    for (int h = 0; h < height; ++h) {
+      for (int w = 0; w < width; ++w) {
+        const int data_index =
+            (c * datum.height() + h_off + h) * datum.width() + w_off + w;
+        const int top_index = do_mirror ?
+            (c * height + h) * width + (width - 1 - w) :
+            (c * height + h) * width + w;
+        const float element = has_uint8 ?
+            static_cast<float>(static_cast<uint8_t>(data[data_index])) :
+            datum.float_data(data_index);
+        top[top_index] = (element - mean_value) * scale;
+      }
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+
+  gflags::SetUsageMessage("Measure DataTransformer throughput on a "
+        "synthetic Datum\n"
+        "Usage:\n"
+        "    transform_speed_benchmark [FLAGS]\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  CHECK_GT(FLAGS_channels, 0);
+  CHECK_GT(FLAGS_iterations, 0);
+  Caffe::set_mode(Caffe::CPU);
+
+  Datum datum;
+  datum.set_channels(FLAGS_channels);
+  datum.set_height(FLAGS_height);
+  datum.set_width(FLAGS_width);
+  const int size = FLAGS_channels * FLAGS_height * FLAGS_width;
+  std::string* data = datum.mutable_data();
+  for (int i = 0; i < size; ++i) {
+    const uint8_t pixel = caffe::caffe_rng_rand() % 256;
+    if (FLAGS_float_data) {
+      datum.add_float_data(pixel);
+    } else {
+      data->push_back(pixel);
+    }
+  }
+
+  TransformationParameter param;
+  param.set_scale(FLAGS_scale);
+  param.set_mirror(FLAGS_mirror);
+  param.set_crop_size(FLAGS_crop_size);
+  if (!FLAGS_mean_file.empty()) {
+    param.set_mean_file(FLAGS_mean_file);
+  } else if (FLAGS_mean_value >= 0) {
+    param.add_mean_value(FLAGS_mean_value);
+  }
+  DataTransformer<float> transformer(param, caffe::TRAIN);
+  transformer.InitRand();
+
+  const int height = FLAGS_crop_size ? FLAGS_crop_size : FLAGS_height;
+  const int width = FLAGS_crop_size ? FLAGS_crop_size : FLAGS_width;
+  Blob<float> blob(1, FLAGS_channels, height, width);
+  const double mpixels =
+      static_cast<double>(FLAGS_channels) * height * width / 1e6;
+
+  // Warm up once so the mean and top buffers are allocated.
+  transformer.Transform(datum, &blob);
+  CPUTimer timer;
+  timer.Start();
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    transformer.Transform(datum, &blob);
+  }
+  timer.Stop();
+  const double seconds = timer.Seconds();
+  LOG(INFO) << "DataTransformer: " << timer.MilliSeconds() / FLAGS_iterations
+      << " ms/image, " << FLAGS_iterations / seconds << " images/s, "
+      << mpixels * FLAGS_iterations / seconds << " Mpixel/s.";
+
+  if (FLAGS_mean_file.empty()) {
+    const float mean_value = FLAGS_mean_value >= 0 ? FLAGS_mean_value : 0;
+    const int h_off = (FLAGS_height - height) / 2;
+    const int w_off = (FLAGS_width - width) / 2;
+    float* top = blob.mutable_cpu_data();
+    timer.Start();
+    for (int i = 0; i < FLAGS_iterations; ++i) {
+      ReferenceTransform(datum, mean_value, FLAGS_scale,
+          FLAGS_mirror && (i & 1), h_off, w_off, height, width, top);
+    }
+    timer.Stop();
+    const double reference_seconds = timer.Seconds();
+    LOG(INFO) << "Per-pixel reference: "
+        << timer.MilliSeconds() / FLAGS_iterations << " ms/image, "
+        << FLAGS_iterations / reference_seconds << " images/s, "
+        << mpixels * FLAGS_iterations / reference_seconds << " Mpixel/s.";
+    LOG(INFO) << "Speedup: " << reference_seconds / seconds << "x";
+  }
+  return 0;
+}